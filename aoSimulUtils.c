@@ -26,6 +26,771 @@
  *
  */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <fftw3.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/************************************************************************
+ * Memory mapped FITS data (_yao_fits_map, _yao_fits_read)              *
+ * The primary data unit of a FITS file is mapped read-only as native   *
+ * floats. BITPIX=-32 unscaled data on a big endian host are mapped in  *
+ * place. Anything else is converted once into a native cache file      *
+ * (header + raw floats, path given by the caller, see yao_fits_cache), *
+ * which the following runs map directly. The cache records the size    *
+ * and mtime of the FITS file it was made from, and is remade when they *
+ * change. If the cache path is empty or can not be written, the data   *
+ * are converted into anonymous memory instead.                         *
+ * _yao_fits_map keeps the mapping in a slot for the ray tracer (mapped *
+ * turbulent screens: slot k = layer k). The mappings are inherited by  *
+ * the fork()ed svipc children.                                         *
+ ************************************************************************/
+
+#define YAO_FITSMAP_MAX   64
+#define YAO_FITSMAP_MAGIC "YAOMAP01"
+#define YAO_FITSMAP_CHUNK 65536   // elements converted at a time
+
+#if defined(__APPLE__)
+#define YAO_MTIME_NS(st) ((long)(st).st_mtimespec.tv_nsec)
+#else
+#define YAO_MTIME_NS(st) ((long)(st).st_mtim.tv_nsec)
+#endif
+
+typedef struct {
+  char  magic[8];
+  long  n;                  // number of floats
+  long  dims[4];            // naxis, naxis1, naxis2, naxis3
+  long  srcsize;            // FITS file the cache was made from
+  long  srcmtime, srcmtimens;
+} yao_fitsmap_hdr;
+
+typedef struct {
+  void   *base;             // mapping
+  size_t len;
+  float  *data;             // native floats
+  long   dims[4];           // naxis, naxis1, naxis2, naxis3
+} yao_fitsmap;
+
+static yao_fitsmap yao_fitsmaps[YAO_FITSMAP_MAX];
+
+static int yao_fits_big_endian(void)
+{
+  const int one = 1;
+  return (*(const char *)&one == 0);
+}
+
+// primary header: BITPIX, NAXIS*, BSCALE, BZERO and data offset
+static int yao_fits_header(FILE *f, int *bitpix, long *dims, double *bscale,
+                           double *bzero, long *offset)
+{
+  char card[81], key[9];
+  long nblocks = 0;
+  int  i, k, end = 0;
+
+  *bitpix = 0; *bscale = 1.0; *bzero = 0.0;
+  dims[0] = 0; dims[1] = dims[2] = dims[3] = 1;
+  card[80] = key[8] = '\0';
+  while (!end) {
+    for ( i=0 ; i<36 ; i++ ) {
+      if (fread(card, 1, 80, f) != 80) return (1);
+      if (end) continue;
+      memcpy(key, card, 8);
+      for ( k=7 ; (k>=0) && (key[k]==' ') ; k-- ) key[k] = '\0';
+      if (!strcmp(key, "END")) end = 1;
+      else if (card[8] != '=') continue;
+      else if (!strcmp(key, "BITPIX")) *bitpix = atoi(card+10);
+      else if (!strcmp(key, "NAXIS"))  dims[0] = atol(card+10);
+      else if (!strcmp(key, "NAXIS1")) dims[1] = atol(card+10);
+      else if (!strcmp(key, "NAXIS2")) dims[2] = atol(card+10);
+      else if (!strcmp(key, "NAXIS3")) dims[3] = atol(card+10);
+      else if (!strcmp(key, "BSCALE")) *bscale = atof(card+10);
+      else if (!strcmp(key, "BZERO"))  *bzero = atof(card+10);
+    }
+    nblocks++;
+  }
+  if ( (dims[0]<1) || (dims[0]>3) ) return (1);
+  if ( (*bitpix!=8) && (*bitpix!=16) && (*bitpix!=32) && \
+       (*bitpix!=-32) && (*bitpix!=-64) ) return (1);
+  *offset = nblocks*2880;
+  return (0);
+}
+
+// n big endian elements of f to native floats, into out or written to fout
+static int yao_fits_convert(FILE *f, int bitpix, double bscale, double bzero,
+                            float *out, FILE *fout, long n)
+{
+  const int     nb = abs(bitpix)/8;
+  unsigned char *buf, *p;
+  float         *fb, fv;
+  double        v, dv;
+  unsigned int  u;
+  unsigned long long u8;
+  long          i, m, done;
+  int           k, err = 0;
+
+  buf = (unsigned char *)malloc((size_t)YAO_FITSMAP_CHUNK*(nb+sizeof(float)));
+  if (buf==NULL) return (1);
+  fb = (float *)(buf + (size_t)YAO_FITSMAP_CHUNK*nb);
+
+  for ( done=0 ; (done<n) && !err ; done+=m ) {
+    m = (n-done<YAO_FITSMAP_CHUNK)? n-done : YAO_FITSMAP_CHUNK;
+    if (fread(buf, nb, m, f) != (size_t)m) { err = 1; break; }
+    for ( i=0 ; i<m ; i++ ) {
+      p = buf + i*nb;
+      switch (bitpix) {
+      case 8:  v = p[0]; break;
+      case 16: v = (short)((p[0]<<8)|p[1]); break;
+      case 32:
+        v = (int)(((unsigned int)p[0]<<24)|((unsigned int)p[1]<<16)|(p[2]<<8)|p[3]);
+        break;
+      case -32:
+        u = ((unsigned int)p[0]<<24)|((unsigned int)p[1]<<16)|(p[2]<<8)|p[3];
+        memcpy(&fv, &u, 4); v = fv;
+        break;
+      default:
+        for ( u8=0,k=0 ; k<8 ; k++ ) u8 = (u8<<8)|p[k];
+        memcpy(&dv, &u8, 8); v = dv;
+      }
+      fb[i] = (float)(bzero + bscale*v);
+    }
+    if (out) memcpy(out+done, fb, sizeof(float)*m);
+    else if (fwrite(fb, sizeof(float), m, fout) != (size_t)m) err = 1;
+  }
+  free(buf);
+  return (err);
+}
+
+static int yao_fits_mmap(const char *fname, size_t len, size_t off, yao_fitsmap *m)
+{
+  struct stat st;
+  void        *base;
+  int         fd;
+
+  fd = open(fname, O_RDONLY);
+  if (fd<0) return (1);
+  if ( fstat(fd, &st) || ((size_t)st.st_size<len) ) { close(fd); return (1); }
+  base = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base==MAP_FAILED) return (1);
+  m->base = base;
+  m->len  = len;
+  m->data = (float *)((char *)base + off);
+  return (0);
+}
+
+static void yao_fits_close(yao_fitsmap *m)
+{
+  if (m->base) munmap(m->base, m->len);
+  memset(m, 0, sizeof(*m));
+}
+
+static int yao_fits_cache_ok(const char *cache, const yao_fitsmap_hdr *h)
+{
+  yao_fitsmap_hdr hc;
+  struct stat     st;
+  FILE            *f;
+  int             ok;
+
+  if (stat(cache, &st)) return (0);
+  if ((size_t)st.st_size != sizeof(hc)+sizeof(float)*h->n) return (0);
+  f = fopen(cache, "rb");
+  if (f==NULL) return (0);
+  ok = (fread(&hc, sizeof(hc), 1, f)==1) && !memcmp(&hc, h, sizeof(hc));
+  fclose(f);
+  return (ok);
+}
+
+static int yao_fits_open(const char *fname, const char *cache, yao_fitsmap *m)
+{
+  yao_fitsmap_hdr h;
+  struct stat     st;
+  FILE            *f, *fc;
+  double          bscale, bzero;
+  long            offset, n;
+  int             bitpix, ok;
+  char            *tmp;
+
+  memset(m, 0, sizeof(*m));
+  if (stat(fname, &st)) return (1);
+  f = fopen(fname, "rb");
+  if (f==NULL) return (1);
+  if ( yao_fits_header(f, &bitpix, m->dims, &bscale, &bzero, &offset) ) {
+    fclose(f);
+    return (1);
+  }
+  n = m->dims[1]*m->dims[2]*m->dims[3];
+  if (st.st_size < offset+n*(abs(bitpix)/8)) { fclose(f); return (1); }
+
+  // native data: the FITS file itself is mapped
+  if ( (bitpix==-32) && (bscale==1.0) && (bzero==0.0) && yao_fits_big_endian() ) {
+    fclose(f);
+    return yao_fits_mmap(fname, offset+sizeof(float)*n, offset, m);
+  }
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, YAO_FITSMAP_MAGIC, 8);
+  h.n = n;
+  memcpy(h.dims, m->dims, sizeof(h.dims));
+  h.srcsize    = st.st_size;
+  h.srcmtime   = st.st_mtime;
+  h.srcmtimens = YAO_MTIME_NS(st);
+
+  if ( (cache!=NULL) && (cache[0]!='\0') ) {
+    if ( yao_fits_cache_ok(cache, &h) && \
+         !yao_fits_mmap(cache, sizeof(h)+sizeof(float)*n, sizeof(h), m) ) {
+      fclose(f);
+      return (0);
+    }
+    // (re)make the cache. Written aside then renamed, as several
+    // processes may do it at the same time
+    tmp = (char *)malloc(strlen(cache)+32);
+    if (tmp) {
+      sprintf(tmp, "%s.%ld", cache, (long)getpid());
+      fc = fopen(tmp, "wb");
+      ok = (fc!=NULL);
+      if (ok) {
+        ok = !fseek(f, offset, SEEK_SET) && (fwrite(&h, sizeof(h), 1, fc)==1) && \
+          !yao_fits_convert(f, bitpix, bscale, bzero, NULL, fc, n);
+        ok = (fclose(fc)==0) && ok;
+        ok = ok && (rename(tmp, cache)==0);
+        if (!ok) remove(tmp);
+      }
+      free(tmp);
+      if ( ok && !yao_fits_mmap(cache, sizeof(h)+sizeof(float)*n, sizeof(h), m) ) {
+        fclose(f);
+        return (0);
+      }
+    }
+  }
+
+  // no cache: converted into anonymous memory
+  m->len  = sizeof(float)*(n>0? n : 1);
+  m->base = mmap(NULL, m->len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (m->base==MAP_FAILED) { m->base = NULL; fclose(f); return (1); }
+  m->data = (float *)m->base;
+  ok = !fseek(f, offset, SEEK_SET) && \
+    !yao_fits_convert(f, bitpix, bscale, bzero, m->data, NULL, n);
+  fclose(f);
+  if (!ok) { yao_fits_close(m); return (1); }
+  return (0);
+}
+
+// mapped data of slot, if it is a [nx,ny] image
+static float *yao_fits_layer(int slot, long nx, long ny)
+{
+  yao_fitsmap *m;
+
+  if ( (slot<0) || (slot>=YAO_FITSMAP_MAX) ) return (NULL);
+  m = &yao_fitsmaps[slot];
+  if ( (m->data==NULL) || (m->dims[1]!=nx) || (m->dims[2]*m->dims[3]!=ny) ) return (NULL);
+  return (m->data);
+}
+
+int _yao_fits_map(char *fname, char *cache, int slot, long *dims)
+{
+  yao_fitsmap m;
+
+  if ( (slot<0) || (slot>=YAO_FITSMAP_MAX) ) return (1);
+  if (yao_fits_open(fname, cache, &m)) return (1);
+  yao_fits_close(&yao_fitsmaps[slot]);
+  yao_fitsmaps[slot] = m;
+  memcpy(dims, m.dims, sizeof(m.dims));
+  return (0);
+}
+
+void _yao_fits_unmap(int slot) // slot<0: all
+{
+  int k;
+
+  for ( k=0 ; k<YAO_FITSMAP_MAX ; k++ )
+    if ( (slot<0) || (k==slot) ) yao_fits_close(&yao_fitsmaps[k]);
+}
+
+int _yao_fits_dims(char *fname, long *dims)
+{
+  FILE   *f;
+  double bscale, bzero;
+  long   offset;
+  int    bitpix, err;
+
+  f = fopen(fname, "rb");
+  if (f==NULL) return (1);
+  err = yao_fits_header(f, &bitpix, dims, &bscale, &bzero, &offset);
+  fclose(f);
+  return (err);
+}
+
+int _yao_fits_read(char *fname, char *cache, float *out, long n)
+{
+  yao_fitsmap m;
+
+  if (yao_fits_open(fname, cache, &m)) return (1);
+  if (m.dims[1]*m.dims[2]*m.dims[3] != n) { yao_fits_close(&m); return (1); }
+  memcpy(out, m.data, sizeof(float)*n);
+  yao_fits_close(&m);
+  return (0);
+}
+
+/************************************************************************
+ * Ray tracing engine (_get2dPhase, _get2dPhase_multi, _get2dPhase_fused)*
+ * Integrates the phase of one or several stacks of screens (turbulent  *
+ * layers, DMs, static optics: the "sources") along ndir directions     *
+ * (WFSs, targets), accumulating into a caller owned output.            *
+ * Layer by layer, blocks of output rows are done for all directions,   *
+ * so that the screen rows shared by overlapping beams are reused from  *
+ * cache instead of being streamed once per direction.                  *
+ * The bilinear weights are separable (X weights depend on i only, Y    *
+ * weights on j only) and are taken out of the pixel loop. Screens      *
+ * whose X shifts are unit steps with a constant fraction (NGS, DMs)    *
+ * go through a contiguous stencil, the others through a gather. The    *
+ * output rows are split over nthreads threads. Bounds are checked      *
+ * once, before anything is accumulated (returns 1 if out of bounds).   *
+ * The turbulent screens are neither padded nor weighted in memory: the *
+ * tracer takes their indices modulo the screen size (GET2D_WRAPX/Y),   *
+ * applies the layer weights, and can read them from the mapped FITS    *
+ * slots (GET2D_MAPPED) instead of a [nx,ny,n] cube. Layer k is screen  *
+ * perm[k] with weight[k]: Cn2 changes and screen swaps are O(nscreens).*
+ * With GET2D_INT16 the cube is int16 (see _yao_quantize16), converted  *
+ * in registers: half the memory traffic. The per screen scale is to be *
+ * folded in weight by the caller.                                      *
+ ************************************************************************/
+
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && \
+    defined(__linux__) && (__GNUC__ >= 6)
+#define GET2D_CLONES __attribute__((target_clones("avx512f","avx2","sse4.2","default"), \
+                                     optimize("tree-vectorize","vect-cost-model=dynamic")))
+#else
+#define GET2D_CLONES
+#endif
+
+#define GET2D_MAXTHREADS 64
+#define GET2D_MAXSRC     3      // turbulence, DMs, optics
+#define GET2D_ROWBLOCK   16     // output rows per cache block
+#define GET2D_MINWORK    32768  // phnx*phny*(active screens) below which we stay serial
+
+#define GET2D_WRAPX      1      // screens periodic in X
+#define GET2D_WRAPY      2      // screens periodic in Y
+#define GET2D_MAPPED     4      // layer k is the mapped FITS slot k (see _yao_fits_map)
+#define GET2D_INT16      8      // screens are a short [nx,ny,n] cube
+
+typedef struct {
+  float *scr;            // screens [nx,ny,n]
+  short *q;              // int16 screens [nx,ny,n] (GET2D_INT16), instead of scr
+  float **lay;           // [n] layer pointers (mapped screens), or NULL for scr
+  int   *perm;           // [n] screen of each layer, or NULL for identity
+  int   nx, ny, n;
+  int   wrap;            // GET2D_WRAPX | GET2D_WRAPY
+  int   *skip;           // [n,ndir]
+  float *weight;         // [n], or NULL for 1
+  int   *is, *js;        // integer shifts [phnx,n,ndir], [phny,n,ndir]
+  float *xs, *ys;        // fractional shifts, same dimensions
+  int   *unit;           // [n,ndir], unit X steps with constant fraction
+  int   *iw;             // [2*phnx,n,ndir] X indices modulo nx (i and i+1), if WRAPX
+} get2d_source;
+
+typedef struct {
+  get2d_source *src;
+  int   nsrc;
+  float *out;            // [outnx,outny,ndir]
+  long  outnx, outny;
+  int   x0, y0;          // offset of the [phnx,phny] window in out
+  int   phnx, phny, ndir, j0, j1;
+} get2d_thread;
+
+// The row kernels, for float (get2d_row_*) and int16 (get2d_row_*16)
+// screens. T is the screen element type.
+#define GET2D_KERNELS(SFX, T)                                                 \
+/* one output row, unit X steps, constant fractions wx and wy, weight wt */   \
+GET2D_CLONES                                                                  \
+static void get2d_row_unit##SFX(float *restrict out, const T *restrict r0,    \
+                                const T *restrict r1, int n, float wx,        \
+                                float wy, float wt)                           \
+{                                                                             \
+  const float w11 = wt*(1.0f-wx)*(1.0f-wy), w21 = wt*wx*(1.0f-wy);            \
+  const float w12 = wt*(1.0f-wx)*wy,        w22 = wt*wx*wy;                   \
+  int i;                                                                      \
+                                                                              \
+  if ( (wx==0.0f) && (wy==0.0f) ) {                                           \
+    /* integer shift, the screen is just added */                             \
+    if (wt==1.0f) for ( i=0 ; i<n ; i++ ) out[i] += r0[i];                    \
+    else for ( i=0 ; i<n ; i++ ) out[i] += wt*r0[i];                          \
+    return;                                                                   \
+  }                                                                           \
+  for ( i=0 ; i<n ; i++ )                                                     \
+    out[i] += w11*r0[i] + w21*r0[i+1] + w12*r1[i] + w22*r1[i+1];              \
+}                                                                             \
+                                                                              \
+/* one output row, arbitrary X shifts */                                      \
+GET2D_CLONES                                                                  \
+static void get2d_row_gather##SFX(float *restrict out, const T *restrict r0,  \
+                                  const T *restrict r1,                       \
+                                  const int *restrict ix,                     \
+                                  const float *restrict fx, int n, float wy,  \
+                                  float wt)                                   \
+{                                                                             \
+  const float wy1 = wt*(1.0f-wy), wy2 = wt*wy;                                \
+  float       a, b;                                                           \
+  int         i;                                                              \
+                                                                              \
+  for ( i=0 ; i<n ; i++ ) {                                                   \
+    a = r0[ix[i]] + fx[i]*(float)(r0[ix[i]+1]-r0[ix[i]]);                     \
+    b = r1[ix[i]] + fx[i]*(float)(r1[ix[i]+1]-r1[ix[i]]);                     \
+    out[i] += wy1*a + wy2*b;                                                  \
+  }                                                                           \
+}                                                                             \
+                                                                              \
+/* one output row, arbitrary X shifts, X indices already wrapped (ia, ib) */  \
+GET2D_CLONES                                                                  \
+static void get2d_row_wrap##SFX(float *restrict out, const T *restrict r0,    \
+                                const T *restrict r1, const int *restrict ia, \
+                                const int *restrict ib,                       \
+                                const float *restrict fx, int n, float wy,    \
+                                float wt)                                     \
+{                                                                             \
+  const float wy1 = wt*(1.0f-wy), wy2 = wt*wy;                                \
+  float       a, b;                                                           \
+  int         i;                                                              \
+                                                                              \
+  for ( i=0 ; i<n ; i++ ) {                                                   \
+    a = r0[ia[i]] + fx[i]*(float)(r0[ib[i]]-r0[ia[i]]);                       \
+    b = r1[ia[i]] + fx[i]*(float)(r1[ib[i]]-r1[ia[i]]);                       \
+    out[i] += wy1*a + wy2*b;                                                  \
+  }                                                                           \
+}
+
+GET2D_KERNELS(, float)
+GET2D_KERNELS(16, short)
+
+// rows j0 to j1-1 of all output phases, source and layer major
+static void *get2d_rows(void *arg)
+{
+  get2d_thread *t = (get2d_thread *)arg;
+  const long   phnx = t->phnx, phny = t->phny;
+  get2d_source *s;
+  const int    *ix, *jy, *iw;
+  const float  *fx, *fy, *scr, *r0, *r1;
+  const short  *q, *q0, *q1;
+  float        *out, wt;
+  long         kd, nx, ny, jj, o0, o1;
+  int          j, jb, je, k, kp, d, m;
+
+  for ( m=0 ; m<t->nsrc ; m++ ) {
+    s  = &t->src[m];
+    nx = s->nx;
+    ny = s->ny;
+    for ( k=0 ; k<s->n ; k++ ) {
+      kp  = (s->perm)? s->perm[k] : k;
+      scr = (s->lay)? s->lay[kp] : s->scr + kp*nx*ny;
+      q   = (s->q)? s->q + kp*nx*ny : NULL;
+      wt  = (s->weight)? s->weight[k] : 1.0f;
+      if (wt==0.0f) continue;
+      // blocks of rows, so that the directions share the screen rows in cache
+      for ( jb=t->j0 ; jb<t->j1 ; jb+=GET2D_ROWBLOCK ) {
+        je = (jb+GET2D_ROWBLOCK<t->j1)? jb+GET2D_ROWBLOCK : t->j1;
+        for ( d=0 ; d<t->ndir ; d++ ) {
+          kd = k + (long)d*s->n;
+          if (s->skip[kd]) continue;
+          ix = s->is + kd*phnx;
+          fx = s->xs + kd*phnx;
+          jy = s->js + kd*phny;
+          fy = s->ys + kd*phny;
+          iw = (s->iw)? s->iw + 2*kd*phnx : ix;
+          for ( j=jb ; j<je ; j++ ) {
+            if (s->wrap & GET2D_WRAPY) {
+              jj = jy[j] % ny;
+              if (jj<0) jj += ny;
+              o0 = jj*nx;
+              o1 = ((jj+1<ny)? jj+1 : 0)*nx;
+            } else {
+              o0 = jy[j]*nx;
+              o1 = o0 + nx;
+            }
+            out = t->out + t->x0 + (t->y0+j+d*t->outny)*t->outnx;
+            if (q) {
+              q0 = q + o0;
+              q1 = q + o1;
+              if (s->unit[kd]) get2d_row_unit16(out, q0+iw[0], q1+iw[0], phnx, fx[0], fy[j], wt);
+              else if (s->iw) get2d_row_wrap16(out, q0, q1, iw, iw+phnx, fx, phnx, fy[j], wt);
+              else get2d_row_gather16(out, q0, q1, ix, fx, phnx, fy[j], wt);
+              continue;
+            }
+            r0 = scr + o0;
+            r1 = scr + o1;
+            if (s->unit[kd]) get2d_row_unit(out, r0+iw[0], r1+iw[0], phnx, fx[0], fy[j], wt);
+            else if (s->iw) get2d_row_wrap(out, r0, r1, iw, iw+phnx, fx, phnx, fy[j], wt);
+            else get2d_row_gather(out, r0, r1, ix, fx, phnx, fy[j], wt);
+          }
+        }
+      }
+    }
+  }
+  return NULL;
+}
+
+static void get2d_release(get2d_source *s)
+{
+  if (s->unit) free(s->unit);
+  if (s->iw) free(s->iw);
+  s->unit = s->iw = NULL;
+}
+
+// unit flags, wrapped X indices and bounds of a source. Returns the number
+// of active (layer,direction) or -1 if out of bounds / out of memory
+static long get2d_prepare(get2d_source *s, int phnx, int phny, int ndir)
+{
+  long kd, firstel, ntot = (long)s->nx*s->ny*s->n, nactive = 0;
+  int  i, j, imin, imax, jmin, jmax, *ia;
+
+  s->unit = s->iw = NULL;
+  if (s->n<=0) return 0;
+  s->unit = (int *)malloc(sizeof(int)*s->n*ndir);
+  if (s->unit==NULL) return -1;
+  if (s->wrap & GET2D_WRAPX) {
+    s->iw = (int *)malloc(sizeof(int)*2*phnx*s->n*ndir);
+    if (s->iw==NULL) { get2d_release(s); return -1; }
+  }
+
+  for (kd=0;kd<(long)s->n*ndir;++kd) {
+    s->unit[kd] = 0;
+    if (s->skip[kd]) continue;
+    nactive++;
+
+    /* Safety net: don't access elements outside of the screens memory space */
+    imin = imax = s->is[kd*phnx];
+    s->unit[kd] = 1;
+    for (i=1;i<phnx;++i) {
+      if (s->is[i+kd*phnx] < imin) imin = s->is[i+kd*phnx];
+      if (s->is[i+kd*phnx] > imax) imax = s->is[i+kd*phnx];
+      if ( (s->is[i+kd*phnx] != s->is[kd*phnx]+i) || \
+           (s->xs[i+kd*phnx] != s->xs[kd*phnx]) ) s->unit[kd] = 0;
+    }
+    jmin = jmax = s->js[kd*phny];
+    for (j=1;j<phny;++j) {
+      if (s->js[j+kd*phny] < jmin) jmin = s->js[j+kd*phny];
+      if (s->js[j+kd*phny] > jmax) jmax = s->js[j+kd*phny];
+    }
+    if (s->iw) {
+      // X indices modulo nx. The contiguous stencil is kept if the
+      // row does not cross the screen edge.
+      ia = s->iw + 2*kd*phnx;
+      for (i=0;i<phnx;++i) {
+        ia[i] = s->is[i+kd*phnx] % s->nx;
+        if (ia[i]<0) ia[i] += s->nx;
+        ia[i+phnx] = (ia[i]+1<s->nx)? ia[i]+1 : 0;
+      }
+      if (ia[0]+phnx >= s->nx) s->unit[kd] = 0;
+      imin = 0; imax = s->nx-2;
+    }
+    if (s->wrap & GET2D_WRAPY) { jmin = 0; jmax = s->ny-2; }
+    if ( (s->lay==NULL) && (s->wrap==0) ) {
+      firstel = (s->perm)? s->perm[kd % s->n] : kd % s->n;
+      firstel *= (long)s->nx*s->ny;
+      if ( ((firstel+imax+1+(long)(jmax+1)*s->nx) >= ntot) || \
+           ((firstel+imin+(long)jmin*s->nx) < 0) ) {
+        get2d_release(s);
+        return -1;
+      }
+    } else if ( (imin<0) || (imax+1>=s->nx) || (jmin<0) || (jmax+1>=s->ny) ) {
+      get2d_release(s);
+      return -1;
+    }
+  }
+  return nactive;
+}
+
+static int get2d_run(get2d_source *src, int nsrc, float *out, int outnx,
+                     int outny, int x0, int y0, int phnx, int phny, int ndir,
+                     int nthreads)
+{
+  get2d_thread th[GET2D_MAXTHREADS];
+  pthread_t    thid[GET2D_MAXTHREADS];
+  int          thok[GET2D_MAXTHREADS];
+  long         nactive = 0, na;
+  int          m, t, err = 0;
+
+  if ( (phnx<=0) || (phny<=0) || (ndir<=0) ) return (0);
+  if ( (x0<0) || (y0<0) || (x0+phnx>outnx) || (y0+phny>outny) ) return (1);
+
+  for (m=0;m<nsrc;m++) src[m].unit = src[m].iw = NULL;
+  for (m=0;m<nsrc;m++) {
+    na = get2d_prepare(&src[m], phnx, phny, ndir);
+    if (na<0) { err = 1; break; }
+    nactive += na;
+  }
+
+  if (!err) {
+    /* split the output rows over the threads (if worth it) */
+    if ((long)phnx*phny*nactive < GET2D_MINWORK) nthreads = 1;
+    if (nthreads > GET2D_MAXTHREADS) nthreads = GET2D_MAXTHREADS;
+    if (nthreads > phny) nthreads = phny;
+    if (nthreads < 1) nthreads = 1;
+
+    for (t=0;t<nthreads;t++) {
+      th[t].src   = src;
+      th[t].nsrc  = nsrc;
+      th[t].out   = out;
+      th[t].outnx = outnx;
+      th[t].outny = outny;
+      th[t].x0    = x0;
+      th[t].y0    = y0;
+      th[t].phnx  = phnx;
+      th[t].phny  = phny;
+      th[t].ndir  = ndir;
+      th[t].j0    = (int)((long)phny*t/nthreads);
+      th[t].j1    = (int)((long)phny*(t+1)/nthreads);
+    }
+    for (t=1;t<nthreads;t++)
+      thok[t] = (pthread_create(&thid[t], NULL, get2d_rows, &th[t]) == 0);
+    get2d_rows(&th[0]);
+    for (t=1;t<nthreads;t++) {
+      if (thok[t]) pthread_join(thid[t], NULL);
+      else get2d_rows(&th[t]);
+    }
+  }
+
+  for (m=0;m<nsrc;m++) get2d_release(&src[m]);
+  return (err);
+}
+
+static void get2d_source_set(get2d_source *s, float *scr, int nx, int ny,
+                             int n, int *skip, float *weight, int *is,
+                             float *xs, int *js, float *ys)
+{
+  s->scr = scr; s->nx = nx; s->ny = ny; s->n = n;
+  s->skip = skip; s->weight = weight;
+  s->is = is; s->xs = xs; s->js = js; s->ys = ys;
+  s->lay = NULL; s->q = NULL; s->perm = NULL; s->wrap = 0;
+  s->unit = s->iw = NULL;
+}
+
+// permutation and flags of the turbulent screens source. With
+// GET2D_MAPPED, the layer pointers are taken from the FITS slots (to be
+// freed by the caller), with GET2D_INT16 the cube is read as shorts.
+// Returns 1 if perm is not a valid screen index, or if a slot is not
+// mapped or has the wrong size
+static int get2d_source_screens(get2d_source *s, int *perm, int flags)
+{
+  int k;
+
+  if (perm) for ( k=0 ; k<s->n ; k++ ) if ( (perm[k]<0) || (perm[k]>=s->n) ) return (1);
+  s->perm = perm;
+  s->wrap = flags & (GET2D_WRAPX|GET2D_WRAPY);
+  if ( (flags & GET2D_INT16) && !(flags & GET2D_MAPPED) ) s->q = (short *)s->scr;
+  if ( !(flags & GET2D_MAPPED) || (s->n<=0) ) return (0);
+  s->lay = (float **)malloc(sizeof(float *)*s->n);
+  if (s->lay==NULL) return (1);
+  for ( k=0 ; k<s->n ; k++ ) {
+    s->lay[k] = yao_fits_layer(k, s->nx, s->ny);
+    if (s->lay[k]==NULL) { free(s->lay); s->lay = NULL; return (1); }
+  }
+  return (0);
+}
+
+/************************************************************************
+ * Function float _yao_quantize16                                       *
+ * int16 copy of a screen for GET2D_INT16: out = round(in/scale) with   *
+ * scale = max(abs(in))/32767, returned (1 if in is all 0). The error   *
+ * is uniform, rms scale/sqrt(12) (see get2dphase_int16_check).         *
+ ************************************************************************/
+
+float _yao_quantize16(float *in, long n, short *out)
+{
+  float amax = 0.0f, inv, scale;
+  long  i;
+
+  for ( i=0 ; i<n ; i++ ) if (fabsf(in[i]) > amax) amax = fabsf(in[i]);
+  scale = (amax > 0.0f)? amax/32767.0f : 1.0f;
+  inv = 1.0f/scale;
+  for ( i=0 ; i<n ; i++ ) out[i] = (short)lrintf(in[i]*inv);
+  return (scale);
+}
+
+/************************************************************************
+ * Function int _get2dPhase_multi                                       *
+ * Computes the integrated phase along ndir directions in one pass on   *
+ * the screens. _get2dPhase is the ndir=1 case.                         *
+ ************************************************************************/
+
+int _get2dPhase_multi(float *pscreens, /* dimension [psnx,psny,nscreens] */
+                      int psnx,
+                      int psny,
+                      int nscreens,
+                      int *skip,       /* dimension [nscreens,ndir] */
+                      float *weight,   /* layer weights [nscreens] */
+                      int *perm,       /* screen of each layer [nscreens] (0 based) */
+                      int flags,       /* GET2D_WRAPX|WRAPY|MAPPED|INT16 */
+                      float *outphase, /* dimension [phnx,phny,ndir] */
+                      int phnx,
+                      int phny,
+                      int ndir,
+                      int *ishifts,    /* X integer shifts [phnx,nscreens,ndir] */
+                      float *xshifts,  /* X fractional shifts [phnx,nscreens,ndir] */
+                      int *jshifts,    /* Y integer shifts [phny,nscreens,ndir] */
+                      float *yshifts,  /* Y fractional shifts [phny,nscreens,ndir] */
+                      int nthreads)    /* number of threads to split the rows over */
+{
+  get2d_source src;
+  int          err;
+
+  get2d_source_set(&src, pscreens, psnx, psny, nscreens, skip, weight,
+                   ishifts, xshifts, jshifts, yshifts);
+  if (get2d_source_screens(&src, perm, flags)) return (1);
+  err = get2d_run(&src, 1, outphase, phnx, phny, 0, 0, phnx, phny, ndir,
+                  nthreads);
+  if (src.lay) free(src.lay);
+  return (err);
+}
+
+/************************************************************************
+ * Function int _get2dPhase_fused                                       *
+ * Turbulence + DMs + optics phase of ndir directions, in one call,     *
+ * accumulated in the [phnx,phny] window at (x0,y0) of the caller's     *
+ * outphase [outnx,outny,ndir]. Layers above a LGS, DMs not in path,    *
+ * etc are given by the skip masks. The layers are weighted by weight   *
+ * (perm, flags as _get2dPhase_multi), the optics scaled by optscale.   *
+ * A source with 0 screens is ignored.                                  *
+ ************************************************************************/
+
+int _get2dPhase_fused(float *outphase, int outnx, int outny, int ndir,
+                      int x0, int y0, int phnx, int phny,
+                      float *pscreens, int psnx, int psny, int nscreens,
+                      int *skip, float *weight, int *perm, int flags,
+                      int *ishifts, float *xshifts,
+                      int *jshifts, float *yshifts,
+                      float *mircube, int mcnx, int mcny, int nmirrors,
+                      int *dmskip, int *dmishifts, float *dmxshifts,
+                      int *dmjshifts, float *dmyshifts,
+                      float *optcube, int ocnx, int ocny, int nopts,
+                      float *optscale, int *optskip, int *optishifts,
+                      float *optxshifts, int *optjshifts, float *optyshifts,
+                      int nthreads)
+{
+  get2d_source src[GET2D_MAXSRC];
+  int          nsrc = 0, err;
+
+  if (nscreens>0) {
+    get2d_source_set(&src[nsrc], pscreens, psnx, psny, nscreens, skip, weight,
+                     ishifts, xshifts, jshifts, yshifts);
+    if (get2d_source_screens(&src[nsrc++], perm, flags)) return (1);
+  }
+  if (nmirrors>0) get2d_source_set(&src[nsrc++], mircube, mcnx, mcny, nmirrors,
+                                   dmskip, NULL, dmishifts, dmxshifts, dmjshifts,
+                                   dmyshifts);
+  if (nopts>0) get2d_source_set(&src[nsrc++], optcube, ocnx, ocny, nopts,
+                                optskip, optscale, optishifts, optxshifts,
+                                optjshifts, optyshifts);
+  err = get2d_run(src, nsrc, outphase, outnx, outny, x0, y0, phnx, phny, ndir,
+                  nthreads);
+  if ( (nscreens>0) && src[0].lay ) free(src[0].lay);
+  return (err);
+}
+
 
 /************************************************************************
  * Function int _get2dPhase                                             *
@@ -47,50 +812,430 @@ int _get2dPhase(float *pscreens, /* dimension [psnx,psny,nscreens] */
                 int *ishifts,    /* array of X integer shifts dimension [phnx,nscreens] */
                 float *xshifts,  /* array of X fractional shifts dimension [phnx,nscreens] */
                 int *jshifts,    /* array of Y integer shifts dimension [phnx,nscreens] */
-                float *yshifts)  /* array of Y fractional shifts dimension [phnx,nscreens] */
+                float *yshifts,  /* array of Y fractional shifts dimension [phnx,nscreens] */
+                int nthreads)    /* number of threads to split the rows over */
      /* ishifts[k,nscreens] and jshifts[k,nscreens] are the integer shifts for screen[k]
         xshifts[k,nscreens] and yshifts[k,nscreens] are the fractional shifts for screen[k],
      */
 {
-  int i,j,k,ips,jps;
-  int firstel;
-  float wx1,wx2,wy1,wy2;
+  return _get2dPhase_multi(pscreens, psnx, psny, nscreens, skip, NULL, NULL, 0,
+                           outphase, phnx, phny, 1, ishifts, xshifts, jshifts,
+                           yshifts, nthreads);
+}
 
-  /* Loop on phase screens */
-  for (k=0;k<nscreens;++k) {
 
-    if (skip[k]) continue;
+/************************************************************************
+ * Function int _yao_screen_extrude                                     *
+ * Infinite phase screens (atm.infinite): adds ncols new columns (or    *
+ * rows) at one edge of layer "layer" of the [nb,nb,nscreens] pscreens  *
+ * cube and drops the same number at the opposite edge. Each new line   *
+ * is the AR prediction from the nst lines at the edge plus innovation  *
+ * (Assemat et al, Opt. Express 14, 988, 2006):                         *
+ *   new = A # Z + weight * B # beta                                    *
+ * with A [nb,nst*nb] and B [nb,nb] precomputed from the von Karman     *
+ * covariance (yao.i, infinite_screens_ar), Z the nst edge lines (edge  *
+ * first) and beta N(0,1), drawn from the counter based generator at    *
+ * the world index of the line: the same line is generated whatever     *
+ * the process (svipc) and the number of lines added per call.          *
+ * dir: 0 = +x (new column at the high X end), 1 = -x, 2 = +y, 3 = -y.  *
+ * pos = world index of the first new line (then pos+1, ... for +x/+y,  *
+ * pos-1, ... for -x/-y).                                               *
+ ************************************************************************/
 
-    /* first indice for this screen */
-    firstel = k*(psnx*psny);
+#define YAO_SCREEN_STREAM 0x40000000u  // RNG streams of the screen layers
 
-    /* Loop on indices of output (integrated) phase */
-    for (j=0;j<phny;++j) {
-      for (i=0;i<phnx;++i) {
+void yao_rng_gauss_at(float *x, long n, unsigned long index0,
+                      unsigned int stream, unsigned int draw, float sigma);
 
-        ips = ishifts[i+k*phnx];
-        jps = jshifts[j+k*phny];
+int _yao_screen_extrude(float *pscreens, int nb, int nscreens, int layer,
+                        int dir, int ncols, long pos, float *A, float *B,
+                        int nst, float weight)
+{
+  const long nbl = nb;
+  float      *scr, *z, *beta, *x, *col, wb;
+  long       i, j, k, c;
+  int        step = ((dir==0)||(dir==2))? 1: -1;
 
-        /* Computes the weights for the 4 surrounding pixels */
-        wx1 = (1.0f - xshifts[i+k*phnx]);
-        wx2 = (xshifts[i+k*phnx]);
-        wy1 = (1.0f - yshifts[j+k*phny]);
-        wy2 = (yshifts[j+k*phny]);
+  if ( (layer<0) || (layer>=nscreens) || (dir<0) || (dir>3) || \
+       (nst<1) || (nst>=nb) ) return (1);
+  scr = pscreens + (long)layer*nbl*nbl;
+  z   = (float *)malloc(sizeof(float)*nbl*(nst+2));
+  if (z==NULL) return (1);
+  beta = z + nst*nbl;
+  x    = beta + nbl;
 
+  for ( c=0 ; c<ncols ; c++ ) {
+    // stencil, edge line first
+    for ( k=0 ; k<nst ; k++ ) {
+      for ( i=0 ; i<nbl ; i++ ) {
+        switch (dir) {
+        case 0: z[i+k*nbl] = scr[(nbl-1-k)+i*nbl]; break;
+        case 1: z[i+k*nbl] = scr[k+i*nbl]; break;
+        case 2: z[i+k*nbl] = scr[i+(nbl-1-k)*nbl]; break;
+        default: z[i+k*nbl] = scr[i+k*nbl];
+        }
+      }
+    }
+    // innovation, keyed on (layer, direction, world line index)
+    for ( i=0 ; i<nbl ; i++ ) beta[i] = 0.0f;
+    yao_rng_gauss_at(beta, nbl, (unsigned long)(pos+step*c+(1L<<30))*nbl,
+                     YAO_SCREEN_STREAM+layer, dir, 1.0f);
+    // x = A # z + weight * B # beta (A, B column major)
+    for ( i=0 ; i<nbl ; i++ ) x[i] = 0.0f;
+    for ( j=0 ; j<nst*nbl ; j++ ) {
+      col = A + j*nbl;
+      for ( i=0 ; i<nbl ; i++ ) x[i] += col[i]*z[j];
+    }
+    for ( j=0 ; j<nbl ; j++ ) {
+      col = B + j*nbl;
+      wb  = weight*beta[j];
+      for ( i=0 ; i<nbl ; i++ ) x[i] += wb*col[i];
+    }
+    // move the screen by one line and put the new one at the edge
+    switch (dir) {
+    case 0:
+      for ( i=0 ; i<nbl ; i++ ) {
+        memmove(scr+i*nbl, scr+i*nbl+1, sizeof(float)*(nbl-1));
+        scr[nbl-1+i*nbl] = x[i];
+      }
+      break;
+    case 1:
+      for ( i=0 ; i<nbl ; i++ ) {
+        memmove(scr+i*nbl+1, scr+i*nbl, sizeof(float)*(nbl-1));
+        scr[i*nbl] = x[i];
+      }
+      break;
+    case 2:
+      memmove(scr, scr+nbl, sizeof(float)*nbl*(nbl-1));
+      memcpy(scr+(nbl-1)*nbl, x, sizeof(float)*nbl);
+      break;
+    default:
+      memmove(scr+nbl, scr, sizeof(float)*nbl*(nbl-1));
+      memcpy(scr, x, sizeof(float)*nbl);
+    }
+  }
+  free(z);
+  return (0);
+}
+
+
+/************************************************************************
+ * Out-of-core phase screen generator (create_phase_screens)            *
+ * The dim x dim von Karman spectrum of generate_phase_with_L0 is       *
+ * transformed in two passes through a scratch file of dim*dim complex  *
+ * floats, so that the memory used is bounded by maxmem whatever dim:   *
+ * _yao_screen_spectrum: blocks of columns. Spectrum times complex      *
+ *   N(0,1) noise, 1D FFTs along Y, written to the scratch file. The    *
+ *   expected structure function of the screens is summed on the way    *
+ *   (sf, for offsets 1..noff), the caller derives the normalization.   *
+ * _yao_screen_synth: blocks of rows. 1D FFTs along X, the real (and    *
+ *   imaginary) parts are scaled and written in the dimy high strips    *
+ *   of the FITS files (as create_phase_screens: prefix1.fits ...).     *
+ * The blocks are spread over nthreads threads (one FFTW plan, executed *
+ * on each thread buffer). The noise is keyed on the spectrum pixel:    *
+ * the screens only depend on draw, not on maxmem or nthreads.          *
+ ************************************************************************/
+
+#define YAO_SCRGEN_STREAM     0x50000000u  // RNG stream of the generator
+#define YAO_SCRGEN_MAXTHREADS 64
+#define YAO_SCRGEN_MAXOFF     16
+
+typedef struct {
+  int           fd;          // scratch file
+  int           dim, bw;     // spectrum size, block width (columns or rows)
+  int           nblk, t, nthreads;
+  fftwf_plan    plan;
+  fftwf_complex *buf;        // [bw,dim] (pass 1) or [dim,bw] (pass 2)
+  // _yao_screen_spectrum:
+  double        k0;          // 1/outer scale, in spectrum pixels
+  int           nalias;
+  unsigned int  draw;
+  int           noff;
+  const double  *cosr;       // [dim,noff] 1-cos(2 pi k r/dim)
+  double        sf[2*YAO_SCRGEN_MAXOFF]; // sums along X, Y
+  // _yao_screen_synth:
+  int           dimy, nstrip, nparts;
+  float         scale;
+  int           *fds;        // [nstrip,nparts] FITS files
+  unsigned char *row;        // [dim] big endian floats
+  int           err;
+} yao_scrgen;
+
+// pread/pwrite all of n bytes
+static int yao_scrgen_io(int fd, void *buf, size_t n, off_t off, int wr)
+{
+  char    *p = (char *)buf;
+  ssize_t m;
+
+  while (n>0) {
+    m = (wr)? pwrite(fd, p, n, off) : pread(fd, p, n, off);
+    if (m<=0) return (1);
+    p += m; off += m; n -= m;
+  }
+  return (0);
+}
+
+// spectrum amplitude at pixel (x,y), as generate_von_karman_spectrum
+// (aliases included), times dim
+static double yao_scrgen_amp(long x, long y, long dim, double k0, int nalias)
+{
+  double fx, fy, d, sum = 0.0;
+  int    a, b;
+
+  if ( (x==0) && (y==0) ) return (0.0);
+  fx = (x<dim-dim/2)? x : x-dim;
+  fy = (y<dim-dim/2)? y : y-dim;
+  for ( a=-nalias ; a<=nalias ; a++ ) {
+    for ( b=-nalias ; b<=nalias ; b++ ) {
+      d = sqrt((fx+a*dim)*(fx+a*dim)+(fy+b*dim)*(fy+b*dim)+k0*k0);
+      if ( (a==0) && (b==0) && (d<1.0) ) d = 1.0;
+      sum += pow(d, -11./6.);
+    }
+  }
+  return (dim*6.88*0.00969*sum);
+}
 
-        /* Safety net: don't access elements outside of pscreens memory space */
-        if ( (firstel+ips+1+(jps+1)*psnx) >= (psnx*psny*nscreens) ) {return (1);}
+static void *yao_scrgen_cols(void *arg)
+{
+  yao_scrgen    *g = (yao_scrgen *)arg;
+  const long    dim = g->dim, bw = g->bw;
+  fftwf_complex *row;
+  double        a, a2;
+  long          i0, nc, i, y;
+  int           blk, r;
+
+  for ( blk=g->t ; (blk<g->nblk) && !g->err ; blk+=g->nthreads ) {
+    i0 = blk*bw;
+    nc = (dim-i0<bw)? dim-i0 : bw;
+    for ( y=0 ; y<dim ; y++ ) {
+      row = g->buf + y*bw;
+      memset(row, 0, sizeof(fftwf_complex)*bw);
+      // re, im N(0,1/2): E|noise|^2 = 1 as the unit phasors of the
+      // yorick version
+      yao_rng_gauss_at((float *)row, 2*nc, 2*((unsigned long)y*dim+i0),
+                       YAO_SCRGEN_STREAM, g->draw, (float)M_SQRT1_2);
+      for ( i=0 ; i<nc ; i++ ) {
+        a  = yao_scrgen_amp(i0+i, y, dim, g->k0, g->nalias);
+        a2 = a*a;
+        row[i][0] *= (float)a;
+        row[i][1] *= (float)a;
+        // <(phi(x)-phi(x+r))^2> of the real (or im) part
+        for ( r=0 ; r<g->noff ; r++ ) {
+          g->sf[r]                    += a2*g->cosr[(i0+i)+r*dim];
+          g->sf[YAO_SCRGEN_MAXOFF+r] += a2*g->cosr[y+r*dim];
+        }
+      }
+    }
+    fftwf_execute_dft(g->plan, g->buf, g->buf);
+    for ( y=0 ; (y<dim) && !g->err ; y++ ) {
+      g->err = yao_scrgen_io(g->fd, g->buf+y*bw, sizeof(fftwf_complex)*nc,
+                             (off_t)sizeof(fftwf_complex)*(y*dim+i0), 1);
+    }
+  }
+  return (NULL);
+}
 
-        /* Finaly, compute and integrate outphase */
-        outphase[i+j*phnx] += ( wx1*wy1*pscreens[firstel+ips+jps*psnx]
-                              + wx2*wy1*pscreens[firstel+ips+1+jps*psnx]
-                              + wx1*wy2*pscreens[firstel+ips+(jps+1)*psnx]
-                              + wx2*wy2*pscreens[firstel+ips+1+(jps+1)*psnx]);
+static void *yao_scrgen_rows(void *arg)
+{
+  yao_scrgen    *g = (yao_scrgen *)arg;
+  const long    dim = g->dim, bw = g->bw;
+  const long    nrows = (long)g->nstrip*g->dimy;
+  float         v;
+  unsigned int  u;
+  long          y0, nr, r, y, i;
+  int           blk, p, s;
 
+  for ( blk=g->t ; (blk<g->nblk) && !g->err ; blk+=g->nthreads ) {
+    y0 = blk*bw;
+    nr = (nrows-y0<bw)? nrows-y0 : bw;
+    g->err = yao_scrgen_io(g->fd, g->buf, sizeof(fftwf_complex)*nr*dim,
+                           (off_t)sizeof(fftwf_complex)*y0*dim, 0);
+    if (g->err) break;
+    fftwf_execute_dft(g->plan, g->buf, g->buf);
+    for ( r=0 ; (r<nr) && !g->err ; r++ ) {
+      y = y0+r;
+      s = (int)(y/g->dimy);
+      for ( p=0 ; (p<g->nparts) && !g->err ; p++ ) {
+        for ( i=0 ; i<dim ; i++ ) {
+          v = g->scale*g->buf[r*dim+i][p];
+          memcpy(&u, &v, 4);
+          g->row[4*i]   = u>>24;
+          g->row[4*i+1] = u>>16;
+          g->row[4*i+2] = u>>8;
+          g->row[4*i+3] = u;
+        }
+        g->err = yao_scrgen_io(g->fds[s+p*g->nstrip], g->row, 4*dim,
+                               2880+(off_t)4*(y%g->dimy)*dim, 1);
       }
     }
   }
-  return(0);
+  return (NULL);
+}
+
+// plans the transforms and runs fn on the blocks, over the threads
+static int yao_scrgen_run(yao_scrgen *g0, void *(*fn)(void *), int rows,
+                          long maxmem, int nthreads, long nlines)
+{
+  yao_scrgen th[YAO_SCRGEN_MAXTHREADS];
+  pthread_t  thid[YAO_SCRGEN_MAXTHREADS];
+  int        thok[YAO_SCRGEN_MAXTHREADS];
+  const long dim = g0->dim;
+  long       bw;
+  int        t, n = g0->dim, err = 0;
+
+  if (nthreads > YAO_SCRGEN_MAXTHREADS) nthreads = YAO_SCRGEN_MAXTHREADS;
+  if (nthreads < 1) nthreads = 1;
+  bw = maxmem/((long)nthreads*dim*sizeof(fftwf_complex));
+  if (bw > nlines) bw = nlines;
+  if (bw < 1) bw = 1;
+  if ((nlines+bw-1)/bw < nthreads) nthreads = (int)((nlines+bw-1)/bw);
+
+  for ( t=0 ; t<nthreads ; t++ ) {
+    th[t] = *g0;
+    th[t].bw       = (int)bw;
+    th[t].nblk     = (int)((nlines+bw-1)/bw);
+    th[t].t        = t;
+    th[t].nthreads = nthreads;
+    th[t].buf      = fftwf_malloc(sizeof(fftwf_complex)*bw*dim);
+    th[t].row      = malloc(4*dim);
+    if ( (th[t].buf==NULL) || (th[t].row==NULL) ) err = 1;
+    else memset(th[t].buf, 0, sizeof(fftwf_complex)*bw*dim);
+  }
+  if (!err) {
+    // the blocks are too large for FFTW_MEASURE to pay off
+    if (rows) g0->plan = fftwf_plan_many_dft(1, &n, (int)bw, th[0].buf, NULL,
+                                             1, n, th[0].buf, NULL, 1, n,
+                                             FFTW_FORWARD, FFTW_ESTIMATE);
+    else g0->plan = fftwf_plan_many_dft(1, &n, (int)bw, th[0].buf, NULL,
+                                        (int)bw, 1, th[0].buf, NULL, (int)bw, 1,
+                                        FFTW_FORWARD, FFTW_ESTIMATE);
+    if (g0->plan == NULL) err = 1;
+  }
+  if (!err) {
+    for ( t=0 ; t<nthreads ; t++ ) th[t].plan = g0->plan;
+    for ( t=1 ; t<nthreads ; t++ )
+      thok[t] = (pthread_create(&thid[t], NULL, fn, &th[t]) == 0);
+    fn(&th[0]);
+    for ( t=1 ; t<nthreads ; t++ ) {
+      if (thok[t]) pthread_join(thid[t], NULL);
+      else fn(&th[t]);
+    }
+    memset(g0->sf, 0, sizeof(g0->sf));
+    for ( t=0 ; t<nthreads ; t++ ) {
+      err |= th[t].err;
+      for ( n=0 ; n<2*YAO_SCRGEN_MAXOFF ; n++ ) g0->sf[n] += th[t].sf[n];
+    }
+    fftwf_destroy_plan(g0->plan);
+  }
+  for ( t=0 ; t<nthreads ; t++ ) {
+    if (th[t].buf) fftwf_free(th[t].buf);
+    free(th[t].row);
+  }
+  return (err);
+}
+
+int _yao_screen_spectrum(char *scratch, // scratch file (created)
+                         int dim,       // spectrum size
+                         float l0,      // outer scale in pixels (0: infinite)
+                         int nalias,    // spectrum aliases (see generate_von_karman_spectrum)
+                         int draw,      // noise draw
+                         double *sf,    // [noff] out, expected structure function
+                         int noff,
+                         long maxmem,   // memory for the buffers, bytes
+                         int nthreads)
+{
+  yao_scrgen g;
+  double     *cosr;
+  long       k;
+  int        r, err;
+
+  if ( (dim<2) || (noff<1) || (noff>YAO_SCRGEN_MAXOFF) || (nalias<0) ) return (1);
+  memset(&g, 0, sizeof(g));
+  g.dim    = dim;
+  g.k0     = (l0>0)? dim/l0 : 0.0;
+  g.nalias = nalias;
+  g.draw   = (unsigned int)draw;
+  g.noff   = noff;
+  cosr = (double *)malloc(sizeof(double)*dim*noff);
+  if (cosr==NULL) return (1);
+  for ( r=0 ; r<noff ; r++ )
+    for ( k=0 ; k<dim ; k++ ) cosr[k+(long)r*dim] = 1.0-cos(2*M_PI*k*(r+1)/dim);
+  g.cosr = cosr;
+
+  g.fd = open(scratch, O_RDWR|O_CREAT|O_TRUNC, 0644);
+  if (g.fd<0) { free(cosr); return (1); }
+  err = ftruncate(g.fd, (off_t)sizeof(fftwf_complex)*dim*dim) ||
+    yao_scrgen_run(&g, yao_scrgen_cols, 0, maxmem, nthreads, dim);
+  close(g.fd);
+  free(cosr);
+  // <(phi(x)-phi(x+r))^2> = sum(amp^2 (1-cos)), average of X and Y
+  for ( r=0 ; r<noff ; r++ ) sf[r] = (g.sf[r]+g.sf[YAO_SCRGEN_MAXOFF+r])/2;
+  return (err);
+}
+
+int _yao_screen_synth(char *scratch, // scratch file of _yao_screen_spectrum
+                      char *prefix,  // FITS files prefix
+                      int dim,       // spectrum size (= screen X size)
+                      int dimy,      // screen Y size
+                      int nparts,    // 1: real part only, 2: real and imaginary
+                      float scale,   // normalization
+                      long maxmem,
+                      int nthreads)
+{
+  yao_scrgen g;
+  char       card[81], *fname;
+  long       nbytes;
+  int        nstrip = dim/dimy, nscreen, i, k, err = 0;
+
+  if ( (dimy<1) || (nstrip<1) || (nparts<1) || (nparts>2) ) return (1);
+  nscreen = nstrip*nparts;
+  memset(&g, 0, sizeof(g));
+  g.dim    = dim;
+  g.dimy   = dimy;
+  g.nstrip = nstrip;
+  g.nparts = nparts;
+  g.scale  = scale;
+  g.fds    = (int *)malloc(sizeof(int)*nscreen);
+  fname    = (char *)malloc(strlen(prefix)+32);
+  if ( (g.fds==NULL) || (fname==NULL) ) { free(g.fds); free(fname); return (1); }
+
+  // BITPIX=-32 FITS files, data filled by the threads
+  nbytes = 2880+((4L*dim*dimy+2879)/2880)*2880;
+  for ( i=0 ; i<nscreen ; i++ ) {
+    if (nscreen==1) sprintf(fname, "%s.fits", prefix);
+    else sprintf(fname, "%s%d.fits", prefix, i+1);
+    g.fds[i] = open(fname, O_RDWR|O_CREAT|O_TRUNC, 0644);
+    if (g.fds[i]<0) { nscreen = i; err = 1; break; }
+    for ( k=0 ; k<36 ; k++ ) {
+      memset(card, ' ', 80);
+      card[80] = '\0';
+      switch (k) {
+      case 0: sprintf(card, "SIMPLE  = %20s", "T"); break;
+      case 1: sprintf(card, "BITPIX  = %20d", -32); break;
+      case 2: sprintf(card, "NAXIS   = %20d", 2); break;
+      case 3: sprintf(card, "NAXIS1  = %20d", dim); break;
+      case 4: sprintf(card, "NAXIS2  = %20d", dimy); break;
+      case 5: sprintf(card, "END"); break;
+      }
+      card[strlen(card)] = ' ';
+      if (yao_scrgen_io(g.fds[i], card, 80, 80*k, 1)) err = 1;
+    }
+    if (ftruncate(g.fds[i], nbytes)) err = 1;
+  }
+
+  if (!err) {
+    g.fd = open(scratch, O_RDONLY);
+    if (g.fd<0) err = 1;
+    else {
+      err = yao_scrgen_run(&g, yao_scrgen_rows, 1, maxmem, nthreads,
+                           (long)nstrip*dimy);
+      close(g.fd);
+    }
+  }
+  for ( i=0 ; i<nscreen ; i++ ) close(g.fds[i]);
+  free(g.fds);
+  free(fname);
+  return (err);
 }
 
 
@@ -199,3 +1344,468 @@ void _dmsumelt(float *def,     // pointer to dm influence functions
     }
   }
 }
+
+
+/************************************************************************
+ * Sparse influence functions (comp_dm_shape, comp_dm_shape_init)       *
+ * Each IF is kept as the bounding box of its non-zero pixels:          *
+ * box[4*k..4*k+3] = i0, j0, nx, ny (0 based) and the nx*ny values of   *
+ * the boxes packed one after the other in vals. _dmsum_sparse sums the *
+ * boxes weighted by the commands (zero commands skipped), with the     *
+ * output rows split over nthreads: O(nact*box^2) instead of the        *
+ * O(nact*N^2) of _dmsum. Boxes may stick out of the output (elt=1      *
+ * IFs, shifted by i1/j1), the part outside is ignored.                 *
+ * _dmsum_sparse_delta updates a previous shape instead, with only the  *
+ * boxes of the actuators whose command moved by more than tol.         *
+ ************************************************************************/
+
+#define DMSPARSE_MAXTHREADS 64
+#define DMSPARSE_MINWORK    65536  // packed values below which we stay serial
+
+// bounding boxes of the nact nx*ny IFs. Returns the total packed size
+long _dm_sparse_boxes(float *def, int nx, int ny, int nact, int *box)
+{
+  const float *d;
+  long        ntot = 0;
+  int         i, j, k, imin, imax, jmin, jmax;
+
+  for ( k=0 ; k<nact ; k++ ) {
+    d = def + (long)k*nx*ny;
+    imin = nx; imax = -1; jmin = ny; jmax = -1;
+    for ( j=0 ; j<ny ; j++ ) {
+      for ( i=0 ; i<nx ; i++ ) {
+        if (d[i+(long)j*nx] == 0.0f) continue;
+        if (i<imin) imin = i;
+        if (i>imax) imax = i;
+        if (j<jmin) jmin = j;
+        jmax = j;
+      }
+    }
+    if (imax<0) { imin = jmin = 0; imax = jmax = -1; } // empty IF
+    box[4*k]   = imin;
+    box[4*k+1] = jmin;
+    box[4*k+2] = imax-imin+1;
+    box[4*k+3] = jmax-jmin+1;
+    ntot += (long)box[4*k+2]*box[4*k+3];
+  }
+  return (ntot);
+}
+
+// packs the boxes (from _dm_sparse_boxes) of the IFs into vals
+void _dm_sparse_pack(float *def, int nx, int ny, int nact, int *box, float *vals)
+{
+  const float *d;
+  int         j, k;
+
+  for ( k=0 ; k<nact ; k++ ) {
+    d = def + (long)k*nx*ny + box[4*k] + (long)box[4*k+1]*nx;
+    for ( j=0 ; j<box[4*k+3] ; j++ ) {
+      memcpy(vals, d+(long)j*nx, sizeof(float)*box[4*k+2]);
+      vals += box[4*k+2];
+    }
+  }
+}
+
+typedef struct {
+  const float *vals, *coefs;
+  const int   *box;
+  float       *out;
+  int         nact, outnx, outny, j0, j1, zero;
+} dmsparse_thread;
+
+GET2D_CLONES
+static void dmsparse_row(float *restrict out, const float *restrict v, int n,
+                         float c)
+{
+  int i;
+  for ( i=0 ; i<n ; i++ ) out[i] += c*v[i];
+}
+
+// output rows j0 to j1-1
+static void *dmsparse_rows(void *arg)
+{
+  dmsparse_thread *t = (dmsparse_thread *)arg;
+  const int       *b;
+  long            off = 0;
+  int             j, k, ib, ie, jb, je;
+
+  if (t->zero) memset(t->out + (long)t->j0*t->outnx, 0,
+                     sizeof(float)*(t->j1-t->j0)*t->outnx);
+  for ( k=0 ; k<t->nact ; off+=(long)b[2]*b[3], k++ ) {
+    b = t->box + 4*k;
+    if (t->coefs[k] == 0.0f) continue;
+    jb = (b[1]>t->j0)? b[1] : t->j0;
+    je = (b[1]+b[3]<t->j1)? b[1]+b[3] : t->j1;
+    ib = (b[0]>0)? b[0] : 0;
+    ie = (b[0]+b[2]<t->outnx)? b[0]+b[2] : t->outnx;
+    if ( (jb>=je) || (ib>=ie) ) continue;
+    for ( j=jb ; j<je ; j++ )
+      dmsparse_row(t->out + ib + (long)j*t->outnx,
+                   t->vals + off + (ib-b[0]) + (long)(j-b[1])*b[2],
+                   ie-ib, t->coefs[k]);
+  }
+  return NULL;
+}
+
+// splits the output rows of a (zero=1) sum or (zero=0) update over threads
+static void dmsparse_run(const float *vals, const int *box, int nact,
+                         const float *coefs, float *dmshape, int outnx,
+                         int outny, int nthreads, int zero, long nvals)
+{
+  dmsparse_thread th[DMSPARSE_MAXTHREADS];
+  pthread_t       thid[DMSPARSE_MAXTHREADS];
+  int             thok[DMSPARSE_MAXTHREADS];
+  int             t;
+
+  if (nvals < DMSPARSE_MINWORK) nthreads = 1;
+  if (nthreads > DMSPARSE_MAXTHREADS) nthreads = DMSPARSE_MAXTHREADS;
+  if (nthreads > outny) nthreads = outny;
+  if (nthreads < 1) nthreads = 1;
+
+  for ( t=0 ; t<nthreads ; t++ ) {
+    th[t].vals  = vals;
+    th[t].coefs = coefs;
+    th[t].box   = box;
+    th[t].out   = dmshape;
+    th[t].nact  = nact;
+    th[t].outnx = outnx;
+    th[t].outny = outny;
+    th[t].zero  = zero;
+    th[t].j0    = (int)((long)outny*t/nthreads);
+    th[t].j1    = (int)((long)outny*(t+1)/nthreads);
+  }
+  for ( t=1 ; t<nthreads ; t++ )
+    thok[t] = (pthread_create(&thid[t], NULL, dmsparse_rows, &th[t]) == 0);
+  dmsparse_rows(&th[0]);
+  for ( t=1 ; t<nthreads ; t++ ) {
+    if (thok[t]) pthread_join(thid[t], NULL);
+    else dmsparse_rows(&th[t]);
+  }
+}
+
+void _dmsum_sparse(float *vals,    // packed IF boxes
+                   int   *box,     // [4,nact] boxes i0,j0,nx,ny in the output
+                   int   nact,
+                   float *coefs,   // command coefficients
+                   float *dmshape, // output phase, zeroed first
+                   int   outnx,
+                   int   outny,
+                   int   nthreads)
+{
+  long nvals = 0;
+  int  k;
+
+  for ( k=0 ; k<nact ; k++ ) nvals += (long)box[4*k+2]*box[4*k+3];
+  dmsparse_run(vals, box, nact, coefs, dmshape, outnx, outny, nthreads, 1,
+               nvals);
+}
+
+int _dmsum_sparse_delta(float *vals,    // packed IF boxes
+                        int   *box,     // [4,nact] boxes i0,j0,nx,ny
+                        int   nact,
+                        float *coefs,   // new command coefficients
+                        float *prev,    // commands dmshape was made with
+                        float tol,      // smallest |coefs-prev| applied
+                        float *dmshape, // shape to update in place
+                        int   outnx,
+                        int   outny,
+                        int   nthreads)
+/* Adds (coefs-prev)*IF to dmshape for the actuators with |coefs-prev| > tol
+   and sets prev to coefs for those (the others keep their old prev, so
+   that sub-tolerance moves accumulate until they are applied). Cost is
+   the footprint of the moved IFs. Returns the number of actuators moved,
+   -1 on allocation failure (dmshape and prev then untouched). */
+{
+  float *delta;
+  long  nvals = 0;
+  int   k, nmoved = 0;
+
+  delta = (float *)malloc(sizeof(float)*(nact>0? nact : 1));
+  if (delta == NULL) return (-1);
+
+  for ( k=0 ; k<nact ; k++ ) {
+    delta[k] = coefs[k] - prev[k];
+    if (fabsf(delta[k]) <= tol) { delta[k] = 0.0f; continue; }
+    prev[k] = coefs[k];
+    nvals += (long)box[4*k+2]*box[4*k+3];
+    nmoved++;
+  }
+  if (nmoved) dmsparse_run(vals, box, nact, delta, dmshape, outnx, outny,
+                           nthreads, 0, nvals);
+  free(delta);
+  return (nmoved);
+}
+
+
+/************************************************************************
+ * C reconstructor (mat.mvm): err = cMat.mes [- dMat.com]. The matrices *
+ * are packed once (_yao_mvm_init) in row-major, 64 byte aligned rows,  *
+ * in float, bf16 or fp16 (YAO_MVM_*). The 16 bit formats halve the     *
+ * memory traffic, which is what a large MVM is bound by; each row has  *
+ * its own scale so that fp16 keeps its 11 bits whatever the units.     *
+ * Rows are done 4 at a time (mes read once for 4 rows) with 16 lane    *
+ * accumulators, and split over threads. The POLC term is subtracted in *
+ * the same pass (polc=1) or returned separately (polc=2, when go()     *
+ * has to mask it per DM).                                              *
+ ************************************************************************/
+
+#define YAO_MVM_MAX        16
+#define YAO_MVM_MAXTHREADS 64
+#define YAO_MVM_MINWORK    262144 // matrix elements below which we stay serial
+#define YAO_MVM_LANES      16     // accumulators per row, and row alignment
+#define YAO_MVM_FLOAT      1
+#define YAO_MVM_BF16       2
+#define YAO_MVM_FP16       3
+
+typedef struct {
+  int   storage, ncols;
+  long  stride;   // elements per packed row (multiple of YAO_MVM_LANES)
+  void  *a;       // packed rows, nrows padded to a multiple of 4
+  float *scale;   // per row
+} yao_mvm_mat;
+
+typedef struct {
+  int         inuse, nrows;
+  yao_mvm_mat c, d; // cMat, dMat (d.a == NULL: no POLC matrix)
+} yao_mvm_ctx;
+
+static yao_mvm_ctx yao_mvm_tab[YAO_MVM_MAX];
+
+static unsigned short yao_float2bf16(float f)
+{
+  unsigned int u;
+  memcpy(&u, &f, 4);
+  u += 0x7fff + ((u >> 16) & 1); // round to nearest even
+  return (unsigned short)(u >> 16);
+}
+
+static unsigned short yao_float2fp16(float f)
+{
+  unsigned int u, s;
+  memcpy(&u, &f, 4);
+  s = (u >> 16) & 0x8000;
+  u &= 0x7fffffff;
+  memcpy(&f, &u, 4);
+  if (f > 65504.0f) f = 65504.0f;
+  f *= 0x1p-112f; // rebias the exponent: fp16 bits are then u>>13
+  memcpy(&u, &f, 4);
+  return (unsigned short)(s | ((u + 0x1000) >> 13));
+}
+
+#define YAO_MVM_BF16DEC(h, f) do {                                      \
+    unsigned int u_ = (unsigned int)(h) << 16; memcpy(&(f), &u_, 4);     \
+  } while (0)
+// normals and subnormals alike (no inf/nan: clipped when packing)
+#define YAO_MVM_FP16DEC(h, f) do {                                      \
+    unsigned int u_ = (((unsigned int)(h) & 0x7fff) << 13) |            \
+                      (((unsigned int)(h) & 0x8000) << 16);             \
+    memcpy(&(f), &u_, 4); (f) *= 0x1p112f;                              \
+  } while (0)
+#define YAO_MVM_F32DEC(h, f) ((f) = (h))
+
+// 4 rows (stride apart) times x, n elements
+#define YAO_MVM_KERNEL(SFX, T, DEC)                                     \
+GET2D_CLONES                                                            \
+static void mvm_rows4_##SFX(const T *restrict a, long stride,           \
+                            const float *restrict x, int n, float *s)   \
+{                                                                       \
+  float acc[4][YAO_MVM_LANES], f;                                       \
+  int   i, l, r;                                                        \
+  memset(acc, 0, sizeof(acc));                                          \
+  for ( i=0 ; i+YAO_MVM_LANES<=n ; i+=YAO_MVM_LANES ) {                 \
+    for ( r=0 ; r<4 ; r++ ) {                                           \
+      for ( l=0 ; l<YAO_MVM_LANES ; l++ ) {                             \
+        DEC(a[r*stride+i+l], f);                                        \
+        acc[r][l] += f*x[i+l];                                          \
+      }                                                                 \
+    }                                                                   \
+  }                                                                     \
+  for ( r=0 ; r<4 ; r++ ) {                                             \
+    s[r] = 0.0f;                                                        \
+    for ( l=i ; l<n ; l++ ) { DEC(a[r*stride+l], f); s[r] += f*x[l]; }  \
+    for ( l=0 ; l<YAO_MVM_LANES ; l++ ) s[r] += acc[r][l];              \
+  }                                                                     \
+}
+
+YAO_MVM_KERNEL(f32,  float,          YAO_MVM_F32DEC)
+YAO_MVM_KERNEL(bf16, unsigned short, YAO_MVM_BF16DEC)
+YAO_MVM_KERNEL(fp16, unsigned short, YAO_MVM_FP16DEC)
+
+// rows r..r+3 of m times x, scaled
+static void mvm_rows4(const yao_mvm_mat *m, long r, const float *x, float *s)
+{
+  int k;
+  if (m->storage == YAO_MVM_FLOAT)
+    mvm_rows4_f32((float *)m->a + r*m->stride, m->stride, x, m->ncols, s);
+  else if (m->storage == YAO_MVM_BF16)
+    mvm_rows4_bf16((unsigned short *)m->a + r*m->stride, m->stride, x,
+                   m->ncols, s);
+  else
+    mvm_rows4_fp16((unsigned short *)m->a + r*m->stride, m->stride, x,
+                   m->ncols, s);
+  for ( k=0 ; k<4 ; k++ ) s[k] *= m->scale[r+k];
+}
+
+static void yao_mvm_mat_free(yao_mvm_mat *m)
+{
+  free(m->a);
+  free(m->scale);
+  m->a = NULL;
+  m->scale = NULL;
+}
+
+// packs the column-major [nrows,ncols] in into m. Returns 0 or -1
+static int yao_mvm_mat_pack(yao_mvm_mat *m, const float *in, int nrows,
+                            int ncols, int storage)
+{
+  long   r, c, nr4 = (nrows+3) & ~3L, esize, nbytes;
+  float  mx, v;
+
+  m->storage = storage;
+  m->ncols   = ncols;
+  m->stride  = (ncols + YAO_MVM_LANES-1) / YAO_MVM_LANES * YAO_MVM_LANES;
+  esize      = (storage == YAO_MVM_FLOAT)? 4 : 2;
+  nbytes     = esize*nr4*m->stride;
+  m->scale   = (float *)calloc(nr4 ? nr4 : 1, sizeof(float));
+  if ( (m->scale == NULL) || posix_memalign(&m->a, 64, nbytes ? nbytes : 64) ) {
+    m->a = NULL;
+    yao_mvm_mat_free(m);
+    return (-1);
+  }
+  memset(m->a, 0, nbytes);
+
+  for ( r=0 ; r<nrows ; r++ ) {
+    mx = 0.0f;
+    if (storage == YAO_MVM_FP16)
+      for ( c=0 ; c<ncols ; c++ ) mx = fmaxf(mx, fabsf(in[r+c*nrows]));
+    // fp16: row maximum at 2^15, well inside the fp16 range
+    m->scale[r] = ((storage == YAO_MVM_FP16) && (mx > 0.0f))? mx/32768.0f : 1.0f;
+    for ( c=0 ; c<ncols ; c++ ) {
+      v = in[r+c*nrows] / m->scale[r];
+      if (storage == YAO_MVM_FLOAT)
+        ((float *)m->a)[r*m->stride+c] = v;
+      else if (storage == YAO_MVM_BF16)
+        ((unsigned short *)m->a)[r*m->stride+c] = yao_float2bf16(v);
+      else
+        ((unsigned short *)m->a)[r*m->stride+c] = yao_float2fp16(v);
+    }
+  }
+  return (0);
+}
+
+void _yao_mvm_free(int h)
+// frees reconstructor h (all if h<0)
+{
+  int i;
+  for ( i=0 ; i<YAO_MVM_MAX ; i++ ) {
+    if ( (h >= 0) && (i != h) ) continue;
+    yao_mvm_mat_free(&yao_mvm_tab[i].c);
+    yao_mvm_mat_free(&yao_mvm_tab[i].d);
+    yao_mvm_tab[i].inuse = 0;
+  }
+}
+
+int _yao_mvm_init(int   h,       // handle to reuse, or <0 for a new one
+                  float *cmat,   // [nact,nmes], column-major (yorick)
+                  int   nact,
+                  int   nmes,
+                  float *dmat,   // [nact,ncom] POLC matrix
+                  int   ncom,    // 0: no dMat
+                  int   storage) // YAO_MVM_FLOAT, _BF16 or _FP16
+/* Returns the handle, -1 on error */
+{
+  yao_mvm_ctx *m;
+
+  if ( (storage < YAO_MVM_FLOAT) || (storage > YAO_MVM_FP16) ) return (-1);
+  if ( (h < 0) || (h >= YAO_MVM_MAX) ) {
+    for ( h=0 ; (h<YAO_MVM_MAX) && yao_mvm_tab[h].inuse ; h++ ) ;
+    if (h == YAO_MVM_MAX) return (-1);
+  }
+  _yao_mvm_free(h);
+  m = &yao_mvm_tab[h];
+  m->nrows = nact;
+  if (yao_mvm_mat_pack(&m->c, cmat, nact, nmes, storage)) return (-1);
+  if ( (ncom > 0) && yao_mvm_mat_pack(&m->d, dmat, nact, ncom, storage) ) {
+    _yao_mvm_free(h);
+    return (-1);
+  }
+  m->inuse = 1;
+  return (h);
+}
+
+typedef struct {
+  const yao_mvm_ctx *m;
+  const float       *mes, *com;
+  float             *err, *polcout;
+  int               polc;
+  long              r0, r1; // rows, multiples of 4
+} yao_mvm_thread;
+
+static void *yao_mvm_rows(void *arg)
+{
+  yao_mvm_thread *t = (yao_mvm_thread *)arg;
+  float          s[4], p[4];
+  long           r;
+  int            k;
+
+  for ( r=t->r0 ; r<t->r1 ; r+=4 ) {
+    mvm_rows4(&t->m->c, r, t->mes, s);
+    if (t->polc) mvm_rows4(&t->m->d, r, t->com, p);
+    for ( k=0 ; (k<4) && (r+k<t->m->nrows) ; k++ ) {
+      t->err[r+k] = (t->polc == 1)? s[k]-p[k] : s[k];
+      if (t->polc == 2) t->polcout[r+k] = p[k];
+    }
+  }
+  return NULL;
+}
+
+int _yao_mvm(int   h,
+             float *mes,      // measurements, nmes
+             int   nmes,
+             float *com,      // commands for POLC, ncom
+             int   ncom,
+             int   polc,      // 0: err=cMat.mes, 1: err-=dMat.com, 2: polcout=dMat.com
+             float *err,      // out, nact
+             float *polcout,  // out if polc==2, nact
+             int   nthreads)
+/* Returns 0, or -1 for a bad handle or size */
+{
+  yao_mvm_thread th[YAO_MVM_MAXTHREADS];
+  pthread_t      thid[YAO_MVM_MAXTHREADS];
+  int            thok[YAO_MVM_MAXTHREADS];
+  yao_mvm_ctx    *m;
+  long           ng, work;
+  int            t;
+
+  if ( (h < 0) || (h >= YAO_MVM_MAX) || !yao_mvm_tab[h].inuse ) return (-1);
+  m = &yao_mvm_tab[h];
+  if (nmes != m->c.ncols) return (-1);
+  if ( (polc < 0) || (polc > 2) ) return (-1);
+  if ( polc && ((m->d.a == NULL) || (ncom != m->d.ncols)) ) return (-1);
+
+  ng   = (m->nrows+3)/4; // groups of 4 rows
+  work = (long)m->nrows*(nmes + (polc? ncom : 0));
+  if (work < YAO_MVM_MINWORK) nthreads = 1;
+  if (nthreads > YAO_MVM_MAXTHREADS) nthreads = YAO_MVM_MAXTHREADS;
+  if (nthreads > ng) nthreads = ng;
+  if (nthreads < 1) nthreads = 1;
+
+  for ( t=0 ; t<nthreads ; t++ ) {
+    th[t].m       = m;
+    th[t].mes     = mes;
+    th[t].com     = com;
+    th[t].err     = err;
+    th[t].polcout = polcout;
+    th[t].polc    = polc;
+    th[t].r0      = 4*(ng*t/nthreads);
+    th[t].r1      = 4*(ng*(t+1)/nthreads);
+  }
+  for ( t=1 ; t<nthreads ; t++ )
+    thok[t] = (pthread_create(&thid[t], NULL, yao_mvm_rows, &th[t]) == 0);
+  yao_mvm_rows(&th[0]);
+  for ( t=1 ; t<nthreads ; t++ ) {
+    if (thok[t]) pthread_join(thid[t], NULL);
+    else yao_mvm_rows(&th[t]);
+  }
+  return (0);
+}
@@ -342,32 +342,36 @@ func check_parameters(void)
   }
 
   // ATM STRUCTURE
-  if ((*atm.screen) == []) {exit,"atm.screen has not been set";}
-  if (typeof(*atm.screen) != "string") {exit,"*atm.screen is not a string";}
-
-  ftmp = *atm.screen;
-  for (i=1;i<=numberof(ftmp);i++) {
-    if (!open(ftmp(i),"r",1)) { // file does not exist
-      msg = swrite(format="Phase screen %s not found!\\n"+
-                   "You need to generate phase screens for yao.\\n"+
-                   "Go to \"Phase Screen -> Create phase Screen\"\\n"+
-                   "If you already have phase screens, you can modify\\n"+
-                   "the path in the parfile atm.screen definition",ftmp(i));
-      if (_pyk_proc) pyk,"set_cursor_busy(0)";
-      pyk_warning,msg;
-      msg = swrite(format="\nWARNING: %s not found!\nEdit the par file and change the "+
-                   "path,\nand/or run \"Phase Screen -> Create phase Screen\"\n",ftmp(i));
-      write,msg;
-      break;
+  if (!atm.infinite) {
+    if ((*atm.screen) == []) {exit,"atm.screen has not been set";}
+    if (typeof(*atm.screen) != "string") {exit,"*atm.screen is not a string";}
+
+    ftmp = *atm.screen;
+    for (i=1;i<=numberof(ftmp);i++) {
+      if (!open(ftmp(i),"r",1)) { // file does not exist
+        msg = swrite(format="Phase screen %s not found!\\n"+
+                     "You need to generate phase screens for yao.\\n"+
+                     "Go to \"Phase Screen -> Create phase Screen\"\\n"+
+                     "If you already have phase screens, you can modify\\n"+
+                     "the path in the parfile atm.screen definition",ftmp(i));
+        if (_pyk_proc) pyk,"set_cursor_busy(0)";
+        pyk_warning,msg;
+        msg = swrite(format="\nWARNING: %s not found!\nEdit the par file and change the "+
+                     "path,\nand/or run \"Phase Screen -> Create phase Screen\"\n",ftmp(i));
+        write,msg;
+        break;
+      }
     }
   }
+  if (atm.infinite && (atm.L0 == 0)) atm.L0 = 25.;
 
   if ((*atm.layerfrac) == []) {exit,"atm.layerfrac has not been set";}
   if ((*atm.layerspeed) == []) {exit,"atm.layerspeed has not been set";}
   if ((*atm.layeralt) == []) {exit,"atm.layeralt has not been set";}
   if ((*atm.winddir) == []) {exit,"atm.winddir has not been set";}
 
-  if (nallof(_(numberof(*atm.screen),numberof(*atm.layerfrac),numberof(*atm.layerspeed), \
+  nlayers = (atm.infinite? numberof(*atm.layerfrac): numberof(*atm.screen));
+  if (nallof(_(nlayers,numberof(*atm.layerfrac),numberof(*atm.layerspeed), \
                numberof(*atm.layeralt)) == numberof(*atm.winddir))) {
     exit,"Some elements within atm.screen, layerfrac, layerspeed, layeralt \n"+\
       "or winddir do not have the same number of elements.";
@@ -441,6 +445,12 @@ func check_parameters(void)
          ((wfs(ns).shthreshold > (wfs(ns).npixels)^2) || (wfs(ns).shthreshold <= 0))) {
         exit,swrite(format="Wrong wfs(%d).shthreshold value for wfs(%d).shthmethod = %d",ns,ns,wfs(ns).shthmethod);
       }
+      if ((wfs(ns).type == "hartmann") && ((wfs(ns).shthmethod < 1) || (wfs(ns).shthmethod > 5))) {
+        exit,swrite(format="wfs(%d).shthmethod = %d is not a valid method (1 to 5)",ns,wfs(ns).shthmethod);
+      }
+      if ((wfs(ns).type == "hartmann") && (wfs(ns).shthmethod >= 4) && (wfs(ns).svipc > 1)) {
+        exit,swrite(format="wfs(%d).shthmethod = %d is not supported with wfs.svipc > 1",ns,wfs(ns).shthmethod);
+      }
     }
 
     if ((wfs(ns).type == "hartmann") && (wfs(ns).shmethod == 2)) {
@@ -478,6 +488,16 @@ func check_parameters(void)
 
     if (wfs(ns).optthroughput == 0) {wfs(ns).optthroughput = 1.0;}
 
+    if (wfs(ns).nthreads < 1) wfs(ns).nthreads = 1;
+    if ((wfs(ns).nthreads>1) && (wfs(ns).type!="hartmann")) {
+      write,format="wfs(%d).nthreads >1: only the phase ray tracing will be threaded (not %s)\n",ns,wfs(ns).type;
+    }
+
+    if (wfs(ns).fftbatch < 1) wfs(ns).fftbatch = 1;
+    if ((wfs(ns).fftbatch>1) && (wfs(ns).type!="hartmann")) {
+      write,format="wfs(%d).fftbatch >1 only for SHWFS, will have no effect\n",ns;
+    }
+
     if (wfs(ns).svipc>1) {
       if (wfs(ns).type!="hartmann") {
         write,format="wfs(%d).svipc >1 only for SHWFS, will have no effect\n",ns;
@@ -601,17 +621,47 @@ func check_parameters(void)
 
   // MAT STRUCTURE
   if (mat.method == string()) {mat.method = "svd";};
-  if (mat.method == "svd"){
+  if ((mat.method == "svd") || (mat.method == "ftr")){
   if ((*mat.condition) == []) {exit,"mat.condition has not been set";}
   if (numberof(*mat.condition) != max(_(wfs.subsystem,dm.subsystem)) ) {
     exit,"dimension of *mat.condition is not equal to the number of subsystems";
   }
   }
+  if (mat.lowrank && (mat.method != "svd")) {exit,"mat.lowrank needs mat.method=\"svd\"";}
+  if (mat.mvm && mat.lowrank) {exit,"mat.mvm and mat.lowrank can not be used together";}
+  if (mat.mvm && (mat.method == "ftr")) {exit,"mat.mvm does not apply to mat.method=\"ftr\"";}
+  if (mat.method == "ftr") {
+    // default: the stackarray with the most actuators, and a Hartmann
+    // WFS of the same subsystem with one subaperture per actuator pitch
+    if (mat.ftr_dm == 0) {
+      w = where((dm.type == "stackarray") & (!dm.dmfit_which));
+      if (numberof(w)) mat.ftr_dm = w(dm(w).nxact(mxx));
+    }
+    nm = mat.ftr_dm;
+    if ((nm < 1) || (nm > numberof(dm)) || (dm(nm).type != "stackarray")) {
+      exit,"mat.method=\"ftr\" needs a stackarray DM (mat.ftr_dm)";
+    }
+    if (mat.ftr_wfs == 0) {
+      w = where((wfs.type == "hartmann") & (wfs.subsystem == dm(nm).subsystem) &
+                (wfs.shnxsub == dm(nm).nxact-1));
+      if (numberof(w)) mat.ftr_wfs = w(1);
+    }
+    ns = mat.ftr_wfs;
+    if ((ns < 1) || (ns > numberof(wfs)) || (wfs(ns).type != "hartmann") ||
+        (wfs(ns).shnxsub != dm(nm).nxact-1)) {
+      exit,"mat.method=\"ftr\" needs a hartmann WFS with shnxsub=dm.nxact-1 (mat.ftr_wfs)";
+    }
+    if (dm(nm).alt != 0) {exit,"mat.method=\"ftr\": the DM has to be in the pupil (dm.alt=0)";}
+    if (loop.method == "pseudo open-loop") {exit,"mat.method=\"ftr\" does not support pseudo open-loop";}
+    if (mat.ftr_niter < 0) {exit,"mat.ftr_niter should be >= 0";}
+  }
   if (mat.file == string()) {mat.file = "";}
   if (mat.sparse_MR == long()){mat.sparse_MR = 10000;}
   if (mat.sparse_MN == long()){mat.sparse_MN = 200000;}
   if (mat.sparse_thresh == float()){mat.sparse_thresh = 1e-8;}
   if (mat.sparse_pcgtol == float()){mat.sparse_pcgtol = 1e-6;}
+  if (mat.sparse_maxit == long()){mat.sparse_maxit = 1000;}
+  if ((mat.sparse_pcg < 0) || (mat.sparse_pcg > 2)) {exit,"mat.sparse_pcg should be 0, 1 or 2";}
   if (mat.fit_subsamp == long()){mat.fit_subsamp = 1;}
   if (mat.fit_minval == float()){mat.fit_minval = 1e-2;}
 
@@ -630,6 +680,7 @@ func check_parameters(void)
     exit,"Some elements within target.xposition, yposition, dispzoom "+\
       "do not have the same number of elements.";
   }
+  if (target.nthreads < 1) target.nthreads = 1;
 
   // GS STRUCTURE
   if (gs.zenithangle > 0 && anyof(wfs.gsalt > 0)){write,"WARNING: The return from the LGS is assumed to vary as cos(gs.zenithangle).";}
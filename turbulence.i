@@ -52,7 +52,7 @@ phaseStructFunc = phase_struct_func;
 
 //+++++++++++++++++++++++++++
 
-func create_phase_screens(dimx,dimy,l0=,prefix=,nalias=,no_ipart=,silent=)
+func create_phase_screens(dimx,dimy,l0=,prefix=,nalias=,no_ipart=,silent=,maxmem=,nthreads=)
   /* DOCUMENT create_phase_screens(dimx,dimy,prefix=)
      Create phase screens and save them in fits files.
      The saved phase screens have a dimension dimx*dimy.
@@ -68,16 +68,25 @@ func create_phase_screens(dimx,dimy,l0=,prefix=,nalias=,no_ipart=,silent=)
      no_ipart = set to loose the imaginary part. Gain some RAM
        to reach larger dimension.
 
+     When called as a subroutine with prefix set, the screens are
+     not returned and are generated out of core, see
+     create_phase_screens_ooc (maxmem=, nthreads=).
+
      Example:
      create_phase_screens,2048,256,prefix="screen256"
      
      F.Rigaut, 2001/11/10.
      modify 2003 Feb 24 to add dimy (before dimy=256) and prefix
-     SEE ALSO: generate_phase, phase_struct_func.
+     SEE ALSO: generate_phase, phase_struct_func, create_phase_screens_ooc.
   */ 
 
 {
   if (is_void(l0)) l0 = 0.;
+  if (!is_void(prefix) && am_subroutine()) {
+    create_phase_screens_ooc,dimx,dimy,prefix,l0=l0,nalias=nalias,
+      no_ipart=no_ipart,silent=silent,maxmem=maxmem,nthreads=nthreads;
+    return;
+  }
   if (yaopy) gui_progressbar_text,"Generating the screen power spectrum";
   nps = (no_ipart?1:2);
   nscreen = dimx/dimy*nps;
@@ -100,26 +109,8 @@ func create_phase_screens(dimx,dimy,l0=,prefix=,nalias=,no_ipart=,silent=)
     if (yaopy) gui_progressbar_frac,0.25+0.6*(i-off(1))/(off(2)-off(1));
   }
   
-  c = (24./5.*gamma(6/5.))^(5/6.);
-  r = float(indgen(off(2)));
-  if (l0 == 0){
-    theo = sqrt(2*c*r^(5./3.));
-  } else {
-    f0 = 1./l0;
-    c = (24./5.*gamma(6/5.))^(5/6.);
-    r = float(indgen(off(2)));
-
-    include, "gsl.i", 3; // loads the Bessel functions, but does not crash if function does not exist
-    if (gsl_sf_bessel_Knu == []){ // function does not exist, use an approximation
-      write, "*** WARNING: gsl_sf_bessel_Knu is not defined ***";
-      write, "Normalization might be wrong with finite outer scale";
-      write, "Please install ygsl (https://github.com/emmt/ygsl)";
-      write, "*************************************************";
-      theo = psfunc; // do not renormalize
-    } else { // bessel function is defined
-      theo = sqrt(2*c*gamma(11./6.)/(2^(5./6)*pi^(8./3))*(f0)^(-5./3)*(gamma(5./6.)/2^(1./6.) - (2*pi*r*f0)^(5./6.)*gsl_sf_bessel_Knu(5./6., 2*pi*r*f0)));
-    }
-  }
+  theo = phase_struct_func_theo(float(indgen(off(2))),l0);
+  if (theo == []) theo = psfunc; // do not renormalize
   nfact = avg(psfunc(off(1):off(2))/theo(off(1):off(2)));
   if (!silent) write,format="normalization factor (actual/theo)= %f\n",
     avg(psfunc(off(1):off(2))/theo(off(1):off(2)));
@@ -144,6 +135,83 @@ func create_phase_screens(dimx,dimy,l0=,prefix=,nalias=,no_ipart=,silent=)
 }
 createPhaseScreens = create_phase_screens;
 
+func phase_struct_func_theo(r,l0)
+  /* DOCUMENT phase_struct_func_theo(r,l0)
+     Square root of the theoretical phase structure function at
+     separations r (pixels), for r0 = 1 pixel and an outer scale
+     l0 (pixels, 0 = infinite). Returns [] if l0 is finite and
+     gsl_sf_bessel_Knu is not available.
+     SEE ALSO: create_phase_screens, phase_struct_func.
+  */
+{
+  c = (24./5.*gamma(6/5.))^(5/6.);
+  if (l0 == 0) return sqrt(2*c*r^(5./3.));
+
+  f0 = 1./l0;
+  include, "gsl.i", 3; // loads the Bessel functions, but does not crash if function does not exist
+  if (gsl_sf_bessel_Knu == []){ // function does not exist, use an approximation
+    write, "*** WARNING: gsl_sf_bessel_Knu is not defined ***";
+    write, "Normalization might be wrong with finite outer scale";
+    write, "Please install ygsl (https://github.com/emmt/ygsl)";
+    write, "*************************************************";
+    return [];
+  }
+  return sqrt(2*c*gamma(11./6.)/(2^(5./6)*pi^(8./3))*(f0)^(-5./3)*(gamma(5./6.)/2^(1./6.) - (2*pi*r*f0)^(5./6.)*gsl_sf_bessel_Knu(5./6., 2*pi*r*f0)));
+}
+
+func create_phase_screens_ooc(dimx,dimy,prefix,l0=,nalias=,no_ipart=,silent=,maxmem=,nthreads=)
+  /* DOCUMENT create_phase_screens_ooc,dimx,dimy,prefix
+     Same screens and files as create_phase_screens, but generated
+     in C (_yao_screen_spectrum, _yao_screen_synth) with float FFTs
+     in two passes through a scratch file (prefix+"_scratch.tmp",
+     dimx^2*8 bytes, removed at the end): the memory used is bounded
+     by maxmem whatever dimx, e.g. 32768x4096 screens on a small node.
+     The normalization uses the expected structure function of the
+     spectrum (summed during the first pass), the screens are written
+     directly in the fits files.
+
+     maxmem = memory for the FFT buffers, bytes. Default 1GB.
+     nthreads = number of threads. Default 4.
+     l0, nalias, no_ipart, silent: see create_phase_screens.
+     SEE ALSO: create_phase_screens, phase_struct_func_theo.
+  */
+{
+  if (is_void(l0)) l0 = 0.;
+  if (is_void(nalias)) nalias = 0;
+  if (is_void(maxmem)) maxmem = 2^30;
+  if (is_void(nthreads)) nthreads = 4;
+  off = [1,5]; // spatial offset for structure function normalization
+  scratch = prefix+"_scratch.tmp";
+
+  randomize;
+  draw = long(random()*2^31);
+  psfunc = array(double,off(2));
+  if (!silent) write,"Generating the screen power spectrum";
+  if (yaopy) gui_progressbar_text,"Generating the screen power spectrum";
+  err = _yao_screen_spectrum(scratch,dimx,float(l0),nalias,draw,&psfunc,
+                             off(2),maxmem,nthreads);
+  if (err) {
+    remove,scratch;
+    error,"Can not generate the phase screens spectrum in "+scratch;
+  }
+  if (yaopy) gui_progressbar_frac,0.5;
+  psfunc = sqrt(psfunc);
+
+  theo = phase_struct_func_theo(indgen(off(2)),l0);
+  if (theo == []) theo = psfunc; // do not renormalize
+  nfact = avg(psfunc(off(1):off(2))/theo(off(1):off(2)));
+  if (!silent) write,format="normalization factor (actual/theo)= %f\n",nfact;
+
+  if (!silent) write,"Sectioning and saving phase screens";
+  if (yaopy) gui_progressbar_text,"Sectioning and saving phase screens";
+  err = _yao_screen_synth(scratch,prefix,dimx,dimy,(no_ipart?1:2),
+                          float(1./nfact),maxmem,nthreads);
+  remove,scratch;
+  if (err) error,"Can not write the phase screens "+prefix+"*.fits";
+  if (yaopy) gui_progressbar_frac,1.;
+  if (yaopy) after,4,clean_progressbar;
+}
+
 func clean_progressbar(void)
 {
   gui_progressbar_text,"";
@@ -132,29 +132,198 @@ pyk_error = pyk_info = pyk_warning = null;
 gui_message = gui_message1 = gui_progressbar_frac = gui_progressbar_text = null;
 clean_progressbar = gui_show_statusbar1 = gui_hide_statusbar1 = pyk_flush = null;
 YAO_SAVEPATH = get_cwd();
+// YAO_CACHEPATH: directory of the native caches of the memory mapped
+// FITS files (see yao_fits_cache). Unset: YAO_SAVEPATH+"yaocache/".
 
 //----------------------------------------------------
 func comp_dm_shape_init(nm)
+/* DOCUMENT comp_dm_shape_init(nm)
+   Sparse influence functions of DM #nm for comp_dm_shape: bounding box
+   of the non-zero pixels of each IF (dm._sbox, in the DM support
+   frame) and the values in the boxes, packed (dm._sdef). Same for the
+   extrapolated actuators (_esbox, _esdef). Called at the end of aoinit,
+   and by comp_dm_shape when _def or _edef are not the ones the sparse
+   IFs were made from (_sdefof, _esdefof). Resets the incremental
+   shapes (see comp_dm_shape_incr). If dm.fourier, there are no
+   sparse IFs: computes the IF kernel FFT instead
+   (comp_dm_shape_fourier_init).
+   SEE ALSO: comp_dm_shape, _dmsum_sparse
+*/
+{
+  dm(nm)._sshape = dm(nm)._sprev = dm(nm)._esshape = dm(nm)._esprev = &([]);
+  dm(nm)._sdefof = dm(nm)._def;
+  dm(nm)._esdefof = dm(nm)._edef;
+  if (dm(nm).fourier) {
+    dm(nm)._sdef = dm(nm)._sbox = dm(nm)._esdef = dm(nm)._esbox = &([]);
+    comp_dm_shape_fourier_init,nm;
+    return;
+  }
+  dm(nm)._sdef = &dm_sparse_ifs(dm(nm)._def,dm(nm)._i1,dm(nm)._j1,
+                                (dm(nm).elt==1),box);
+  dm(nm)._sbox = &box;
+  if (*dm(nm)._edef == []) {
+    dm(nm)._esdef = dm(nm)._esbox = &([]);
+    return;
+  }
+  dm(nm)._esdef = &dm_sparse_ifs(dm(nm)._edef,dm(nm)._ei1,dm(nm)._ej1,
+                                 (dm(nm).elt==1),box);
+  dm(nm)._esbox = &box;
+}
+
+func comp_dm_shape_fourier_init(nm)
+/* DOCUMENT comp_dm_shape_fourier_init(nm)
+   dm.fourier: FFT of the IF kernel of DM #nm (dm._fkern), on a grid
+   (dm._fn) large enough to hold the DM support plus the kernel on
+   both sides, so that the convolution does not wrap. dm._def (and
+   _edef) hold this single kernel (make_pzt_dm_elt), the actuators
+   are only their corners _i1,_j1 (_ei1,_ej1). Called by
+   comp_dm_shape_init.
+   SEE ALSO: comp_dm_shape, _dm_fourier_shape
+*/
+{
+  if ((dm(nm).type != "stackarray") || (dm(nm).elt != 1))
+    error,swrite(format="DM#%d: dm.fourier needs a stackarray DM with elt=1",nm);
+  ker = (*dm(nm)._def)(,,1);
+  ks = dimsof(ker)(2);
+  n = fft_good(dm(nm)._n2-dm(nm)._n1+1+2*ks);
+  kerf = array(float,2*(n/2+1)*n);
+  if (_dm_fourier_kernel(float(ker),int(ks),int(n),kerf))
+    error,"_dm_fourier_kernel failed";
+  dm(nm)._fkern = &kerf;
+  dm(nm)._fn = n;
+  dm(nm)._fks = ks;
+}
+
+func dm_elt_ifs(nm,def,nact)
+/* DOCUMENT def = dm_elt_ifs(nm,def,nact)
+   elt=1 IFs *def read from an IF file, as DM #nm keeps them: the
+   single kernel if dm.fourier, nact copies of it otherwise (the file
+   may have been written with the other dm.fourier setting).
+   SEE ALSO: make_pzt_dm_elt, comp_dm_shape_fourier_init
+*/
+{
+  if (dm(nm).fourier) return &((*def)(,,1:1));
+  if (dimsof(*def)(4) == nact) return def;
+  return &((*def)(,,1)(,,-)*array(1.f,nact)(-,-,));
+}
+
+func dm_sparse_ifs(def,i1,j1,elt,&box)
+/* DOCUMENT vals = dm_sparse_ifs(def,i1,j1,elt,&box)
+   Packed bounding boxes of the IFs *def [nx,ny,nact]. Returns the
+   values, box [4,nact] gets (i0,j0,nx,ny) of each box (0 based), in
+   the *def frame or, if elt, in the output frame (offset by *i1,*j1).
+   SEE ALSO: comp_dm_shape_init
+*/
+{
+  d = dimsof(*def);
+  box = array(int,4,d(4));
+  vals = array(float,_dm_sparse_boxes(def,d(2),d(3),d(4),&box));
+  if (numberof(vals)) _dm_sparse_pack,def,d(2),d(3),d(4),&box,&vals;
+  else vals = [0.0f];
+  if (elt) {
+    box(1,) += *i1;
+    box(2,) += *j1;
+  }
+  return vals;
+}
+
+func comp_dm_shape_incr(nm,command,tol,nxy,extrap=)
+/* DOCUMENT sphase = comp_dm_shape_incr(nm,command,tol,nxy,extrap=)
+   Incremental sum of comp_dm_shape: adds to the shape kept from the
+   previous call (dm._sshape, _esshape if extrap) the IFs of the
+   actuators whose command moved by more than tol since they were last
+   applied (dm._sprev, _esprev). The cost is the footprint of the IFs
+   that moved, e.g. 2 IFs per poke in do_imat. The shape is recomputed
+   from scratch on the first call, after comp_dm_shape_init, when nxy
+   changed and every dm.incr_resync [100] calls, which bounds the float
+   drift and the sub-tol changes left out.
+   If dm.fourier, the shape is recomputed by _dm_fourier_shape, and
+   the moved actuators are added from the single kernel.
+   Returns the shape before _puppixoffset/disjointpup.
+   SEE ALSO: comp_dm_shape, _dmsum_sparse_delta
+*/
 {
-  extern wpupil;
-  if (numberof(wpupil)!=ndm) wpupil = array(pointer,ndm);
-  wpupil(nm) = &long(where((abs(*dm(nm)._def))(,,sum)));
+  if (extrap) {
+    vals = dm(nm)._esdef; box = dm(nm)._esbox; nact = int(dm(nm)._enact);
+    shape = dm(nm)._esshape; prev = dm(nm)._esprev; count = dm(nm)._esincr;
+    i1 = dm(nm)._ei1; j1 = dm(nm)._ej1;
+  } else {
+    vals = dm(nm)._sdef; box = dm(nm)._sbox; nact = int(dm(nm)._nact);
+    shape = dm(nm)._sshape; prev = dm(nm)._sprev; count = dm(nm)._sincr;
+    i1 = dm(nm)._i1; j1 = dm(nm)._j1;
+  }
+  resync = (dm(nm).incr_resync? dm(nm).incr_resync: 100);
+
+  if ((*shape==[]) || (numberof(*prev)!=nact) || (dimsof(*shape)(2)!=nxy) || \
+      (count>=resync)) {
+    sshape = array(float,[2,nxy,nxy]);
+    if (dm(nm).fourier) {
+      if (_dm_fourier_shape(dm(nm)._fkern, int(dm(nm)._fn), int(dm(nm)._fks),
+                            i1, j1, nact, command, &sshape, nxy, nxy))
+        error,"_dm_fourier_shape failed";
+    } else _dmsum_sparse, vals, box, nact, command, &sshape, nxy, nxy,
+             int(dm(nm).nthreads);
+    com = *command;
+    shape = &sshape; prev = &com; count = 0;
+  } else if (dm(nm).fourier) {
+    // boxes of the moved actuators only, from the kernel box:
+    com = *command;
+    pcom = *prev;
+    w = where(abs(com-pcom) > tol);
+    if (numberof(w)) {
+      kvals = dm_sparse_ifs(dm(nm)._def,&([0n]),&([0n]),1,kbox);
+      nw = numberof(w);
+      kbox = kbox(,1)(,-:1:nw);
+      kbox(1,) += (*i1)(w);
+      kbox(2,) += (*j1)(w);
+      kvals = kvals(,-:1:nw)(*);
+      cw = com(w);
+      pw = pcom(w);
+      if (_dmsum_sparse_delta(&kvals, &kbox, int(nw), &cw, &pw, float(tol),
+                              shape, nxy, nxy, int(dm(nm).nthreads)) < 0)
+        error,"_dmsum_sparse_delta: out of memory";
+      pcom(w) = cw;
+      prev = &pcom;
+    }
+    count++;
+  } else {
+    if (_dmsum_sparse_delta(vals, box, nact, command, prev, float(tol),
+                            shape, nxy, nxy, int(dm(nm).nthreads)) < 0)
+      error,"_dmsum_sparse_delta: out of memory";
+    count++;
+  }
+
+  if (extrap) {
+    dm(nm)._esshape = shape; dm(nm)._esprev = prev; dm(nm)._esincr = count;
+  } else {
+    dm(nm)._sshape = shape; dm(nm)._sprev = prev; dm(nm)._sincr = count;
+  }
+  return *shape;
 }
 
-func comp_dm_shape(nm,command,extrap=)
-/* DOCUMENT comp_dm_shape(nm,command,extrap=)
-   Fast compute of DM #nm shape from a command vector.
-   Branch over _dmsum or _dmsumelt according to case.
+func comp_dm_shape(nm,command,extrap=,incr=,tol=)
+/* DOCUMENT comp_dm_shape(nm,command,extrap=,incr=,tol=)
+   Fast compute of DM #nm shape from a command vector, from the
+   sparse influence functions (see comp_dm_shape_init) over
+   dm(nm).nthreads threads, or by FFT convolution if dm(nm).fourier.
    nm: DM yao #
    command: POINTER to a float vector containing the commands
             length of vector = numberof(*dm(nm)._command) = dm(nm)._nact
    extrap : Compute for extrapolated only (otherwise compute for valid only)
             so that to compute valid + extrap, you have to make 2 calls,
             one with and one without the extrap keyword set.
-   SEE ALSO:
+   incr   : update the shape of the previous call from the command
+            changes (comp_dm_shape_incr) instead of recomputing it.
+            Default dm(nm).incremental.
+   tol    : incr=1: smallest command change applied. Default dm(nm).incr_tol
+   SEE ALSO: comp_dm_shape_incr
 */
 {
-  if (dmsum_use_new&&(wpupil==[])) for (i=1;i<=ndm;i++) comp_dm_shape_init,i;
+  if ((dm(nm)._sdefof != dm(nm)._def) || (dm(nm)._esdefof != dm(nm)._edef) ||
+      (dm(nm).fourier && (*dm(nm)._fkern == [])))
+    comp_dm_shape_init,nm;
+  if (incr==[]) incr = dm(nm).incremental;
+  if (tol==[]) tol = dm(nm).incr_tol;
 
   if (typeof(*command)!="float") error,"command is not float";
 
@@ -175,15 +344,14 @@ func comp_dm_shape(nm,command,extrap=)
       command = &com;
     }
 
-    if (dm(nm).elt == 1) { //use fast dm shape computation
-      _dmsumelt, dm(nm)._def, dm(nm)._eltdefsize, dm(nm)._eltdefsize, int(dm(nm)._nact),
-        dm(nm)._i1, dm(nm)._j1, command, &sphase,nxy,nxy;
-    } else { // use standard
-      if (dmsum_use_new) _dmsum2, dm(nm)._def, wpupil(nm),              \
-                           numberof(*wpupil(nm)), dm(nm)._nact, command, &sphase, numberof(sphase);
-      else _dmsum, dm(nm)._def, nxy, nxy, dm(nm)._nact, command, &sphase;
-      // }
-    }
+    if (incr) sphase = comp_dm_shape_incr(nm,command,tol,nxy);
+    else if (dm(nm).fourier) {
+      if (_dm_fourier_shape(dm(nm)._fkern, int(dm(nm)._fn), int(dm(nm)._fks),
+                            dm(nm)._i1, dm(nm)._j1, int(dm(nm)._nact), command,
+                            &sphase, nxy, nxy))
+        error,"_dm_fourier_shape failed";
+    } else _dmsum_sparse, dm(nm)._sdef, dm(nm)._sbox, int(dm(nm)._nact),
+           command, &sphase, nxy, nxy, int(dm(nm).nthreads);
 
   } else { // extrapolated actuators
 
@@ -194,14 +362,14 @@ func comp_dm_shape(nm,command,extrap=)
       command = &com; // this way this does not go up in integrated commands
     }
 
-    if (dm(nm).elt == 1) { //use fast dm shape computation
-      _dmsumelt, dm(nm)._edef, dm(nm)._eltdefsize, dm(nm)._eltdefsize, int(dm(nm)._enact),
-        dm(nm)._ei1, dm(nm)._ej1, command, &sphase,nxy,nxy;
-    } else { // use standard
-      if (dmsum_use_new) _dmsum2, dm(nm)._edef, wpupil(nm), \
-        numberof(*wpupil(nm)), dm(nm)._enact, command, &sphase, numberof(sphase);
-      else _dmsum, dm(nm)._edef, nxy, nxy, dm(nm)._enact, command, &sphase;
-    }
+    if (incr) sphase = comp_dm_shape_incr(nm,command,tol,nxy,extrap=1);
+    else if (dm(nm).fourier) {
+      if (_dm_fourier_shape(dm(nm)._fkern, int(dm(nm)._fn), int(dm(nm)._fks),
+                            dm(nm)._ei1, dm(nm)._ej1, int(dm(nm)._enact), command,
+                            &sphase, nxy, nxy))
+        error,"_dm_fourier_shape failed";
+    } else _dmsum_sparse, dm(nm)._esdef, dm(nm)._esbox, int(dm(nm)._enact),
+           command, &sphase, nxy, nxy, int(dm(nm).nthreads);
 
   }
 
@@ -575,7 +743,8 @@ func do_imat(disp=)
 
       mircube  *= 0.0f; command *= 0.0f;
       command(i) = float(dm(nm).push4imat);
-      mircube(n1:n2,n1:n2,nm) = comp_dm_shape(nm,&command);
+      // only the IFs of actuators i-1 and i are (un)applied:
+      mircube(n1:n2,n1:n2,nm) = comp_dm_shape(nm,&command,incr=1,tol=0.);
 
       if (mat.method != "mmse-sparse"){
         if (!dm(nm).ncp){
@@ -674,6 +843,9 @@ func store_noise_etc_for_imat(&noise_orig, &cycle_orig, &kconv_orig,
 
   for (ns=1;ns<=nwfs;ns++) {
 
+    // exact phasor for the calibration, whatever wfs.phasor
+    _yao_phasor_tier,wfs(ns)._fftctx,1n;
+
     // Impose noise = rmsbias = rmsflat = 0 for interaction matrix measurements
     noise_orig(ns) = wfs(ns).noise;
     wfs(ns).noise = 0n;
@@ -720,6 +892,8 @@ func restore_noise_etc_for_imat(noise_orig, cycle_orig, kconv_orig,
 
   for (ns=1;ns<=nwfs;ns++) {
 
+    _yao_phasor_tier,wfs(ns)._fftctx,int(wfs(ns).phasor);
+
     wfs(ns).noise = noise_orig(ns);
     wfs(ns).darkcurrent = darkcurrent_orig(ns);
     wfs(ns).rayleighflag = rayleigh_orig(ns);
@@ -830,6 +1004,20 @@ func prep_svd(imat,subsystem,svd=,disp=)
 // }
 //----------------------------------------------------
 
+func svd_kept_modes(condition,all=)
+/* DOCUMENT kept = svd_kept_modes(condition,all=)
+   Indices of the modes of the last prep_svd that build_cmat keeps
+   with the same condition and all= (eigenvalue threshold, ev_user_mask).
+   Used for the low rank reconstructor (mat.lowrank).
+   SEE ALSO: build_cmat, prep_svd
+*/
+{
+  mask = ((eigenvalues/max(eigenvalues)) > (1./condition));
+  if (numberof(ev_user_mask)==numberof(mask)) mask = (mask|ev_user_mask);
+  if (!is_set(all)) mask(0) = 0;
+  return where(mask);
+}
+
 func build_cmat(condition,modalgain,subsystem=,all=,nomodalgain=,disp=)
 /* DOCUMENT build_cmat(condition,modalgain,subsystem=,all=,nomodalgain=,disp=)
    Build the command matrix from V,UT, the eigenvalues and the modal gains
@@ -994,28 +1182,70 @@ func swap_screens(void)
    Swap the phase screens. This is to get better statistics
    out of fewer phase screens and iterations.
    The 2nd phase screen becomes the 1rst one, 3->2, etc...
-   This routine uses the phase screens and normalization
-   factor stored in extern by get_turb_phase_init
-   SEE ALSO:
+   The screens are not moved: the ray tracer reads layer i from
+   screen screenperm(i), so this is O(nscreens).
+   SEE ALSO: get_turb_phase_weights
+*/
+{
+  extern screenperm;
+  // infinite screens never repeat, nothing to swap:
+  if (atm.infinite) return;
+
+  perm = ((indgen(nscreens)) % nscreens)+1;
+  screenperm = screenperm(perm);
+}
+//----------------------------------------------------
+
+func get_turb_phase_weights(void)
+/* DOCUMENT get_turb_phase_weights
+   Computes the layer weights (currentScreenNorm) from atm.layerfrac,
+   atm.dr0at05mic, gs.zenithangle (or atm.screen_norm if set).
+   The weights are applied by the ray tracer, so this is all there is
+   to do when the Cn2 profile or r0 change, even at every iteration
+   (see set_cn2, set_dr0).
+   SEE ALSO: get_turb_phase_init, swap_screens
 */
 {
-  extern pscreens;
-  weight = currentScreenNorm;
-  // avoid division per zero
-  // it's legitimate to have one screen == 0
-  weight += (weight == 0);
-  // get rid of layer strength normalization factor:
-  pscreens = pscreens/weight(-,-,);
-
-  // swap screens:
-  pscreens = pscreens(,,((indgen(nscreens)) % nscreens)+1);
-
-  // re-apply normalization:
-  weight = currentScreenNorm;
-  pscreens = pscreens*weight(-,-,);
+  extern currentScreenNorm;
+
+  // Compute normalization factor:
+  (*atm.layerfrac) = (*atm.layerfrac)/sum(*atm.layerfrac);
+  weight = float(sqrt(*atm.layerfrac)*(atm.dr0at05mic/
+                                       cos(gs.zenithangle*dtor)^0.6/sim.pupildiam)^(5./6.));
+  // above: in radian at 0.5 microns
+  weight = weight * float(0.5/(2*pi));
+  // ... and now in microns.
+
+
+  /*=====================================================
+    How to relate r0(layer) and atm.layerfrac ?
+    r0(i)   = r0 of layer i
+    r0tot   = total r0
+    f(i)    = "fraction" in layer i ( = (*atm.layerfrac)(i) )
+    we have:
+    weight(i) = sqrt(f(i)) * (D/r0tot)^(5/6.) = (D/r0(i))^(5/6.)
+    thus
+    f(i) = (r0tot/r0(i))^(5./3)
+
+    inversely, we have:
+    r0(i) = r0tot / f(i)^(3./5)
+    =====================================================*/
+
+  if (*atm.screen_norm!=[]) {
+    weight = float(*atm.screen_norm);
+    write,format="%s","Using special normalisation: "; weight;
+  }
+  currentScreenNorm = weight;
 }
 //----------------------------------------------------
 
+// ray tracer (_get2dPhase_multi) flags of the screens (screenflags),
+// as GET2D_* in aoSimulUtils.c:
+GET2D_WRAPX  = 1n;   // periodic in X
+GET2D_WRAPY  = 2n;   // periodic in Y
+GET2D_MAPPED = 4n;   // mapped FITS files (pscreens is then void)
+GET2D_INT16  = 8n;   // int16 screens
+
 func get_turb_phase_init(skipReadPhaseScreens=)
 /* DOCUMENT get_turb_phase_init(skipReadPhaseScreens=)
    Initializes everything for get_turb_phase (see below), which
@@ -1068,13 +1298,14 @@ func get_turb_phase_init(skipReadPhaseScreens=)
     //~ statsokvec,   // 1 if it is ok to collect stats at this iteration.
                   //~ // 0 if not, e.g. we just did a jump. dim [iteration]
     inithistory,  // 1 if init has been done.
-    screendim;    // [phase screen X dim, Y dim] before they are extended for safe wrapping
-
-  extern currentScreenNorm; // current screen normalization. Used when swaping screen.
+    screendim,    // [phase screen X dim, Y dim]
+    screenflags,  // ray tracer flags of the screens (GET2D_*)
+    screenperm,   // screen of each layer (swap_screens)
+    screenscale;  // int16 screens: phase of one step of each screen, else 1
 
   // Define a few variables:
 
-  nscreens = numberof(*atm.screen);
+  nscreens = (atm.infinite? numberof(*atm.layerfrac): numberof(*atm.screen));
   if (opt!=[]) noptics = numberof(opt); else noptics=0;
 
   wfsxposcub = wfsyposcub = array(float,[3,_n,nscreens,nwfs]);
@@ -1093,92 +1324,67 @@ func get_turb_phase_init(skipReadPhaseScreens=)
   // the phase screens now (v2.4) are normalized in microns
   //=======================================================
 
-  if (!is_set(skipReadPhaseScreens)) {
-    // Compute normalization factor:
-    (*atm.layerfrac) = (*atm.layerfrac)/sum(*atm.layerfrac);
-    weight = float(sqrt(*atm.layerfrac)*(atm.dr0at05mic/
-                                         cos(gs.zenithangle*dtor)^0.6/sim.pupildiam)^(5./6.));
-    // above: in radian at 0.5 microns
-    weight = weight * float(0.5/(2*pi));
-    // ... and now in microns.
-
-
-    /*=====================================================
-      How to relate r0(layer) and atm.layerfrac ?
-      r0(i)   = r0 of layer i
-      r0tot   = total r0
-      f(i)    = "fraction" in layer i ( = (*atm.layerfrac)(i) )
-      we have:
-      weight(i) = sqrt(f(i)) * (D/r0tot)^(5/6.) = (D/r0(i))^(5/6.)
-      thus
-      f(i) = (r0tot/r0(i))^(5./3)
-
-      inversely, we have:
-      r0(i) = r0tot / f(i)^(3./5)
-      =====================================================*/
-
-    if (sim.verbose) {
-      write,format="Reading phase screen \"%s\"\n",(*atm.screen)(1);
-    }
-
-    // read the first one, determine dimensions, stuff it:
-    tmp      = yao_fitsread((*atm.screen)(1));
-    dimx     = dimsof(tmp)(2);
-    dimy     = dimsof(tmp)(3);
-    screendim = [dimx,dimy];
-
-    if (dimx == dimy){ // can wrap both x and y
-      // Extend dimension in X and Y for wrapping issues
-      // Made larger to accommodate GLAO, Marcos van Dam, May 2012
-      pscreens = array(float,[3,dimx+4*sim._size,dimy+4*sim._size,nscreens]);
-      // Stuff it
-      pscreens(1:dimx,1:dimy,1) = tmp;
-      // free RAM
-      tmp      = [];
+  // weights of each phase screens (normalize), applied by the ray
+  // tracer: the phase is expressed in microns
+  get_turb_phase_weights;
 
-      // Now read all the other screens and put in pscreens
-      for (i=2;i<=nscreens;i++) {
+  if (!is_set(skipReadPhaseScreens)) {
+    screenscale = array(1.0f,nscreens);
+    if (atm.infinite) {
+      // built by infinite_screens_init once the beam geometry is known
+      pscreens = [];
+      screenflags = 0;
+    } else {
+      // The screens are memory mapped (see _yao_fits_map), or read if
+      // they can not be. They are neither padded for wrapping nor
+      // weighted: the ray tracer takes the indices modulo the screen
+      // size and applies currentScreenNorm. int16 screens
+      // (atm.screen_int16) are read and quantized, not mapped.
+      _yao_fits_unmap,-1;
+      dims = array(long,4);
+      screenflags = (atm.screen_int16? 0: GET2D_MAPPED);
+      for (i=1;screenflags && (i<=nscreens);i++) {
         if (sim.verbose) {
-          write,format="Reading phase screen \"%s\"\n",(*atm.screen)(i);
+          write,format="Mapping phase screen \"%s\"\n",(*atm.screen)(i);
         }
-        pscreens(1:dimx,1:dimy,i) = yao_fitsread((*atm.screen)(i));
+        if (_yao_fits_map((*atm.screen)(i),yao_fits_cache((*atm.screen)(i)),i-1,&dims) ||
+            (dims(1)!=2) || ((i>1) && anyof(dims(2:3)!=screendim))) {
+          screenflags = 0;
+          break;
+        }
+        screendim = dims(2:3);
       }
 
-      // Extend the phase screen length for safe wrapping:
-      pscreens(dimx+1:,,) = pscreens(1:4*sim._size,,);
-      pscreens(,dimy+1:,) = pscreens(,1:4*sim._size,);
-
-    } else {
-      // Extend dimension in X for wrapping issues
-      pscreens = array(float,[3,dimx+2*sim._size,dimy,nscreens]);
-      // Stuff it
-      pscreens(1:dimx,,1) = tmp;
-      // free RAM
-      tmp      = [];
-
-      // Now read all the other screens and put in pscreens
-      for (i=2;i<=nscreens;i++) {
-        if (sim.verbose) {
-          write,format="Reading phase screen \"%s\"\n",(*atm.screen)(i);
+      if (screenflags) {
+        pscreens = [];
+      } else {
+        _yao_fits_unmap,-1;
+        for (i=1;i<=nscreens;i++) {
+          if (sim.verbose) {
+            write,format="Reading phase screen \"%s\"\n",(*atm.screen)(i);
+          }
+          tmp = float(yao_fitsread((*atm.screen)(i)));
+          if (i==1) {
+            screendim = dimsof(tmp)(2:3);
+            pscreens = array((atm.screen_int16? short: float),
+                             [3,screendim(1),screendim(2),nscreens]);
+          }
+          if (atm.screen_int16) {
+            q = array(short,dimsof(tmp));
+            screenscale(i) = _yao_quantize16(&tmp,numberof(tmp),&q);
+            pscreens(,,i) = q;
+            q = [];
+          } else pscreens(,,i) = tmp;
         }
-        pscreens(1:dimx,,i) = yao_fitsread((*atm.screen)(i));
+        tmp = [];
+        if (atm.screen_int16) screenflags = GET2D_INT16;
       }
-
-      // Extend the phase screen length for safe wrapping:
-      pscreens(dimx+1:,,) = pscreens(1:2*sim._size,,);
-      // Can't do in Y as the phase screens are not periodic (they have been cutted)
-      //  pscreens(,dimy+1:,) = pscreens(,1:sim._size,);
-
+      dimx = screendim(1);
+      dimy = screendim(2);
+      // periodic in X, and in Y if square (they have been cut otherwise)
+      screenflags |= ((dimx == dimy)? (GET2D_WRAPX|GET2D_WRAPY): GET2D_WRAPX);
     }
-
-    // apply weights to each phase screens (normalize):
-    // the screens are expressed in microns
-    if (*atm.screen_norm!=[]) {
-      weight = float(*atm.screen_norm);
-      write,format="%s","Using special normalisation: "; weight;
-    }
-    pscreens = pscreens*weight(-,-,);
-    currentScreenNorm = weight;
+    screenperm = indgen(nscreens);
 
     //=============================================
     // READ THE OPTICS PHASE MAPS
@@ -1248,8 +1454,13 @@ func get_turb_phase_init(skipReadPhaseScreens=)
   deltax  = sim.pupildiam/tel.diam*(*atm.layerspeed)*cos(dtor*gs.zenithangle)*loop.ittime;
   // has to start away from edge as this is the coordinate of the beam center
   // will modified later on when we know the beams geometry. see few lines below.
-  xposvec = (1.+iposvec*deltax(-,)*cos(dtor*(*atm.winddir)(-,)));
-  yposvec = (1.+iposvec*deltax(-,)*sin(dtor*(*atm.winddir)(-,)));
+  if (atm.infinite) {
+    // positions are computed on the fly (get_turb_phase_shifts)
+    xposvec = yposvec = [];
+  } else {
+    xposvec = (1.+iposvec*deltax(-,)*cos(dtor*(*atm.winddir)(-,)));
+    yposvec = (1.+iposvec*deltax(-,)*sin(dtor*(*atm.winddir)(-,)));
+  }
 
   psize  = tel.diam/sim.pupildiam;  // pixel in meter
 
@@ -1391,6 +1602,13 @@ func get_turb_phase_init(skipReadPhaseScreens=)
   optgsyposcub = float(optgsyposcub);
 
 
+  if (atm.infinite) {
+    // no wrapping: the screens follow the beams
+    infinite_screens_init,deltax;
+    inithistory = 1;
+    return 1;
+  }
+
   //======================================
   // SOME CHECKS TO AVOID INDICES OVERFLOW
   //======================================
@@ -1439,6 +1657,190 @@ func get_turb_phase_init(skipReadPhaseScreens=)
   inithistory = 1;
   return 1;
 }
+//----------------------------------------------------
+func infinite_screens_ar(nb,L0,nst,&A,&B)
+/* DOCUMENT infinite_screens_ar,nb,L0,nst,A,B
+   Extrusion operators of the infinite phase screens (Assemat et al.,
+   Opt. Express 14, 988, 2006) for a nb pixels wide screen with von
+   Karman statistics, r0 = 1 pixel and outer scale L0 (pixels).
+   A new line x next to the nst edge lines z of the screen (edge line
+   first, z is [nb,nst]) is drawn as
+     x = A(,+)*z(*)(+) + B(,+)*beta(+)
+   with beta a vector of nb unit gaussian deviates.
+   A is [nb,nst*nb], B is [nb,nb].
+   SEE ALSO: infinite_screens_init, _yao_screen_extrude
+*/
+{
+  // covariance vs pixel offset [dx,dy], dx=0..nst, dy=0..nb-1:
+  r   = abs(indgen(0:nst),indgen(0:nb-1)(-,));
+  cov = vk_covariance(r,L0);
+
+  // stencil pixels: line k (0=edge) is at x=-k; new line at x=1.
+  xz = -(indgen(nst)-1)(-:1:nb,)(*);
+  yz = (indgen(nb)-1)(,-:1:nst)(*);
+  yx = indgen(nb)-1;
+
+  czz = cov(1+abs(xz-xz(-,))+(nst+1)*abs(yz-yz(-,)));
+  cxz = cov(1+abs(1-xz(-,))+(nst+1)*abs(yx-yz(-,)));
+  cxx = cov(1+(nst+1)*abs(yx-yx(-,)));
+
+  // A = cxz # czz^-1, czz is symmetric:
+  A = transpose(SVsolve(czz,transpose(cxz)));
+  // B # B^T = cxx - A # czx
+  bbt = cxx - A(,+)*cxz(,+);
+  s = SVdec(bbt,u,vt);
+  B = u*sqrt(max(s,0.))(-,);
+
+  A = float(A);
+  B = float(B);
+}
+
+//----------------------------------------------------
+func vk_covariance(r,L0)
+/* DOCUMENT vk_covariance(r,L0)
+   Phase covariance (rad^2) of von Karman turbulence at separation r,
+   for r0 = 1 and outer scale L0 (same unit as r).
+   SEE ALSO: infinite_screens_ar
+*/
+{
+  // 0.0858 = (24/5*gamma(6/5))^(5/6)*gamma(11/6)/(2^(5/6)*pi^(8/3))
+  c = 0.08583068106228546*L0^(5./3);
+  x = 2*pi*double(r)/L0;
+  // x^(5/6)*K_(5/6)(x), x->0 limit is gamma(5/6)/2^(1/6):
+  res = array(1.00563491799859,dimsof(x));
+  w = where(x>0);
+  if (numberof(w)) {
+    xw = x(w);
+    // K_nu(x) = int_0^inf exp(-x*cosh(t))*cosh(nu*t) dt
+    t = span(0.,1.,2001)(-,)*acosh(50./xw+1)(,-);
+    f = exp(-xw*cosh(t))*cosh(5./6*t);
+    res(w) = xw^(5./6)*(f(,zcen)*t(,dif))(,sum);
+  }
+  return c*res;
+}
+
+//----------------------------------------------------
+func infinite_screens_init(deltax)
+/* DOCUMENT infinite_screens_init,deltax
+   Builds the infinite phase screens (atm.infinite=1), called by
+   get_turb_phase_init. pscreens are square buffers (not weighted, r0 = 1
+   pixel) just large enough for the footprint of all the wfs and target
+   beams. They are filled by AR extrusion and then extruded further by
+   infinite_screens_advance as the layers move by deltax pixels per
+   iteration along atm.winddir.
+   SEE ALSO: get_turb_phase_init, infinite_screens_advance
+*/
+{
+  extern pscreens,// [nb,nb,nscreens] screen buffers (r0 = 1 pixel)
+    infA, infB,   // extrusion operators (see infinite_screens_ar)
+    infnst,       // number of stencil lines of the extrusion
+    infL0,        // outer scale (pixels) of infA and infB
+    infstep,      // [2,nscreens] beam motion (pixels) per equivalent iteration
+    infrel,       // [2,2] min/max of the beam footprint around its centre, in x and y
+    inforigin,    // [2,nscreens] world coordinates of the buffer pixel 0,0
+    infipos;      // equivalent iteration the buffers have been extruded to
+
+  infnst = 2;
+
+  // footprint of all the beams around the beam centre:
+  relx = _(wfsxposcub(*),gsxposcub(*));
+  rely = _(wfsyposcub(*),gsyposcub(*));
+  ppm = sim.pupildiam/tel.diam;
+  if (target.xspeed) {
+    drift = max(abs(*target.xspeed))*4.848e-6*max(*atm.layeralt)*loop.ittime*loop.niter*ppm;
+    grow,relx,min(relx)-drift,max(relx)+drift;
+  }
+  if (target.yspeed) {
+    drift = max(abs(*target.yspeed))*4.848e-6*max(*atm.layeralt)*loop.ittime*loop.niter*ppm;
+    grow,rely,min(rely)-drift,max(rely)+drift;
+  }
+  infrel = [[min(relx),max(relx)],[min(rely),max(rely)]];
+  nb = long(ceil(max(infrel(2,)-infrel(1,))))+4;
+
+  L0 = atm.L0*ppm;
+  if ((infA==[]) || (dimsof(infA)(2)!=nb) || (infL0!=L0)) {
+    if (sim.verbose) \
+      write,format="Computing the %dx%d infinite screen extrusion operators\n",nb,nb;
+    infinite_screens_ar,nb,L0,infnst,infA,infB;
+    infL0 = L0;
+  }
+
+  infstep = transpose([deltax*cos(dtor*(*atm.winddir)),deltax*sin(dtor*(*atm.winddir))]);
+
+  pscreens = array(float,[3,nb,nb,nscreens]);
+  screendim = [nb,nb];
+  infinite_screens_reset;
+}
+
+//----------------------------------------------------
+func infinite_screens_reset(void)
+/* DOCUMENT infinite_screens_reset
+   Fills the infinite screen buffers from scratch for the beam position
+   at iteration 0. nb extrusions are made and thrown away first, so
+   that the zero starting point has no memory left.
+   SEE ALSO: infinite_screens_init, infinite_screens_advance
+*/
+{
+  extern inforigin,infipos;
+
+  nb = dimsof(pscreens)(2);
+  nscreens = dimsof(pscreens)(4);
+  pscreens(,,) = 0.0f;
+
+  // buffer centred on the footprint of the beams at ipos=0:
+  inforigin = array(long,2,nscreens);
+  inforigin(1,) = -long(floor((nb-2-sum(infrel(,1)))/2.));
+  inforigin(2,) = -long(floor((nb-2-sum(infrel(,2)))/2.));
+
+  for (ns=1;ns<=nscreens;ns++) {
+    err = _yao_screen_extrude(&pscreens,nb,nscreens,ns-1,0,2*nb,
+                              inforigin(1,ns)-nb,&infA,&infB,infnst,1.0f);
+    if (err) error,"Error in _yao_screen_extrude";
+  }
+  infipos = 0;
+}
+
+//----------------------------------------------------
+func infinite_screens_advance(ipos)
+/* DOCUMENT infinite_screens_advance,ipos
+   Extrudes the infinite screens so that they contain the footprint of
+   the beams at equivalent iteration ipos. The lines are added one
+   equivalent iteration at a time, x before y: the screens at a given
+   ipos are the same whatever the sequence of calls, and hence in all
+   the svipc processes.
+   SEE ALSO: infinite_screens_init, get_turb_phase_shifts
+*/
+{
+  extern inforigin,infipos;
+
+  if (ipos < infipos) infinite_screens_reset;
+
+  nb = dimsof(pscreens)(2);
+  nscreens = dimsof(pscreens)(4);
+
+  for (ip=infipos+1;ip<=ipos;ip++) {
+    for (ns=1;ns<=nscreens;ns++) {
+      for (ax=1;ax<=2;ax++) {
+        // beam centre in the buffer. Need 0 <= b+rel <= nb-2
+        b = ip*infstep(ax,ns)-inforigin(ax,ns);
+        nup = long(ceil(b+infrel(2,ax)-(nb-2)));
+        ndown = long(ceil(-b-infrel(1,ax)));
+        if (nup > 0) {
+          n = nup; dir = 2*ax-2; pos = inforigin(ax,ns)+nb;
+          inforigin(ax,ns) += n;
+        } else if (ndown > 0) {
+          n = ndown; dir = 2*ax-1; pos = inforigin(ax,ns)-1;
+          inforigin(ax,ns) -= n;
+        } else continue;
+        err = _yao_screen_extrude(&pscreens,nb,nscreens,ns-1,dir,n,pos,
+                                  &infA,&infB,infnst,1.0f);
+        if (err) error,"Error in _yao_screen_extrude";
+      }
+    }
+  }
+  infipos = ipos;
+}
+
 //----------------------------------------------------
 
 func get_turb_phase(iter,nn,type)
@@ -1446,57 +1848,257 @@ func get_turb_phase(iter,nn,type)
    Returns the interpolated, integrated phase along the turbulent phase
    screen data cube to the loop function for iteration number "iter".
    You have to call get_turb_phase_init to initialize prior using.
-   SEE ALSO: aoinit, aoloop, get_turb_phase_init.
+   n can be a vector of wfs/target indices: the phases of all these
+   directions are then computed in one pass on the screens and returned
+   as a cube [sim._size,sim._size,numberof(n)].
+   SEE ALSO: aoinit, aoloop, get_turb_phase_init, get_phase2d.
 */
 {
   if (!inithistory) {error,"get_turb_phase has not been initialized !";}
 
-  sphase = array(float,_n,_n);
-  bphase = array(float,sim._size,sim._size);
+  // directions, as a vector (n may be a scalar):
+  dirs = nn(*);
+  ndir = numberof(dirs);
+
+  sphase = array(float,_n,_n,ndir);
+  bphase = array(float,sim._size,sim._size,ndir);
 
   // Now we can call the C interpolation routine and get the integrated
-  // phase for this star
+  // phase for these stars
   // there are a few things to do to get ready
-  psnx = dimsof(pscreens)(2);
-  psny = dimsof(pscreens)(3);
-  nscreens = dimsof(pscreens)(4);
+  // (mapped screens are not in pscreens, see get_turb_phase_init)
+  pscr = ((screenflags&GET2D_MAPPED)? &[0.0f]: &pscreens);
+
+  get_turb_phase_shifts,iter,dirs,type,ishifts,xshifts,jshifts,yshifts,skip;
+
+  // rows of the ray tracing split over the threads of the wfs/target
+  nthreads = int((type=="wfs")? max(wfs(dirs).nthreads): target.nthreads);
+
+  // one pass on the layers for all directions:
+  err = _get2dPhase_multi(pscr,screendim(1),screendim(2),nscreens,&skip,
+                          &float(currentScreenNorm*screenscale(screenperm)),
+                          &int(screenperm-1),screenflags,
+                          &sphase,_n,_n,ndir,
+                          &ishifts,&xshifts,
+                          &jshifts,&yshifts,nthreads);
+
+  if (err != 0) {error,"Error in get_turb_phase";}
+
+  bphase(_n1:_n2,_n1:_n2,) = sphase;
+
+  if (dimsof(nn)(1)==0) return bphase(,,1);
+  return bphase;
+}
+
+//----------------------------------------------------
+func get_turb_phase_shifts(iter,dirs,type,&ishifts,&xshifts,&jshifts,&yshifts,&skip)
+/* DOCUMENT get_turb_phase_shifts,iter,dirs,type,ishifts,xshifts,jshifts,yshifts,skip
+   Integer and fractional shifts [_n,nscreens,numberof(dirs)] of the
+   turbulent layers along the wfs/target directions dirs at iteration
+   iter, and the [nscreens,numberof(dirs)] skip mask (layers above a LGS).
+   SEE ALSO: get_turb_phase, get_phase2d
+*/
+{
+  ndir = numberof(dirs);
+  skip = array(0n,nscreens,ndir);
+
+  // position of the beam centre on each screen:
+  if (atm.infinite) {
+    ipos = iter;
+    if (loop.skipevery > 0) ipos += ((iter-1)/loop.skipevery)*loop.skipby;
+    infinite_screens_advance,ipos;
+    xpos = float(ipos*infstep(1,)-inforigin(1,));
+    ypos = float(ipos*infstep(2,)-inforigin(2,));
+  } else {
+    xpos = xposvec(iter,);
+    ypos = yposvec(iter,);
+  }
 
   // here we have a branch to be able to process wfs and targets with the same
   // subroutine, this one.
   if (type == "wfs") {
     // mod 2011jan19 w/ DG to get rid of screens above LGS
-    if (wfs(nn).gsalt>0) nscreens = long(sum(*atm.layeralt < wfs(nn).gsalt));
+    for (d=1;d<=ndir;d++) {
+      if (wfs(dirs(d)).gsalt>0) {
+        nscr = long(sum(*atm.layeralt < wfs(dirs(d)).gsalt));
+        if (nscr<nscreens) skip(nscr+1:,d) = 1n;
+      }
+    }
     // stuff xshifts with fractionnal offsets, add xposvec for each screen
-    xshifts = wfsxposcub(,,nn)+xposvec(iter,)(-,);
-    yshifts = wfsyposcub(,,nn)+yposvec(iter,)(-,);
+    xshifts = wfsxposcub(,,dirs)+xpos(-,);
+    yshifts = wfsyposcub(,,dirs)+ypos(-,);
   } else if ( type == "target") {
     // stuff xshifts with fractionnal offsets, add xposvec for each screen
-    xshifts = gsxposcub(,,nn)+xposvec(iter,)(-,);
-    yshifts = gsyposcub(,,nn)+yposvec(iter,)(-,);
+    xshifts = gsxposcub(,,dirs)+xpos(-,);
+    yshifts = gsyposcub(,,dirs)+ypos(-,);
     ppm = sim.pupildiam/tel.diam;
     if (target.xspeed&&loopCounter) {
-      xss = (*target.xspeed)(nn)*4.848e-6*(*atm.layeralt)*loop.ittime*loopCounter*ppm;
-      xshifts += float(xss)(-,);
+      xss = (*target.xspeed)(dirs)(-,)*4.848e-6*(*atm.layeralt)*loop.ittime*loopCounter*ppm;
+      xshifts += float(xss)(-,,);
     }
     if (target.yspeed&&loopCounter) {
-      yss = (*target.yspeed)(nn)*4.848e-6*(*atm.layeralt)*loop.ittime*loopCounter*ppm;
-      yshifts += float(yss)(-,);
+      yss = (*target.yspeed)(dirs)(-,)*4.848e-6*(*atm.layeralt)*loop.ittime*loopCounter*ppm;
+      yshifts += float(yss)(-,,);
     }
   }
-  skip = array(0n,nscreens);
 
-  ishifts = int(xshifts);  xshifts = xshifts - ishifts;
-  jshifts = int(yshifts);  yshifts = yshifts - jshifts;
+  ishifts = int(xshifts);  xshifts = float(xshifts - ishifts);
+  jshifts = int(yshifts);  yshifts = float(yshifts - jshifts);
+}
 
-  err = _get2dPhase(&pscreens,psnx,psny,nscreens,&skip,
-                    &sphase,_n,_n,
-                    &ishifts,&xshifts,
-                    &jshifts,&yshifts);
+//----------------------------------------------------
+func get_dm_phase_shifts(dirs,type,&ishifts,&xshifts,&jshifts,&yshifts,&skip)
+/* DOCUMENT get_dm_phase_shifts,dirs,type,ishifts,xshifts,jshifts,yshifts,skip
+   Same as get_turb_phase_shifts, for the DMs (mircube). skip masks the
+   DMs not in the path of the WFS and the non common path DMs that are
+   not the one of the wfs/target.
+   SEE ALSO: get_phase2d_from_dms, get_phase2d
+*/
+{
+  ndir = numberof(dirs);
+  skip = array(0n,ndm,ndir);
 
-  if (err != 0) {error,"Error in get_turb_phase";}
+  if (type == "wfs") {
+    // stuff xshifts with fractional offsets, add xposvec for each screen
+    xshifts = dmwfsxposcub(,,dirs)+(sim._cent+dm.misreg(1,)-1)(-,);
+    yshifts = dmwfsyposcub(,,dirs)+(sim._cent+dm.misreg(2,)-1)(-,);
+    for (d=1;d<=ndir;d++) {
+      ncp = dm.ncp;
+      if (wfs(dirs(d)).ncpdm) ncp(wfs(dirs(d)).ncpdm) = 0;
+      skip(,d) = int(*wfs(dirs(d))._dmnotinpath) | (ncp!=0);
+    }
+  } else if ( type == "target") {
+    // stuff xshifts with fractional offsets, add xposvec for each screen
+    xshifts = dmgsxposcub(,,dirs)+(sim._cent+dm.misreg(1,)-1)(-,);
+    yshifts = dmgsyposcub(,,dirs)+(sim._cent+dm.misreg(2,)-1)(-,);
+    ppm = sim.pupildiam/tel.diam;
+    if (target.xspeed&&loopCounter) {
+      xss = (*target.xspeed)(dirs)(-,)*4.848e-6*dm.alt*loop.ittime*loopCounter*ppm;
+      xshifts += float(xss)(-,,);
+    }
+    if (target.yspeed&&loopCounter) {
+      yss = (*target.yspeed)(dirs)(-,)*4.848e-6*dm.alt*loop.ittime*loopCounter*ppm;
+      yshifts += float(yss)(-,,);
+    }
+    for (d=1;d<=ndir;d++) {
+      ncp = dm.ncp;
+      if (*target.ncpdm != []) {
+        if ((*target.ncpdm)(dirs(d))) ncp((*target.ncpdm)(dirs(d))) = 0;
+      }
+      skip(,d) = (ncp!=0);
+    }
+  }
 
-  bphase(_n1:_n2,_n1:_n2) = sphase;
+  ishifts = int(xshifts); xshifts = float(xshifts - ishifts);
+  jshifts = int(yshifts); yshifts = float(yshifts - jshifts);
+}
+
+//----------------------------------------------------
+func get_opt_phase_shifts(dirs,type,&ishifts,&xshifts,&jshifts,&yshifts,&skip)
+/* DOCUMENT get_opt_phase_shifts,dirs,type,ishifts,xshifts,jshifts,yshifts,skip
+   Same as get_turb_phase_shifts, for the static optics (optphasemaps).
+   skip masks the optics that do not apply to the wfs/target (path_type,
+   path_which, scale=0).
+   SEE ALSO: get_phase2d_from_optics, get_phase2d
+*/
+{
+  ndir = numberof(dirs);
+  noptics = numberof(opt);
+  skip = array(1n,noptics,ndir);
+
+  // select optics in path that apply to type (see get_phase2d_from_optics):
+  for (d=1;d<=ndir;d++) {
+    for (no=1;no<=noptics;no++) {
+      if (opt(no).path_type == ((type=="wfs")? "target": "wfs")) continue;
+      if (opt(no).path_type != "common") {
+        if (noneof(*opt(no).path_which==dirs(d))) continue;
+        if (opt(no).scale==0) continue;
+      }
+      skip(no,d) = 0n;
+    }
+  }
+
+  if (type == "wfs") {
+    // stuff xshifts with fractional offsets, add xposvec for each screen
+    xshifts = optwfsxposcub(,,dirs)+(opt._cent+opt.misreg(1,)-1)(-,);
+    yshifts = optwfsyposcub(,,dirs)+(opt._cent+opt.misreg(2,)-1)(-,);
+  } else if ( type == "target") {
+    // stuff xshifts with fractional offsets, add xposvec for each screen
+    xshifts = optgsxposcub(,,dirs)+(opt._cent+opt.misreg(1,)-1)(-,);
+    yshifts = optgsyposcub(,,dirs)+(opt._cent+opt.misreg(2,)-1)(-,);
+    ppm = sim.pupildiam/tel.diam;
+    if (target.xspeed&&loopCounter) {
+      xss = (*target.xspeed)(dirs)(-,)*4.848e-6*opt.alt*loop.ittime*loopCounter*ppm;
+      xshifts += float(xss)(-,,);
+    }
+    if (target.yspeed&&loopCounter) {
+      yss = (*target.yspeed)(dirs)(-,)*4.848e-6*opt.alt*loop.ittime*loopCounter*ppm;
+      yshifts += float(yss)(-,,);
+    }
+  }
+
+  ishifts = int(xshifts); xshifts = float(xshifts - ishifts);
+  jshifts = int(yshifts); yshifts = float(yshifts - jshifts);
+}
+
+//----------------------------------------------------
+func get_phase2d(iter,nn,type,nodm=)
+/* DOCUMENT get_phase2d(iter,n,type,nodm=)
+   Total phase (turbulence + DMs + optics) along the wfs/target
+   direction(s) n at iteration iter, i.e.
+     get_turb_phase(iter,n,type) + get_phase2d_from_dms(n,type) +
+     get_phase2d_from_optics(n,type)
+   in a single C call (_get2dPhase_fused) writing straight into the
+   returned array: no intermediate phase arrays. As for get_turb_phase,
+   n can be a vector, the result is then [sim._size,sim._size,numberof(n)].
+   nodm=1 leaves out the DMs (open loop WFS).
+   SEE ALSO: get_turb_phase, get_phase2d_from_dms, get_phase2d_from_optics
+*/
+{
+  if (!inithistory) {error,"get_turb_phase has not been initialized !";}
+
+  dirs = nn(*);
+  ndir = numberof(dirs);
+  bphase = array(float,sim._size,sim._size,ndir);
+  // unused sources get a (never read) dummy:
+  dummy = array(0n,1);
+
+  pscr = ((screenflags&GET2D_MAPPED)? &dummy: &pscreens);
+  get_turb_phase_shifts,iter,dirs,type,ishifts,xshifts,jshifts,yshifts,skip;
+
+  nmirrors = (is_set(nodm)? 0: ndm);
+  dmd = dimsof(mircube);
+  if (nmirrors) {
+    get_dm_phase_shifts,dirs,type,dmishifts,dmxshifts,dmjshifts,dmyshifts,dmskip;
+  } else dmishifts = dmxshifts = dmjshifts = dmyshifts = dmskip = dummy;
+
+  nopts = numberof(opt);
+  if (nopts) {
+    get_opt_phase_shifts,dirs,type,optishifts,optxshifts,optjshifts,optyshifts,optskip;
+    optscale = float(opt.scale);
+    od = dimsof(optphasemaps);
+  } else {
+    optishifts = optxshifts = optjshifts = optyshifts = optskip = optscale = dummy;
+    od = [3,1,1,1];
+  }
+
+  nthreads = int((type=="wfs")? max(wfs(dirs).nthreads): target.nthreads);
+
+  err = _get2dPhase_fused(&bphase,sim._size,sim._size,ndir,_n1-1,_n1-1,_n,_n,
+                          pscr,screendim(1),screendim(2),nscreens,&skip,
+                          &float(currentScreenNorm*screenscale(screenperm)),
+                          &int(screenperm-1),screenflags,
+                          &ishifts,&xshifts,&jshifts,&yshifts,
+                          &mircube,dmd(2),dmd(3),nmirrors,&dmskip,
+                          &dmishifts,&dmxshifts,&dmjshifts,&dmyshifts,
+                          (nopts? &optphasemaps: &dummy),od(2),od(3),nopts,
+                          &optscale,&optskip,
+                          &optishifts,&optxshifts,&optjshifts,&optyshifts,
+                          nthreads);
 
+  if (err != 0) {error,"Error in get_phase2d";}
+
+  if (dimsof(nn)(1)==0) return bphase(,,1);
   return bphase;
 }
 
@@ -1522,63 +2124,24 @@ func get_phase2d_from_dms(nn,type)
   sphase = array(float,_n,_n);
   bphase = array(float,sim._size,sim._size);
 
-  if (anyof(dm.ncp)||(target.ncpdm)||((type=="wfs")&&(wfs(nn).ncpdm))) {
-    mirrorcube = mircube; // create a copy
-    dmidx = where(dm.ncp == 0);
-
-    if (type == "target"){
-      if (*target.ncpdm != []){
-        ncpdm = (*target.ncpdm)(nn);
-        if (ncpdm != 0 && noneof(dmidx == ncpdm)){
-          grow, dmidx, ncpdm;
-        }
-      }
-    } else { // type == "wfs"
-      if (wfs(nn).ncpdm != 0 && noneof(dmidx == wfs(nn).ncpdm)){
-        grow, dmidx, wfs(nn).ncpdm;
-      }
-    }
-
-    mirrorcube = mirrorcube(,,dmidx);
-  } else eq_nocopy,mirrorcube,mircube;
-
   // Now we can call the C interpolation routine and get the integrated
   // phase for this star
   // there are a few things to do to get ready
-  psnx = dimsof(mirrorcube)(2);
-  psny = dimsof(mirrorcube)(3);
-  nmirrors = dimsof(mirrorcube)(4);
+  psnx = dimsof(mircube)(2);
+  psny = dimsof(mircube)(3);
+  nmirrors = dimsof(mircube)(4);
 
-  // here we have a branch to be able to process wfs and targets with the same
-  // subroutine, this one.
-  if (type == "wfs") {
-    // stuff xshifts with fractional offsets, add xposvec for each screen
-    xshifts = dmwfsxposcub(,,nn)+(sim._cent+dm.misreg(1,)-1)(-,);
-    yshifts = dmwfsyposcub(,,nn)+(sim._cent+dm.misreg(2,)-1)(-,);
-    skip = int(*wfs(nn)._dmnotinpath);
-  } else if ( type == "target") {
-    // stuff xshifts with fractional offsets, add xposvec for each screen
-    xshifts = dmgsxposcub(,,nn)+(sim._cent+dm.misreg(1,)-1)(-,);
-    yshifts = dmgsyposcub(,,nn)+(sim._cent+dm.misreg(2,)-1)(-,);
-    ppm = sim.pupildiam/tel.diam;
-    if (target.xspeed&&loopCounter) {
-      xss = (*target.xspeed)(nn)*4.848e-6*dm.alt*loop.ittime*loopCounter*ppm;
-      xshifts += float(xss)(-,);
-    }
-    if (target.yspeed&&loopCounter) {
-      yss = (*target.yspeed)(nn)*4.848e-6*dm.alt*loop.ittime*loopCounter*ppm;
-      yshifts += float(yss)(-,);
-    }
-    skip = array(0n,nmirrors);
-  }
+  // shifts for this wfs/target, the DMs that are not in its path
+  // (dmnotinpath, other non common path DMs) are skipped:
+  get_dm_phase_shifts,nn(*),type,ishifts,xshifts,jshifts,yshifts,skip;
 
-  ishifts = int(xshifts); xshifts = xshifts - ishifts;
-  jshifts = int(yshifts); yshifts = yshifts - jshifts;
+  // rows of the ray tracing split over the threads of the wfs/target
+  nthreads = int((type=="wfs")? wfs(nn).nthreads: target.nthreads);
 
-  err = _get2dPhase(&mirrorcube,psnx,psny,nmirrors,&skip,
+  err = _get2dPhase(&mircube,psnx,psny,nmirrors,&skip,
                     &sphase,_n,_n,
                     &ishifts,&xshifts,
-                    &jshifts,&yshifts);
+                    &jshifts,&yshifts,nthreads);
 
   if (err != 0) {error,"Error in get_phase2d_from_dms";}
 
@@ -1673,6 +2236,8 @@ func get_phase2d_from_optics(nn,type)
       yshifts += float(yss)(-,);
     }
   }
+  // rows of the ray tracing split over the threads of the wfs/target
+  nthreads = int((type=="wfs")? wfs(nn).nthreads: target.nthreads);
   skip = array(0n,nopts);
 
   ishifts = int(xshifts); xshifts = float(xshifts - ishifts);
@@ -1681,7 +2246,7 @@ func get_phase2d_from_optics(nn,type)
   err = _get2dPhase(&thisphasemaps,psnx,psny,nopts,&skip,
                     &sphase,_n,_n,
                     &ishifts,&xshifts,
-                    &jshifts,&yshifts);
+                    &jshifts,&yshifts,nthreads);
 
   //  if (err != 0) {error,"Error in get_phase2d_from_optics";}
 
@@ -1837,6 +2402,8 @@ func aoread(parfile)
 
   // if we are re-reading and had forks, get rid of them:
   if ((wfs!=[])&&(anyof(wfs.svipc>1))) status=quit_wfs_forks();
+  // and release the previous C reconstructor:
+  if ((mat!=[])&&(mat._mvm>=0)) _yao_mvm_free,mat._mvm;
 
   if (strmatch(parfile,".par")) {
     tmp = strpart(parfile,strword(parfile,"/",50));
@@ -1859,7 +2426,7 @@ func aoread(parfile)
   sim  = sim_struct();
   wfss = wfs_struct(dispzoom=1,_bckgrdsub=1,shcalibseeing=0.667,subsystem=1,excessnoise=1.,framedelay=-1);
   dms  = dm_struct(gain=1.,coupling=0.2);
-  mat  = mat_struct(file="",fit_type="target",fit_which=1);
+  mat  = mat_struct(file="",fit_type="target",fit_which=1,_mvm=-1);
   tel  = tel_struct();
   target = target_struct();
   gs   = gs_struct();
@@ -1907,6 +2474,7 @@ func aoinit(disp=,clean=,forcemat=,svd=,dpi=,keepdmconfig=)
   extern iMat,cMat,fMat,dMat;
   extern iMatSP,AtAregSP,fMatSP,GxSP, polcMatSP;
   extern modalgain;
+  extern modToActLR,mesToModLR,modIndexLR;
   extern _n,_n1,_n2,_p1,_p2,_p;
   extern def,mircube;
   extern tip1arcsec,tilt1arcsec;
@@ -1927,6 +2495,12 @@ func aoinit(disp=,clean=,forcemat=,svd=,dpi=,keepdmconfig=)
     if (sim.verbose){write, "Using ylapack to do matrix inversions: LUsolve=LUsolve2";}
   }
 
+  // cMat/dMat are rebuilt: release the C reconstructor (yao_mvm_init)
+  if (mat._mvm >= 0) {
+    _yao_mvm_free,mat._mvm;
+    mat._mvm = -1;
+  }
+
   disp = ( (disp==[])? (aoinit_disp==[]? 0:aoinit_disp):disp );
   clean = ( (clean==[])? (aoinit_clean==[]? 0:aoinit_clean):clean );
   forcemat = ( (forcemat==[])? (aoinit_forcemat==[]? 0:aoinit_forcemat):forcemat );
@@ -1966,6 +2540,19 @@ func aoinit(disp=,clean=,forcemat=,svd=,dpi=,keepdmconfig=)
                        "forcemat=%d,svd=%d,keepdmconfig=%d\n", \
                        disp,clean,forcemat,svd,keepdmconfig;
 
+  // FFT workspace contexts for the C engines: one per WFS + one for the
+  // target PSFs. The FFTW plans are kept across aoinit, except if clean.
+  yao_fft_free,release=1,plans=clean;
+  // one noise stream per WFS (see sim.rngseed):
+  _yao_rng_seed,(sim.rngseed? sim.rngseed: long(random()*2^31));
+  for (ns=1;ns<=nwfs;ns++) {
+    wfs(ns)._fftctx = _yao_fft_context_new();
+    _yao_phasor_tier,wfs(ns)._fftctx,int(wfs(ns).phasor);
+    _yao_rng_stream,wfs(ns)._fftctx,int(ns);
+  }
+  target._fftctx = _yao_fft_context_new();
+  _yao_phasor_tier,target._fftctx,int(target.phasor);
+
   sphase = bphase = mircube = [];
 
   hcp_file,YAO_SAVEPATH+parprefix+"init.ps",ps=1;
@@ -2207,7 +2794,11 @@ func aoinit(disp=,clean=,forcemat=,svd=,dpi=,keepdmconfig=)
   // sync forks if needed:
   if ( (anyof(wfs.type=="hartmann"))&&(anyof(wfs.svipc>1))) s = sync_wfs_forks();
 
+  // reference spots for the correlation/matched filter methods are
+  // taken on the same frames:
+  wfs._refinit = (wfs.type=="hartmann")*(wfs.shthmethod>=4);
   refmes = mult_wfs_int_mat(disp=disp);
+  wfs._refinit *= 0n;
   wfs._refmes = split_wfs_vector(refmes);
 
   wfs.filtertilt = mem;
@@ -2312,7 +2903,7 @@ func aoinit(disp=,clean=,forcemat=,svd=,dpi=,keepdmconfig=)
         write,format="Replicating influence functions of DM%d\n",dm(n).use_def_of;
         dm(n)._def = dm(dm(n).use_def_of)._def;
       } else {
-        dm(n)._def = &(float(yao_fitsread(YAO_SAVEPATH+dm(n).iffile)));
+        dm(n)._def = &(yao_fitsread_native(YAO_SAVEPATH+dm(n).iffile));
       }
       dm(n)._nact = dimsof(*(dm(n)._def))(4);
       if ( dm(n).type == "stackarray" ) {
@@ -2322,6 +2913,8 @@ func aoinit(disp=,clean=,forcemat=,svd=,dpi=,keepdmconfig=)
           dm(n)._eltdefsize = dimsof(*(dm(n)._def))(2);
           dm(n)._i1 = &(int(yao_fitsread(YAO_SAVEPATH+dm(n).iffile,hdu=3)));
           dm(n)._j1 = &(int(yao_fitsread(YAO_SAVEPATH+dm(n).iffile,hdu=4)));
+          dm(n)._nact = numberof(*dm(n)._i1);
+          dm(n)._def = dm_elt_ifs(n,dm(n)._def,dm(n)._nact);
         }
       }
 
@@ -2329,7 +2922,7 @@ func aoinit(disp=,clean=,forcemat=,svd=,dpi=,keepdmconfig=)
         if (sim.verbose) {
           write,format=">> Reading extrapolated actuators file %s\n",dm(n)._eiffile;
         }
-        dm(n)._edef = &(float(yao_fitsread(YAO_SAVEPATH+dm(n)._eiffile)));
+        dm(n)._edef = &(yao_fitsread_native(YAO_SAVEPATH+dm(n)._eiffile));
         dm(n)._enact = dimsof(*(dm(n)._edef))(4);
         if ( dm(n).type == "stackarray" ) {
           dm(n)._ex = &(yao_fitsread(YAO_SAVEPATH+dm(n)._eiffile,hdu=1));
@@ -2337,6 +2930,8 @@ func aoinit(disp=,clean=,forcemat=,svd=,dpi=,keepdmconfig=)
           if (dm(n).elt == 1) {
             dm(n)._ei1 = &(int(yao_fitsread(YAO_SAVEPATH+dm(n)._eiffile,hdu=3)));
             dm(n)._ej1 = &(int(yao_fitsread(YAO_SAVEPATH+dm(n)._eiffile,hdu=4)));
+            dm(n)._enact = numberof(*dm(n)._ei1);
+            dm(n)._edef = dm_elt_ifs(n,dm(n)._edef,dm(n)._enact);
           }
         }
       }
@@ -2350,6 +2945,9 @@ func aoinit(disp=,clean=,forcemat=,svd=,dpi=,keepdmconfig=)
       if (fileExist(YAO_SAVEPATH+dm(n)._eiffile)) {// delete the extrapolated influence functions
         remove, YAO_SAVEPATH+dm(n)._eiffile;
       }
+      if (fileExist(yao_fits_cache(YAO_SAVEPATH+dm(n)._eiffile))) {// and its native cache
+        remove, yao_fits_cache(YAO_SAVEPATH+dm(n)._eiffile);
+      }
       if (disp) { plsys,1; animate,1; }
 
       if (dm(n).use_def_of) {
@@ -2391,7 +2989,7 @@ func aoinit(disp=,clean=,forcemat=,svd=,dpi=,keepdmconfig=)
 
       if (dm(n).ifunrot) {
         hxy = dimsof(*dm(n)._def)(2)/2.+0.5;
-        for (i=1;i<=dm(n)._nact;i++) {
+        for (i=1;i<=dimsof(*dm(n)._def)(4);i++) { // 1 if dm.fourier
           (*dm(n)._def)(,,i) = rotate2((*dm(n)._def)(,,i),dm(n).ifunrot,xc=hxy,yc=hxy);
         }
         xy = (*dm(n)._x)(,-);
@@ -2408,7 +3006,7 @@ func aoinit(disp=,clean=,forcemat=,svd=,dpi=,keepdmconfig=)
         dd = dimsof(*dm(n)._def)(2);
         xx = yy = indgen(dd);
         xx = (xx-dd/2.)*(1.+dm(n).xscale)+dd/2.;
-        for (i=1;i<=dm(n)._nact;i++) (*dm(n)._def)(,,i) = bilinear((*dm(n)._def)(,,i),xx,yy,grid=1);
+        for (i=1;i<=dimsof(*dm(n)._def)(4);i++) (*dm(n)._def)(,,i) = bilinear((*dm(n)._def)(,,i),xx,yy,grid=1);
         *dm(n)._x = (*dm(n)._x-sim._cent)*(1-dm(n).xscale)+sim._cent;
       }
 
@@ -2487,14 +3085,14 @@ func aoinit(disp=,clean=,forcemat=,svd=,dpi=,keepdmconfig=)
     if (!is_set(keepdmconfig)) { // concatenate dm._def and dm._edef
       for (nm=1;nm<=ndm;nm++) {  // loop on DMs
         if ((*dm(nm)._edef) != []) {  // if _edef == [], there is no extrap. act. defined
-          dm(nm)._def = &(_(*dm(nm)._def,*dm(nm)._edef));
+          if (!dm(nm).fourier) dm(nm)._def = &(_(*dm(nm)._def,*dm(nm)._edef));
           dm(nm)._x = &(_(*dm(nm)._x,*dm(nm)._ex));
           dm(nm)._y = &(_(*dm(nm)._y,*dm(nm)._ey));
           if (dm(nm).elt == 1) {
             dm(nm)._i1 = &(int(_(*dm(nm)._i1,*dm(nm)._ei1)));
             dm(nm)._j1 = &(int(_(*dm(nm)._j1,*dm(nm)._ej1)));
           }
-          dm(nm)._nact = dimsof(*(dm(nm)._def))(4);
+          dm(nm)._nact = (dm(nm).fourier? numberof(*dm(nm)._i1): dimsof(*(dm(nm)._def))(4));
           dm(nm)._edef = dm(nm)._ex = dm(nm)._ey = &([]);
           dm(nm)._enact = 0;
           if (dm(nm).elt == 1) { dm(nm)._ei1 = dm(nm)._ej1 = &([]); }
@@ -2615,8 +3213,12 @@ func aoinit(disp=,clean=,forcemat=,svd=,dpi=,keepdmconfig=)
             dm(nm)._ej1 = &(int(dmj1(nok)));
           }
 
-          dm(nm)._edef = &((*(dm(nm)._def))(,,nok));
-          dm(nm)._def = &((*(dm(nm)._def))(,,ok));
+          if (dm(nm).fourier) { // one kernel for all
+            dm(nm)._edef = dm(nm)._def;
+          } else {
+            dm(nm)._edef = &((*(dm(nm)._def))(,,nok));
+            dm(nm)._def = &((*(dm(nm)._def))(,,ok));
+          }
 
           if (sim.verbose) {
             write,format="DM #%d: # of valid actuators: %d. "+
@@ -2633,7 +3235,7 @@ func aoinit(disp=,clean=,forcemat=,svd=,dpi=,keepdmconfig=)
             yao_fitswrite,YAO_SAVEPATH+dm(nm).iffile,long(*(dm(nm)._i1)),exttype="IMAGE",append=1;
             yao_fitswrite,YAO_SAVEPATH+dm(nm).iffile,long(*(dm(nm)._j1)),exttype="IMAGE",append=1;
           }
-          dm(nm)._nact = (dimsof(*(dm(nm)._def)))(4);
+          dm(nm)._nact = numberof(ok);
 
           // write extrapolated actuator influence functions file:
           yao_fitswrite,YAO_SAVEPATH+dm(nm)._eiffile,*(dm(nm)._edef);
@@ -2643,7 +3245,7 @@ func aoinit(disp=,clean=,forcemat=,svd=,dpi=,keepdmconfig=)
             yao_fitswrite,YAO_SAVEPATH+dm(nm)._eiffile,long(*(dm(nm)._ei1)),exttype="IMAGE",append=1;
             yao_fitswrite,YAO_SAVEPATH+dm(nm)._eiffile,long(*(dm(nm)._ej1)),exttype="IMAGE",append=1;
           }
-          dm(nm)._enact = (dimsof(*(dm(nm)._edef)))(4);
+          dm(nm)._enact = numberof(nok);
 
           if (sim.debug >= 1) {
             tv,comp_dm_shape(nm,&(array(1.0f,dm(nm)._nact)));
@@ -2751,7 +3353,7 @@ func aoinit(disp=,clean=,forcemat=,svd=,dpi=,keepdmconfig=)
 
   // INITIALIZE MODAL GAINS:
 
-  if (mat.method == "svd"){
+  if ((mat.method == "svd") || (mat.method == "ftr")){
     if (sim.verbose) {write,"\n> INITIALIZING MODAL GAINS";}
     gui_message,"Initializing modal gains";
 
@@ -2793,6 +3395,16 @@ func aoinit(disp=,clean=,forcemat=,svd=,dpi=,keepdmconfig=)
       iMat = tmp(,,1);
       cMat = transpose(tmp(,,2));
       tmp = [];
+      if (mat.lowrank) {
+        filename = YAO_SAVEPATH+parprefix+"-lowrank.fits";
+        if (fileExist(filename)) {
+          modToActLR = float(yao_fitsread(filename));
+          mesToModLR = float(yao_fitsread(filename,hdu=1));
+          modIndexLR = long(yao_fitsread(filename,hdu=2));
+        } else {
+          svd = 1;
+        }
+      }
       if (anyof(dm.dmfit_which)){
         if (fileExist(YAO_SAVEPATH+parprefix+"-dMat.fits")){
           dMat = yao_fitsread(YAO_SAVEPATH + parprefix + "-dMat.fits");
@@ -2994,7 +3606,7 @@ func aoinit(disp=,clean=,forcemat=,svd=,dpi=,keepdmconfig=)
             mircube *= 0.0f;
             command *= 0.0f;
             command(i) = float(1.);
-            mircube(n1:n2,n1:n2,nm) = comp_dm_shape(nm,&command);
+            mircube(n1:n2,n1:n2,nm) = comp_dm_shape(nm,&command,incr=1,tol=0.);
             if (dm(nm).ncp){ // DM on WFS path only
               phase = get_phase2d_from_dms(dm(nm).ncpfit_which,dm(nm).ncpfit_type)-get_phase2d_from_dms(mat.fit_which,mat.fit_type);
             } else {
@@ -3039,7 +3651,7 @@ func aoinit(disp=,clean=,forcemat=,svd=,dpi=,keepdmconfig=)
               mircube  *= 0.0f;
               command *= 0.0f;
               command(i) = 1.;
-              mircube(n1:n2,n1:n2,nv) = comp_dm_shape(nv,&command);
+              mircube(n1:n2,n1:n2,nv) = comp_dm_shape(nv,&command,incr=1,tol=0.);
               if (dm(nm).ncp){ // DM on WFS path only
                 phase = get_phase2d_from_dms(dm(nm).ncpfit_which,dm(nm).ncpfit_type)-get_phase2d_from_dms(mat.fit_which,mat.fit_type);
               } else {
@@ -3080,18 +3692,24 @@ func aoinit(disp=,clean=,forcemat=,svd=,dpi=,keepdmconfig=)
 
   // in the opposite case, plus if svd=1 (request re-do SVD):
   if ((!fileExist(YAO_SAVEPATH+mat.file)) || (forcemat == 1) || (svd == 1)) {
-    if (mat.method == "svd") {
+    if ((mat.method == "svd") || (mat.method == "ftr")) {
       if (sim.verbose) {
         write,">> Preparing SVD and computing command matrices";
       }
       // do the SVD and build the command matrix:
       sswfs = ssdm = [];
+      modToActLR = mesToModLR = modIndexLR = [];
       for (ns=1;ns<=nwfs;ns++) {grow,sswfs,array(wfs(ns).subsystem,wfs(ns)._nmes);}
-      for (nm=1;nm<=ndm;nm++)  {grow,ssdm,array(dm(nm).subsystem,dm(nm)._nact);}
+      for (nm=1;nm<=ndm;nm++)  {
+        // ftr: the FTR DM is not in the SVD (its cMat rows stay 0)
+        grow,ssdm,array(((mat.method == "ftr") && (nm == mat.ftr_dm))? 0: dm(nm).subsystem,
+                        dm(nm)._nact);
+      }
       for (ss=1;ss<=max(dm.subsystem);ss++) {
 
         wsswfs = where(sswfs == ss);
         wssdm  = where(ssdm  == ss);
+        if (!numberof(wssdm)) continue;
         imat = iMat(wsswfs,wssdm);
         mg = modalgain(wssdm);
 
@@ -3101,6 +3719,29 @@ func aoinit(disp=,clean=,forcemat=,svd=,dpi=,keepdmconfig=)
         cmat = build_cmat( (*mat.condition)(ss), mg, subsystem=ss,
                           all=1,disp=tmpdisp);
         cMat(wssdm,wsswfs) = cmat;
+
+        // kept modes of this subsystem, 1/eigenvalue folded in mesToModLR:
+        if (mat.lowrank) kept = svd_kept_modes((*mat.condition)(ss),all=1);
+        if (mat.lowrank && numberof(kept)) {
+          u = array(float,sum(dm._nact),numberof(kept));
+          u(wssdm,) = modToAct(,kept);
+          w = array(float,sum(wfs._nmes),numberof(kept));
+          w(wsswfs,) = transpose(mesToMod(kept,)/eigenvalues(kept));
+          grow,modToActLR,u;
+          grow,mesToModLR,w;
+          grow,modIndexLR,wssdm(kept);
+        }
+      }
+      if (mat.lowrank) {
+        mesToModLR = transpose(mesToModLR);
+        filename = YAO_SAVEPATH+parprefix+"-lowrank.fits";
+        yao_fitswrite,filename,modToActLR;
+        yao_fitswrite,filename,mesToModLR,exttype="IMAGE",append=1;
+        yao_fitswrite,filename,modIndexLR,exttype="IMAGE",append=1;
+        if (sim.verbose) {
+          write,format=">> Low rank reconstructor: %d modes, stored in %s\n",
+            numberof(modIndexLR),parprefix+"-lowrank.fits";
+        }
       }
 
     } else if (mat.method == "mmse") {
@@ -3495,6 +4136,9 @@ func aoinit(disp=,clean=,forcemat=,svd=,dpi=,keepdmconfig=)
     if (wfs(ns).shmethod==1) wfs(ns)._kernelconv = 0n;
   }
 
+  // sparse influence functions for comp_dm_shape:
+  for (nm=1;nm<=ndm;nm++) comp_dm_shape_init,nm;
+
   // basic initialization in case of svipc use:
   if (sim.svipc) require,"yao_svipc.i";
 
@@ -3504,6 +4148,392 @@ func aoinit(disp=,clean=,forcemat=,svd=,dpi=,keepdmconfig=)
   notify,swrite(format="%s: aoinit done",parprefix);
 }
 
+//---------------------------------------------------------------
+func yao_mvm_init(void)
+/* DOCUMENT yao_mvm_init
+   Packs cMat (and dMat, for pseudo open-loop) in the C reconstructor
+   used by go() when mat.mvm is set (handle mat._mvm), with float
+   (mat.mvm=1), bf16 (2) or fp16 (3) storage. Called by aoloop. Call
+   it again if you change cMat or dMat while the loop is running.
+   The handle is released by aoinit and aoread (-1: none).
+   SEE ALSO: _yao_mvm, yao_mvm_check
+*/
+{
+  extern mat;
+  // not used by go() with the FTR or the low rank svd (see check_parameters):
+  if (!mat.mvm || mat.lowrank || (mat.method == "ftr")) {
+    if (mat._mvm >= 0) _yao_mvm_free,mat._mvm;
+    mat._mvm = -1;
+    return;
+  }
+  if (mat.method == "mmse-sparse") error,"mat.mvm does not apply to mmse-sparse";
+  c = float(cMat);
+  d = [0.0f]; ncom = 0;
+  if ((loop.method == "pseudo open-loop") && (dMat != [])) {
+    d = float(dMat);
+    ncom = dimsof(d)(3);
+  }
+  h = _yao_mvm_init(mat._mvm,c,dimsof(c)(2),dimsof(c)(3),d,ncom,int(mat.mvm));
+  if (h < 0) error,"_yao_mvm_init failed (out of memory?)";
+  mat._mvm = h;
+}
+
+//---------------------------------------------------------------
+func ftr_init(void)
+/* DOCUMENT ftr_init
+   Prepares the Fourier transform reconstructor of mat.method="ftr".
+   dm(mat.ftr_dm) (stackarray, one actuator at each corner of the
+   subapertures: Fried geometry) is reconstructed from the slopes of
+   wfs(mat.ftr_wfs) by _ftr_recon, in O(n^2 log n) on a n*n grid,
+   n = fft_good(shnxsub+1). The slopes to phase filters are the least
+   square inverse of the Fried gradients on the periodic grid. The
+   post filter divides by the response of the DM, averaged over the
+   reconstructions of the iMat columns of interior actuators (this
+   also takes care of the units and signs), and applies mat.ftr_filter
+   (optional gains per spatial frequency, see ftr_freq). The other DMs
+   are reconstructed by their cMat rows and their contribution is
+   removed from the slopes before the FTR. Called by aoloop.
+   SEE ALSO: ftr_recon, ftr_freq, ftr_check, _ftr_recon
+*/
+{
+  extern mat;
+  if (mat.method != "ftr") return;
+  nm = mat.ftr_dm;
+  ns = mat.ftr_wfs;
+  nxsub = wfs(ns).shnxsub;
+  n = fft_good(nxsub+1);
+
+  // grid coordinates of the valid subapertures:
+  valid = where(*wfs(ns)._validsubs);
+  nsub = numberof(valid);
+  if (2*nsub != wfs(ns)._nmes) error,"ftr: unexpected number of measurements";
+  pitch = tel.diam/nxsub;
+  ix = long(floor((*wfs(ns)._x)(valid)/pitch+nxsub/2.));
+  iy = long(floor((*wfs(ns)._y)(valid)/pitch+nxsub/2.));
+  msk = array(0,n,n);
+  msk(ix+1+n*iy) = 1;
+  bnd = array(-1n,n,4);
+  for (i=1;i<=n;i++) {
+    w = where(msk(i,));
+    if (numberof(w)) bnd(i,1:2) = int([min(w),max(w)]-1);
+    w = where(msk(,i));
+    if (numberof(w)) bnd(i,3:4) = int([min(w),max(w)]-1);
+  }
+
+  // actuators at the subaperture corners (pixel coordinates):
+  subsize = sim.pupildiam/nxsub;
+  if (wfs(ns).npixpersub) subsize = wfs(ns).npixpersub;
+  x0 = (*wfs(ns)._istart)(valid(1))+0.5-ix(1)*subsize;
+  y0 = (*wfs(ns)._jstart)(valid(1))+0.5-iy(1)*subsize;
+  ia = (*dm(nm)._x-x0)/subsize;
+  ja = (*dm(nm)._y-y0)/subsize;
+  if (anyof(abs(_(ia-round(ia),ja-round(ja))) > 0.25))
+    error,swrite(format="ftr: the actuators of DM#%d are not at the corners of the "+
+                 "subapertures of WFS#%d",nm,ns);
+  ia = long(round(ia));
+  ja = long(round(ja));
+  nact = dm(nm)._nact;
+  a1 = sum(dm(1:nm)._nact)-nact;
+
+  // measurement indices of the WFS in the mesvec:
+  mc = ((ns > 1)? sum(wfs(1:ns-1)._nmes): 0);
+  imes = indgen(wfs(ns)._nmes);
+  if (*wfs(ns)._reordervec != []) imes(*wfs(ns)._reordervec) = indgen(wfs(ns)._nmes);
+  imes += mc;
+
+  // other DMs:
+  other = where((indgen(sum(dm._nact)) <= a1) | (indgen(sum(dm._nact)) > a1+nact));
+  doth = (numberof(other)? float(iMat(imes,other)): []);
+
+  // slopes to phase filters:
+  k = indgen(n/2+1)-1.;
+  l = indgen(n)-1.;
+  ex = exp(1i*2*pi*k/n)(,-);
+  ey = exp(1i*2*pi*l/n)(-,);
+  gx = (ex-1)*(1+ey)/2;
+  gy = (1+ex)*(ey-1)/2;
+  den = abs(gx)^2+abs(gy)^2;
+  ok = (den > 1e-6); // piston and waffle are not seen
+  den = n^2*(den+!ok);
+  fx = ok*conj(gx)/den;
+  fy = ok*conj(gy)/den;
+  filt = array(float,2,n/2+1,n,3);
+  filt(1,,,1) = fx.re; filt(2,,,1) = fx.im;
+  filt(1,,,2) = fy.re; filt(2,,,2) = fy.im;
+  filt(1,,,3) = 1.;
+
+  mat._ftrn = n;
+  mat._ftrfilt = &filt;
+  mat._ftrsub = &int([ix,iy]);
+  mat._ftrbnd = &bnd;
+  mat._ftract = &int([ia,ja]);
+  mat._ftrmes = &imes;
+  mat._ftrother = &other;
+  mat._ftrdoth = &doth;
+
+  // DM response: reconstructed phase around the poked actuator, on
+  // interior actuators (the 4x4 subapertures around them are valid):
+  cand = [];
+  for (a=1;a<=nact;a++) {
+    if ((ia(a) < 2) || (ja(a) < 2) || (ia(a) > n-2) || (ja(a) > n-2)) continue;
+    if (allof(msk(ia(a)-1:ia(a)+2,ja(a)-1:ja(a)+2))) grow,cand,a;
+  }
+  if (!numberof(cand)) error,"ftr: no interior actuator to calibrate the DM response";
+  ncal = min([64,numberof(cand)]);
+  cal = cand(1+((indgen(ncal)-1)*numberof(cand))/ncal);
+  d = indgen(5)-3;
+  di = d(,-:1:5);
+  dj = d(-:1:5,);
+  r = array(0.,5,5);
+  for (c=1;c<=ncal;c++) {
+    r(*) += ftr_recon(float(iMat(,a1+cal(c))),
+                      int([ia(cal(c))+di(*),ja(cal(c))+dj(*)]));
+  }
+  r /= ncal;
+
+  rf = array(complex,n/2+1,n);
+  for (p=1;p<=25;p++) rf += r(p)*exp(-1i*2*pi*(k(,-)*di(p)+l(-,)*dj(p))/n);
+  mag = abs(rf);
+  fl = 0.1*max(mag);
+  w = where(mag < fl);
+  if (numberof(w)) rf(w) = fl*(rf(w)+(mag(w)==0))/(mag(w)+(mag(w)==0));
+  post = 1./rf;
+  if (*mat.ftr_filter != []) {
+    if (anyof(dimsof(*mat.ftr_filter) != [2,n/2+1,n]))
+      error,swrite(format="ftr: mat.ftr_filter should be [%d,%d]",n/2+1,n);
+    post *= *mat.ftr_filter;
+  }
+  filt(1,,,3) = post.re; filt(2,,,3) = post.im;
+  mat._ftrfilt = &filt;
+
+  if (sim.verbose) {
+    write,format=">> FTR: DM#%d from WFS#%d, %dx%d grid, DM response %.3g (center), %.3g (neighbours)\n",
+      nm,ns,n,n,r(3,3),avg(r([8,12,14,18]));
+  }
+}
+
+func ftr_recon(mes,corners)
+/* DOCUMENT err = ftr_recon(mes)
+   mat.method="ftr" reconstruction of the measurement vector mes: the
+   actuators of the other DMs by cMat, then those of dm(mat.ftr_dm) by
+   the FTR of the slopes of wfs(mat.ftr_wfs) from which the other DMs
+   contribution has been removed. If corners ([nc,2], 0 based) is set,
+   returns the FTR output at these grid corners instead.
+   SEE ALSO: ftr_init, _ftr_recon
+*/
+{
+  err = array(float,dimsof(cMat)(2));
+  s = float(mes(*mat._ftrmes));
+  oth = *mat._ftrother;
+  if (numberof(oth)) {
+    err(oth) = cMat(oth,+)*mes(+);
+    s -= (*mat._ftrdoth)(,+)*err(oth)(+);
+  }
+  sub = *mat._ftrsub;
+  act = ((corners == [])? *mat._ftract: corners);
+  com = array(float,dimsof(act)(2));
+  if (_ftr_recon(s,dimsof(sub)(2),sub(,1),sub(,2),int(mat._ftrn),*mat._ftrbnd,
+                 *mat._ftrfilt,int(mat.ftr_niter),numberof(com),act(,1),act(,2),com))
+    error,"_ftr_recon failed";
+  if (corners != []) return com;
+  nm = mat.ftr_dm;
+  err(sum(dm(1:nm)._nact)-dm(nm)._nact+1:sum(dm(1:nm)._nact)) = com;
+  return err;
+}
+
+func ftr_freq(void)
+/* DOCUMENT f = ftr_freq()
+   Spatial frequencies [n/2+1,n,2] (x,y) of the FTR filters, in cycles
+   per subaperture (-0.5 to 0.5), to build mat.ftr_filter, e.g.
+   mat.ftr_filter = &(1./(1+(abs(f(,,1),f(,,2))/0.4)^8)).
+   Needs ftr_init (aoloop) to have been run once.
+   SEE ALSO: ftr_init
+*/
+{
+  n = mat._ftrn;
+  if (!n) error,"call aoloop (ftr_init) first";
+  k = indgen(n/2+1)-1.;
+  l = indgen(n)-1.;
+  l = l-n*(l > n/2);
+  f = array(float,n/2+1,n,2);
+  f(,,1) = k(,-)/n;
+  f(,,2) = l(-,)/n;
+  return f;
+}
+
+func ftr_check(cmat,niter=)
+/* DOCUMENT ftr_check(cmat,niter=)
+   Accuracy and speed of the FTR (mat.method="ftr") against a cMat,
+   e.g. the svd one from a run with mat.method="svd":
+   cmat = transpose(yao_fitsread(YAO_SAVEPATH+mat.file)(,,2));
+   The slopes of random commands of the FTR DM (white, and smooth)
+   are obtained from the iMat and reconstructed by both. Prints the
+   relative rms error on the commands (piston and tip/tilt removed)
+   and the time per reconstruction, over niter [20] calls. For the
+   Strehls, see ftr_run_check.
+   Returns [3,2] [error white, error smooth, ms] per method.
+   SEE ALSO: ftr_init, ftr_recon, ftr_run_check
+*/
+{
+  if (mat.method != "ftr") error,"mat.method is not \"ftr\"";
+  if (niter == []) niter = 20;
+  nm = mat.ftr_dm;
+  nact = dm(nm)._nact;
+  a = sum(dm(1:nm)._nact)-nact+indgen(nact);
+  act = double(*mat._ftract);
+  ptt = [array(1.,nact),act(,1),act(,2)];
+  com = array(double,nact,2);
+  com(,1) = random_n(nact);
+  f = 2*pi*random(4,2)/8.;
+  for (i=1;i<=4;i++) com(,2) += cos(f(i,1)*act(,1)+f(i,2)*act(,2)+2*pi*random());
+  res = array(double,[2,3,2]);
+  for (m=1;m<=1+(cmat!=[]);m++) {
+    for (c=1;c<=2;c++) {
+      mes = float(iMat(,a)(,+)*com(+,c));
+      err = ((m==1)? ftr_recon(mes): cmat(,+)*mes(+))(a);
+      ref = com(,c);
+      err -= ptt(,+)*LUsolve(ptt(+,)*ptt(+,),ptt(+,)*err(+))(+);
+      ref -= ptt(,+)*LUsolve(ptt(+,)*ptt(+,),ptt(+,)*ref(+))(+);
+      res(c,m) = (err-ref)(rms)/ref(rms);
+    }
+    tic;
+    for (it=1;it<=niter;it++) err = ((m==1)? ftr_recon(mes): cmat(,+)*mes(+));
+    res(3,m) = tac()/niter*1000.;
+    write,format="%-4s: relative rms error %.2g (white), %.2g (smooth), %.2f ms\n",
+      (["ftr","cMat"])(m),res(1,m),res(2,m),res(3,m);
+  }
+  return res;
+}
+
+func ftr_run_check(parfile,niter=)
+/* DOCUMENT ftr_run_check(parfile,niter=)
+   Runs the square SH system parfile (e.g. "sh100x100_svipc.par") with
+   mat.method="svd", then "ftr", with the same turbulence and noise
+   (niter [500] iterations, no display), calls ftr_check with the svd
+   cMat, and prints the Strehl (first target, last lambda) and
+   iterations per second of both runs.
+   Returns [2,2] [Strehl, iter/s] per method (svd, ftr).
+   SEE ALSO: ftr_check
+*/
+{
+  extern iter_per_sec, strehl;
+  if (niter == []) niter = 500;
+  meth = ["svd","ftr"];
+  res = array(double,[2,2,2]);
+  for (m=1;m<=2;m++) {
+    aoread,parfile;
+    loop.niter = niter;
+    mat.method = meth(m);
+    sim.rngseed = 1;
+    random_seed,0.5;
+    aoinit,disp=0,forcemat=1;
+    random_seed,0.5;
+    aoloop,disp=0;
+    go,all=1;
+    res(,m) = [strehl(1,0),iter_per_sec];
+    if (m == 1) cmat = cMat;
+    else ftr_check,cmat;
+    if (sim.svipc||anyof(wfs.svipc)) status = quit_forks();
+  }
+  write,format="%-4s: Strehl %.3f @ %.2f microns, %.1f iter/s\n",
+    meth,res(1,),(*target.lambda)(0),res(2,);
+  return res;
+}
+
+//---------------------------------------------------------------
+func yao_sparse_init(void)
+/* DOCUMENT yao_sparse_init
+   mat.method="mmse-sparse": resets the warm start of the PCG of go()
+   (mat._spx) and, with mat.sparse_pcg, copies AtAregSP, GxSP,
+   polcMatSP and the tomographic fitting matrices (dm._fMat) in C
+   handles (yao_sp_handle) for the loop products and the C PCG. With
+   mat.sparse_pcg=2, also sets the FFT preconditioner (see
+   yao_sparse_precond). Called by aoloop. Call it again if you change
+   these matrices while the loop is running.
+   SEE ALSO: _yao_sp_pcg, _yao_sp_xv
+*/
+{
+  extern mat, dm;
+  if (mat.method != "mmse-sparse") return;
+  mat._spx = &array(float,AtAregSP.r);
+  mat._spniter = 0;
+  if (!mat.sparse_pcg) return;
+  _yao_sp_free,-1n;
+  mat._spata = yao_sp_handle(AtAregSP,1);
+  mat._spgx = yao_sp_handle(GxSP,0);
+  mat._sppolc = ((polcMatSP != [])? yao_sp_handle(polcMatSP,0): -1n);
+  for (nm=1;nm<=numberof(dm);nm++) {
+    dm(nm)._spfmat = -1n;
+    if (dm(nm).dmfit_which) dm(nm)._spfmat = yao_sp_handle(*dm(nm)._fMat,0);
+  }
+  if (mat.sparse_pcg == 2) yao_sparse_precond;
+}
+
+func yao_sp_handle(a,sym)
+/* DOCUMENT h = yao_sp_handle(a,sym)
+   C copy (_yao_sp_init) of the soy rco (sym=0) or ruo (sym=1) matrix a,
+   for _yao_sp_xv and _yao_sp_pcg.
+   SEE ALSO: yao_sparse_init
+*/
+{
+  nz = max([a.n,1]);
+  jx = ((a.n > 0)? long((*a.jx)(1:nz)): [0]);
+  xn = ((a.n > 0)? float((*a.xn)(1:nz)): [0.0f]);
+  if (sym) {
+    h = _yao_sp_init(-1n,1n,a.r,a.r,long((*a.ix)(1:a.r)),jx,xn,float((*a.xd)(1:a.r)));
+  } else {
+    h = _yao_sp_init(-1n,0n,a.r,a.c,long((*a.ix)(1:a.r+1)),jx,xn,[0.0f]);
+  }
+  if (h == -2) error,"yao_sp_handle: unexpected layout of the sparse matrix";
+  if (h < 0) error,"yao_sp_handle: out of memory or of handles";
+  return int(h);
+}
+
+func yao_sparse_precond(void)
+/* DOCUMENT yao_sparse_precond
+   mat.sparse_pcg=2: FFT preconditioner of the C PCG. For each
+   stackarray DM in the unknowns of AtAregSP, the column of an interior
+   actuator gives the stencil of the shift invariant approximation of
+   the DM block (WFS term plus regularization). The inverse of its
+   symbol is applied on the actuator grid with FFTs (_yao_sp_precond).
+   The other unknowns get the inverse diagonal.
+   SEE ALSO: yao_sparse_init, _yao_sp_pcg
+*/
+{
+  _yao_sp_precond,mat._spata,-1n,0n,0n,[0n],[0n],[0.0f];
+  // unknowns: the DMs that estimate the wavefront (not the tomographic ones)
+  a0 = 0;
+  for (nm=1;nm<=numberof(dm);nm++) {
+    if (dm(nm).dmfit_which) continue;
+    nact = dm(nm)._nact;
+    if ((dm(nm).type == "stackarray") && (nact > 4)) {
+      ia = long(round((*dm(nm)._x-min(*dm(nm)._x))/dm(nm).pitch));
+      ja = long(round((*dm(nm)._y-min(*dm(nm)._y))/dm(nm).pitch));
+      n = fft_good(max(_(ia,ja))+5); // some margin against the wrap around
+      // the actuator closest to the center, among the well seen ones:
+      d = (*AtAregSP.xd)(a0+1:a0+nact);
+      ok = where(d >= median(d));
+      kc = ok(abs(ia(ok)-avg(ia),ja(ok)-avg(ja))(mnx));
+      v = col = array(float,AtAregSP.r);
+      v(a0+kc) = 1.;
+      _yao_sp_xv,mat._spata,v,col;
+      col = col(a0+1:a0+nact);
+      w = where(col != 0);
+      k = indgen(n/2+1)-1.;
+      l = indgen(n)-1.;
+      sym = array(0.,n/2+1,n);
+      for (p=1;p<=numberof(w);p++) {
+        sym += col(w(p))*cos(2*pi*(k(,-)*(ia(w(p))-ia(kc))+l(-,)*(ja(w(p))-ja(kc)))/n);
+      }
+      sym = max(sym,1e-3*max(sym));
+      if (_yao_sp_precond(mat._spata,int(a0),int(nact),int(n),int(ia),int(ja),
+                          float(1./(sym*n^2))))
+        error,"_yao_sp_precond failed";
+    }
+    a0 += nact;
+  }
+}
+
 //---------------------------------------------------------------
 func aoloop(disp=,savecb=,dpi=,controlscreen=,nographinit=,anim=,savephase=,no_reinit_wfs=)
 /* DOCUMENT aoloop(disp=,savecb=,dpi=,controlscreen=,nographinit=,anim=,savephase=)
@@ -3528,6 +4558,7 @@ func aoloop(disp=,savecb=,dpi=,controlscreen=,nographinit=,anim=,savephase=,no_r
   extern niterok;
   extern pp, sphase, bphase, imphase, dimpow2, cMat, pupil, ipupil;
   extern time, strehllp, strehlsp, rpv, itv, ok, njumpsinceswap;
+  extern sparse_niter;
   extern remainingTimestring  ;
   extern cbmes, cbcom, cberr;
   extern indexDm, aniso, waniso, wdmaniso;
@@ -3611,6 +4642,10 @@ func aoloop(disp=,savecb=,dpi=,controlscreen=,nographinit=,anim=,savephase=,no_r
   imphase       = array(float,[2,size,size]);
   dimpow2       = int(log(size)/log(2));
   cMat          = float(cMat);
+  yao_mvm_init;
+  ftr_init;
+  yao_sparse_init;
+  sparse_niter  = ((mat.method == "mmse-sparse") && mat.sparse_pcg? array(long,loop.niter): []);
   pupil         = float(pupil);
   ipupil        = float(ipupil);
   time          = array(float,10);
@@ -3683,7 +4718,7 @@ func aoloop(disp=,savecb=,dpi=,controlscreen=,nographinit=,anim=,savephase=,no_r
   // special: re-init phase screens, as often we want to change the
   // number of iterations without re-doing the full aoinit
   // note: ok, but have to quit_forks() explicitely if using svipc.
-  if (loop.niter > dimsof(xposvec)(2)) get_turb_phase_init;
+  if (!atm.infinite && (loop.niter > dimsof(xposvec)(2))) get_turb_phase_init;
 
   // reset cyclecounters
   wfs._cyclecounter = wfs._cyclecounter*0 +1;
@@ -3805,6 +4840,7 @@ func go(nshot,all=)
   extern nographinitFlag,savephaseFlag;
   extern cbmes, cbcom, cberr;
   extern iMatSP, AtAregSP
+  extern sparse_niter;
   extern commb,errmb; // minibuffers (last 10 iterations)
   extern im,imav;
   extern iter_per_sec;
@@ -3947,11 +4983,22 @@ func go(nshot,all=)
 
     if (sum(usedMes != 0) == 0){ // sparse CG method does not work if all zeros
       err = array(float,AtAregSP.r);
+      mat._spniter = 0;
     } else {
-      Ats=rcoxv(GxSP,usedMes)
+      if (mat.sparse_pcg) {
+        Ats = array(float,AtAregSP.r);
+        _yao_sp_xv,mat._spgx,usedMes,Ats;
+      } else {
+        Ats=rcoxv(GxSP,usedMes)
+      }
       if ((loop.method == "pseudo open-loop") && (i > 1) && (polcMatSP != [])){
         // apply polc correction
-        polccorr = rcoxv(polcMatSP,estdmcommand);
+        if (mat.sparse_pcg) {
+          polccorr = array(float,polcMatSP.r);
+          _yao_sp_xv,mat._sppolc,float(estdmcommand),polccorr;
+        } else {
+          polccorr = rcoxv(polcMatSP,estdmcommand);
+        }
         if (anyof(wfs.nintegcycles > 1)){
           // if some DMs are not updating because the WFSs have not finished
           // integrating, then the POLC correction should not be applied to
@@ -3970,12 +5017,45 @@ func go(nshot,all=)
         }
         Ats -= polccorr;
       }
-      err = float(ruopcg(AtAregSP,Ats, array(float,AtAregSP.r), tol=mat.sparse_pcgtol));
+      // warm start from the previous solution:
+      x = *mat._spx;
+      if (mat.sparse_pcg) {
+        res = [0.0f];
+        mat._spniter = _yao_sp_pcg(mat._spata,Ats,x,float(mat.sparse_pcgtol),
+                                   int(mat.sparse_maxit),res);
+        if (mat._spniter < 0) error,"_yao_sp_pcg failed: call yao_sparse_init";
+      } else {
+        x = float(ruopcg(AtAregSP,Ats,x,tol=mat.sparse_pcgtol));
+      }
+      mat._spx = &x;
+      err = x;
     }
+    if (sparse_niter != []) sparse_niter(i) = mat._spniter;
   } else {
-    err = cMat(,+) * usedMes(+);
-    if ((loop.method == "pseudo open-loop") && (i > 1) && (dMat != [])){
-      polccorr = dMat(,+)*estdmcommand(+); //pseudo open loop correction
+    dopolc = ((loop.method == "pseudo open-loop") && (i > 1) && (dMat != []));
+    if (mat.method == "ftr") {
+      // Fourier transform reconstructor (ftr_init), cMat for the other DMs:
+      err = ftr_recon(usedMes);
+    } else if (mat.lowrank) {
+      // measurements -> modes, modal gains, modes -> actuators:
+      err = modToActLR(,+) * (float(modalgain(modIndexLR))*(mesToModLR(,+)*usedMes(+)))(+);
+      if (dopolc) polccorr = dMat(,+)*estdmcommand(+); //pseudo open loop correction
+    } else if (mat.mvm) {
+      // C reconstructor (yao_mvm_init). POLC fused, unless it has
+      // to be masked per DM below:
+      err = array(float,dimsof(cMat)(2));
+      polc = (dopolc? (anyof(wfs.nintegcycles > 1)? 2n: 1n): 0n);
+      polccorr = array(float,(polc==2)? numberof(err): 1);
+      com = (dopolc? float(estdmcommand): [0.0f]);
+      if (_yao_mvm(mat._mvm,usedMes,numberof(usedMes),com,(dopolc? numberof(com): 0),
+                   polc,err,polccorr,int(mat.nthreads)))
+        error,"_yao_mvm failed: call yao_mvm_init after changing cMat/dMat";
+      dopolc = (polc==2);
+    } else {
+      err = cMat(,+) * usedMes(+);
+      if (dopolc) polccorr = dMat(,+)*estdmcommand(+); //pseudo open loop correction
+    }
+    if (dopolc){
       if (anyof(wfs.nintegcycles > 1)){
         // if some DMs are not updating because the WFSs have not finished
         // integrating, then the POLC correction should not be applied to
@@ -4046,7 +5126,11 @@ func go(nshot,all=)
       for (idx=1;idx<= numberof(virtualDMs);idx++){
         grow, virtualdmcommand, *dm(virtualDMs(idx))._command;
       }
-      if (mat.method == "mmse-sparse"){
+      if ((mat.method == "mmse-sparse") && mat.sparse_pcg){
+        fcom = array(float,dm(nm)._nact);
+        _yao_sp_xv,dm(nm)._spfmat,float(virtualdmcommand),fcom;
+        *dm(nm)._command = fcom;
+      } else if (mat.method == "mmse-sparse"){
         *dm(nm)._command = rcoxv(*dm(nm)._fMat,virtualdmcommand);
       } else {
         *dm(nm)._command = (*dm(nm)._fMat)(,+)*virtualdmcommand(+);
@@ -4152,9 +5236,7 @@ func go(nshot,all=)
     if (residual_phase_what==[]) residual_phase_what="target";
     if (residual_phase_which==[]) residual_phase_which=1;
 
-    residual_phase=get_phase2d_from_dms(residual_phase_which,residual_phase_what) +
-                   get_phase2d_from_optics(residual_phase_which,residual_phase_what) +
-                   get_turb_phase(i,residual_phase_which,residual_phase_what);
+    residual_phase=get_phase2d(i,residual_phase_which,residual_phase_what);
 
     residual_phase1d = residual_phase(where(pupil > 0));
     residual_phase1d -= min(residual_phase1d);
@@ -4231,20 +5313,16 @@ func go(nshot,all=)
       psf_child_started = 1;
     } else {
       // compute integrated phases and fill phase cube
-      for (jl=1;jl<=target._nlambda;jl++) {
-        for (jt=1;jt<=target._ntarget;jt++) {
-          cubphase(,,jt)  = get_phase2d_from_dms(jt,"target") +    \
-                            get_phase2d_from_optics(jt,"target") + \
-                            get_turb_phase(i,jt,"target");
-          // vibration already added to dm1
-        }
-        // compute image cube from phase cube
-        status = _calc_psf_fast(&pupil,&cubphase,&im,2^dimpow2,
-                                target._ntarget,float(2*pi/(*target.lambda)(jl)),1n);
-
-        // Accumulate statistics:
-        imav(,,,jl) = imav(,,,jl) + im;
-      }
+      // (in microns, the same for all lambdas)
+      // all targets in one pass on the screens
+      // (vibration already added to dm1):
+      cubphase(,,) = get_phase2d(i,indgen(target._ntarget),"target");
+      // compute all (target,lambda) images from phase cube, accumulate
+      // in imav. im gets the instantaneous images at the last lambda.
+      status = _calc_psf_multi(pupil,cubphase,im,imav,2^dimpow2,
+                               target._ntarget,float(2*pi/(*target.lambda)),
+                               target._nlambda,1n,int(target.nthreads),
+                               target._fftctx);
       niterok += 1;
       grow,itv,i;
       if (disp_strehl_indice) sind=disp_strehl_indice; else sind=1;
@@ -4485,6 +5563,9 @@ func reset(void,nmv=)
     *dm(nm)._command *=0.0f;
   }
   mircube *=0.0f; wfsMesHistory *=0.0f;
+
+  // release the C engines fft workspaces (plans are kept):
+  yao_fft_free;
 }
 
 
@@ -4558,7 +5639,7 @@ func after_loop(void)
   extern strehllp,strehsp, itv;
   extern cbmes, cbcom, cberr;
   extern strehl,e50,fwhm;
-  extern iter_per_sec;
+  extern iter_per_sec, sparse_niter;
 
   savecb = savecbFlag;
 
@@ -4580,6 +5661,10 @@ func after_loop(void)
   // tottime = (endtime - starttime);
   iter_per_sec = loopCounter/tottime;
   if (!go_quiet) write,format="%f iterations/second on average\n",iter_per_sec;
+  if ((!go_quiet) && (sparse_niter != []) && (loopCounter > 0)) {
+    write,format="%.1f PCG iterations on average (max %d)\n",
+      avg(sparse_niter(1:loopCounter)),max(sparse_niter(1:loopCounter));
+  }
 
   // Save the circular buffers:
   if (is_set(savecb)) {
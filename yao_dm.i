@@ -316,7 +316,10 @@ func make_pzt_dm_elt(nm,&def,disp=)
   dm(nm)._i1  = &(int(long(cubval(,1)-smallsize/2+0.5)-dm(nm)._n1));
   dm(nm)._j1  = &(int(long(cubval(,2)-smallsize/2+0.5)-dm(nm)._n1));
 
-  def = def(,,-)*array(1.f,dm(nm)._nact)(-,-,);
+  // all the IFs are this one, shifted. dm.fourier only keeps it once
+  // (see comp_dm_shape_fourier_init):
+  if (dm(nm).fourier) def = def(,,-);
+  else def = def(,,-)*array(1.f,dm(nm)._nact)(-,-,);
 
   if (dm(nm)._puppixoffset!=[]) {
     // see comment above in make_pzt_dm
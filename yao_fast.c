@@ -25,9 +25,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
 #include <complex.h>
 #include <fftw3.h>
 #include <time.h>
+#include <pthread.h>
 #include "ydata.h"
 #include "yapi.h"
 
@@ -43,8 +45,9 @@
 int use_sincos_approx_flag = 0;
 
 void _eclat_float(float *ar, int nx, int ny);
-void _poidev(float *xmv, long n);
-void _gaussdev(float *xmv, long n);
+void yao_rng_detector(int ctx, float *x, long n, long index0, float gain, float sigma);
+void yao_rng_poisson(int ctx, float *x, long n, long index0);
+void yao_rng_gauss(int ctx, float *x, long n, long index0, float sigma);
 
 // int Y__fftw_init_threads(void)
 // {
@@ -125,6 +128,215 @@ sincosf(float x, float *s, float *c)
 }
 #endif
 
+/**************************************************************
+ * Phasor kernel: fills an interleaved complex (fftwf_complex)*
+ * array with amp*exp(i*scal*(phase+offset)). offset can be   *
+ * NULL. Points where amp==0 are set to 0 (phase not used).   *
+ * Accuracy tiers (per wfs/target, see yao_phasor_tier()):    *
+ * YAO_PHASOR_DEFAULT: EXACT or LEGACY, as use_sincos_approx()*
+ * YAO_PHASOR_EXACT  : sincosf()                              *
+ * YAO_PHASOR_LEGACY : _sinecosinef() above                   *
+ * YAO_PHASOR_POLY   : reduction to [-pi/4,pi/4] + minimax    *
+ *                     polynomials (cephes sinf/cosf)         *
+ * YAO_PHASOR_TABLE  : 1024 points sin/cos table + 2nd order  *
+ *                     Taylor correction                      *
+ * POLY and TABLE work on blocks of 16 values (gcc vector     *
+ * extension) and are compiled for AVX-512, AVX2, SSE4.2 and  *
+ * the baseline; the best one for the CPU is picked at load   *
+ * time (target_clones). Both are valid for |phase| < 1e4 rad.*
+ * See yao_phasor_check (yao_fast.i) for the max errors.      *
+ **************************************************************/
+
+#define YAO_PHASOR_DEFAULT 0
+#define YAO_PHASOR_EXACT   1
+#define YAO_PHASOR_LEGACY  2
+#define YAO_PHASOR_POLY    3
+#define YAO_PHASOR_TABLE   4
+
+#define YAO_PHASOR_VL      16      // block length
+#define YAO_PHASOR_NTAB    1024    // sin table size, power of 2
+
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && \
+    defined(__linux__) && (__GNUC__ >= 6)
+#define YAO_PHASOR_CLONES __attribute__((target_clones("avx512f","avx2","sse4.2","default")))
+#else
+#define YAO_PHASOR_CLONES
+#endif
+
+typedef float        yao_v16f __attribute__((vector_size(4*YAO_PHASOR_VL)));
+typedef int          yao_v16i __attribute__((vector_size(4*YAO_PHASOR_VL)));
+typedef unsigned int yao_v16u __attribute__((vector_size(4*YAO_PHASOR_VL)));
+
+// sin table, one period + a quarter (cos = sin shifted by NTAB/4):
+static float          yao_sintab[YAO_PHASOR_NTAB+YAO_PHASOR_NTAB/4];
+static pthread_once_t yao_sintab_once = PTHREAD_ONCE_INIT;
+
+static void yao_sintab_init(void)
+{
+  int i;
+  for ( i=0 ; i<YAO_PHASOR_NTAB+YAO_PHASOR_NTAB/4 ; i++ )
+    yao_sintab[i] = (float)sin(2.*M_PI*i/YAO_PHASOR_NTAB);
+}
+
+// loads a block of phase (+offset), scaled. Zeroes the phase where amp==0.
+static inline void yao_phasor_load(const float *amp, const float *phase,
+                                   const float *offset, float scal, long nv,
+                                   yao_v16f *a, yao_v16f *x)
+{
+  yao_v16f o;
+  long     k;
+
+  if (nv==YAO_PHASOR_VL) {
+    memcpy(a, amp, sizeof(yao_v16f));
+    memcpy(x, phase, sizeof(yao_v16f));
+    if (offset) { memcpy(&o, offset, sizeof(yao_v16f)); *x = *x + o; }
+  } else {
+    for ( k=0 ; k<YAO_PHASOR_VL ; k++ ) {
+      (*a)[k] = (k<nv)? amp[k] : 0.0f;
+      (*x)[k] = (k<nv)? phase[k] + ((offset)? offset[k] : 0.0f) : 0.0f;
+    }
+  }
+  *x = *x * scal;
+  *x = (yao_v16f)((yao_v16i)*x & ~(*a == 0.0f));
+}
+
+// interleaves a*cos and a*sin into out
+static inline void yao_phasor_store(float *out, long nv, const yao_v16f *a,
+                                    const yao_v16f *c, const yao_v16f *s)
+{
+  const yao_v16i lo = {0,16,1,17,2,18,3,19,4,20,5,21,6,22,7,23};
+  const yao_v16i hi = {8,24,9,25,10,26,11,27,12,28,13,29,14,30,15,31};
+  yao_v16f       re, im, z[2];
+
+  re   = *a * *c;
+  im   = *a * *s;
+  z[0] = __builtin_shuffle(re, im, lo);
+  z[1] = __builtin_shuffle(re, im, hi);
+  memcpy(out, z, 2*nv*sizeof(float));
+}
+
+// x = k*pi/2 + r, |r|<=pi/4 (Cody-Waite). Returns r, and k in the low bits of q
+static inline void yao_phasor_reduce(const yao_v16f *x, yao_v16f *r, yao_v16u *q)
+{
+  const float twoopi = 0.636619772367581343f;
+  const float magic  = 12582912.0f; // 1.5*2^23: x+magic rounds x to an integer
+  const float DP1 = 1.5703125f, DP2 = 4.837512969970703125e-4f;
+  const float DP3 = 7.54978995489188216e-8f; // DP1+DP2+DP3 = pi/2
+  yao_v16f    y, kf;
+
+  y  = *x*twoopi + magic;
+  kf = y - magic;
+  *q = (yao_v16u)y;
+  *r = ((*x - kf*DP1) - kf*DP2) - kf*DP3;
+}
+
+// from sin(r), cos(r) to sin(x), cos(x): swap for odd k, signs from k&2, (k+1)&2
+static inline void yao_phasor_quadrant(const yao_v16u *q, yao_v16f *s, yao_v16f *c)
+{
+  yao_v16u swap, sgs, sgc, si, ci;
+
+  swap = -(*q & 1u);
+  sgs  = (*q & 2u) << 30;
+  sgc  = ((*q+1u) & 2u) << 30;
+  si   = (yao_v16u)*s;
+  ci   = (yao_v16u)*c;
+  *s   = (yao_v16f)(((si & ~swap) | (ci & swap)) ^ sgs);
+  *c   = (yao_v16f)(((ci & ~swap) | (si & swap)) ^ sgc);
+}
+
+YAO_PHASOR_CLONES
+static void yao_phasor_poly(float *out, const float *amp, const float *phase,
+                            const float *offset, float scal, long n)
+{
+  yao_v16f    a, x, r, r2, s, c;
+  yao_v16u    q;
+  long        i, nv;
+
+  for ( i=0 ; i<n ; i+=YAO_PHASOR_VL ) {
+    nv = (n-i<YAO_PHASOR_VL)? n-i : YAO_PHASOR_VL;
+    yao_phasor_load(amp+i, phase+i, (offset)? offset+i : NULL, scal, nv, &a, &x);
+    yao_phasor_reduce(&x, &r, &q);
+    r2 = r*r;
+    s  = r + r*r2*(-1.6666654611e-1f + r2*(8.3321608736e-3f + r2*(-1.9515295891e-4f)));
+    c  = 1.0f - 0.5f*r2 + r2*r2*(4.166664568298827e-2f + \
+         r2*(-1.388731625493765e-3f + r2*2.443315711809948e-5f));
+    yao_phasor_quadrant(&q, &s, &c);
+    yao_phasor_store(out+2*i, nv, &a, &c, &s);
+  }
+}
+
+YAO_PHASOR_CLONES
+static void yao_phasor_table(float *out, const float *amp, const float *phase,
+                             const float *offset, float scal, long n)
+{
+  const float ooh   = YAO_PHASOR_NTAB/(2*3.141592653589793f);
+  const float h     = (2*3.141592653589793f)/YAO_PHASOR_NTAB;
+  const float magic = 12582912.0f;
+  yao_v16f    a, x, r, y, d, d2, s0, c0, s, c;
+  yao_v16u    q, idx;
+  long        i, k, nv;
+
+  for ( i=0 ; i<n ; i+=YAO_PHASOR_VL ) {
+    nv = (n-i<YAO_PHASOR_VL)? n-i : YAO_PHASOR_VL;
+    yao_phasor_load(amp+i, phase+i, (offset)? offset+i : NULL, scal, nv, &a, &x);
+    yao_phasor_reduce(&x, &r, &q);
+    // nearest table point, and distance d to it (|d|<=h/2):
+    y   = r*ooh + magic;
+    idx = (yao_v16u)y & (YAO_PHASOR_NTAB-1);
+    d   = r - (y-magic)*h;
+    for ( k=0 ; k<YAO_PHASOR_VL ; k++ ) {
+      s0[k] = yao_sintab[idx[k]];
+      c0[k] = yao_sintab[idx[k]+YAO_PHASOR_NTAB/4];
+    }
+    d2 = 0.5f*d*d;
+    s  = s0 + d*c0 - d2*s0;
+    c  = c0 - d*s0 - d2*c0;
+    yao_phasor_quadrant(&q, &s, &c);
+    yao_phasor_store(out+2*i, nv, &a, &c, &s);
+  }
+}
+
+void yao_phasor(fftwf_complex *cout, const float *amp, const float *phase,
+                const float *offset, float scal, long n, int tier)
+{
+  float *out = (void *)cout;
+  float pp, ppsin, ppcos;
+  long  i;
+
+  if (tier==YAO_PHASOR_DEFAULT) {
+    tier = (use_sincos_approx_flag)? YAO_PHASOR_LEGACY : YAO_PHASOR_EXACT;
+  }
+
+  if (tier==YAO_PHASOR_POLY) {
+    yao_phasor_poly(out, amp, phase, offset, scal, n);
+    return;
+  }
+  if (tier==YAO_PHASOR_TABLE) {
+    pthread_once(&yao_sintab_once, yao_sintab_init);
+    yao_phasor_table(out, amp, phase, offset, scal, n);
+    return;
+  }
+
+  for ( i=0 ; i<n ; i++ ) {
+    if ( amp[i] != 0.0f ) {
+      pp = (offset)? (phase[i]+offset[i])*scal : phase[i]*scal;
+      if (tier==YAO_PHASOR_LEGACY) _sinecosinef(pp, &ppsin, &ppcos);
+      else sincosf(pp, &ppsin, &ppcos);
+      out[2*i]   = amp[i] * ppcos;
+      out[2*i+1] = amp[i] * ppsin;
+    } else {
+      out[2*i]   = 0.0f;
+      out[2*i+1] = 0.0f;
+    }
+  }
+}
+
+void _yao_phasor(float *out, float *amp, float *phase, float scal, long n, int tier)
+/* yorick access to the phasor kernel (checks, benchmarks). out is 2*n */
+{
+  yao_phasor((void *)out, amp, phase, NULL, scal, n, tier);
+}
+
 int _import_wisdom(char *wisdom_file)
 {
   FILE *fp;
@@ -217,6 +429,689 @@ int _init_fftw_plan(int size)
   return(0);
 }
 
+/**************************************************************
+ * FFTW plan and workspace registry.                          *
+ * Plans are cached for the whole session, keyed by size,     *
+ * number of transforms (howmany>1 gives a batched plan over  *
+ * contiguous arrays), direction and layout. They are planned *
+ * once on scratch arrays and then run on the engine buffers  *
+ * with the new-array execute interface (all buffers come     *
+ * from fftwf_malloc, so alignment is the same).              *
+ * Workspaces (the A, result, ximage... buffers of the        *
+ * engines) hang off a context. Each WFS gets one at aoinit   *
+ * (wfs._fftctx), as does the target PSF calculation          *
+ * (target._fftctx). Context 0 is shared by the occasional    *
+ * callers (calc_psf_fast(), fftVE()).                        *
+ * The plan table grows as needed; lookups and planning are   *
+ * serialized by yao_fft_lock (the FFTW planner is not thread *
+ * safe) and the hit/miss counters are atomic.                *
+ **************************************************************/
+
+#define YAO_FFT_PLANCHUNK 64 // plan table growth step
+#define YAO_FFT_MAXCTX   256
+#define YAO_FFT_MAXTHREADS 64
+#define YAO_FFT_THREADSLOT 16  // first slot of the per-thread workspaces
+#define YAO_FFT_NSLOTS   (YAO_FFT_THREADSLOT+YAO_FFT_MAXTHREADS)
+
+// plan layouts:
+#define YAO_FFT_C2C      0   // out of place, complex to complex
+#define YAO_FFT_ROWS     1   // out of place, 1D FFTs of n0 rows of n1x n1 arrays
+#define YAO_FFT_COLS     2   // in place, 1D FFTs of the n1 columns of n0x n1 arrays
+#define YAO_FFT_R2C      3   // out of place, real n0*n1 to n0*(n1/2+1) complex
+#define YAO_FFT_C2R      4   // out of place, n0*(n1/2+1) complex to real n0*n1
+
+typedef struct {
+  int        n0, n1;      // transform dimensions
+  int        howmany;     // number of transforms in one execute
+  int        dir;         // FFTW_FORWARD or FFTW_BACKWARD
+  int        layout;      // one of YAO_FFT_*
+  fftwf_plan plan;
+} yao_fftplan;
+
+typedef struct {
+  int        inuse;
+  int        phasor;      // phasor accuracy tier (YAO_PHASOR_*)
+  unsigned int rngstream; // noise stream (wfs #, see _yao_rng_stream)
+  unsigned int rngdraw;   // noise draw counter
+  void       *buf[YAO_FFT_NSLOTS];
+  size_t     size[YAO_FFT_NSLOTS];
+} yao_fftctx;
+
+static yao_fftplan *yao_fft_plans = NULL;
+static int         yao_fft_nplans = 0;
+static int         yao_fft_maxplans = 0;
+static pthread_mutex_t yao_fft_lock = PTHREAD_MUTEX_INITIALIZER;
+static yao_fftctx  yao_fft_ctx[YAO_FFT_MAXCTX];
+// plan hits, plan misses, workspace hits, workspace misses:
+static long        yao_fft_counts[4] = {0,0,0,0};
+#define YAO_FFT_COUNT(k) __atomic_fetch_add(&yao_fft_counts[k], 1, __ATOMIC_RELAXED)
+
+static fftwf_plan yao_fft_plan_locked(int n0, int n1, int howmany, int dir, int layout)
+{
+  fftwf_complex *in, *out;
+  fftwf_plan    p;
+  yao_fftplan   *tab;
+  int           i;
+
+  for ( i=0 ; i<yao_fft_nplans ; i++ ) {
+    if ( (yao_fft_plans[i].n0==n0) && (yao_fft_plans[i].n1==n1) &&
+         (yao_fft_plans[i].howmany==howmany) && (yao_fft_plans[i].dir==dir) &&
+         (yao_fft_plans[i].layout==layout) ) {
+      YAO_FFT_COUNT(0);
+      return yao_fft_plans[i].plan;
+    }
+  }
+  YAO_FFT_COUNT(1);
+
+  if (yao_fft_nplans==yao_fft_maxplans) {
+    tab = realloc(yao_fft_plans, sizeof(yao_fftplan)*(yao_fft_maxplans+YAO_FFT_PLANCHUNK));
+    if (tab==NULL) {
+      printf("yao_fft_plan: the plan registry is full (%d plans) and can not "
+             "grow. Free the plans with yao_fft_free(plans=1)\n",yao_fft_nplans);
+      return NULL;
+    }
+    yao_fft_plans = tab;
+    yao_fft_maxplans += YAO_FFT_PLANCHUNK;
+  }
+
+  // FFTW_MEASURE scribbles over the arrays: plan on scratch ones
+  // (the pruned layouts work on square n1*n1 arrays, n0<=n1)
+  in  = fftwf_malloc(sizeof(fftwf_complex) * n1 * n1 * howmany);
+  out = fftwf_malloc(sizeof(fftwf_complex) * n1 * n1 * howmany);
+  if ( in == NULL || out == NULL ) {
+    if (in) fftwf_free(in);
+    if (out) fftwf_free(out);
+    printf("yao_fft_plan: out of memory planning a %dx%d (x%d) FFT\n",n0,n1,howmany);
+    return NULL;
+  }
+
+  if (layout==YAO_FFT_R2C) {
+    p = fftwf_plan_dft_r2c_2d(n0, n1, (float *)in, out, FFTWOPTMODE);
+  } else if (layout==YAO_FFT_C2R) {
+    p = fftwf_plan_dft_c2r_2d(n0, n1, in, (float *)out, FFTWOPTMODE);
+  } else if (layout==YAO_FFT_ROWS) {
+    // the transform is along a row, loops over rows and arrays:
+    fftwf_iodim dim = {n1, 1, 1};
+    fftwf_iodim hdims[2] = {{howmany, n1*n1, n1*n1}, {n0, n1, n1}};
+    p = fftwf_plan_guru_dft(1, &dim, 2, hdims, in, out, dir, FFTWOPTMODE);
+  } else if (layout==YAO_FFT_COLS) {
+    // along a column (stride n1), loops over columns and arrays:
+    fftwf_iodim dim = {n0, n1, n1};
+    fftwf_iodim hdims[2] = {{howmany, n0*n1, n0*n1}, {n1, 1, 1}};
+    p = fftwf_plan_guru_dft(1, &dim, 2, hdims, out, out, dir, FFTWOPTMODE);
+  } else if (howmany==1) {
+    p = fftwf_plan_dft_2d(n0, n1, in, out, dir, FFTWOPTMODE);
+  } else {
+    // howmany contiguous n0*n1 transforms (batched subapertures...):
+    int dims[2] = {n0, n1};
+    p = fftwf_plan_many_dft(2, dims, howmany, in, NULL, 1, n0*n1,
+                            out, NULL, 1, n0*n1, dir, FFTWOPTMODE);
+  }
+
+  fftwf_free(in);
+  fftwf_free(out);
+
+  if (p==NULL) {
+    printf("yao_fft_plan: FFTW could not plan a %dx%d (x%d) FFT\n",n0,n1,howmany);
+    return NULL;
+  }
+
+  yao_fft_plans[yao_fft_nplans].n0      = n0;
+  yao_fft_plans[yao_fft_nplans].n1      = n1;
+  yao_fft_plans[yao_fft_nplans].howmany = howmany;
+  yao_fft_plans[yao_fft_nplans].dir     = dir;
+  yao_fft_plans[yao_fft_nplans].layout  = layout;
+  yao_fft_plans[yao_fft_nplans].plan    = p;
+  yao_fft_nplans++;
+
+  return p;
+}
+
+fftwf_plan yao_fft_plan(int n0, int n1, int howmany, int dir, int layout)
+{
+  fftwf_plan p;
+
+  pthread_mutex_lock(&yao_fft_lock);
+  p = yao_fft_plan_locked(n0, n1, howmany, dir, layout);
+  pthread_mutex_unlock(&yao_fft_lock);
+  return p;
+}
+
+/* Pruned 2D FFT. When the input arrays (n*n, howmany of them, contiguous)
+   are zero outside of rows [j0,j0+nrows) and columns [i0,i0+ncols),
+   the row transforms of the first pass are only done on these nrows
+   rows (the others give 0), then the column transforms are done in place
+   on the full output. This is used when the support covers less than
+   half the padded array (or always/never, see _set_fft_pruning). */
+
+static int yao_fft_pruning = 1; // 0: never, 1: auto, 2: always
+
+void _set_fft_pruning(int mode)
+{
+  yao_fft_pruning = mode;
+}
+
+void Y__get_fft_pruning(int nargs)
+{
+  ypush_int(yao_fft_pruning);
+}
+
+typedef struct {
+  fftwf_plan p, prow, pcol; // full plan, or rows + columns plans
+  int        n, j0, nrows, howmany;
+} yao_fft2d;
+
+int yao_fft2d_init(yao_fft2d *f, int n, int j0, int nrows, int ncols,
+                   int howmany, int dir)
+{
+  int prune;
+
+  f->n = n; f->j0 = j0; f->nrows = nrows; f->howmany = howmany;
+  f->p = f->prow = f->pcol = NULL;
+
+  // n>=8 keeps the first support row aligned as the planning arrays
+  prune = (n>=8) && (nrows>0) && (nrows<n) && (j0>=0) && (j0+nrows<=n);
+  if (yao_fft_pruning==0) prune = 0;
+  else if (yao_fft_pruning==1) prune = prune && (2*nrows*ncols < n*n);
+
+  if (prune) {
+    f->prow = yao_fft_plan(nrows, n, howmany, dir, YAO_FFT_ROWS);
+    f->pcol = yao_fft_plan(n, n, howmany, dir, YAO_FFT_COLS);
+    if ( (f->prow!=NULL) && (f->pcol!=NULL) ) return 0;
+  }
+  f->prow = f->pcol = NULL;
+  f->p = yao_fft_plan(n, n, howmany, dir, YAO_FFT_C2C);
+  return (f->p==NULL)? -1 : 0;
+}
+
+void yao_fft2d_execute(yao_fft2d *f, fftwf_complex *in, fftwf_complex *out)
+{
+  float *ptr;
+  long  i, k, nn = (long)f->n*f->n;
+
+  if (f->p) { fftwf_execute_dft(f->p, in, out); return; }
+
+  // rows outside of the support transform to 0:
+  for ( k=0 ; k<f->howmany ; k++ ) {
+    ptr = (void *)(out + k*nn);
+    for ( i=0 ; i<2L*f->j0*f->n ; i++ ) ptr[i] = 0.0f;
+    for ( i=2L*(f->j0+f->nrows)*f->n ; i<2*nn ; i++ ) ptr[i] = 0.0f;
+  }
+  fftwf_execute_dft(f->prow, in + (long)f->j0*f->n, out + (long)f->j0*f->n);
+  fftwf_execute_dft(f->pcol, out, out);
+}
+
+// bounding box of the non zero pixels of a n*n array: rows [*j0,*j0+*nrows)
+// and *ncols columns
+void yao_fft_support(float *a, int n, int *j0, int *nrows, int *ncols)
+{
+  int i, j, j1, i0, i1;
+
+  *j0 = n; j1 = -1; i0 = n; i1 = -1;
+  for ( j=0 ; j<n ; j++ ) {
+    for ( i=0 ; i<n ; i++ ) {
+      if (a[i+j*n]==0.0f) continue;
+      if (j<*j0) *j0 = j;
+      if (j>j1) j1 = j;
+      if (i<i0) i0 = i;
+      if (i>i1) i1 = i;
+    }
+  }
+  if (j1<0) { *j0 = 0; *nrows = n; *ncols = n; return; } // empty: no pruning
+  *nrows = j1-*j0+1;
+  *ncols = i1-i0+1;
+}
+
+void *yao_fft_workspace(int ctx, int slot, size_t nbytes)
+/* returns a buffer of at least nbytes, attached to context ctx.
+   The content is *not* preserved when the buffer has to grow. */
+{
+  yao_fftctx *c;
+
+  if ( (ctx<0) || (ctx>=YAO_FFT_MAXCTX) ) ctx = 0;
+  c = &yao_fft_ctx[ctx];
+
+  if ( (c->buf[slot]!=NULL) && (c->size[slot]>=nbytes) ) {
+    YAO_FFT_COUNT(2);
+    return c->buf[slot];
+  }
+  YAO_FFT_COUNT(3);
+
+  if (c->buf[slot]) fftwf_free(c->buf[slot]);
+  c->buf[slot]  = fftwf_malloc(nbytes);
+  c->size[slot] = (c->buf[slot]==NULL)? 0 : nbytes;
+
+  return c->buf[slot];
+}
+
+int _yao_fft_context_new(void)
+{
+  int ctx;
+
+  // context 0 is the shared one, never handed out
+  for ( ctx=1 ; ctx<YAO_FFT_MAXCTX ; ctx++ ) {
+    if (!yao_fft_ctx[ctx].inuse) {
+      yao_fft_ctx[ctx].inuse = 1;
+      return ctx;
+    }
+  }
+  return 0;
+}
+
+void _yao_fft_context_free(int ctx, int release)
+/* frees the workspaces of context ctx (all contexts if ctx<0).
+   if release is set, the handle(s) can be handed out again. */
+{
+  int c, c1, c2, s;
+
+  if (ctx<0) { c1 = 0; c2 = YAO_FFT_MAXCTX; }
+  else if (ctx<YAO_FFT_MAXCTX) { c1 = ctx; c2 = ctx+1; }
+  else return;
+
+  for ( c=c1 ; c<c2 ; c++ ) {
+    for ( s=0 ; s<YAO_FFT_NSLOTS ; s++ ) {
+      if (yao_fft_ctx[c].buf[s]) fftwf_free(yao_fft_ctx[c].buf[s]);
+      yao_fft_ctx[c].buf[s]  = NULL;
+      yao_fft_ctx[c].size[s] = 0;
+    }
+    if (release) {
+      yao_fft_ctx[c].inuse = 0; yao_fft_ctx[c].phasor = 0;
+      yao_fft_ctx[c].rngstream = 0; yao_fft_ctx[c].rngdraw = 0;
+    }
+  }
+}
+
+void _yao_phasor_tier(int ctx, int tier)
+/* sets the phasor accuracy tier of the engines using context ctx */
+{
+  if ( (ctx<0) || (ctx>=YAO_FFT_MAXCTX) ) return;
+  if ( (tier<YAO_PHASOR_DEFAULT) || (tier>YAO_PHASOR_TABLE) ) tier = YAO_PHASOR_DEFAULT;
+  yao_fft_ctx[ctx].phasor = tier;
+}
+
+static int yao_fft_phasor(int ctx)
+{
+  if ( (ctx<0) || (ctx>=YAO_FFT_MAXCTX) ) ctx = 0;
+  return yao_fft_ctx[ctx].phasor;
+}
+
+void _yao_fft_plans_free(void)
+{
+  int i;
+
+  pthread_mutex_lock(&yao_fft_lock);
+  for ( i=0 ; i<yao_fft_nplans ; i++ ) fftwf_destroy_plan(yao_fft_plans[i].plan);
+  free(yao_fft_plans);
+  yao_fft_plans = NULL;
+  yao_fft_nplans = yao_fft_maxplans = 0;
+  pthread_mutex_unlock(&yao_fft_lock);
+}
+
+void _yao_fft_stats(long *stats, int zero)
+/* stats = [plan hits, plan misses, workspace hits, workspace misses,
+            # of cached plans, # of contexts in use, workspace bytes] */
+{
+  int  c, s;
+
+  for ( s=0 ; s<4 ; s++ ) {
+    if (zero) stats[s] = __atomic_exchange_n(&yao_fft_counts[s], 0, __ATOMIC_RELAXED);
+    else stats[s] = __atomic_load_n(&yao_fft_counts[s], __ATOMIC_RELAXED);
+  }
+  stats[4] = yao_fft_nplans;
+  stats[5] = 0;
+  stats[6] = 0;
+  for ( c=0 ; c<YAO_FFT_MAXCTX ; c++ ) {
+    stats[5] += yao_fft_ctx[c].inuse;
+    for ( s=0 ; s<YAO_FFT_NSLOTS ; s++ ) stats[6] += yao_fft_ctx[c].size[s];
+  }
+}
+
+/**************************************************************
+ * Counter based random numbers for the noise of the engines. *
+ * Philox4x32-10 (Salmon et al., SC11): every draw is a pure  *
+ * function of (seed, stream, index, draw), so that the noise *
+ * does not depend on the number of threads, on the svipc     *
+ * fork layout (index = pixel # in the full wfs image) or on  *
+ * the call order of the other random users. The stream and  *
+ * the draw counter live in the wfs fft context; each sampler *
+ * call advances the draw counter by one. Seed with           *
+ * _yao_rng_seed (see sim.rngseed), streams are set at aoinit.*
+ **************************************************************/
+
+#define YAO_RNG_PSMALL 30.0f   // Poisson: inversion below, PTRS rejection above
+
+typedef unsigned long long yao_v16ul __attribute__((vector_size(8*YAO_PHASOR_VL)));
+
+static unsigned int yao_rng_key[2] = {0x2545F491u, 0x9E3779B9u};
+
+void _yao_rng_seed(long seed)
+{
+  unsigned long long z = (unsigned long long)seed + 0x9E3779B97F4A7C15ull;
+
+  // splitmix64 finalizer, so that close seeds give unrelated keys
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  z = z ^ (z >> 31);
+  yao_rng_key[0] = (unsigned int)z;
+  yao_rng_key[1] = (unsigned int)(z >> 32);
+}
+
+void _yao_rng_stream(int ctx, int stream)
+/* sets the stream of context ctx and restarts its draw counter */
+{
+  if ( (ctx<0) || (ctx>=YAO_FFT_MAXCTX) ) return;
+  yao_fft_ctx[ctx].rngstream = (unsigned int)stream;
+  yao_fft_ctx[ctx].rngdraw   = 0;
+}
+
+static unsigned int yao_rng_draw(int ctx, unsigned int *stream)
+{
+  if ( (ctx<0) || (ctx>=YAO_FFT_MAXCTX) ) ctx = 0;
+  *stream = yao_fft_ctx[ctx].rngstream;
+  return yao_fft_ctx[ctx].rngdraw++;
+}
+
+// 16 Philox4x32-10 blocks, counters (c0+lane, c1, c2, c3)
+static inline void yao_philox(yao_v16u *c0, yao_v16u *c1, yao_v16u *c2, yao_v16u *c3)
+{
+  const unsigned long long M0 = 0xD2511F53ull, M1 = 0xCD9E8D57ull;
+  unsigned int k0 = yao_rng_key[0], k1 = yao_rng_key[1];
+  yao_v16ul    p0, p1;
+  yao_v16u     t;
+  int          r;
+
+  for ( r=0 ; r<10 ; r++ ) {
+    p0  = __builtin_convertvector(*c0, yao_v16ul) * M0;
+    p1  = __builtin_convertvector(*c2, yao_v16ul) * M1;
+    t   = *c1;
+    *c0 = __builtin_convertvector(p1 >> 32, yao_v16u) ^ t ^ k0;
+    *c1 = __builtin_convertvector(p1, yao_v16u);
+    *c2 = __builtin_convertvector(p0 >> 32, yao_v16u) ^ *c3 ^ k1;
+    *c3 = __builtin_convertvector(p0, yao_v16u);
+    k0 += 0x9E3779B9u; k1 += 0xBB67AE85u;
+  }
+}
+
+static inline void yao_philox_block(unsigned long index, unsigned int stream,
+                                    unsigned int draw, unsigned int attempt,
+                                    yao_v16u w[4])
+{
+  int k;
+  if ( (index & 0xffffffffUL) <= 0xffffffffUL-YAO_PHASOR_VL ) {
+    for ( k=0 ; k<YAO_PHASOR_VL ; k++ ) w[0][k] = k;
+    w[0] = w[0] + (unsigned int)index;
+    w[1] = w[0]*0u + (stream ^ ((unsigned int)(index >> 32) << 16));
+  } else {
+    for ( k=0 ; k<YAO_PHASOR_VL ; k++ ) {
+      w[0][k] = (unsigned int)(index+k);
+      w[1][k] = stream ^ ((unsigned int)((index+k) >> 32) << 16);
+    }
+  }
+  w[2] = w[0]*0u + draw;
+  w[3] = w[0]*0u + attempt;
+  yao_philox(&w[0], &w[1], &w[2], &w[3]);
+}
+
+// uniform in ]0,1[
+static inline void yao_rng_unif(yao_v16f *x, const yao_v16u *u)
+{
+  *x = __builtin_convertvector((yao_v16i)(*u >> 8), yao_v16f)*5.9604644775390625e-8f \
+    + 2.98023223876953125e-8f;
+}
+
+static inline double yao_rng_unifd(unsigned int u)
+{
+  return ((u >> 8) + 0.5) * 5.9604644775390625e-8;
+}
+
+// natural log for x in ]0,1] (cephes logf polynomial)
+static inline void yao_rng_log(yao_v16f *out, const yao_v16f *x)
+{
+  yao_v16i e, lt;
+  yao_v16f m, z, y, ef;
+
+  e  = (((yao_v16i)*x >> 23) & 0xff) - 126;
+  m  = (yao_v16f)(((yao_v16i)*x & 0x007fffff) | 0x3f000000); // [0.5,1[
+  lt = (m < 0.707106781186547524f);
+  e  = e + lt;
+  m  = m + (yao_v16f)((yao_v16i)m & lt) - 1.0f;
+  ef = __builtin_convertvector(e, yao_v16f);
+  z  = m*m;
+  y  = 7.0376836292e-2f*m - 1.1514610310e-1f;
+  y  = y*m + 1.1676998740e-1f;
+  y  = y*m - 1.2420140846e-1f;
+  y  = y*m + 1.4249322787e-1f;
+  y  = y*m - 1.6668057665e-1f;
+  y  = y*m + 2.0000714765e-1f;
+  y  = y*m - 2.4999993993e-1f;
+  y  = y*m + 3.3333331174e-1f;
+  y  = y*m*z - 2.12194440e-4f*ef - 0.5f*z;
+  *out = m + y + 0.693359375f*ef;
+}
+
+// exp(x) for x in [-88,0] (cephes expf polynomial)
+static inline void yao_rng_exp(yao_v16f *out, const yao_v16f *x)
+{
+  const float magic = 12582912.0f;
+  yao_v16f    y, nf, r, z;
+
+  y  = *x*1.44269504088896341f + magic;   // round(x/ln2)
+  nf = y - magic;
+  r  = (*x - nf*0.693359375f) + nf*2.12194440e-4f;
+  z  = r*r;
+  y  = 1.9875691500e-4f*r + 1.3981999507e-3f;
+  y  = y*r + 8.3334519073e-3f;
+  y  = y*r + 4.1665795894e-2f;
+  y  = y*r + 1.6666665459e-1f;
+  y  = y*r + 5.0000001201e-1f;
+  y  = y*z + r + 1.0f;
+  // times 2^n
+  *out = (yao_v16f)((yao_v16i)y + (__builtin_convertvector(nf, yao_v16i) << 23));
+}
+
+// log(Gamma(x)), x>=1 (Stirling series, as numpy's loggam)
+static double yao_rng_lgam(double x)
+{
+  static const double a[10] = {8.333333333333333e-02, -2.777777777777778e-03,
+    7.936507936507937e-04, -5.952380952380952e-04, 8.417508417508418e-04,
+    -1.917526917526918e-03, 6.410256410256410e-03, -2.955065359477124e-02,
+    1.796443723688307e-01, -1.39243221690590e+00};
+  double x0 = x, x2, gl0, gl;
+  int    k, n = 0;
+
+  if ( (x==1.) || (x==2.) ) return 0.;
+  if (x<=7.) { n = (int)(7-x); x0 = x+n; }
+  x2  = 1./(x0*x0);
+  gl0 = a[9];
+  for ( k=8 ; k>=0 ; k-- ) gl0 = gl0*x2 + a[k];
+  gl = gl0/x0 + 0.91893853320467274178 + (x0-0.5)*log(x0) - x0;
+  for ( k=1 ; k<=n ; k++ ) { x0 -= 1.; gl -= log(x0); }
+  return gl;
+}
+
+// Poisson deviate of mean lam>=YAO_RNG_PSMALL, transformed rejection
+// (Hormann 1993, PTRS). Attempt 0 uses u0,v0, attempt a the first lane
+// of Philox block (index, stream, draw, a).
+static float yao_rng_ptrs(double lam, unsigned long index, unsigned int stream,
+                          unsigned int draw, unsigned int u0, unsigned int v0)
+{
+  double   slam = sqrt(lam), loglam = log(lam), b, a, invalpha, vr, U, V, us, k;
+  yao_v16u w[4];
+  unsigned int att, uu, vv;
+
+  b = 0.931 + 2.53*slam;
+  a = -0.059 + 0.02483*b;
+  invalpha = 1.1239 + 1.1328/(b-3.4);
+  vr = 0.9277 - 3.6224/(b-2);
+  for ( att=0 ; ; att++ ) {
+    if (att==0) { uu = u0; vv = v0; }
+    else {
+      yao_philox_block(index, stream, draw, att, w);
+      uu = w[0][0]; vv = w[1][0];
+    }
+    U  = yao_rng_unifd(uu) - 0.5;
+    V  = yao_rng_unifd(vv);
+    us = 0.5 - fabs(U);
+    k  = floor((2.*a/us + b)*U + lam + 0.43);
+    if ( (us>=0.07) && (V<=vr) ) return (float)k;
+    if ( (k<0.) || ((us<0.013) && (V>us)) ) continue;
+    if ( log(V) + log(invalpha) - log(a/(us*us)+b) <= \
+         -lam + k*loglam - yao_rng_lgam(k+1.) ) return (float)k;
+  }
+}
+
+// N(0,1) from two uniform words (Box-Muller, cosine branch)
+static inline void yao_rng_normal(yao_v16f *z, const yao_v16u *wu, const yao_v16u *wv)
+{
+  yao_v16f u, v, r, th, s, c, r2, y;
+  yao_v16u q;
+  int      k;
+
+  yao_rng_unif(&u, wu);
+  yao_rng_unif(&v, wv);
+  yao_rng_log(&r, &u);
+  r = -2.0f*r;
+  for ( k=0 ; k<YAO_PHASOR_VL ; k++ ) r[k] = sqrtf(r[k]);
+  th = v*6.283185307179586f;
+  yao_phasor_reduce(&th, &y, &q);
+  r2 = y*y;
+  s  = y + y*r2*(-1.6666654611e-1f + r2*(8.3321608736e-3f + r2*(-1.9515295891e-4f)));
+  c  = 1.0f - 0.5f*r2 + r2*r2*(4.166664568298827e-2f + \
+       r2*(-1.388731625493765e-3f + r2*2.443315711809948e-5f));
+  yao_phasor_quadrant(&q, &s, &c);
+  *z = r*c;
+}
+
+// Detector noise, in place: x = gain*Poisson(x/gain) + sigma*N(0,1).
+// x[i] is element index0+i of the stream. Words 0 and 1 of the Philox
+// block feed the Poisson deviate, 2 and 3 the gaussian one.
+YAO_PHASOR_CLONES
+static void yao_rng_detector_block(float *x, long n, unsigned long index0,
+                                   unsigned int stream, unsigned int draw,
+                                   float gain, float sigma)
+{
+  yao_v16f m, lam, lb, u, v, p, F, kf, more, one, sl, a, b, vr, us, kb, z;
+  yao_v16i acc;
+  yao_v16u w[4];
+  long     i, k, nv;
+  int      it, any, nbig;
+
+  for ( i=0 ; i<n ; i+=YAO_PHASOR_VL ) {
+    nv = (n-i<YAO_PHASOR_VL)? n-i : YAO_PHASOR_VL;
+    yao_philox_block(index0+i, stream, draw, 0, w);
+    nbig = 0;
+    for ( k=0 ; k<YAO_PHASOR_VL ; k++ ) {
+      m[k] = (k<nv)? x[i+k]/gain : 0.0f;
+      lam[k] = ( (m[k]>0.0f) && (m[k]<YAO_RNG_PSMALL) )? m[k] : 0.0f;
+      one[k] = 1.0f;
+      // large means, for the PTRS fast acceptance below
+      lb[k] = (m[k]>=YAO_RNG_PSMALL)? m[k] : YAO_RNG_PSMALL;
+      nbig += (m[k]>=YAO_RNG_PSMALL);
+    }
+    p = -lam;
+    yao_rng_exp(&p, &p);
+    // inversion: smallest k with u <= F(k), all lanes at once
+    yao_rng_unif(&u, &w[0]);
+    F  = p;
+    kf = p*0.0f;
+    for ( it=0 ; it<128 ; it++ ) {
+      more = (yao_v16f)(u > F);
+      any  = 0;
+      for ( k=0 ; k<YAO_PHASOR_VL ; k++ ) any |= ((yao_v16i)more)[k];
+      if (!any) break;
+      kf = kf + (yao_v16f)((yao_v16i)one & (yao_v16i)more);
+      p  = p*lam/kf;
+      F  = F + (yao_v16f)((yao_v16i)p & (yao_v16i)more);
+    }
+    if (nbig) {
+      // PTRS first attempt for all lanes (accepted right away ~85% of the
+      // time), the others go through yao_rng_ptrs
+      for ( k=0 ; k<YAO_PHASOR_VL ; k++ ) sl[k] = sqrtf(lb[k]);
+      yao_rng_unif(&v, &w[1]);
+      b   = 0.931f + 2.53f*sl;
+      a   = -0.059f + 0.02483f*b;
+      vr  = 0.9277f - 3.6224f/(b-2.0f);
+      u   = u - 0.5f;
+      us  = 0.5f - (yao_v16f)((yao_v16i)u & 0x7fffffff);
+      kb  = (2.0f*a/us + b)*u + lb + 0.43f;
+      acc = (us >= 0.07f) & (v <= vr);
+      for ( k=0 ; k<nv ; k++ ) {
+        if (m[k]<YAO_RNG_PSMALL) continue;
+        if (acc[k]) kf[k] = floorf(kb[k]);
+        else kf[k] = yao_rng_ptrs(m[k], index0+i+k, stream, draw, w[0][k], w[1][k]);
+      }
+    }
+    kf = kf*gain;
+    if (sigma!=0.0f) {
+      yao_rng_normal(&z, &w[2], &w[3]);
+      kf = kf + sigma*z;
+    }
+    for ( k=0 ; k<nv ; k++ ) x[i+k] = kf[k];
+  }
+}
+
+// x += sigma*N(0,1)
+YAO_PHASOR_CLONES
+static void yao_rng_gauss_block(float *x, long n, float sigma, unsigned long index0,
+                                unsigned int stream, unsigned int draw)
+{
+  yao_v16f z;
+  yao_v16u w[4];
+  long     i, k, nv;
+
+  for ( i=0 ; i<n ; i+=YAO_PHASOR_VL ) {
+    nv = (n-i<YAO_PHASOR_VL)? n-i : YAO_PHASOR_VL;
+    yao_philox_block(index0+i, stream, draw, 0, w);
+    yao_rng_normal(&z, &w[0], &w[1]);
+    for ( k=0 ; k<nv ; k++ ) x[i+k] += sigma*z[k];
+  }
+}
+
+void yao_rng_detector(int ctx, float *x, long n, long index0, float gain, float sigma)
+{
+  unsigned int stream, draw = yao_rng_draw(ctx, &stream);
+  yao_rng_detector_block(x, n, (unsigned long)index0, stream, draw, gain, sigma);
+}
+
+void yao_rng_poisson(int ctx, float *x, long n, long index0)
+{
+  yao_rng_detector(ctx, x, n, index0, 1.0f, 0.0f);
+}
+
+void yao_rng_gauss(int ctx, float *x, long n, long index0, float sigma)
+{
+  unsigned int stream, draw = yao_rng_draw(ctx, &stream);
+  yao_rng_gauss_block(x, n, sigma, (unsigned long)index0, stream, draw);
+}
+
+// x += sigma*N(0,1) at explicit counters, for callers that need the
+// deviates to be keyed on something else than a context draw (e.g. the
+// world position of an extruded screen column, see aoSimulUtils.c)
+void yao_rng_gauss_at(float *x, long n, unsigned long index0,
+                      unsigned int stream, unsigned int draw, float sigma)
+{
+  yao_rng_gauss_block(x, n, sigma, index0, stream, draw);
+}
+
+void _yao_rng_poisson(int ctx, float *x, long n, long index0)
+/* yorick access: x = Poisson(x), elements index0.. of the ctx stream */
+{
+  yao_rng_poisson(ctx, x, n, index0);
+}
+
+void _yao_rng_gauss(int ctx, float *x, long n, long index0, float sigma)
+/* yorick access: x += sigma*N(0,1), elements index0.. of the ctx stream */
+{
+  yao_rng_gauss(ctx, x, n, index0, sigma);
+}
+
+void _yao_rng_draw(int ctx, int draw)
+/* sets the draw counter of context ctx (to replay a draw) */
+{
+  if ( (ctx<0) || (ctx>=YAO_FFT_MAXCTX) ) return;
+  yao_fft_ctx[ctx].rngdraw = (unsigned int)draw;
+}
+
 /**************************************************************
  * The following function computes the PSF, given a pupil and *
  * a phase, both float. phase can be a 3 dimensional array,   *
@@ -235,54 +1130,42 @@ int _calc_psf_fast(float *pupil, /* pupil image, dim [ n , n ] */
                    int nplans,   /* number of plans (min 1, mostly to spped up calculations */
                                  /* by avoiding multiple setups and mallocs */
                    float scal,   /* phase scaling factor */
-                   int swap)
+                   int swap,
+                   int fftctx)   /* fft workspace context (see registry above) */
 {
   /* Declarations */
 
   fftwf_complex *in, *out;
   float         *ptr;
   long          i,k,koff;
-  fftwf_plan     p;
-  float         ppsin,ppcos;
+  yao_fft2d     fft;
+  int           j0, nrows, ncols;
+  int           tier = yao_fft_phasor(fftctx);
       
   // fftwf_plan_with_nthreads(n_threads);
 
-  /* Allocate memory for the input operands and check its availability. */
-  in  = fftwf_malloc(sizeof(fftwf_complex) * n * n);
-  out = fftwf_malloc(sizeof(fftwf_complex) * n * n );
+  /* Get the workspace for the input operands and check its availability. */
+  in  = yao_fft_workspace(fftctx, 0, sizeof(fftwf_complex) * n * n);
+  out = yao_fft_workspace(fftctx, 1, sizeof(fftwf_complex) * n * n);
 
   if ( in == NULL || out == NULL ) { return (-1); }
   
-  /* Set up the required memory for the FFT routines */
-  p = fftwf_plan_dft_2d(n, n, in, out, FFTW_FORWARD, FFTWOPTMODE);
+  /* Get the (cached) plans for the FFT routines, pruned to the pupil
+     support if worth it */
+  yao_fft_support(pupil, n, &j0, &nrows, &ncols);
+  if ( yao_fft2d_init(&fft, n, j0, nrows, ncols, 1, FFTW_FORWARD) ) { return (-1); }
   
   /* Main loop on plan #, in case several phases are input to the routine */
   for ( k=0; k<nplans; k++ ) {
 
     koff = k*n*n;
-    //    ptr  = &(in[0]);
-    ptr  = (void *)in;
-
-    for ( i=0; i<n*n; i++ ) {
-      if ( pupil[i] != 0.f ) {
-        //~ *(ptr)   = pupil[i] * cosf( phase[koff+i] * scal );
-        //~ *(ptr+1) = pupil[i] * sinf( phase[koff+i] * scal );
-        //~ *(ptr)   = pupil[i] * cosine( phase[koff+i] * scal );
-        //~ *(ptr+1) = pupil[i] * sine( phase[koff+i] * scal );
-        if (use_sincos_approx_flag) _sinecosinef(phase[koff+i] * scal, &ppsin, &ppcos);
-        else sincosf(phase[koff+i] * scal, &ppsin, &ppcos);
-        *(ptr)   = pupil[i] * ppcos;
-        *(ptr+1) = pupil[i] * ppsin;
-      } else {
-        *(ptr)   = 0.0f;
-        *(ptr+1) = 0.0f;
-      }
-      ptr +=2;
-    }
+
+    // in = pupil * exp(i*phase*scal):
+    yao_phasor(in, pupil, &(phase[koff]), NULL, scal, n*n, tier);
 
     /* Carry out a Forward 2d FFT transform, check for errors. */
 
-    fftwf_execute(p); /* repeat as needed */
+    yao_fft2d_execute(&fft, in, out); /* repeat as needed */
 
     //    ptr = &(out[0]);
     ptr  = (void *)out;
@@ -295,10 +1178,137 @@ int _calc_psf_fast(float *pupil, /* pupil image, dim [ n , n ] */
     if (swap) _eclat_float(&(image[koff]),n,n);
   }
 
-  /* Free allocated memory. */
-  fftwf_destroy_plan(p);
-  fftwf_free(in);
-  fftwf_free(out);
+  return (0);
+}
+
+
+/* Per-call data of _calc_psf_multi(), and per-thread data */
+typedef struct {
+  float      *pupil, *phase, *im, *imav, *scal;
+  int        n, ntarget, nlambda, swap, tier, nthreads;
+  yao_fft2d  fft;
+} psfm_shared;
+
+typedef struct {
+  psfm_shared   *sh;
+  int           tid;
+  fftwf_complex *in, *out;
+  float         *image;
+} psfm_thread;
+
+/* Computes the PSFs (target, lambda) = tid, tid+nthreads,...
+   (target index running fastest) */
+static void *_calc_psf_items(void *arg)
+{
+  psfm_thread   *th = arg;
+  psfm_shared   *sh = th->sh;
+  float         *ptr, *image = th->image, *imav, *im;
+  long          i, nn = (long)sh->n*sh->n;
+  int           it, jt, jl;
+
+  for ( it=th->tid ; it<sh->ntarget*sh->nlambda ; it+=sh->nthreads ) {
+
+    jt = it % sh->ntarget;
+    jl = it / sh->ntarget;
+    yao_phasor(th->in, sh->pupil, sh->phase+jt*nn, NULL, sh->scal[jl], nn, sh->tier);
+
+    yao_fft2d_execute(&sh->fft, th->in, th->out);
+
+    ptr = (void *)th->out;
+    for ( i=0; i<nn; i++ ) {
+      image[i] = ( *(ptr) * *(ptr) + *(ptr+1) * *(ptr+1) );
+      ptr +=2;
+    }
+    if (sh->swap) _eclat_float(image,sh->n,sh->n);
+
+    // accumulate in the long exposure, keep last lambda as short exposure:
+    imav = sh->imav + (long)it*nn;
+    for ( i=0; i<nn; i++ ) imav[i] += image[i];
+    if (jl==sh->nlambda-1) {
+      im = sh->im + (long)jt*nn;
+      for ( i=0; i<nn; i++ ) im[i] = image[i];
+    }
+  }
+
+  return NULL;
+}
+
+/**************************************************************
+ * Multi-target, multi-wavelength version of _calc_psf_fast,  *
+ * for the PSF statistics of go(). phase (n,n,ntarget) is in  *
+ * microns, and is scaled by scal(jl)=float(2*pi/lambda(jl)),  *
+ * computed by the caller, for each of the nlambda            *
+ * wavelengths. The images are added to imav          *
+ * (n,n,ntarget,nlambda) and the ones of the last wavelength  *
+ * are returned in im (n,n,ntarget), the instantaneous PSFs.  *
+ * The (target,lambda) pairs are split over nthreads threads  *
+ * (target.nthreads), each with its own workspace in fftctx.  *
+ **************************************************************/
+
+int _calc_psf_multi(float *pupil,  /* pupil image, dim [ n , n ] */
+                    float *phase,  /* phase cube (microns), dim [ n , n , ntarget ] */
+                    float *im,     /* output images, dim [ n , n , ntarget ] */
+                    float *imav,   /* accumulated images, dim [ n , n , ntarget, nlambda ] */
+                    int n,         /* side linear dimension */
+                    int ntarget,   /* number of targets */
+                    float *scal,   /* phase scaling factors (2*pi/lambda), dim [ nlambda ] */
+                    int nlambda,   /* number of wavelengths */
+                    int swap,      /* swap quadrants? */
+                    int nthreads,  /* number of threads */
+                    int fftctx)    /* fft workspace context (see registry above) */
+{
+  psfm_shared   sh;
+  psfm_thread   th[YAO_FFT_MAXTHREADS];
+  pthread_t     thid[YAO_FFT_MAXTHREADS];
+  int           thok[YAO_FFT_MAXTHREADS];
+  char          *ws;
+  size_t        csize, fsize;
+  int           t, j0, nrows, ncols;
+
+  // no point having more threads than PSFs
+  if (nthreads > ntarget*nlambda) nthreads = ntarget*nlambda;
+  if (nthreads > YAO_FFT_MAXTHREADS) nthreads = YAO_FFT_MAXTHREADS;
+  if (nthreads < 1) nthreads = 1;
+
+  /* Get the (cached) plans for the FFT routines (pruned if worth it) */
+  yao_fft_support(pupil, n, &j0, &nrows, &ncols);
+  if ( yao_fft2d_init(&sh.fft, n, j0, nrows, ncols, 1, FFTW_FORWARD) ) { return (-1); }
+
+  /* and the per-thread workspaces (in, out, image) */
+  csize = (sizeof(fftwf_complex)*n*n+63)/64*64;
+  fsize = (sizeof(float)*n*n+63)/64*64;
+  for ( t=0 ; t<nthreads ; t++ ) {
+    ws = yao_fft_workspace(fftctx, YAO_FFT_THREADSLOT+t, 2*csize+fsize);
+    if ( ws == NULL ) { return (-1); }
+    th[t].in    = (void *)ws;
+    th[t].out   = (void *)(ws+csize);
+    th[t].image = (void *)(ws+2*csize);
+    th[t].sh    = &sh;
+    th[t].tid   = t;
+  }
+
+  sh.pupil    = pupil;
+  sh.phase    = phase;
+  sh.im       = im;
+  sh.imav     = imav;
+  sh.scal     = scal;
+  sh.n        = n;
+  sh.ntarget  = ntarget;
+  sh.nlambda  = nlambda;
+  sh.swap     = swap;
+  sh.tier     = yao_fft_phasor(fftctx);
+  sh.nthreads = nthreads;
+
+  // thread 0 is the calling thread. If a thread can not be
+  // created, its share is done in the calling thread.
+  for ( t=1 ; t<nthreads ; t++ ) \
+    thok[t] = (pthread_create(&thid[t], NULL, _calc_psf_items, &th[t])==0);
+  _calc_psf_items(&th[0]);
+  for ( t=1 ; t<nthreads ; t++ ) {
+    if (thok[t]) pthread_join(thid[t], NULL);
+    else _calc_psf_items(&th[t]);
+  }
+
   return (0);
 }
 
@@ -317,18 +1327,19 @@ int _fftVE(float *rp,
   long          i;
   fftwf_plan    p;
 
-  /* Allocate memory for the input operands and check its availability. */
-  in  = fftwf_malloc(sizeof(fftwf_complex) * n * n);
-  out = fftwf_malloc(sizeof(fftwf_complex) * n * n );
+  /* Get the workspace (shared context) and check its availability. */
+  in  = yao_fft_workspace(0, 0, sizeof(fftwf_complex) * n * n);
+  out = yao_fft_workspace(0, 1, sizeof(fftwf_complex) * n * n);
 
   if ( in == NULL || out == NULL ) { return (-1); }
   
-  /* Set up the required memory for the FFT routines */
+  /* Get the (cached) plan for the FFT routines */
   if (dir == 1) {
-    p = fftwf_plan_dft_2d(n, n, in, out, FFTW_FORWARD, FFTWOPTMODE);
+    p = yao_fft_plan(n, n, 1, FFTW_FORWARD, YAO_FFT_C2C);
   } else {
-    p = fftwf_plan_dft_2d(n, n, in, out, FFTW_BACKWARD, FFTWOPTMODE);
+    p = yao_fft_plan(n, n, 1, FFTW_BACKWARD, YAO_FFT_C2C);
   }
+  if ( p == NULL ) { return (-1); }
 
   /* fill input */
   ptr  = (void *)in;
@@ -341,7 +1352,7 @@ int _fftVE(float *rp,
 
   /* Carry out a Forward 2d FFT transform, check for errors. */
 
-  fftwf_execute(p); /* repeat as needed */
+  fftwf_execute_dft(p, in, out); /* repeat as needed */
 
   ptr = (void *)out;
   for ( i = 0; i < n*n; i++ ) {
@@ -350,10 +1361,6 @@ int _fftVE(float *rp,
     ptr +=2;
   }
 
-  /* Free allocated memory. */
-  fftwf_destroy_plan(p);
-  fftwf_free(in);
-  fftwf_free(out);
   return (0);
 }
 
@@ -383,6 +1390,509 @@ void _fftVE2(fftwf_complex *in,
 
 }
 
+/************************************************************************
+ * Fourier DM shape (dm.fourier). For shift-invariant IFs (stackarray, *
+ * elt=1) the shape is the grid of the commands, one impulse per        *
+ * actuator at its (i1,j1), convolved with the IF kernel: one r2c/c2r   *
+ * pair on the n*n padded grid instead of the sum over the actuators.   *
+ * Impulses go at (i1+off,j1+off); with off >= ksize and                *
+ * n >= out+2*ksize the circular convolution does not wrap onto the     *
+ * output, which is read at (off,off). Shares context 0 with _fftVE.    *
+ ************************************************************************/
+
+int _dm_fourier_kernel(float *ker,  // IF kernel, ksize*ksize
+                       int   ksize,
+                       int   n,     // FFT size
+                       float *kerf) // out: r2c FFT of ker/n^2, n*(n/2+1) complex
+{
+  float         *in;
+  fftwf_complex *out;
+  fftwf_plan    p;
+  long          i, nc = (long)n*(n/2+1);
+  int           j;
+
+  if (ksize > n) return (-1);
+  in  = yao_fft_workspace(0, 0, sizeof(float) * n * n);
+  out = yao_fft_workspace(0, 1, sizeof(fftwf_complex) * nc);
+  p   = yao_fft_plan(n, n, 1, FFTW_FORWARD, YAO_FFT_R2C);
+  if ( in == NULL || out == NULL || p == NULL ) { return (-1); }
+
+  memset(in, 0, sizeof(float) * n * n);
+  for ( j=0 ; j<ksize ; j++ )
+    memcpy(in + (long)j*n, ker + (long)j*ksize, sizeof(float) * ksize);
+  fftwf_execute_dft_r2c(p, in, out);
+
+  // kerf is not necessarily aligned as FFTW wants: copy
+  for ( i=0 ; i<nc ; i++ ) {
+    kerf[2*i]   = out[i][0] / ((float)n*n);
+    kerf[2*i+1] = out[i][1] / ((float)n*n);
+  }
+  return (0);
+}
+
+int _dm_fourier_shape(float *kerf,    // from _dm_fourier_kernel
+                      int   n,        // FFT size
+                      int   off,      // impulse offset (>= ksize)
+                      int   *i1,      // IF corner of each actuator
+                      int   *j1,
+                      int   nact,
+                      float *coefs,   // command coefficients
+                      float *dmshape, // output, outnx*outny
+                      int   outnx,
+                      int   outny)
+{
+  float         *grid;
+  fftwf_complex *spec;
+  fftwf_plan    pf, pb;
+  float         re;
+  long          i, nc = (long)n*(n/2+1);
+  int           k, x, y;
+
+  if ( (off+outnx > n) || (off+outny > n) ) return (-1);
+  grid = yao_fft_workspace(0, 0, sizeof(float) * n * n);
+  spec = yao_fft_workspace(0, 1, sizeof(fftwf_complex) * nc);
+  pf   = yao_fft_plan(n, n, 1, FFTW_FORWARD, YAO_FFT_R2C);
+  pb   = yao_fft_plan(n, n, 1, FFTW_BACKWARD, YAO_FFT_C2R);
+  if ( grid == NULL || spec == NULL || pf == NULL || pb == NULL ) { return (-1); }
+
+  memset(grid, 0, sizeof(float) * n * n);
+  for ( k=0 ; k<nact ; k++ ) {
+    if (coefs[k] == 0.0f) continue;
+    x = i1[k] + off;
+    y = j1[k] + off;
+    // out of the grid: too far to reach the output
+    if ( (x<0) || (y<0) || (x>=n) || (y>=n) ) continue;
+    grid[x + (long)y*n] += coefs[k];
+  }
+
+  fftwf_execute_dft_r2c(pf, grid, spec);
+  for ( i=0 ; i<nc ; i++ ) {
+    re         = spec[i][0]*kerf[2*i] - spec[i][1]*kerf[2*i+1];
+    spec[i][1] = spec[i][0]*kerf[2*i+1] + spec[i][1]*kerf[2*i];
+    spec[i][0] = re;
+  }
+  fftwf_execute_dft_c2r(pb, spec, grid);
+
+  for ( y=0 ; y<outny ; y++ )
+    memcpy(dmshape + (long)y*outnx, grid + off + (long)(y+off)*n,
+           sizeof(float) * outnx);
+  return (0);
+}
+
+/************************************************************************
+ * Fourier transform reconstructor (mat.method="ftr"). Fried geometry:  *
+ * the slopes of subaperture (i,j) are the differences of the phase at  *
+ * its 4 corners, (i,j)..(i+1,j+1) on the n*n periodic grid.            *
+ * The slopes are first made consistent with a periodic phase by the    *
+ * extension method: x slopes are copied out of the aperture along y    *
+ * (from bounds[0:n] to bounds[n:2n], per column), then the last column *
+ * (always outside, n > nxsub) closes the sum of each row to 0. Same    *
+ * for y with x and y swapped (bounds[2n:4n], last row).                *
+ * filt holds 3 n*(n/2+1) complex filters: x and y slopes to phase      *
+ * (1/n^2 included), then the post filter (phase to commands). With     *
+ * niter > 0, the slopes of the reconstructed phase replace the         *
+ * extension outside of the subapertures and the phase is recomputed    *
+ * (niter more r2c/c2r). The result is read at the corners (ia,ja) of   *
+ * the outputs. Uses slots 2 and 3 of context 0.                        *
+ ************************************************************************/
+
+static void ftr_slopes(float *ph, float *sx, float *sy, int n)
+/* Fried slopes of the periodic phase ph */
+{
+  long i, j, i1, j1;
+  float a, b;
+
+  for ( j=0 ; j<n ; j++ ) {
+    j1 = (j+1)%n;
+    for ( i=0 ; i<n ; i++ ) {
+      i1 = (i+1)%n;
+      a  = ph[i1+j1*n] - ph[i+j*n];
+      b  = ph[i1+j*n]  - ph[i+j1*n];
+      sx[i+j*n] = 0.5f*(a+b);
+      sy[i+j*n] = 0.5f*(a-b);
+    }
+  }
+}
+
+int _ftr_recon(float *mes,    // x slopes then y slopes, nsub each
+               int   nsub,
+               int   *ix,     // subaperture grid coordinates
+               int   *iy,
+               int   n,       // grid size
+               int   *bounds, // extension bounds, 4*n, -1 for empty
+               float *filt,   // x, y and post filters, 3*n*(n/2+1) complex
+               int   niter,   // boundary iterations
+               int   nout,
+               int   *ia,     // corner coordinates of the outputs,
+               int   *ja,     //   out of the grid: output 0
+               float *out)
+{
+  float         *sx, *sy, *ph, *fp, s, re, im;
+  fftwf_complex *fx, *fy;
+  fftwf_plan    pf, pb;
+  long          i, nc = (long)n*(n/2+1);
+  long          rstride = ((long)n*n+15) & ~15L; // keep sy, ph and fy aligned
+  long          cstride = (nc+7) & ~7L;
+  int           k, j, lo, hi, it;
+
+  sx = yao_fft_workspace(0, 2, sizeof(float) * 3 * rstride);
+  fx = yao_fft_workspace(0, 3, sizeof(fftwf_complex) * 2 * cstride);
+  pf = yao_fft_plan(n, n, 1, FFTW_FORWARD, YAO_FFT_R2C);
+  pb = yao_fft_plan(n, n, 1, FFTW_BACKWARD, YAO_FFT_C2R);
+  if ( sx == NULL || fx == NULL || pf == NULL || pb == NULL ) { return (-1); }
+  sy = sx + rstride;
+  ph = sy + rstride;
+  fy = fx + cstride;
+  fp = filt + 4*nc;
+
+  memset(sx, 0, sizeof(float) * 2 * rstride);
+  for ( k=0 ; k<nsub ; k++ ) {
+    if ( (ix[k]<0) || (iy[k]<0) || (ix[k]>=n-1) || (iy[k]>=n-1) ) return (-1);
+    sx[ix[k] + (long)iy[k]*n] = mes[k];
+    sy[ix[k] + (long)iy[k]*n] = mes[nsub+k];
+  }
+
+  // extension: x slopes along the columns, y slopes along the rows
+  for ( i=0 ; i<n ; i++ ) {
+    lo = bounds[i]; hi = bounds[n+i];
+    if (lo >= 0) {
+      for ( j=0 ; j<lo ; j++ ) sx[i + (long)j*n] = sx[i + (long)lo*n];
+      for ( j=hi+1 ; j<n ; j++ ) sx[i + (long)j*n] = sx[i + (long)hi*n];
+    }
+    lo = bounds[2*n+i]; hi = bounds[3*n+i];
+    if (lo >= 0) {
+      for ( j=0 ; j<lo ; j++ ) sy[j + i*n] = sy[lo + i*n];
+      for ( j=hi+1 ; j<n ; j++ ) sy[j + i*n] = sy[hi + i*n];
+    }
+  }
+  // loop continuity: each row of x slopes, each column of y slopes sums to 0
+  for ( j=0 ; j<n ; j++ ) {
+    s = 0.0f;
+    for ( i=0 ; i<n-1 ; i++ ) s += sx[i + (long)j*n];
+    sx[n-1 + (long)j*n] = -s;
+  }
+  for ( i=0 ; i<n ; i++ ) {
+    s = 0.0f;
+    for ( j=0 ; j<n-1 ; j++ ) s += sy[i + (long)j*n];
+    sy[i + (long)(n-1)*n] = -s;
+  }
+
+  for ( it=0 ; it<=niter ; it++ ) {
+    fftwf_execute_dft_r2c(pf, sx, fx);
+    fftwf_execute_dft_r2c(pf, sy, fy);
+    for ( i=0 ; i<nc ; i++ ) {
+      re = fx[i][0]*filt[2*i] - fx[i][1]*filt[2*i+1]
+         + fy[i][0]*filt[2*(nc+i)] - fy[i][1]*filt[2*(nc+i)+1];
+      im = fx[i][0]*filt[2*i+1] + fx[i][1]*filt[2*i]
+         + fy[i][0]*filt[2*(nc+i)+1] + fy[i][1]*filt[2*(nc+i)];
+      fx[i][0] = re;
+      fx[i][1] = im;
+    }
+    if (it == niter) break;
+    // slopes of this phase outside of the subapertures, measured ones inside
+    fftwf_execute_dft_c2r(pb, fx, ph);
+    ftr_slopes(ph, sx, sy, n);
+    for ( k=0 ; k<nsub ; k++ ) {
+      sx[ix[k] + (long)iy[k]*n] = mes[k];
+      sy[ix[k] + (long)iy[k]*n] = mes[nsub+k];
+    }
+  }
+
+  for ( i=0 ; i<nc ; i++ ) {
+    re       = fx[i][0]*fp[2*i] - fx[i][1]*fp[2*i+1];
+    fx[i][1] = fx[i][0]*fp[2*i+1] + fx[i][1]*fp[2*i];
+    fx[i][0] = re;
+  }
+  fftwf_execute_dft_c2r(pb, fx, ph);
+
+  for ( k=0 ; k<nout ; k++ ) {
+    if ( (ia[k]<0) || (ja[k]<0) || (ia[k]>=n) || (ja[k]>=n) ) out[k] = 0.0f;
+    else out[k] = ph[ia[k] + (long)ja[k]*n];
+  }
+  return (0);
+}
+
+/************************************************************************
+ * Sparse operators and PCG for mat.method="mmse-sparse" (sparse_pcg).  *
+ * The soy rco (row compressed) and ruo (symmetric: strict upper         *
+ * triangle, rows 0..r-2, + diagonal xd) matrices are copied once into   *
+ * a CSR handle, the ruo ones with both triangles so that the product   *
+ * is a plain row loop. The PCG starts from x (warm start). It is       *
+ * preconditioned by the inverse diagonal, except on the blocks set by  *
+ * _yao_sp_precond (the actuators of a DM on a n*n grid), where the     *
+ * inverse of the circulant approximation of the block is applied with  *
+ * a r2c/c2r pair. Uses slots 4 and 5 of context 0.                     *
+ ************************************************************************/
+
+#define YAO_SP_MAX    32
+#define YAO_SP_MAXBLK 16
+
+typedef struct {
+  int   a0, nact, n;
+  int   *ia, *ja;       // grid coordinates of the actuators
+  float *filt;          // n*(n/2+1) real, 1/n^2 included
+} yao_sp_block;
+
+typedef struct {
+  int   inuse;
+  long  r, c;
+  long  *ix;            // row starts, r+1
+  int   *jx;
+  float *xn;
+  float *dinv;          // inverse diagonal (square matrices)
+  float *work;          // PCG vectors, 4*r
+  int   nblk;
+  yao_sp_block blk[YAO_SP_MAXBLK];
+} yao_sp_ctx;
+
+static yao_sp_ctx yao_sp[YAO_SP_MAX];
+
+void _yao_sp_free(int h)
+/* frees handle h (all of them if h<0) */
+{
+  yao_sp_ctx *s;
+  int b;
+
+  if (h<0) {
+    for ( h=0 ; h<YAO_SP_MAX ; h++ ) _yao_sp_free(h);
+    return;
+  }
+  if ( (h>=YAO_SP_MAX) || (!yao_sp[h].inuse) ) return;
+  s = &yao_sp[h];
+  free(s->ix); free(s->jx); free(s->xn); free(s->dinv); free(s->work);
+  for ( b=0 ; b<s->nblk ; b++ ) {
+    free(s->blk[b].ia); free(s->blk[b].ja); free(s->blk[b].filt);
+  }
+  memset(s, 0, sizeof(yao_sp_ctx));
+}
+
+int _yao_sp_init(int   h,    // handle to re-use, or <0
+                 int   sym,  // 0: rco, 1: ruo
+                 long  r,    // rows
+                 long  c,    // columns (= r for ruo)
+                 long  *ix,  // rco: r+1 row starts, ruo: r
+                 long  *jx,  // column indices (0 based)
+                 float *xn,  // values
+                 float *xd)  // ruo: diagonal, r
+/* returns the handle, -1 if out of memory or handles, -2 if the
+   matrix does not have the expected layout */
+{
+  yao_sp_ctx *s;
+  long       i, j, k, nr, *cnt;
+
+  if ( (h>=0) && (h<YAO_SP_MAX) && yao_sp[h].inuse ) _yao_sp_free(h);
+  else {
+    for ( h=0 ; h<YAO_SP_MAX ; h++ ) if (!yao_sp[h].inuse) break;
+    if (h==YAO_SP_MAX) return (-1);
+  }
+  if ( (r<1) || (c<1) || (sym && (r!=c)) ) return (-2);
+
+  // rows of the (strict upper) triangle of ruo: 0..r-2
+  nr = (sym? r-1: r);
+  if (ix[0] != 0) return (-2);
+  for ( i=0 ; i<nr ; i++ ) {
+    if (ix[i+1] < ix[i]) return (-2);
+    for ( j=ix[i] ; j<ix[i+1] ; j++ ) if ( (jx[j]<0) || (jx[j]>=c) ) return (-2);
+  }
+
+  s = &yao_sp[h];
+  memset(s, 0, sizeof(yao_sp_ctx));
+  s->r = r; s->c = c;
+  s->ix = malloc(sizeof(long)*(r+1));
+  cnt   = calloc(r+1, sizeof(long));
+  if ( (s->ix==NULL) || (cnt==NULL) ) { free(s->ix); free(cnt); return (-1); }
+
+  // row counts
+  for ( i=0 ; i<nr ; i++ ) {
+    cnt[i] += ix[i+1]-ix[i];
+    if (sym) for ( j=ix[i] ; j<ix[i+1] ; j++ ) cnt[jx[j]]++;
+  }
+  if (sym) for ( i=0 ; i<r ; i++ ) cnt[i]++;
+  s->ix[0] = 0;
+  for ( i=0 ; i<r ; i++ ) s->ix[i+1] = s->ix[i]+cnt[i];
+
+  s->jx = malloc(sizeof(int)*(s->ix[r]+1));
+  s->xn = malloc(sizeof(float)*(s->ix[r]+1));
+  if (r==c) s->dinv = calloc(r, sizeof(float));
+  s->work = malloc(sizeof(float)*4*r);
+  if ( (s->jx==NULL) || (s->xn==NULL) || (s->work==NULL) || ((r==c) && (s->dinv==NULL)) ) {
+    free(cnt); s->inuse = 1; _yao_sp_free(h); return (-1);
+  }
+
+  // fill (cnt now = next free position of each row)
+  for ( i=0 ; i<r ; i++ ) cnt[i] = s->ix[i];
+  if (sym) {
+    for ( i=0 ; i<r ; i++ ) {
+      s->jx[cnt[i]] = i; s->xn[cnt[i]++] = xd[i];
+    }
+  }
+  for ( i=0 ; i<nr ; i++ ) {
+    for ( j=ix[i] ; j<ix[i+1] ; j++ ) {
+      s->jx[cnt[i]] = jx[j]; s->xn[cnt[i]++] = xn[j];
+      if (sym) { k = jx[j]; s->jx[cnt[k]] = i; s->xn[cnt[k]++] = xn[j]; }
+    }
+  }
+  free(cnt);
+
+  if (s->dinv) {
+    for ( i=0 ; i<r ; i++ ) {
+      for ( j=s->ix[i] ; j<s->ix[i+1] ; j++ ) if (s->jx[j]==i) s->dinv[i] += s->xn[j];
+      s->dinv[i] = (s->dinv[i] != 0.0f)? 1.0f/s->dinv[i]: 1.0f;
+    }
+  }
+  s->inuse = 1;
+  return (h);
+}
+
+static void yao_sp_mv(yao_sp_ctx *s, float *v, float *u)
+{
+  long  i, j;
+  float acc;
+
+  for ( i=0 ; i<s->r ; i++ ) {
+    acc = 0.0f;
+    for ( j=s->ix[i] ; j<s->ix[i+1] ; j++ ) acc += s->xn[j]*v[s->jx[j]];
+    u[i] = acc;
+  }
+}
+
+int _yao_sp_xv(int h, float *v, float *u)
+/* u = A v, the rcoxv/ruoxv of handle h */
+{
+  if ( (h<0) || (h>=YAO_SP_MAX) || (!yao_sp[h].inuse) ) return (-1);
+  yao_sp_mv(&yao_sp[h], v, u);
+  return (0);
+}
+
+int _yao_sp_precond(int   h,
+                    int   a0,    // first unknown of the block (<0: clear all)
+                    int   nact,
+                    int   n,     // grid size
+                    int   *ia,   // grid coordinates
+                    int   *ja,
+                    float *filt) // n*(n/2+1) real, inverse of the block symbol / n^2
+{
+  yao_sp_ctx   *s;
+  yao_sp_block *b;
+  long         nc = (long)n*(n/2+1);
+  int          b0, k;
+
+  if ( (h<0) || (h>=YAO_SP_MAX) || (!yao_sp[h].inuse) ) return (-1);
+  s = &yao_sp[h];
+  if (a0 < 0) {
+    for ( b0=0 ; b0<s->nblk ; b0++ ) {
+      free(s->blk[b0].ia); free(s->blk[b0].ja); free(s->blk[b0].filt);
+    }
+    s->nblk = 0;
+    return (0);
+  }
+  if ( (s->nblk==YAO_SP_MAXBLK) || (s->dinv==NULL) || (a0+nact > s->r) ) return (-1);
+  for ( k=0 ; k<nact ; k++ )
+    if ( (ia[k]<0) || (ja[k]<0) || (ia[k]>=n) || (ja[k]>=n) ) return (-1);
+  b = &s->blk[s->nblk];
+  b->ia   = malloc(sizeof(int)*nact);
+  b->ja   = malloc(sizeof(int)*nact);
+  b->filt = malloc(sizeof(float)*nc);
+  if ( (b->ia==NULL) || (b->ja==NULL) || (b->filt==NULL) ) {
+    free(b->ia); free(b->ja); free(b->filt); return (-1);
+  }
+  memcpy(b->ia, ia, sizeof(int)*nact);
+  memcpy(b->ja, ja, sizeof(int)*nact);
+  memcpy(b->filt, filt, sizeof(float)*nc);
+  b->a0 = a0; b->nact = nact; b->n = n;
+  s->nblk++;
+  return (0);
+}
+
+static int yao_sp_prec(yao_sp_ctx *s, float *r, float *z)
+{
+  yao_sp_block  *b;
+  float         *grid;
+  fftwf_complex *spec;
+  fftwf_plan    pf, pb;
+  long          i, nc;
+  int           bb, k, n;
+
+  for ( i=0 ; i<s->r ; i++ ) z[i] = s->dinv[i]*r[i];
+
+  for ( bb=0 ; bb<s->nblk ; bb++ ) {
+    b  = &s->blk[bb];
+    n  = b->n;
+    nc = (long)n*(n/2+1);
+    grid = yao_fft_workspace(0, 4, sizeof(float) * n * n);
+    spec = yao_fft_workspace(0, 5, sizeof(fftwf_complex) * nc);
+    pf   = yao_fft_plan(n, n, 1, FFTW_FORWARD, YAO_FFT_R2C);
+    pb   = yao_fft_plan(n, n, 1, FFTW_BACKWARD, YAO_FFT_C2R);
+    if ( grid == NULL || spec == NULL || pf == NULL || pb == NULL ) return (-1);
+    memset(grid, 0, sizeof(float) * n * n);
+    for ( k=0 ; k<b->nact ; k++ ) grid[b->ia[k] + (long)b->ja[k]*n] = r[b->a0+k];
+    fftwf_execute_dft_r2c(pf, grid, spec);
+    for ( i=0 ; i<nc ; i++ ) { spec[i][0] *= b->filt[i]; spec[i][1] *= b->filt[i]; }
+    fftwf_execute_dft_c2r(pb, spec, grid);
+    for ( k=0 ; k<b->nact ; k++ ) z[b->a0+k] = grid[b->ia[k] + (long)b->ja[k]*n];
+  }
+  return (0);
+}
+
+int _yao_sp_pcg(int   h,
+                float *b,     // right hand side
+                float *x,     // in: initial guess (warm start), out: solution
+                float tol,    // on |residual|/|b|
+                int   maxit,
+                float *res)   // out: final |residual|/|b|
+/* returns the number of iterations, -1 on error */
+{
+  yao_sp_ctx *s;
+  float      *r, *z, *p, *q;
+  double     bn, rn, rz, rz1, pq, alpha, beta;
+  long       i, nr;
+  int        it;
+
+  if ( (h<0) || (h>=YAO_SP_MAX) || (!yao_sp[h].inuse) ) return (-1);
+  s = &yao_sp[h];
+  if (s->dinv == NULL) return (-1);
+  nr = s->r;
+  r = s->work; z = r+nr; p = z+nr; q = p+nr;
+
+  bn = 0.;
+  for ( i=0 ; i<nr ; i++ ) bn += (double)b[i]*b[i];
+  bn = sqrt(bn);
+  if (bn == 0.) {
+    memset(x, 0, sizeof(float)*nr);
+    *res = 0.0f;
+    return (0);
+  }
+
+  yao_sp_mv(s, x, q);
+  for ( i=0 ; i<nr ; i++ ) r[i] = b[i]-q[i];
+  if (yao_sp_prec(s, r, z)) return (-1);
+  rz = rn = 0.;
+  for ( i=0 ; i<nr ; i++ ) { p[i] = z[i]; rz += (double)r[i]*z[i]; rn += (double)r[i]*r[i]; }
+
+  for ( it=0 ; it<maxit ; it++ ) {
+    if (sqrt(rn) <= tol*bn) break;
+    yao_sp_mv(s, p, q);
+    pq = 0.;
+    for ( i=0 ; i<nr ; i++ ) pq += (double)p[i]*q[i];
+    if (pq <= 0.) break;
+    alpha = rz/pq;
+    rn = 0.;
+    for ( i=0 ; i<nr ; i++ ) {
+      x[i] += alpha*p[i];
+      r[i] -= alpha*q[i];
+      rn   += (double)r[i]*r[i];
+    }
+    if (yao_sp_prec(s, r, z)) return (-1);
+    rz1 = 0.;
+    for ( i=0 ; i<nr ; i++ ) rz1 += (double)r[i]*z[i];
+    beta = rz1/rz;
+    rz   = rz1;
+    for ( i=0 ; i<nr ; i++ ) p[i] = z[i] + beta*p[i];
+  }
+  *res = sqrt(rn)/bn;
+  return (it);
+}
+
 int embed_image(float *inim, // Input (origin) image
    int indx,      // X dim of origin image
    int indy,      // Y dim of origin image
@@ -466,12 +1976,556 @@ int embed_image(float *inim, // Input (origin) image
       outim[ioff+joff] += inim[i-hx+(j-hy)*indx];
     }
   }
-  return 0;
-  
+  return 0;
+  
+}
+
+
+
+/* Per-call data shared by the threads of _shwfs_phase2spots.
+   Everything in here is read-only for the workers, except bimages,
+   in which each worker writes the binned images of its subapertures. */
+typedef struct {
+  float         *pupil, *phase_scaled, *unit_defocus;
+  int           dim;
+  int           *istart, *jstart;
+  int           nsx, nsy, nsubs;
+  long          n, ns;
+  int           nx, nb, nxdiff, dynrange;
+  long          domask;
+  float         *submask, *bsubmask;
+  fftwf_complex *Ker;       // nx*(nx/2+1): hermitian half, as kerfftr/i
+  float         *kerfftr, *kerffti;
+  int           kernconv;
+  int           *binindices;
+  float         *unittip, *unittilt;
+  float         *lgs_prof_amp, *lgs_defocuses;
+  int           n_in_profile;
+  int           *svipc_subok;
+  float         *flux, *rayleighflux, *skyflux;
+  int           rayleighflag;
+  float         *rayleigh;
+  int           bckgrdinit;
+  yao_fft2d     fftps;      // (pruned) subaperture FFT
+  fftwf_plan    fftpx, fftpxi;
+  int           phasor;     // phasor accuracy tier
+  int           nbatch;     // # of subapertures per batch
+  long          nst;        // stride of the batch items in A and result
+  float         *bimages;   // nb*nb*nsubs binned subaperture images (output)
+  int           nthreads;
+  int           debug;
+} shwfs_shared;
+
+/* Per-thread data: the thread scratch buffers and the (debug) timers */
+typedef struct {
+  shwfs_shared  *sh;
+  int           tid;
+  fftwf_complex *A, *result, *Xf;
+  float         *simage, *ximage, *brayleigh, *pprow;
+  int           *sublist, *idxp, *idyp;
+  double        cpu10,cpu21,cpu32,cpu43,cpu54;
+} shwfs_thread;
+
+// number of bytes of thread scratch, sub-buffers aligned on 64 bytes.
+// A and result hold the nitems=nbatch*n_in_profile phasors of a batch,
+// each one also aligned on 64 bytes (stride SHWFS_NST(n) complexes), so
+// that the subaperture plan runs on every item as on the planning arrays:
+#define SHWFS_ALIGN(x) ((((size_t)(x))+63)/64*64)
+#define SHWFS_NST(n)   ((long)(SHWFS_ALIGN((n)*sizeof(fftwf_complex))/sizeof(fftwf_complex)))
+
+static size_t shwfs_thread_bytes(long n, int nx, int nb, int nbatch, int nitems)
+{
+  return 2*SHWFS_ALIGN(nitems*SHWFS_NST(n)*sizeof(fftwf_complex)) +
+         SHWFS_ALIGN(nx*(nx/2+1)*sizeof(fftwf_complex)) +
+         2*SHWFS_ALIGN(n*sizeof(float)) + SHWFS_ALIGN(nx*nx*sizeof(float)) +
+         SHWFS_ALIGN(nb*nb*sizeof(float)) + SHWFS_ALIGN(nbatch*sizeof(int)) +
+         2*SHWFS_ALIGN(nitems*sizeof(int));
+}
+
+static void shwfs_thread_buffers(shwfs_thread *th, char *ws, long n, int nx, int nb,
+                                 int nbatch, int nitems)
+{
+  th->A         = (void *)ws; ws += SHWFS_ALIGN(nitems*SHWFS_NST(n)*sizeof(fftwf_complex));
+  th->result    = (void *)ws; ws += SHWFS_ALIGN(nitems*SHWFS_NST(n)*sizeof(fftwf_complex));
+  th->Xf        = (void *)ws; ws += SHWFS_ALIGN(nx*(nx/2+1)*sizeof(fftwf_complex));
+  th->simage    = (void *)ws; ws += SHWFS_ALIGN(n*sizeof(float));
+  th->pprow     = (void *)ws; ws += SHWFS_ALIGN(n*sizeof(float));
+  th->ximage    = (void *)ws; ws += SHWFS_ALIGN(nx*nx*sizeof(float));
+  th->brayleigh = (void *)ws; ws += SHWFS_ALIGN(nb*nb*sizeof(float));
+  th->sublist   = (void *)ws; ws += SHWFS_ALIGN(nbatch*sizeof(int));
+  th->idxp      = (void *)ws; ws += SHWFS_ALIGN(nitems*sizeof(int));
+  th->idyp      = (void *)ws;
+}
+
+/* Fills A with the complex wavefront of subaperture l, at lgs profile
+   altitude nalt. Returns in *idxp, *idyp the (small) pixel shift to apply
+   to the spot when embedding it in ximage (dynrange). */
+static void shwfs_phasor(shwfs_thread *th, int l, int nalt, fftwf_complex *A,
+                         int *idxp, int *idyp)
+{
+  shwfs_shared  *sh = th->sh;
+  float         *pupil = sh->pupil, *phase_scaled = sh->phase_scaled;
+  float         *unit_defocus = sh->unit_defocus;
+  float         *unittip = sh->unittip, *unittilt = sh->unittilt;
+  float         *pprow = th->pprow;
+  float         *ptr;
+  float         dx,dxp,dy,dyp;
+  float         lgsdef;
+  long          n = sh->n, ns = sh->ns;
+  int           dim = sh->dim, nsx = sh->nsx, nsy = sh->nsy;
+  int           dynrange = sh->dynrange, debug = sh->debug;
+  int           i,j,k,koff,kk,ndx,ndy;
+  double        sys,cpu0,cpu1,cpu2;
+  const float   pi = 3.141592653589793f;
+  const float   twopi = 2*pi;
+
+  lgsdef = sh->lgs_defocuses[nalt];
+
+  cpu0  = p_cpu_secs(&sys);
+
+  // reset A
+  ptr = (void *)A;
+  for ( i=0; i<n ; i++ ) { *(ptr)   = 0.0f; *(ptr+1) = 0.0f; ptr +=2; }
+
+  // indice offset of phaselet in phase/pupil array
+  koff = sh->istart[l] + sh->jstart[l]*dim;
+
+  // START section to allow larger dynamical range by
+  // subtracting a tilt to the phase and moving later on
+  // the image in the big image
+  // (declarations on top of function)
+  if (dynrange) {
+    // compute approximate average slope over the subaperture
+    // it doesn't matter if this is not the exact value
+    // as it only serves to determine if we should offset,
+    // but the end result should be the same. Because of edge subapertures,
+    // we'll have to do the whole average gradient calculation
+    dx = 0.0f; dy = 0.0f;
+    ndx = 0; ndy = 0;
+    for ( j=0; j<(nsy-1); j++ ) {
+      for ( i=0; i<(nsx-1) ; i++ ) {
+        k = koff + i + j*dim;
+        if ( pupil[k] && pupil[k+1] ) {
+          dx +=            phase_scaled[k+1] - phase_scaled[k] + \
+                  lgsdef*( unit_defocus[k+1] - unit_defocus[k] );
+          ndx++;
+        }
+        if ( pupil[k] && pupil[k+dim] ) {
+          dy +=            phase_scaled[k+dim] - phase_scaled[k] + \
+                  lgsdef*( unit_defocus[k+dim] - unit_defocus[k] );
+          ndy++;
+        }
+      }
+    }
+    if (ndx) dx = dx / (float)(ndx); // in radian/pixel
+    if (ndy) dy = dy / (float)(ndy);
+    // now we need to transform this average phase gradient into
+    // pixel motion.
+    // So how many small pixels we expect the spot to move?
+    // if dx = 2*pi, the spot will wrap all the way back to center,
+    // i.e. will move by ns pixels:
+    dxp = dx / twopi * (float)(ns);
+    dyp = dy / twopi * (float)(ns);
+    // round to the nearest (small) pixel: 
+    *idxp = lroundf(dxp);
+    *idyp = lroundf(dyp);
+    if (*idxp!=0) dx = dx * (float)(*idxp) / dxp; else dx = 0.0f;
+    if (*idyp!=0) dy = dy * (float)(*idyp) / dyp; else dy = 0.0f;
+     if ((debug>1)&&((*idxp!=0)||(*idyp!=0))) printf("idxp = %d, idyp = %d, dx=%f, dy=%f\n",*idxp,*idyp,dx,dy);
+  } else {
+    dx = 0.0f; dy = 0.0f; 
+    *idxp = 0; *idyp = 0;
+  }
+  // END section to allow larger dynamical range
+  // (more below to add to phase and to shift imagelets)
+
+  cpu1  = p_cpu_secs(&sys);
+  th->cpu10 += cpu1-cpu0;
+
+  // fill in the complex wavefront array for this subaperture, row by row
+  // (cos & sin are very costly, see yao_phasor() for the accuracy tiers):
+  if (dynrange) {
+    
+    if (debug>1) printf("here, dynrange enabled\n");
+    for ( j=0; j<nsy ; j++ ) {
+      for ( i=0; i<nsx ; i++ ) {
+        k = koff + i + j*dim;
+        kk = i + j*nsx;
+        pprow[i] = phase_scaled[k] + lgsdef * unit_defocus[k] \
+                     - dx * unittip[kk] - dy * unittilt[kk];
+      }
+      yao_phasor(A+j*ns, pupil+koff+j*dim, pprow, NULL, 1.0f, nsx, sh->phasor);
+    }
+
+  } else {
+
+    if (debug>1) printf("here, dynrange disabled\n");
+    for ( j=0; j<nsy ; j++ ) {
+      yao_phasor(A+j*ns, pupil+koff+j*dim, phase_scaled+koff+j*dim, NULL, 1.0f, \
+                 nsx, sh->phasor);
+    }
+
+  }
+
+  if (debug>1) printf("here3\n");
+
+  cpu2  = p_cpu_secs(&sys);
+  th->cpu21 += cpu2-cpu1;
+}
+
+/* Goes from ximage (the extended field of view image of subaperture l,
+   all lgs profile altitudes embedded) to the binned, flux normalized
+   image in sh->bimages, adding sky and rayleigh. */
+static void shwfs_finish(shwfs_thread *th, int l)
+{
+  shwfs_shared  *sh = th->sh;
+  fftwf_complex *Xf = th->Xf;
+  float         *simage = th->simage, *ximage = th->ximage;
+  float         *brayleigh = th->brayleigh;
+  float         *bimage;
+  float         *kerfftr = sh->kerfftr, *kerffti = sh->kerffti;
+  float         *submask = sh->submask, *bsubmask = sh->bsubmask;
+  int           *binindices = sh->binindices;
+  float         *ptr,*ptr1,*kr,*ki;
+  float         tot, totrayleigh, krp, kip, xr, xi, sky;
+  long          ns = sh->ns;
+  int           nx = sh->nx, nb = sh->nb, nh = sh->nx*(sh->nx/2+1);
+  int           debug = sh->debug;
+  int           i;
+  double        sys,cpu3,cpu4,cpu5;
+
+  bimage = sh->bimages + l*nb*nb;
+
+  cpu3  = p_cpu_secs(&sys);
+
+  if ( (debug>1) && (l==10) ) printf("here4\n");
+
+  if ((debug>10)&&(l==10)) {
+    FILE *fp;
+    fp=fopen("xim-pre.dat", "w");
+    fprintf(fp, "%d\n",(int)nx);
+    for ( i=0 ; i<nx*nx ; i++ ) fprintf(fp, "%f\n",ximage[i]);
+    fclose(fp);
+  }
+  
+  // Carry out convolution by kernel if required
+  // (ximage is real: r2c/c2r transforms, only the hermitian half
+  // nh = nx*(nx/2+1) of the spectra is computed and stored)
+  if (sh->kernconv == 1) {
+    // Transform ximage
+    fftwf_execute_dft_r2c(sh->fftpx, ximage, Xf);
+
+    // multiply by kernel transform:
+    ptr  = (void *)sh->Ker;
+    ptr1 = (void *)Xf;
+    kr   = kerfftr + l*nh;
+    ki   = kerffti + l*nh;
+    for ( i=0 ; i<nh ; i++ ) {
+      // this is FFT(kernel) * FFT(kernelS)
+      krp = *(ptr)*kr[i] - *(ptr+1)*ki[i];
+      kip = *(ptr)*ki[i] + *(ptr+1)*kr[i];
+      // and next we multiply by FFT(image):
+      xr  = *(ptr1);
+      xi  = *(ptr1+1);
+      *(ptr1)   = xr*krp - xi*kip;
+      *(ptr1+1) = xi*krp + xr*kip;
+      ptr +=2; ptr1 +=2;
+    }
+    // Transform back (destroys Xf):
+    fftwf_execute_dft_c2r(sh->fftpxi, Xf, ximage);
+
+    // the convolution of positive images is positive, up to rounding
+    // (this was the modulus of the complex result):
+    for ( i=0 ; i<nx*nx ; i++ ) ximage[i] = fabsf(ximage[i]);
+  }
+
+  cpu4  = p_cpu_secs(&sys);
+  th->cpu43 += cpu4-cpu3;
+
+  // FLUX NORMALIZATION FOR STAR. Has to be done *before* applying fieldstop
+  // will be used a bit below
+  // LGS FIXME FIXME FIXME: flux totally screwed up w/ new lgs_prof_amp!
+  tot = 0.0f;
+  for ( i=0 ; i<nx*nx ; i++ ) tot += ximage[i];
+    
+  // APPLY FIELD STOP / AMPLITUDE MASK
+  // For instance to take into account the central dark spot of STRAP,
+  // or more generally a field stop
+  if (sh->domask == 1) {
+    for ( i=0 ; i<nx*nx ; i++ ) {
+      ximage[i] = ximage[i] * submask[i];
+    }
+  }
+
+  // IF BACKGROUND CALIBRATION, NULL STAR SIGNAL
+  if (sh->bckgrdinit) {
+    for ( i=0 ; i<nx*nx ; i++ ) ximage[i] = 0.0f;
+  }
+
+  // PUT THIS SUBAPERTURE'S XIMAGE INTO BIMAGE (binned image)
+  for ( i=0 ; i<nb*nb ; i++ ) { bimage[i] = 0.0f; }
+
+  for ( i=0 ; i<nx*nx ; i++ ) {
+    if (binindices[i]<0) continue;
+    bimage[binindices[i]] += ximage[i];
+  }
+
+  if ((debug>10)&&(l==10)) {
+    FILE *fp;
+    fp=fopen("sim.dat", "w");
+    fprintf(fp, "%d\n",(int)ns);
+    for ( i=0 ; i<ns*ns ; i++ ) fprintf(fp, "%f\n",simage[i]);
+    fclose(fp);
+    fp=fopen("xim.dat", "w");
+    fprintf(fp, "%d\n",nx);
+    for ( i=0 ; i<nx*nx ; i++ ) fprintf(fp, "%f\n",ximage[i]);
+    fclose(fp);
+    fp=fopen("bim.dat", "w");
+    fprintf(fp, "%d\n",nb);
+    for ( i=0 ; i<nb*nb ; i++ ) fprintf(fp, "%f\n",bimage[i]);
+    fclose(fp);
+    fp=fopen("kre.dat", "w");
+    fprintf(fp, "%d\n",nx/2+1);
+    ptr  = (void *)sh->Ker;
+    for ( i=0 ; i<nh ; i++ ) { fprintf(fp, "%f\n",*ptr); ptr+=2; }
+    fclose(fp);
+    fp=fopen("kim.dat", "w");
+    fprintf(fp, "%d\n",nx/2+1);
+    ptr  = (void *)sh->Ker; ptr++;
+    for ( i=0 ; i<nh ; i++ ) { fprintf(fp, "%f\n",*ptr); ptr+=2; }
+    fclose(fp);
+  }
+
+  // NORMALIZE FLUX FOR STAR
+  if (tot>0.0f) {
+    tot = sh->flux[l]/tot;
+    for ( i=0 ; i<nb*nb ; i++ ) { bimage[i] = bimage[i]*tot; }
+  }
+  
+  // COMPUTE RAYLEIGH BACKGROUND
+  // I have to do this after the convolution because otherwise there is a lot
+  // of wrapping/ringing. I could do it once the image is binned. Saved for future
+  // upgrade (will save a bit of time).
+  for ( i=0 ; i<nb*nb ; i++ ) { brayleigh[i] = 0.0f; }
+  if (sh->rayleighflag==1) {
+    for ( i=0 ; i<nx*nx ; i++ ) {
+      if (binindices[i]>=0) {
+        brayleigh[binindices[i]] += sh->rayleigh[i+l*nx*nx];
+      }
+    }
+    // NORMALIZE FLUX FOR RAYLEIGH
+    if (debug) printf("here4-1\n");
+    totrayleigh = 0.0f;
+    for ( i=0 ; i<nb*nb ; i++ ) { totrayleigh += brayleigh[i]; }
+    if (debug) printf("l=%d, totrayleigh=%f\n",l,totrayleigh);
+
+    if (totrayleigh > 0.0f) {
+      totrayleigh = sh->rayleighflux[l]/totrayleigh;
+      for ( i = 0; i < nb*nb; i++ ) brayleigh[i] = brayleigh[i]*totrayleigh;
+    }
+    if (debug) printf("here4-2\n");
+  }
+
+  // NORMALIZE FLUX FOR SKY
+  //    sky = skyflux[l] / (float)(nb);  // sky per rebinned pixel, e-/frame
+  sky = sh->skyflux[l];  // sky per rebinned pixel, e-/frame
+
+  if (debug) printf("here4-3\n");
+  for ( i=0 ; i<nb*nb ; i++ ) { 
+    // bimage[i] += darkcurrent; // nope. has to be added only once/pixel!
+    bimage[i] += ( sky + brayleigh[i] ) * bsubmask[i]; 
+  }
+  if (debug) printf("here4-4\n");
+  
+  cpu5  = p_cpu_secs(&sys);
+  th->cpu54 += cpu5-cpu4;
+}
+
+/* Computes the binned image of subapertures tid, tid+nthreads, ...
+   and stores them in sh->bimages. See _shwfs_phase2spots() below.
+   Can be called directly (tid=0, nthreads=1) or as a pthread.
+   The subapertures are processed by batches of sh->nbatch: the phasors
+   of all subapertures (and lgs profile altitudes) of a batch are stacked
+   in A, each is transformed with the single subaperture plan sh->fftps
+   (so that the spots are bit identical to the unbatched ones), then each
+   subaperture is finished in turn. */
+static void *_shwfs_subaps(void *arg)
+{
+  shwfs_thread  *th = arg;
+  shwfs_shared  *sh = th->sh;
+  fftwf_complex *A = th->A, *result = th->result;
+  float         *simage = th->simage, *ximage = th->ximage;
+  float         *ptr;
+  float         lgsamp;
+  long          n = sh->n, ns = sh->ns, nst = sh->nst;
+  int           nx = sh->nx, nxdiff = sh->nxdiff;
+  int           nprof = sh->n_in_profile, debug = sh->debug;
+  int           i,l,c,nl,it,nitems,nalt,sub;
+  double        sys,cpu2,cpu3;
+
+  //=====================
+  // LOOP ON SUBAPERTURES
+  //=====================
+  l = th->tid;
+  while ( l<sh->nsubs ) {
+
+    // gather the next batch of subapertures. The ones skipped by svipc
+    // do not need the FFT and are finished right away (empty ximage)
+    nl = 0;
+    while ( (l<sh->nsubs) && (nl<sh->nbatch) ) {
+      if ( sh->svipc_subok[l]==0 ) {
+        for ( i=0 ; i<nx*nx ; i++ ) ximage[i] = 0.0f;
+        shwfs_finish(th, l);
+      } else th->sublist[nl++] = l;
+      l += sh->nthreads;
+    }
+    if (nl==0) continue;
+    
+    //====================
+    // LOOP ON LGS PROFILE    
+    //====================
+    // fill in the phasors of the batch:
+    nitems = nl*nprof;
+    for ( c=0 ; c<nl ; c++ ) {
+      for ( nalt=0; nalt<nprof ; nalt++ ) {
+        it = c*nprof+nalt;
+        shwfs_phasor(th, th->sublist[c], nalt, A+it*nst, &th->idxp[it], &th->idyp[it]);
+      }
+    }
+    cpu2  = p_cpu_secs(&sys);
+
+    // Carry out the Forward 2d FFT transforms of the batch
+    for ( it=0 ; it<nitems ; it++ ) \
+      yao_fft2d_execute(&sh->fftps, A+it*nst, result+it*nst); // A -> result
+    // at this point result should contain the diffraction
+    // of the subaperture + turbulence, but not kernel yet
+
+    cpu3  = p_cpu_secs(&sys);
+    th->cpu32 += cpu3-cpu2;
+
+    for ( c=0 ; c<nl ; c++ ) {
+
+      sub = th->sublist[c];
+
+      // zero out ximage:
+      for ( i=0 ; i<nx*nx ; i++ ) ximage[i] = 0.0f;
+
+      for ( nalt=0; nalt<nprof ; nalt++ ) {
+
+        it = c*nprof+nalt;
+        lgsamp = sh->lgs_prof_amp[nalt];
+        if ( nprof==1 ) lgsamp = 1.0f;
+
+        // compute image from complex image object:
+        ptr = (void *)(result+it*nst);
+        for ( i=0; i<n; i++ ) {
+          simage[i] = (*(ptr) * *(ptr) + *(ptr+1) * *(ptr+1) );
+          simage[i] *= lgsamp;
+          if ( (debug>20) && ( sub==10 ) ) printf("%f ",simage[i]);
+          ptr +=2;
+        }
+      
+        if ( (debug>1) && ( sub==10 ) ) printf(" ");
+
+        // Embed (and add to) this simage into ximage, the extended field 
+        // of view image for this subaperture (with shifts computed above):
+        if ( (debug>1) && (sub==10) ) printf("\nns=%d nx=%d\n",(int)ns,(int)nx);
+        embed_image(simage,ns,ns,ximage,nx,nx,(nx-ns)/2+th->idxp[it]-nxdiff, \
+                    (nx-ns)/2+th->idyp[it]-nxdiff,1);
+      } // END LOOP ON LGS PROFILE
+
+      shwfs_finish(th, sub);
+    }
+
+  }  // END LOOP ON SUBAPERTURES
+
+  return NULL;
+}
+
+
+/* Fast lgs elongation (wfs.lgs_fast): rather than one FFT per lgs profile
+   altitude, the spot is computed once (at the profile focus) and convolved
+   by the geometric elongation of the subaperture. Each altitude shifts the
+   spot by its defocus times the average slope of unit_defocus over the
+   subaperture (as in the dynrange estimate of shwfs_phasor), so the
+   transfer function is a weighted sum of phase ramps. It multiplies, in
+   place, the hermitian half spectrum kr + i*ki of the subaperture kernel.
+   The defocus blur within the subaperture is neglected.
+   ws is scratch for 2*(nx+1)*(nx/2+2) doubles. */
+static void shwfs_lgs_transfer(float *kr, float *ki, int nx, long ns,
+   float *pupil, float *unit_defocus, int dim, int koff, int nsx, int nsy,
+   float *lgs_prof_amp, float *lgs_defocuses, int n_in_profile, double *ws)
+{
+  int     nhx = nx/2+1;
+  double  *tf = ws, *ex = ws+2*nhx*nx, *ey = ex+2*nhx;
+  double  gx, gy, sx, sy, a, atot, ph, re, im;
+  int     i, j, k, ky, kp, ngx, ngy;
+  const double twopi = 2*M_PI;
+
+  // average slope of unit_defocus over the subaperture (rad/pixel)
+  gx = 0.; gy = 0.;
+  ngx = 0; ngy = 0;
+  for ( j=0; j<(nsy-1); j++ ) {
+    for ( i=0; i<(nsx-1) ; i++ ) {
+      k = koff + i + j*dim;
+      if ( pupil[k] && pupil[k+1] ) {
+        gx += unit_defocus[k+1] - unit_defocus[k];
+        ngx++;
+      }
+      if ( pupil[k] && pupil[k+dim] ) {
+        gy += unit_defocus[k+dim] - unit_defocus[k];
+        ngy++;
+      }
+    }
+  }
+  if (ngx) gx = gx / ngx;
+  if (ngy) gy = gy / ngy;
+  // spot motion per unit defocus, in (small) pixels:
+  gx = gx / twopi * ns;
+  gy = gy / twopi * ns;
+
+  for ( i=0 ; i<2*nhx*nx ; i++ ) tf[i] = 0.;
+  atot = 0.;
+  for ( kp=0 ; kp<n_in_profile ; kp++ ) {
+    a = lgs_prof_amp[kp];
+    if (a == 0.) continue;
+    atot += a;
+    sx = lgs_defocuses[kp] * gx;
+    sy = lgs_defocuses[kp] * gy;
+    // separable ramps. At the Nyquist frequency the shift of a real
+    // image is the average of the two opposite ramps, i.e. a cosine:
+    for ( i=0 ; i<nhx ; i++ ) {
+      if ( 2*i == nx ) { ex[2*i] = cos(M_PI*sx); ex[2*i+1] = 0.; continue; }
+      ph = -twopi * i * sx / nx;
+      ex[2*i] = cos(ph); ex[2*i+1] = sin(ph);
+    }
+    for ( j=0 ; j<nx ; j++ ) {
+      if ( 2*j == nx ) { ey[2*j] = cos(M_PI*sy); ey[2*j+1] = 0.; continue; }
+      ky = ( 2*j < nx )? j : j-nx;
+      ph = -twopi * ky * sy / nx;
+      ey[2*j] = cos(ph); ey[2*j+1] = sin(ph);
+    }
+    for ( j=0 ; j<nx ; j++ ) {
+      for ( i=0 ; i<nhx ; i++ ) {
+        k = i + j*nhx;
+        tf[2*k]   += a * ( ex[2*i]*ey[2*j]   - ex[2*i+1]*ey[2*j+1] );
+        tf[2*k+1] += a * ( ex[2*i]*ey[2*j+1] + ex[2*i+1]*ey[2*j]   );
+      }
+    }
+  }
+  if (atot <= 0.) return;
+
+  // normalized to unit flux, times the kernel:
+  for ( k=0 ; k<nhx*nx ; k++ ) {
+    re = tf[2*k] / atot;
+    im = tf[2*k+1] / atot;
+    a  = kr[k];
+    kr[k] = (float)( a*re - ki[k]*im );
+    ki[k] = (float)( a*im + ki[k]*re );
+  }
 }
 
 
-
 /* Shack- Hartmann coded in C
    pass one phase array and a set of indices (start and end of each subapertures)
    then this routine puts the phase sections in one larger phase and does a serie
@@ -488,7 +2542,12 @@ int embed_image(float *inim, // Input (origin) image
    to made up for the missing eclat at previous step).
    - compute X and Y centroids
    - optionaly stuff this image in a larger image (fimage) for display
-   - free memory
+   The loop on subapertures can be split over several threads
+   (wfs.nthreads), each with its own A, result, simage, ximage... buffers.
+   Within a thread, the subapertures can be done by batches of
+   nbatch (wfs.fftbatch): all the phasors, then all the FFTs (each with
+   the single subaperture plan), then all the spots.
+   The binned images are then stuffed in fimage, in subaperture order.
 
    The array used in here are:
 
@@ -536,7 +2595,7 @@ int _shwfs_phase2spots(
    float *kernels,      // to convolve the (s)image with, one per subaperture
                         // dimension: 2^sdimpow2 * 2 * nsubs. FFTs precomputed
                         // at init call.
-   float *kerfftr,      // real part of kernels FFT. dim: same as kernels
+   float *kerfftr,      // real part of kernels r2c FFT. dim: nx*(nx/2+1)*nsubs
    float *kerffti,      // imaginary part of kernels FFT. same dim as kerfftr
    int   initkernels,   // init kernels: pre-compute FFTs
    int   kernconv,      // convolve with kernel?
@@ -552,6 +2611,8 @@ int _shwfs_phase2spots(
    float *lgs_prof_amp, // vector of lgs profile amplitudes
    float *lgs_defocuses,// vector of lgs profile altitudes
    int   n_in_profile,  // dimension of lgs_prof_amp and lgs_prof_alt
+   int   lgs_fast,      // lgs elongation as a per-subap transfer function (wfs.lgs_fast).
+                        // Folded in kerfftr/i, i.e. requires initkernels when changed
    float *unit_defocus,  // as it says, same dimsof as phase
    float *fimage,       // final image with spots
    int   *svipc_subok,  // to skip (0) subap for svipc partial spot comput.
@@ -572,36 +2633,38 @@ int _shwfs_phase2spots(
    int   bckgrdinit,    // init background processing. fill bckgrdcalib
    
    int   counter,       // current counter (in number of cycles)
-   int   niter)         // total # of cycles over which to integrate
+   int   niter,         // total # of cycles over which to integrate
+   int   nbatch,        // # of subapertures per batched FFT (wfs.fftbatch)
+   int   nthreads,      // # of threads to split the subapertures over (wfs.nthreads)
+   int   fftctx)        // fft workspace context for this wfs (wfs._fftctx)
            
 {
   /* Declarations */
 
-  fftwf_complex *A, *result, *Ax, *Kx, *Ker, *resultx;
-  fftwf_plan    fftps,fftpx,fftpxi;
+  fftwf_complex *Kx, *Ker, *resultx;
+  float         *Rx;
+  fftwf_plan    fftpx,fftpxi;
   float         *ptr,*ptr1,*ptr2;
   float         *phase_scaled;
-  float         *simage;
-  float         *bimage;
-  float         *ximage; // extended image for one subap, un-rebinned
   float         *bsubmask;
-  float         *brayleigh;
-  float         tot, totrayleigh, krp, kip, sky;
+  float         *bimages; // binned images of all subapertures
   float         corfact;
-  float         dx,dxp,dy,dyp;
-  float         lgsdef,lgsamp,pp,ppsin,ppcos;
   long          log2nr, log2nc, n, ns;
-  int           i,j,k,l,koff,kk,nalt;
-  int           idxp,idyp,ndx,ndy,dynrange;
+  int           i,j,k,l,koff,t;
+  int           dynrange;
   int           debug=0;
-  int           nxdiff;
-  double        sys,cpu0,cpu1,cpu2,cpu3,cpu4,cpu5,cpu6;
+  int           nxdiff, nh, nprof;
+  float         nodefocus = 0.0f;
+  double        *lgsws;
+  double        sys,cpu5,cpu6;
   double        cpu10,cpu21,cpu32,cpu43,cpu54,cpu65;
-  const float   pi = 3.141592653589793f;
-  const float   twopi = 2*pi;
+  shwfs_shared  sh;
+  shwfs_thread  th[YAO_FFT_MAXTHREADS];
+  pthread_t     thid[YAO_FFT_MAXTHREADS];
+  int           thok[YAO_FFT_MAXTHREADS];
+  char          *ws;
   
   cpu10=0.0;cpu21=0.0;cpu32=0.0;cpu43=0.0;cpu54=0.0;cpu65=0.0;
-  cpu0=0.0;cpu1=0.0;cpu2=0.0;cpu3=0.0;cpu4=0.0;cpu5=0.0;cpu6=0.0;
   
   //======================
   // Global setup for FFTs:
@@ -618,30 +2681,60 @@ int _shwfs_phase2spots(
   // enlarge dynamical range?
   if (nx==ns) dynrange=0; else dynrange=1;
 
+  // kernel spectra are hermitian: only nx*(nx/2+1) complex are kept
+  nh     = nx*(nx/2+1);
+
+  // fast lgs elongation: the profile goes in the subaperture kernels
+  // (see shwfs_lgs_transfer) and the spots are computed at focus only
+  if (n_in_profile < 2) lgs_fast = 0;
+  if (lgs_fast) kernconv = 1;
+  nprof = (lgs_fast)? 1 : n_in_profile;
+
+  // no point having more threads than subapertures
+  if (nthreads > nsubs) nthreads = nsubs;
+  if (nthreads > YAO_FFT_MAXTHREADS) nthreads = YAO_FFT_MAXTHREADS;
+  if (nthreads < 1) nthreads = 1;
+
+  // nor more subapertures per batch than each thread gets:
+  if (nbatch > (nsubs+nthreads-1)/nthreads) nbatch = (nsubs+nthreads-1)/nthreads;
+  if (nbatch < 1) nbatch = 1;
+
   // integrate = 1; // force to pass by the end (subap overlap upgrade)
   // if (niter > 1) {integrate = 1;}  // we are in "integrating mode"
 
   if (debug>1) printf("here1 nx=%d ns=%d dynrange=%d\n",(int)nx,(int)ns,(int)dynrange);
 
-  // Allocate memory for the input operands and check its availability.
-  A            = fftwf_malloc ( n * sizeof ( fftwf_complex ) );
-  result       = fftwf_malloc ( n * sizeof ( fftwf_complex ) );
-  Ax           = fftwf_malloc ( nx *nx * sizeof ( fftwf_complex ) );
-  Kx           = fftwf_malloc ( nx *nx * sizeof ( fftwf_complex ) );
-  Ker          = fftwf_malloc ( nx *nx * sizeof ( fftwf_complex ) );
-  resultx      = fftwf_malloc ( nx *nx * sizeof ( fftwf_complex ) );
-  phase_scaled = ( float* ) malloc ( dim * dim * sizeof ( float ) );
-  simage       = ( float* ) malloc ( ns * ns * sizeof ( float ) );
-  ximage       = ( float* ) malloc ( nx * nx * sizeof ( float ) );
-  bimage       = ( float* ) malloc ( nb * nb * sizeof ( float ) );
-  brayleigh    = ( float* ) malloc ( nb * nb * sizeof ( float ) );
-  bsubmask     = ( float* ) malloc ( nb * nb * sizeof ( float ) );
-  
+  // Get the workspace for the input operands and check its availability.
+  // These are kept from one call to the next in this wfs context.
+  Rx           = yao_fft_workspace ( fftctx, 2, nx *nx * sizeof ( float ) );
+  Kx           = yao_fft_workspace ( fftctx, 3, nh * sizeof ( fftwf_complex ) );
+  Ker          = yao_fft_workspace ( fftctx, 4, nh * sizeof ( fftwf_complex ) );
+  resultx      = yao_fft_workspace ( fftctx, 5, nh * sizeof ( fftwf_complex ) );
+  phase_scaled = yao_fft_workspace ( fftctx, 6, dim * dim * sizeof ( float ) );
+  bimages      = yao_fft_workspace ( fftctx, 7, nsubs * nb * nb * sizeof ( float ) );
+  bsubmask     = yao_fft_workspace ( fftctx, 11, nb * nb * sizeof ( float ) );
   
-  if ( A == NULL || result == NULL || Ax == NULL || \
-       Kx == NULL || Ker == NULL || resultx == NULL || phase_scaled == NULL || 
-       bimage == NULL || simage == NULL || ximage == NULL || 
-       brayleigh == NULL || bsubmask == NULL ) { return (1); }
+  if ( Rx == NULL || Kx == NULL || Ker == NULL || resultx == NULL || \
+       phase_scaled == NULL || bimages == NULL || bsubmask == NULL ) { return (1); }
+
+  // and the scratch buffers of each thread (A, result, simage, ximage...):
+  for ( t=0 ; t<nthreads ; t++ ) {
+    ws = yao_fft_workspace ( fftctx, YAO_FFT_THREADSLOT+t, \
+                shwfs_thread_bytes(n,nx,nb,nbatch,nbatch*nprof) );
+    if ( ws == NULL ) { return (1); }
+    shwfs_thread_buffers(&th[t], ws, n, nx, nb, nbatch, nbatch*nprof);
+    th[t].sh  = &sh;
+    th[t].tid = t;
+    th[t].cpu10=0.0;th[t].cpu21=0.0;th[t].cpu32=0.0;th[t].cpu43=0.0;th[t].cpu54=0.0;
+  }
+
+  // Get the (cached) plans.
+  // The phasors only fill the first nsy rows and nsx columns of A
+  if ( yao_fft2d_init(&sh.fftps, ns, 0, nsy, nsx, 1, FFTW_FORWARD) ) { return (1); }
+  fftpx  = yao_fft_plan(nx, nx, 1, FFTW_FORWARD, YAO_FFT_R2C);
+  fftpxi = yao_fft_plan(nx, nx, 1, FFTW_BACKWARD, YAO_FFT_C2R);
+
+  if ( fftpx == NULL || fftpxi == NULL ) { return (1); }
 
   //Zero out final image if first iteration
   if (counter == 1) {
@@ -680,28 +2773,29 @@ int _shwfs_phase2spots(
   // do that for first row only:
   for (i=0;i<nx;i++) if (binindices[i]==-1) nxdiff++;
   
-  // Set up the required memory for the FFT routines and 
-  // check its availability.
-  fftpx = fftwf_plan_dft_2d(nx, nx, Ax, Kx, FFTW_FORWARD, FFTWOPTMODE);
-
   if (initkernels == 1) {
     // Transform kernels, store and return for future use
+    // (hermitian half only: kerfftr and kerffti are nh*nsubs)
     for ( l=0 ; l<nsubs ; l++ ) {
-      ptr = (void *)Ax;
-      for ( i=0 ; i<nx*nx ; i++ ) {
-        *(ptr) = kernels[i+l*nx*nx];
-        *(ptr+1) = 0.0f;
-        ptr += 2;
-      }
-      fftwf_execute(fftpx);
+      for ( i=0 ; i<nx*nx ; i++ ) Rx[i] = kernels[i+l*nx*nx];
+      fftwf_execute_dft_r2c(fftpx, Rx, Kx);
 
       ptr = (void *)Kx;
-      for ( i=0 ; i<nx*nx ; i++ ) {
-        kerfftr[i+l*nx*nx] = *(ptr);
-        kerffti[i+l*nx*nx] = *(ptr+1);
+      for ( i=0 ; i<nh ; i++ ) {
+        kerfftr[i+l*nh] = *(ptr);
+        kerffti[i+l*nh] = *(ptr+1);
         ptr += 2;
       }
     }
+    if (lgs_fast) {
+      lgsws = yao_fft_workspace ( fftctx, 8, 2*(nx+1)*(nx/2+2)*sizeof(double) );
+      if ( lgsws == NULL ) { return (1); }
+      for ( l=0 ; l<nsubs ; l++ ) {
+        shwfs_lgs_transfer(kerfftr+l*nh, kerffti+l*nh, nx, ns, pupil,
+                           unit_defocus, dim, istart[l]+jstart[l]*dim, nsx, nsy,
+                           lgs_prof_amp, lgs_defocuses, n_in_profile, lgsws);
+      }
+    }
   }
 
   if (debug>1) printf("here2\n");
@@ -710,7 +2804,7 @@ int _shwfs_phase2spots(
     // init resultx to (1,0)
     // we're starting from a non-filter.
     ptr = (void *)resultx;
-    for ( i=0; i<nx*nx ; i++ ) {
+    for ( i=0; i<nh ; i++ ) {
       *(ptr) = 1.0f;
       *(ptr+1) = 0.0f;
       ptr += 2;
@@ -721,19 +2815,14 @@ int _shwfs_phase2spots(
     for ( k=0 ; k<nkernels ; k++ ) {
       koff = k*nx*nx;
       // Transform kernel
-      ptr = (void *)Ax;
-      for ( i=koff; i<koff+nx*nx; i++ ) {
-        *(ptr)   = kernel[i];
-        *(ptr+1) = 0.0f;
-        ptr +=2;
-      }
-      fftwf_execute(fftpx); // Ax -> Kx
+      for ( i=0; i<nx*nx; i++ ) Rx[i] = kernel[koff+i];
+      fftwf_execute_dft_r2c(fftpx, Rx, Kx); // Rx -> Kx
       // result in in Kx
       // Kx * resultx -> Ker:
       ptr1 = (void *)Kx;
       ptr2 = (void *)resultx;
       ptr = (void *)Ker;
-      for ( i=0; i<nx*nx; i++ ) {
+      for ( i=0; i<nh; i++ ) {
         *(ptr)     = *(ptr1) * *(ptr2) - *(ptr1+1) * *(ptr2+1);
         *(ptr+1)   = *(ptr1) * *(ptr2+1) + *(ptr1+1) * *(ptr2);
         ptr +=2; ptr1 +=2; ptr2 +=2;
@@ -742,331 +2831,94 @@ int _shwfs_phase2spots(
       // copy in resultx for next one:
       ptr1 = (void *)Ker;
       ptr2 = (void *)resultx;
-      for ( i=0; i<2*nx*nx; i++ ) *(ptr2++) = *(ptr1++);
+      for ( i=0; i<2*nh; i++ ) *(ptr2++) = *(ptr1++);
     }
   }
-  fftwf_destroy_plan(fftpx);
   // at this point, Ker contains the Fourier transform of
   // all kernels comulated. Just one however for all subapertures.
 
-  fftps  = fftwf_plan_dft_2d(ns, ns, A, result, FFTW_FORWARD, FFTWOPTMODE);
-  fftpx  = fftwf_plan_dft_2d(nx, nx, Ax, resultx, FFTW_FORWARD, FFTWOPTMODE);
-  fftpxi = fftwf_plan_dft_2d(nx, nx, Ax, resultx, FFTW_BACKWARD, FFTWOPTMODE);
-
   //=====================
   // LOOP ON SUBAPERTURES
   //=====================
-  for ( l=0 ; l<nsubs ; l++ ) {
-
-    // zero out ximage:
-    for ( i=0 ; i<nx*nx ; i++ ) ximage[i] = 0.0f;
-    
-    //====================
-    // LOOP ON LGS PROFILE    
-    //====================
-    for ( nalt=0; nalt<n_in_profile ; nalt++ ) {
-      
-      lgsdef = lgs_defocuses[nalt];
-      lgsamp = lgs_prof_amp[nalt];
-      if ( n_in_profile==1 ) lgsamp = 1.0f;
-  
-      if ( svipc_subok[l]==0 ) continue;
-      
-      cpu0  = p_cpu_secs(&sys);
-
-      // reset A and result
-      ptr = (void *)A;
-      for ( i=0; i<n ; i++ ) { *(ptr)   = 0.0f; *(ptr+1) = 0.0f; ptr +=2; }
-      
-      ptr = (void *)result;
-      for ( i=0; i<n ; i++ ) { *(ptr)   = 0.0f; *(ptr+1) = 0.0f; ptr +=2; }
-
-      // indice offset of phaselet in phase/pupil array
-      koff = istart[l] + jstart[l]*dim;
-  
-      // START section to allow larger dynamical range by
-      // subtracting a tilt to the phase and moving later on
-      // the image in the big image
-      // (declarations on top of function)
-      if (dynrange) {
-        // compute approximate average slope over the subaperture
-        // it doesn't matter if this is not the exact value
-        // as it only serves to determine if we should offset,
-        // but the end result should be the same. Because of edge subapertures,
-        // we'll have to do the whole average gradient calculation
-        dx = 0.0f; dy = 0.0f;
-        ndx = 0; ndy = 0;
-        for ( j=0; j<(nsy-1); j++ ) {
-          for ( i=0; i<(nsx-1) ; i++ ) {
-            k = koff + i + j*dim;
-            if ( pupil[k] && pupil[k+1] ) {
-              dx +=            phase_scaled[k+1] - phase_scaled[k] + \
-                      lgsdef*( unit_defocus[k+1] - unit_defocus[k] );
-              ndx++;
-            }
-            if ( pupil[k] && pupil[k+dim] ) {
-              dy +=            phase_scaled[k+dim] - phase_scaled[k] + \
-                      lgsdef*( unit_defocus[k+dim] - unit_defocus[k] );
-              ndy++;
-            }
-          }
-        }
-        if (ndx) dx = dx / (float)(ndx); // in radian/pixel
-        if (ndy) dy = dy / (float)(ndy);
-        // now we need to transform this average phase gradient into
-        // pixel motion.
-        // So how many small pixels we expect the spot to move?
-        // if dx = 2*pi, the spot will wrap all the way back to center,
-        // i.e. will move by ns pixels:
-        dxp = dx / twopi * (float)(ns);
-        dyp = dy / twopi * (float)(ns);
-        // round to the nearest (small) pixel: 
-        idxp = lroundf(dxp);
-        idyp = lroundf(dyp);
-        if (idxp!=0) dx = dx * (float)(idxp) / dxp; else dx = 0.0f;
-        if (idyp!=0) dy = dy * (float)(idyp) / dyp; else dy = 0.0f;
-         if ((debug>1)&&((idxp!=0)||(idyp!=0))) printf("idxp = %d, idyp = %d, dx=%f, dy=%f\n",idxp,idyp,dx,dy);
-      } else {
-        dx = 0.0f; dy = 0.0f; 
-        idxp = 0; idyp = 0;
-      }
-      // END section to allow larger dynamical range
-      // (more below to add to phase and to shift imagelets)
-  
-      cpu1  = p_cpu_secs(&sys);
-      cpu10 += cpu1-cpu0;
-
-      // fill in the complex wavefront array for this subaperture:
-      // cos & sin are very costly, so we use an aproximation:
-      ptr = (void *)A;
-      if (dynrange) {
-        
-        if (debug>1) printf("here, dynrange enabled\n");
-        for ( j=0; j<nsy ; j++ ) {
-          for ( i=0; i<nsx ; i++ ) {
-            k = koff + i + j*dim;
-            kk = i + j*nsx;
-            pp = phase_scaled[k] + lgsdef * unit_defocus[k] \
-                     - dx * unittip[kk] - dy * unittilt[kk];
-            if (use_sincos_approx_flag) _sinecosinef(pp,&ppsin,&ppcos);
-            else sincosf(pp,&ppsin,&ppcos);
-            *(ptr + 2*(i+j*ns))   = pupil[k] * ppcos;
-            *(ptr + 2*(i+j*ns)+1) = pupil[k] * ppsin;
-          }
-        }
-
-      } else {
-
-        if (debug>1) printf("here, dynrange disabled\n");
-        for ( j=0; j<nsy ; j++ ) {
-          for ( i=0; i<nsx ; i++ ) {
-            k = koff + i + j*dim;
-            pp = phase_scaled[k];
-            if (use_sincos_approx_flag) _sinecosinef(pp,&ppsin,&ppcos);
-            else sincosf(pp,&ppsin,&ppcos);
-            *(ptr + 2*(i+j*ns))   = pupil[k] * ppcos;
-            *(ptr + 2*(i+j*ns)+1) = pupil[k] * ppsin;
-          }
-        }
-
-      }
-
-      if (debug>1) printf("here3\n");
-
-      cpu2  = p_cpu_secs(&sys);
-      cpu21 += cpu2-cpu1;
-
-      // Carry out a Forward 2d FFT transform, check for errors.
-      fftwf_execute(fftps); // A -> result
-      // at this point result should contain the diffraction
-      // of the subaperture + turbulence, but not kernel yet
-  
-      // compute image from complex image object:
-      ptr = (void *)result;
-      for ( i=0; i<n; i++ ) {
-        simage[i] = (*(ptr) * *(ptr) + *(ptr+1) * *(ptr+1) );
-        simage[i] *= lgsamp;
-        if ( (debug>20) && ( l==10 ) ) printf("%f ",simage[i]);
-        ptr +=2;
-      }
-      
-      if ( (debug>1) && ( l==10 ) ) printf(" ");
-      
-      cpu3  = p_cpu_secs(&sys);
-      cpu32 += cpu3-cpu2;
+  // The subapertures are dealt over nthreads threads (see _shwfs_subaps).
+  // Each thread has its own scratch buffers; the plans are shared
+  // (fftwf_execute_dft is thread safe, only planning is not).
+  sh.pupil         = pupil;
+  sh.phase_scaled  = phase_scaled;
+  sh.unit_defocus  = unit_defocus;
+  sh.dim           = dim;
+  sh.istart        = istart;
+  sh.jstart        = jstart;
+  sh.nsx           = nsx;
+  sh.nsy           = nsy;
+  sh.nsubs         = nsubs;
+  sh.n             = n;
+  sh.ns            = ns;
+  sh.nx            = nx;
+  sh.nb            = nb;
+  sh.nxdiff        = nxdiff;
+  sh.dynrange      = dynrange;
+  sh.domask        = domask;
+  sh.submask       = submask;
+  sh.bsubmask      = bsubmask;
+  sh.Ker           = Ker;
+  sh.kerfftr       = kerfftr;
+  sh.kerffti       = kerffti;
+  sh.kernconv      = kernconv;
+  sh.binindices    = binindices;
+  sh.unittip       = unittip;
+  sh.unittilt      = unittilt;
+  sh.lgs_prof_amp  = lgs_prof_amp;
+  sh.lgs_defocuses = (lgs_fast)? &nodefocus : lgs_defocuses;
+  sh.n_in_profile  = nprof;
+  sh.svipc_subok   = svipc_subok;
+  sh.flux          = flux;
+  sh.rayleighflux  = rayleighflux;
+  sh.skyflux       = skyflux;
+  sh.rayleighflag  = rayleighflag;
+  sh.rayleigh      = rayleigh;
+  sh.bckgrdinit    = bckgrdinit;
+  sh.fftpx         = fftpx;
+  sh.fftpxi        = fftpxi;
+  sh.phasor        = yao_fft_phasor(fftctx);
+  sh.nbatch        = nbatch;
+  sh.nst           = SHWFS_NST(n);
+  sh.bimages       = bimages;
+  sh.nthreads      = nthreads;
+  sh.debug         = debug;
+
+  // thread 0 is the calling thread. If a thread can not be created,
+  // its share of subapertures is done here too.
+  for ( t=1 ; t<nthreads ; t++ ) \
+    thok[t] = (pthread_create(&thid[t], NULL, _shwfs_subaps, &th[t]) == 0);
+  _shwfs_subaps(&th[0]);
+  for ( t=1 ; t<nthreads ; t++ ) {
+    if (thok[t]) pthread_join(thid[t], NULL);
+    else _shwfs_subaps(&th[t]);
+  }
 
-      // Embed (and add to) this simage into ximage, the extended field 
-      // of view image for this subaperture (with shifts computed above):
-      if ( (debug>1) && (l==10) ) printf("\nns=%d nx=%d\n",(int)ns,(int)nx);
-      embed_image(simage,ns,ns,ximage,nx,nx,(nx-ns)/2+idxp-nxdiff,(nx-ns)/2+idyp-nxdiff,1);
-    
-    } // END LOOP ON LGS PROFILE
-    
-    if ( (debug>1) && (l==10) ) printf("here4\n");
+  for ( t=0 ; t<nthreads ; t++ ) {
+    cpu10 += th[t].cpu10; cpu21 += th[t].cpu21; cpu32 += th[t].cpu32;
+    cpu43 += th[t].cpu43; cpu54 += th[t].cpu54;
+  }
 
-    if ((debug>10)&&(l==10)) {
-      FILE *fp;
-      fp=fopen("xim-pre.dat", "w");
-      fprintf(fp, "%d\n",(int)nx);
-      for ( i=0 ; i<nx*nx ; i++ ) fprintf(fp, "%f\n",ximage[i]);
-      fclose(fp);
-    }
-    
-    // Carry out convolution by kernel if required
-    if (kernconv == 1) {
-      // Transform ximage
-      ptr = (void *)Ax;
-      for ( i=0 ; i<nx*nx ; i++ ) {
-        *(ptr)   = ximage[i]; 
-        *(ptr+1) = 0.0f;
-        ptr +=2;
-      }
-      fftwf_execute(fftpx);
-  
-      // multiply by kernel transform:
-      ptr  = (void *)Ker;
-      ptr1 = (void *)Ax;
-      ptr2 = (void *)resultx;
-      for ( i=0 ; i<nx*nx ; i++ ) {
-        // this is FFT(kernel) * FFT(kernelS)
-        krp = *(ptr)*kerfftr[i+l*nx*nx] - *(ptr+1)*kerffti[i+l*nx*nx];
-        kip = *(ptr)*kerffti[i+l*nx*nx] + *(ptr+1)*kerfftr[i+l*nx*nx];
-        // and next we multiply by FFT(image):
-        *(ptr1)   = *(ptr2)*krp   - *(ptr2+1)*kip;
-        *(ptr1+1) = *(ptr2+1)*krp + *(ptr2)*kip;
-        ptr +=2; ptr1 +=2; ptr2 +=2;
-      }
-      // Transform back:
-      fftwf_execute(fftpxi);
-  
-      ptr = (void *)resultx;
-      for ( i=0 ; i<nx*nx ; i++ ) {
-        ximage[i] = sqrt ( *(ptr) * *(ptr) + *(ptr+1) * *(ptr+1) );
-        ptr +=2;
-      }
-    }
-  
-    cpu4  = p_cpu_secs(&sys);
-    cpu43 += cpu4-cpu3;
+  cpu5  = p_cpu_secs(&sys);
 
-    // FLUX NORMALIZATION FOR STAR. Has to be done *before* applying fieldstop
-    // will be used a bit below
-    // LGS FIXME FIXME FIXME: flux totally screwed up w/ new lgs_prof_amp!
-    tot = 0.0f;
-    for ( i=0 ; i<nx*nx ; i++ ) tot += ximage[i];
-      
-    // APPLY FIELD STOP / AMPLITUDE MASK
-    // For instance to take into account the central dark spot of STRAP,
-    // or more generally a field stop
-    if (domask == 1) {
-      for ( i=0 ; i<nx*nx ; i++ ) {
-        ximage[i] = ximage[i] * submask[i];
-      }
-    }
-  
-    // IF BACKGROUND CALIBRATION, NULL STAR SIGNAL
-    if (bckgrdinit) {
-      for ( i=0 ; i<nx*nx ; i++ ) ximage[i] = 0.0f;
-    }
-  
-    // PUT THIS SUBAPERTURE'S XIMAGE INTO BIMAGE (binned image)
-    for ( i=0 ; i<nb*nb ; i++ ) { bimage[i] = 0.0f; }
-  
-    for ( i=0 ; i<nx*nx ; i++ ) {
-      if (binindices[i]<0) continue;
-      //~ if (binindices[i]>nb*nb) {
-        //~ printf("binindices[%d] = %d > nb*nb (%d). It shouldn't be so! (ns=%d, nx=%d, nb=%d)\n",i,binindices[i],nb*nb,ns,nx,nb);
-        //~ return 1;
-      //~ }
-      bimage[binindices[i]] += ximage[i];
-      //~ if (ximage[i]==0) printf("ximage[%d]==0 ",i);
-    }
-  
-    if ((debug>10)&&(l==10)) {
-      FILE *fp;
-      fp=fopen("sim.dat", "w");
-      fprintf(fp, "%d\n",(int)ns);
-      for ( i=0 ; i<ns*ns ; i++ ) fprintf(fp, "%f\n",simage[i]);
-      fclose(fp);
-      fp=fopen("xim.dat", "w");
-      fprintf(fp, "%d\n",nx);
-      for ( i=0 ; i<nx*nx ; i++ ) fprintf(fp, "%f\n",ximage[i]);
-      fclose(fp);
-      fp=fopen("bim.dat", "w");
-      fprintf(fp, "%d\n",nb);
-      for ( i=0 ; i<nb*nb ; i++ ) fprintf(fp, "%f\n",bimage[i]);
-      fclose(fp);
-      fp=fopen("kre.dat", "w");
-      fprintf(fp, "%d\n",nx);
-      ptr  = (void *)Ker;
-      for ( i=0 ; i<nx*nx ; i++ ) { fprintf(fp, "%f\n",*ptr); ptr+=2; }
-      fclose(fp);
-      fp=fopen("kim.dat", "w");
-      fprintf(fp, "%d\n",nx);
-      ptr  = (void *)Ker; ptr++;
-      for ( i=0 ; i<nx*nx ; i++ ) { fprintf(fp, "%f\n",*ptr); ptr+=2; }
-      fclose(fp);
-    }
-  
-    // NORMALIZE FLUX FOR STAR
-    if (tot>0.0f) {
-      tot = flux[l]/tot;
-      for ( i=0 ; i<nb*nb ; i++ ) { bimage[i] = bimage[i]*tot; }
-    }
-    
-    // COMPUTE RAYLEIGH BACKGROUND
-    // I have to do this after the convolution because otherwise there is a lot
-    // of wrapping/ringing. I could do it once the image is binned. Saved for future
-    // upgrade (will save a bit of time).
-    for ( i=0 ; i<nb*nb ; i++ ) { brayleigh[i] = 0.0f; }
-    if (rayleighflag==1) {
-      for ( i=0 ; i<nx*nx ; i++ ) {
-        if (binindices[i]>=0) {
-          brayleigh[binindices[i]] += rayleigh[i+l*nx*nx];
-        }
-      }
-      // NORMALIZE FLUX FOR RAYLEIGH
-      if (debug) printf("here4-1\n");
-      totrayleigh = 0.0f;
-      for ( i=0 ; i<nb*nb ; i++ ) { totrayleigh += brayleigh[i]; }
-      if (debug) printf("l=%d, totrayleigh=%f\n",l,totrayleigh);
-  
-      if (totrayleigh > 0.0f) {
-        totrayleigh = rayleighflux[l]/totrayleigh;
-        for ( i = 0; i < nb*nb; i++ ) brayleigh[i] = brayleigh[i]*totrayleigh;
-      }
-      if (debug) printf("here4-2\n");
-    }
-  
-    // NORMALIZE FLUX FOR SKY
-    //    sky = skyflux[l] / (float)(nb);  // sky per rebinned pixel, e-/frame
-    sky = skyflux[l];  // sky per rebinned pixel, e-/frame
-  
-    if (debug) printf("here4-3\n");
-    for ( i=0 ; i<nb*nb ; i++ ) { 
-      // bimage[i] += darkcurrent; // nope. has to be added only once/pixel!
-      bimage[i] += ( sky + brayleigh[i] ) * bsubmask[i]; 
-    }
-    if (debug) printf("here4-4\n");
-    
-    cpu5  = p_cpu_secs(&sys);
-    cpu54 += cpu5-cpu4;
-  
-    // put image where it belongs in large image
+  // put images where they belong in large image. Done here, in subaperture
+  // order, as the spots of neighbouring subapertures may overlap.
+  for ( l=0 ; l<nsubs ; l++ ) {
     koff = imistart[l] + (imjstart[l])*fimnx;
   
     for ( j=0 ; j<nb ;j++) {
       for ( i=0 ; i<nb ;i++) {
         k = koff + i + j*fimnx;
-        *(fimage+k) += bimage[i+j*nb];
-        //~ if (bimage[i+j*nb]==0) printf("bimage[%d]==0 ",i+j*nb);
+        *(fimage+k) += bimages[l*nb*nb+i+j*nb];
       }
     }
+  }
     
-    cpu6  = p_cpu_secs(&sys);
-    cpu65 += cpu6-cpu5;
-    
-  }  // END LOOP ON SUBAPERTURES
+  cpu6  = p_cpu_secs(&sys);
+  cpu65 += cpu6-cpu5;
   
   if (debug) {
     printf("\n1-0 %.3f  2-1(%d,%d) %.3f  3-2 %.3f  4-3 %.3f  5-4 %.3f  6-5 %.3f\n",\
@@ -1077,24 +2929,7 @@ int _shwfs_phase2spots(
   //============================
 
 
-  fftwf_destroy_plan(fftps);
-  fftwf_destroy_plan(fftpx);
-  fftwf_destroy_plan(fftpxi);
-
-  fftwf_free ( A );
-  fftwf_free ( result );
-  fftwf_free ( Ax );
-  fftwf_free ( Kx );
-  fftwf_free ( Ker );
-  fftwf_free ( resultx );
-  free ( phase_scaled );
-  free ( simage );
-  if (debug>1) printf("here5\n");
-  free ( ximage );
-  free ( bimage );
-  free ( brayleigh ); /* fixed memleak 2008nov18 */
-  free ( bsubmask );
-
+  // plans and workspaces stay in the registry for the next call
   if (debug>1) printf("here6\n");
 
 
@@ -1109,6 +2944,392 @@ all time used by loop, good:
 
 
 
+/* Slopes from spots. The subaperture pixels are gathered in a SoA stack,
+   pix[p*nsubs+l] (pixel p=i+j*binxy2 of subaperture l), so that the
+   thresholds, centroids, correlations and matched filters run (and
+   vectorize) across subapertures. The scratch arrays live in the wfs
+   fft context, slots S2S_SLOT, +1 and +3 (see _shwfs_phase2spots for
+   the others), nothing is allocated once the context is warm.
+   shthmethod:
+   1: yao default (threshold subtracted, negative pixels zeroed)
+   2: podium (pixels below threshold zeroed)
+   3: brightest pixels (threshold = number of pixels kept)
+   4: correlation with the reference spots (thresholded as 1)
+   5: matched filter (no threshold)
+   4 and 5 measure the shift to the reference spots refspots, and return
+   it added to the reference centroid (so that the wfs._refmes subtraction
+   works as for the others). The reference spots and matched filters are
+   taken from the current frame when refinit is set (aoinit sets it while
+   acquiring the reference measurements). */
+
+#define S2S_SLOT    12
+#define S2S_BLOCK   256     // subapertures per correlation block
+#define S2S_NBMAX   64      // max subaperture size (pixels) for the matched filter
+#define S2S_TOPMAX  32      // max length of the brightest pixel selection lists
+
+/* SoA kernels: one pixel of n subapertures, by blocks of YAO_PHASOR_VL
+   (gcc vector extension, compiled for several instruction sets, as the
+   phasor kernel). Branchless: the pixel signs are random across
+   subapertures. */
+static inline void s2s_load(yao_v16f *x, const float *p, long nv)
+{
+  long k;
+  if (nv==YAO_PHASOR_VL) { memcpy(x, p, sizeof(yao_v16f)); return; }
+  for ( k=0 ; k<YAO_PHASOR_VL ; k++ ) (*x)[k] = (k<nv)? p[k] : 0.0f;
+}
+
+static inline void s2s_store(float *p, const yao_v16f *x, long nv)
+{
+  long k;
+  if (nv==YAO_PHASOR_VL) { memcpy(p, x, sizeof(yao_v16f)); return; }
+  for ( k=0 ; k<nv ; k++ ) p[k] = (*x)[k];
+}
+
+static inline void s2s_loadi(yao_v16i *x, const int *p, long nv)
+{
+  long k;
+  if (nv==YAO_PHASOR_VL) { memcpy(x, p, sizeof(yao_v16i)); return; }
+  for ( k=0 ; k<YAO_PHASOR_VL ; k++ ) (*x)[k] = (k<nv)? p[k] : 0;
+}
+
+static inline void s2s_storei(int *p, const yao_v16i *x, long nv)
+{
+  long k;
+  if (nv==YAO_PHASOR_VL) { memcpy(p, x, sizeof(yao_v16i)); return; }
+  for ( k=0 ; k<nv ; k++ ) p[k] = (*x)[k];
+}
+
+// v = v+thback-thr, negative values zeroed (podium=0) or
+// v = v+thback, values below thr zeroed (podium=1)
+YAO_PHASOR_CLONES
+static void s2s_threshold(float *v, const float *thr, float thback, long n, int podium)
+{
+  yao_v16f x, t;
+  long     l, nv;
+
+  for ( l=0 ; l<n ; l+=YAO_PHASOR_VL ) {
+    nv = (n-l < YAO_PHASOR_VL)? n-l : YAO_PHASOR_VL;
+    s2s_load(&x, v+l, nv);
+    s2s_load(&t, thr+l, nv);
+    if (podium) {
+      x = x + thback;
+      x = (yao_v16f)((yao_v16i)x & ~(x < t));
+    } else {
+      x = x + thback - t;
+      x = (yao_v16f)((yao_v16i)x & ~(x < 0.0f));
+    }
+    s2s_store(v+l, &x, nv);
+  }
+}
+
+// brightest pixels: keep v > thr, and v == thr while quota > 0
+YAO_PHASOR_CLONES
+static void s2s_brightest(float *v, const float *thr, int *quota, long n)
+{
+  yao_v16f x, t;
+  yao_v16i q, gt, eq;
+  long     l, nv;
+
+  for ( l=0 ; l<n ; l+=YAO_PHASOR_VL ) {
+    nv = (n-l < YAO_PHASOR_VL)? n-l : YAO_PHASOR_VL;
+    s2s_load(&x, v+l, nv);
+    s2s_load(&t, thr+l, nv);
+    s2s_loadi(&q, quota+l, nv);
+    // x > t and x == t from the sign of the differences (exact for
+    // finite floats): gcc scalarizes the float compares here for avx512f
+    gt = (yao_v16i)(t - x) >> 31;
+    eq = ~(gt | ((yao_v16i)(x - t) >> 31)) & (q > 0);
+    q  = q + eq;             // true is -1
+    x  = (yao_v16f)((yao_v16i)x & (gt | eq));
+    s2s_store(v+l, &x, nv);
+    s2s_storei(quota+l, &q, nv);
+  }
+}
+
+// cx += wx*v, cy += wy*v, ci += v, with wx, wy scalars (wv==NULL) or
+// vectors wv (x) and wv+ws (y)
+YAO_PHASOR_CLONES
+static void s2s_accumulate(float *cx, float *cy, float *ci, const float *v,
+                           float wx, float wy, const float *wv, long ws, long n)
+{
+  yao_v16f x, a, b, c, u, w;
+  long     l, nv;
+
+  for ( l=0 ; l<n ; l+=YAO_PHASOR_VL ) {
+    nv = (n-l < YAO_PHASOR_VL)? n-l : YAO_PHASOR_VL;
+    s2s_load(&x, v+l, nv);
+    s2s_load(&a, cx+l, nv);
+    s2s_load(&b, cy+l, nv);
+    s2s_load(&c, ci+l, nv);
+    if (wv) {
+      s2s_load(&u, wv+l, nv);
+      s2s_load(&w, wv+ws+l, nv);
+      a = a + u*x;
+      b = b + w*x;
+    } else {
+      a = a + wx*x;
+      b = b + wy*x;
+    }
+    c = c + x;
+    s2s_store(cx+l, &a, nv);
+    s2s_store(cy+l, &b, nv);
+    s2s_store(ci+l, &c, nv);
+  }
+}
+
+// k[l]-th largest pixel thr[l] (k from 1) and quota[l] = k[l] - #(pixels >
+// thr[l]), by partial selection across subapertures: each lane keeps its
+// m largest pixels (or its m smallest, whichever list is shorter) sorted
+// in t[], each new pixel being inserted with m max/min pairs. Returns the
+// number of subapertures done: it stops at the first block of YAO_PHASOR_VL
+// that would need more than S2S_TOPMAX entries.
+YAO_PHASOR_CLONES
+static long s2s_kth_select(const float *pix, long nsubs, int nb2, const int *k,
+                          float *thr, int *quota, long n)
+{
+  yao_v16f x, y, t[S2S_TOPMAX];
+  yao_v16i kk, c, sel;
+  long     l, nv, m;
+  int      p, j, ktop, kbot, nt;
+
+  for ( l=0 ; l<n ; l+=YAO_PHASOR_VL ) {
+    nv = (n-l < YAO_PHASOR_VL)? n-l : YAO_PHASOR_VL;
+    ktop = 1; kbot = 1;
+    for ( m=0 ; m<YAO_PHASOR_VL ; m++ ) {
+      kk[m] = (m<nv)? k[l+m] : 1;
+      if (kk[m] > ktop) ktop = kk[m];
+      if (nb2-kk[m]+1 > kbot) kbot = nb2-kk[m]+1;
+    }
+    nt = (ktop <= kbot)? ktop : kbot;
+    if (nt > S2S_TOPMAX) return l;
+    if (ktop <= kbot) {
+      // t[0] >= t[1] >= ... the nt largest
+      for ( j=0 ; j<nt ; j++ ) for ( m=0 ; m<YAO_PHASOR_VL ; m++ ) t[j][m] = -HUGE_VALF;
+      for ( p=0 ; p<nb2 ; p++ ) {
+        s2s_load(&x, pix+p*nsubs+l, nv);
+        for ( j=0 ; j<nt ; j++ ) {
+          sel  = (x > t[j]);
+          y    = (yao_v16f)(((yao_v16i)x & sel) | ((yao_v16i)t[j] & ~sel));
+          x    = (yao_v16f)(((yao_v16i)t[j] & sel) | ((yao_v16i)x & ~sel));
+          t[j] = y;
+        }
+      }
+      // k-th largest is t[k-1]
+      x = t[0];
+      for ( j=1 ; j<nt ; j++ ) {
+        sel = (kk == j+1);
+        x = (yao_v16f)(((yao_v16i)t[j] & sel) | ((yao_v16i)x & ~sel));
+      }
+    } else {
+      // t[0] <= t[1] <= ... the nt smallest
+      for ( j=0 ; j<nt ; j++ ) for ( m=0 ; m<YAO_PHASOR_VL ; m++ ) t[j][m] = HUGE_VALF;
+      for ( p=0 ; p<nb2 ; p++ ) {
+        s2s_load(&x, pix+p*nsubs+l, nv);
+        for ( j=0 ; j<nt ; j++ ) {
+          sel  = (x < t[j]);
+          y    = (yao_v16f)(((yao_v16i)x & sel) | ((yao_v16i)t[j] & ~sel));
+          x    = (yao_v16f)(((yao_v16i)t[j] & sel) | ((yao_v16i)x & ~sel));
+          t[j] = y;
+        }
+      }
+      // k-th largest is the (nb2-k+1)-th smallest, t[nb2-k]
+      x = t[0];
+      for ( j=1 ; j<nt ; j++ ) {
+        sel = (kk == nb2-j);
+        x = (yao_v16f)(((yao_v16i)t[j] & sel) | ((yao_v16i)x & ~sel));
+      }
+    }
+    c = kk;
+    for ( p=0 ; p<nb2 ; p++ ) {
+      s2s_load(&y, pix+p*nsubs+l, nv);
+      c += (y > x);          // true is -1
+    }
+    s2s_store(thr+l, &x, nv);
+    for ( m=0 ; m<nv ; m++ ) quota[l+m] = c[m];
+  }
+  return n;
+}
+
+// c += a*b
+YAO_PHASOR_CLONES
+static void s2s_mac(float *c, const float *a, const float *b, long n)
+{
+  yao_v16f x, y, z;
+  long     l, nv;
+
+  for ( l=0 ; l<n ; l+=YAO_PHASOR_VL ) {
+    nv = (n-l < YAO_PHASOR_VL)? n-l : YAO_PHASOR_VL;
+    s2s_load(&x, a+l, nv);
+    s2s_load(&y, b+l, nv);
+    s2s_load(&z, c+l, nv);
+    z = z + x*y;
+    s2s_store(c+l, &z, nv);
+  }
+}
+
+// k-th largest (k from 0) of v[0..n-1], v is reordered (quickselect,
+// linear on average).
+static float s2s_kth_largest(float *v, int n, int k)
+{
+  int   lo = 0, hi = n-1, i, j;
+  float piv, t;
+
+  while (lo < hi) {
+    piv = v[(lo+hi)/2];
+    i = lo; j = hi;
+    while (i <= j) {
+      while (v[i] > piv) i++;
+      while (v[j] < piv) j--;
+      if (i <= j) { t = v[i]; v[i] = v[j]; v[j] = t; i++; j--; }
+    }
+    if (k <= j) hi = j;
+    else if (k >= i) lo = i;
+    else break;
+  }
+  return v[k];
+}
+
+/* Stores the reference spot of subaperture l (pix + shift, SoA) and
+   computes its matched filter: the noise weighted least square estimate
+   of a small shift, s = -(G'WG)^-1 G'W (I-R), with G the spot gradients
+   and W = 1/(photon + read noise variance). Per subaperture, mfilter holds
+   (SoA, stride nsubs): the x and y filters (nb2 each, in arcsec), the
+   reference centroid x and y, the reference flux and the filters applied
+   to the reference. */
+static void s2s_reference(float *pix, float shift, float *refspots, float *mfilter,
+                          int l, int nsubs, int nb, float *centroidw, float pixsize,
+                          float ron, float excessnoise, double *gr)
+{
+  long    nb2 = nb*nb;
+  float   *r = refspots + l, *mf = mfilter + l;
+  double  flux, cx, cy, gx, gy, w, a11, a12, a22, det, vfloor, mx, my, mrx, mry;
+  double  d[S2S_NBMAX];
+  int     i, j, k, p;
+
+  flux = 0.; cx = 0.; cy = 0.;
+  for ( j=0 ; j<nb ; j++ ) {
+    for ( i=0 ; i<nb ; i++ ) {
+      p = i + j*nb;
+      r[p*nsubs] = pix[p*nsubs+l] + shift;
+      flux += r[p*nsubs];
+      cx   += centroidw[i]*r[p*nsubs];
+      cy   += centroidw[j]*r[p*nsubs];
+    }
+  }
+  if (flux > 0.) { cx /= flux; cy /= flux; } else { cx = 0.; cy = 0.; }
+
+  // gradients: spectral (periodic) differentiation, as the spots are
+  // often too sharp for finite differences (which then underestimate the
+  // gradients and the shifts), d[k] = derivative weight at distance k:
+#define S2S_R(ii,jj) ((double)r[((ii)+(jj)*nb)*nsubs])
+  d[0] = 0.;
+  for ( k=1 ; k<nb ; k++ ) {
+    if (nb%2 == 0) d[k] = M_PI/nb / tan(M_PI*k/nb);
+    else           d[k] = M_PI/nb / sin(M_PI*k/nb);
+    if (k%2) d[k] = -d[k];
+  }
+  for ( j=0 ; j<nb ; j++ ) {
+    for ( i=0 ; i<nb ; i++ ) {
+      gx = 0.; gy = 0.;
+      for ( k=1 ; k<nb ; k++ ) {
+        // d/dx r(i) = sum_k d[k] r(i-k), k taken modulo nb
+        gx += d[k] * S2S_R((i-k+nb)%nb,j);
+        gy += d[k] * S2S_R(i,(j-k+nb)%nb);
+      }
+      gr[i+j*nb] = gx; gr[nb2+i+j*nb] = gy;
+    }
+  }
+#define S2S_GX(ii,jj) gr[(ii)+(jj)*nb]
+#define S2S_GY(ii,jj) gr[nb2+(ii)+(jj)*nb]
+  vfloor = 1e-3 * ( (flux>0.)? flux/nb2 : 1. );
+  a11 = 0.; a12 = 0.; a22 = 0.;
+  for ( j=0 ; j<nb ; j++ ) {
+    for ( i=0 ; i<nb ; i++ ) {
+      w = fmax(S2S_R(i,j),0.)*excessnoise*excessnoise + ron*ron;
+      w = 1. / fmax(w,vfloor);
+      gx = S2S_GX(i,j); gy = S2S_GY(i,j);
+      a11 += w*gx*gx; a12 += w*gx*gy; a22 += w*gy*gy;
+    }
+  }
+  det = a11*a22 - a12*a12;
+
+  mrx = 0.; mry = 0.;
+  for ( j=0 ; j<nb ; j++ ) {
+    for ( i=0 ; i<nb ; i++ ) {
+      p = i + j*nb;
+      mx = 0.; my = 0.;
+      if (det > 0.) {
+        w = fmax(S2S_R(i,j),0.)*excessnoise*excessnoise + ron*ron;
+        w = 1. / fmax(w,vfloor);
+        gx = S2S_GX(i,j); gy = S2S_GY(i,j);
+        mx = -pixsize * w * ( a22*gx - a12*gy) / det;
+        my = -pixsize * w * (-a12*gx + a11*gy) / det;
+      }
+      mf[p*nsubs]       = (float)mx;
+      mf[(nb2+p)*nsubs] = (float)my;
+      mrx += mx * S2S_R(i,j);
+      mry += my * S2S_R(i,j);
+    }
+  }
+#undef S2S_R
+#undef S2S_GX
+#undef S2S_GY
+  mf[(2*nb2)*nsubs]   = (float)cx;
+  mf[(2*nb2+1)*nsubs] = (float)cy;
+  mf[(2*nb2+2)*nsubs] = (float)flux;
+  mf[(2*nb2+3)*nsubs] = (float)mrx;
+  mf[(2*nb2+4)*nsubs] = (float)mry;
+}
+
+/* Shift (in pixels) of the spots to the reference spots, from the peak
+   of their cross correlation over all shifts |dx|,|dy| <= nb/2, refined
+   by a parabola through the peak and its neighbours. Done by blocks of
+   S2S_BLOCK subapertures [l0,l1) (corr: nd*nd*S2S_BLOCK scratch). */
+static void s2s_correlate(float *pix, float *refspots, int nsubs, int nb,
+                          int l0, int l1, float *corr, float *sx, float *sy)
+{
+  int   h = nb/2, nd = 2*h+1, bl = l1-l0;
+  int   dx, dy, i, j, ir, jr, a, k, kmax, ix, iy;
+
+  float *c, *pi, *pr, cmax, cm, cp, den, d;
+
+  for ( dy=-h ; dy<=h ; dy++ ) {
+    for ( dx=-h ; dx<=h ; dx++ ) {
+      c = corr + ((dy+h)*nd+dx+h)*S2S_BLOCK;
+      for ( a=0 ; a<bl ; a++ ) c[a] = 0.0f;
+      for ( j=(dy>0?dy:0) ; j<(dy<0?nb+dy:nb) ; j++ ) {
+        jr = j-dy;
+        for ( i=(dx>0?dx:0) ; i<(dx<0?nb+dx:nb) ; i++ ) {
+          ir = i-dx;
+          pi = pix + (i+j*nb)*nsubs + l0;
+          pr = refspots + (ir+jr*nb)*nsubs + l0;
+          s2s_mac(c, pi, pr, bl);
+        }
+      }
+    }
+  }
+
+  for ( a=0 ; a<bl ; a++ ) {
+    kmax = h*nd+h; cmax = corr[kmax*S2S_BLOCK+a];
+    for ( k=0 ; k<nd*nd ; k++ ) {
+      if (corr[k*S2S_BLOCK+a] > cmax) { cmax = corr[k*S2S_BLOCK+a]; kmax = k; }
+    }
+    ix = kmax%nd; iy = kmax/nd;
+    sx[l0+a] = (float)(ix-h);
+    sy[l0+a] = (float)(iy-h);
+    if ( (ix>0) && (ix<nd-1) ) {
+      cm = corr[(kmax-1)*S2S_BLOCK+a]; cp = corr[(kmax+1)*S2S_BLOCK+a];
+      den = cm - 2.0f*cmax + cp;
+      if (den < 0.0f) { d = 0.5f*(cm-cp)/den; if (fabsf(d)<=1.0f) sx[l0+a] += d; }
+    }
+    if ( (iy>0) && (iy<nd-1) ) {
+      cm = corr[(kmax-nd)*S2S_BLOCK+a]; cp = corr[(kmax+nd)*S2S_BLOCK+a];
+      den = cm - 2.0f*cmax + cp;
+      if (den < 0.0f) { d = 0.5f*(cm-cp)/den; if (fabsf(d)<=1.0f) sy[l0+a] += d; }
+    }
+  }
+}
+
 int _shwfs_spots2slopes(
     float    *fimage,       // final image with spots
     int      *imistart2,    // vector of i starts of each image
@@ -1121,8 +3342,12 @@ int _shwfs_spots2slopes(
     int      fimny,         // final image Y dimension
     int      yoff,          // y offset (to process only part of the image, when using svipc)
     float    *centroidw,    // centroid weight vector for centroid computations, X & Y
-    long     shthmethod,    // threshold method (1: yao default, 2: podium, 3: brightest pixels)
+    long     shthmethod,    // threshold method (1: yao default, 2: podium, 3: brightest pixels
+                            // 4: correlation, 5: matched filter)
     float    *threshold,    // vector of threshold (input), dim nsubs
+    float    *refspots,     // reference spots (4 & 5), binxy2*binxy2*nsubs, SoA
+    float    *mfilter,      // matched filters & ref. data (4 & 5), (2*binxy2^2+5)*nsubs, SoA
+    int      refinit,       // fill refspots and mfilter from this frame
     float    *bias,         // bias array, dim = nsubs*binxy*binxy, in e-
     float    *flat,         // flat array, dim = nsubs*binxy*binxy, normalized @ 1.
     float    ron,           // read-out noise
@@ -1135,42 +3360,53 @@ int _shwfs_spots2slopes(
                             // for which an image is computed (0/1)
     int      *svipc_subok,  // to skip (0) subap for svipc partial spot comput.
     int      niter,         // total # of cycles over which to integrate
-    float    *mesvec)       // final measurement vector
+    float    *mesvec,       // final measurement vector
+    int      fftctx)        // fft workspace context for this wfs (wfs._fftctx)
            
 {
   /* Declarations */
-  const         int sizeThArray = binxy2*binxy2;
-
-  float         *bimage2;
-  float         *fnoise;
-  float         centx, centy, centi, tmpf, thback;
-  float         val[sizeThArray];
-  float         minval;
-  long          nb2;
-  int           i, j, k, l, koff, xyoff;
-  int           nvalidsubs, vsc; // vsc = valid sub counter
-  int           ind[sizeThArray];
-  int           ii, kk, minind;
-  int           met3threshold;
+  const int     nb = binxy2;
+  const long    nb2 = binxy2*binxy2;
+  const long    npix = (long)fimnx*fimny;
+  float         *pix, *scratch;
+  float         *thr, *cx, *cy, *ci, *v, *mf;
+  int           *koff, *vidx, *quota;
+  char          *ws;
+  float         thback, thsub, pixsize, g;
+  long          i, j, l, p, xyoff;
+  int           nvalidsubs, k, l0, l1;
   const float   excess_noise_sqr = pow(excessnoise,2.0f);
-  const float   one_over_excess_noise_sqr = 1.0f/excess_noise_sqr;
   
-  // Set the size of 2d FFT.
-  nb2 = binxy2 * binxy2;
-  vsc = -1;
   xyoff = yoff * fimnx;
   //  printf("shthemthod = %ld\n",shthmethod);
   
-  // Allocate memory for the input operands and check its availability.
-  bimage2      = ( float* ) malloc ( nb2 * sizeof ( float ) );
-  fnoise       = ( float* ) malloc ( fimnx * fimny * sizeof ( float ) );
+  // Scratch from the wfs fft context: the SoA pixel stack, per subaperture
+  // values, the gaussian noise frame and the selection/correlation buffer
+  pix     = yao_fft_workspace ( fftctx, S2S_SLOT, nb2 * nsubs * sizeof ( float ) );
+  ws      = yao_fft_workspace ( fftctx, S2S_SLOT+1, \
+                                nsubs * ( 4*sizeof(float) + 3*sizeof(int) ) );
+  scratch = yao_fft_workspace ( fftctx, S2S_SLOT+3, sizeof ( float ) * \
+            ( (nb2 > (nb/2*2+1)*(nb/2*2+1)*S2S_BLOCK)? nb2 : (nb/2*2+1)*(nb/2*2+1)*S2S_BLOCK ) );
   
-  if ( bimage2 == NULL || fnoise == NULL ) { return (1); }
-
-
-  // how many valid subs?
+  if ( pix == NULL || ws == NULL || scratch == NULL ) { return (1); }
+
+  thr   = (float *)ws;
+  cx    = thr + nsubs;
+  cy    = cx + nsubs;
+  ci    = cy + nsubs;
+  koff  = (int *)(ci + nsubs);
+  vidx  = koff + nsubs;
+  quota = vidx + nsubs;
+
+  // index in mesvec of each valid subaperture (-1: not valid), and offset
+  // of each subaperture image in fimage:
   nvalidsubs = 0;
-  for( i=0; i<nsubs; i++) nvalidsubs += validsubs[i];
+  for ( l=0 ; l<nsubs ; l++ ) {
+    vidx[l] = (validsubs[l])? nvalidsubs++ : -1;
+    koff[l] = imistart2[l] + imjstart2[l]*fimnx;
+  }
+  // the correlation and matched filter are in units of centroidw:
+  pixsize = (nb>1)? centroidw[1]-centroidw[0] : 0.0f;
 
   // zero out mesurement vector ( now done in sh_wfs() )
 
@@ -1185,28 +3421,25 @@ int _shwfs_spots2slopes(
   // first, if this is a call to establish the calibration background, 
   // let's do it (before we apply bias, flat and noise):
   if (bckgrdinit) {
-    for ( i=xyoff; i<(xyoff+fimnx*fimny); i++ ) bckgrdcalib[i] = fimage[i];
+    for ( i=xyoff; i<(xyoff+npix); i++ ) bckgrdcalib[i] = fimage[i];
   }
     
   
   // first we have to multiply by the gain (flat) before applying
   // the noise:
-  for ( i=xyoff; i<(xyoff+fimnx*fimny); i++) fimage[i] *= flat[i];
+  for ( i=xyoff; i<(xyoff+npix); i++) fimage[i] *= flat[i];
                 
-  // Then apply photon and gaussian (read-out) noise
+  // Then apply photon and gaussian (read-out) noise. The noise of a
+  // pixel only depends on its index in the full image (xyoff+i), so that
+  // it is the same whatever the svipc split.
   if ( noise==1 ) {
-    // poisson noise
-    for ( i=0; i<(fimnx*fimny); i++ ) fnoise[i] = fimage[i+xyoff] * one_over_excess_noise_sqr ;
-    _poidev(fnoise,fimnx*fimny);
-    for ( i=0; i<(fimnx*fimny); i++ ) fimage[i+xyoff] = fnoise[i] * excess_noise_sqr ;
-    // add gaussian noise
-    _gaussdev(fnoise,fimnx*fimny);
-    for ( i=xyoff; i<(xyoff+fimnx*fimny); i++ ) fimage[i] += ron*fnoise[i-xyoff];
+    // poisson noise (with excess noise factor) + gaussian noise, in place
+    yao_rng_detector(fftctx, fimage+xyoff, npix, xyoff, excess_noise_sqr, ron);
   }
   
   // Then add the bias (counted as many time as there were frames)
   // No noise on the bias, as this is a bias *error* (see below)
-  for ( i=xyoff; i<(xyoff+fimnx*fimny); i++) fimage[i] += (float) niter * bias[i];
+  for ( i=xyoff; i<(xyoff+npix); i++) fimage[i] += (float) niter * bias[i];
 
   // let's clarify something, as I'm not sure it was as I understood it
   // initially: the bias and flat entries in the parfile are for
@@ -1216,179 +3449,155 @@ int _shwfs_spots2slopes(
     
   // if requested, we should now subtract the background:
   if (bckgrdsub) {
-    for ( i=xyoff; i<(xyoff+fimnx*fimny); i++ ) fimage[i] -= bckgrdcalib[i];
+    for ( i=xyoff; i<(xyoff+npix); i++ ) fimage[i] -= bckgrdcalib[i];
   }
 
-  //thresholding in case of default yao thresholding or "podium" thresholding
-  if (shthmethod == 1 || shthmethod == 2) {
+  // thresholding in case of default yao thresholding or "podium" thresholding
+  // (and correlation, thresholded as 1)
+  thsub = 0.0f;
+  thback = (float) niter * threshold[nsubs];
+  if (shthmethod == 1 || shthmethod == 2 || shthmethod == 4) {
     // 2010apr16: see note on outside pixels not being thresholded
     // in yao_wfs.i (func sh_wfs). not a big issue, but we solve it here.
     // we need to threshold the fimage pixels outside the valid
     // subap. Let's remove this value here and then adjust by the
     // difference below:
-    thback = (float) niter * threshold[nsubs];
-    for ( i=xyoff; i<(xyoff+fimnx*fimny); i++ ) fimage[i] -= thback;
+    thsub = thback;
+    for ( i=xyoff; i<(xyoff+npix); i++ ) fimage[i] -= thback;
+  }
 
-  
-    // OK, now let's finally compute the slopes over all subaps.
-    for ( l=0 ; l<nsubs ; l++ ) {
+  // retrieve the final/integrated subaperture spot images from fimage
+  // (the subapertures skipped by svipc are zeroed, and not written back).
+  // Subaperture after subaperture, the nb2 lines of pix written stay in cache
+  for ( l=0 ; l<nsubs ; l++ ) {
+    v = pix + l;
+    if (svipc_subok[l]==0) {
+      for ( p=0 ; p<nb2 ; p++ ) v[p*nsubs] = 0.0f;
+      continue;
+    }
+    for ( j=0 ; j<nb ; j++ ) {
+      for ( i=0 ; i<nb ; i++ ) v[(i+j*nb)*nsubs] = fimage[koff[l]+i+j*fimnx];
+    }
+  }
 
-      if (validsubs[l]) vsc++;
-    
+  // new reference spots (before threshold):
+  // (scratch holds at least 4*nb2 floats, the gradients)
+  if (refinit) {
+    if (nb > S2S_NBMAX) return (1);
+    for ( l=0 ; l<nsubs ; l++ ) {
       if (svipc_subok[l]==0) continue;
-
-      // retrieve the final/integrated subaperture spot image from fimage:
-      koff = imistart2[l] + imjstart2[l]*fimnx;  
-      for ( j=0 ; j<binxy2 ;j++) {
-        for ( i=0 ; i<binxy2 ;i++) {
-          k = koff + i + j*fimnx;
-          bimage2[i+j*binxy2] = fimage[k];
-        }
-      }
-
-      // Apply threshold
-       tmpf = (float) niter * threshold[l];
-       if (shthmethod ==1) {
-         for ( i=0; i<nb2; i++ ) { 
-           // see above for thback meaning
-           bimage2[i] = bimage2[i] + thback - tmpf; 
-           if (bimage2[i] < 0.0f) bimage2[i] = 0.0f;
-         }
-       } else { 
-         for ( i=0; i<nb2; i++ ) { 
-           // see above for thback meaning
-           bimage2[i] = bimage2[i] + thback; 
-           if (bimage2[i] < tmpf) bimage2[i] = 0.0f;
-         }
-       }
-    
-      // put back image where it belongs in large image for displays
-      // a big stupid: the only operation we did was the threshold...
-      koff = imistart2[l] + imjstart2[l]*fimnx;
-    
-      for ( j=0 ; j<binxy2 ;j++) {
-        for ( i=0 ; i<binxy2 ;i++) {
-          k = koff + i + j*fimnx;
-          fimage[k] = bimage2[i+j*binxy2];
-        }
-      }
-    
-      // is that a valid subaperture?
-      if (validsubs[l]) {
-        // Compute centroids
-        centx = centy = centi = 0.0f;
-        for ( i=0 ; i<binxy2 ; i++ ) {
-          for ( j=0 ; j<binxy2 ; j++ ) {
-            centx += centroidw[i]*bimage2[i+j*binxy2];
-            centy += centroidw[j]*bimage2[i+j*binxy2];
-            centi += bimage2[i+j*binxy2];
-          }
-        }
-      
-        // Compute measurements
-        if (centi > 0.0f) {
-          mesvec[vsc]   = centx/centi;
-          mesvec[nvalidsubs+vsc] = centy/centi;
-        } // otherwise stay at zero (init value)
-        //      vsc++; // increment valid subaperture counter
-      }
-
+      s2s_reference(pix, thsub, refspots, mfilter, l, nsubs, nb, centroidw, pixsize, \
+                    ron, excessnoise, (double *)scratch);
     }
-    // thresholding in case of "bright pixels" thresholding
+  }
+
+  // Apply threshold
+  for ( l=0 ; l<nsubs ; l++ ) thr[l] = (float) niter * threshold[l];
+  if (shthmethod == 1 || shthmethod == 2 || shthmethod == 4) {
+    // see above for thback meaning
+    for ( p=0 ; p<nb2 ; p++ ) \
+      s2s_threshold(pix+p*nsubs, thr, thback, nsubs, (shthmethod == 2));
   } else if (shthmethod == 3) {
-    // OK, now let's finally compute the slopes over all subaps.
+    // "bright pixels" thresholding: keep the threshold[l] brightest pixels.
+    // Find the k-th largest value thr[l] by partial selection, then keep
+    // the pixels above it and, in pixel order, the first quota[l] equal.
     for ( l=0 ; l<nsubs ; l++ ) {
-      
-      met3threshold = (int) threshold[l];
       // make sure we don't select a number of brightest pixel
       // <1 or >total number of pixels in subap:
-      if (met3threshold < 1)   met3threshold = 1;
-      if (met3threshold > nb2) met3threshold = nb2;
-      
-      if (validsubs[l]) vsc++;
-    
+      k = (int) threshold[l];
+      if (k < 1)   k = 1;
+      if (k > nb2) k = nb2;
+      quota[l] = k;
+    }
+    // from the first block that keeps and rejects more than S2S_TOPMAX
+    // pixels (large subapertures), scalar quickselect:
+    for ( l=s2s_kth_select(pix, nsubs, nb2, quota, thr, quota, nsubs) ; l<nsubs ; l++ ) {
       if (svipc_subok[l]==0) continue;
-      // retrieve the final/integrated subaperture spot image from fimage
-      // search for the brightest pixels
-      // start putting back image where it belongs in large image
-      // for displays by "zeroing" fimage
-      koff = imistart2[l] + imjstart2[l]*fimnx;    
-      minval = fimage[koff];
-      minind = 0;
-      val[0] = minval;
-      ind[0] = minind;
-      for ( j=0 ; j<binxy2 ;j++) {
-        for ( i=0 ; i<binxy2 ;i++) {
-          k = koff + i + j*fimnx;
-          ii = i+j*binxy2;
-          bimage2[ii] = fimage[k];
-
-          // put the first "threshold" values of bimage2 in val and the
-          // subscript values in ind look for the minimum value of val
-          // and its subscript minind
-          if (ii < met3threshold && ii > 0) {
-            val[ii] = bimage2[ii];
-            ind[ii] = ii;
-            if (val[ii] < minval) {
-              minval = val[ii];
-              minind = ind[ii];
-            }
-
-            // compare each following value of bimage2 to the min value of
-            // val and if it is larger, replace it
-          } else if (ii > 0 && bimage2[ii] > minval) {
-            val[minind] = bimage2[ii];
-            ind[minind] = ii;
-
-            // look for the minimum value of val and its subscript minind
-            minval = val[0];
-            minind = 0;
-            for ( kk=1 ; kk < met3threshold ; kk++) {
-              if (val[kk] < minval) {
-                minval = val[kk];
-                minind = kk;
-              }
-            }   
-          }
-          // zero fimage before filling it by the brightest pixels
-          fimage[k] = 0;
-        }
+      k = quota[l];
+      for ( p=0 ; p<nb2 ; p++ ) scratch[p] = pix[p*nsubs+l];
+      thr[l] = s2s_kth_largest(scratch, nb2, k-1);
+      for ( p=0 ; p<nb2 ; p++ ) if (scratch[p] > thr[l]) quota[l]--;
+    }
+    for ( l=0 ; l<nsubs ; l++ ) {
+      if (svipc_subok[l]) continue;
+      thr[l] = 0.0f; quota[l] = 0;
+    }
+    for ( p=0 ; p<nb2 ; p++ ) s2s_brightest(pix+p*nsubs, thr, quota, nsubs);
+  }
+
+  // put back the thresholded images where they belong in the large image,
+  // for displays (the matched filter does not threshold):
+  if (shthmethod != 5) {
+    for ( l=0 ; l<nsubs ; l++ ) {
+      if (svipc_subok[l]==0) continue;
+      v = pix + l;
+      for ( j=0 ; j<nb ; j++ ) {
+        for ( i=0 ; i<nb ; i++ ) fimage[koff[l]+i+j*fimnx] = v[(i+j*nb)*nsubs];
       }
-      centx = centy = centi = 0.0f;
-       
-      for (ii=0 ; ii < met3threshold ; ii++) {
-        i = ind[ii]%binxy2;
-        j = ind[ii]/binxy2;
-        k = koff + i + j*fimnx;
-        // fill fimage with the brightest pixels
-        fimage[k] = val[ii];
-        // is that a valid subaperture?
-        if (validsubs[l]) {
-          // Compute centroids
-          centx += centroidw[i]*val[ii];
-          centy += centroidw[j]*val[ii];
-          centi += val[ii];
-        }
+    }
+  }
+
+  // OK, now let's finally compute the slopes over all subaps.
+  for ( l=0 ; l<nsubs ; l++ ) { cx[l] = 0.0f; cy[l] = 0.0f; ci[l] = 0.0f; }
+
+  if (shthmethod <= 3) {
+    // Compute centroids
+    for ( i=0 ; i<nb ; i++ ) {
+      for ( j=0 ; j<nb ; j++ ) {
+        s2s_accumulate(cx, cy, ci, pix+(i+j*nb)*nsubs, centroidw[i], centroidw[j], \
+                       NULL, 0, nsubs);
       }
+    }
+    for ( l=0 ; l<nsubs ; l++ ) {
+      // is that a valid subaperture?
+      if ( (vidx[l] < 0) || (svipc_subok[l]==0) ) continue;
       // Compute measurements
-      if (centi > 0.0f) {
-        mesvec[vsc]   = centx/centi;
-        mesvec[nvalidsubs+vsc] = centy/centi;
+      if (ci[l] > 0.0f) {
+        mesvec[vidx[l]]   = cx[l]/ci[l];
+        mesvec[nvalidsubs+vidx[l]] = cy[l]/ci[l];
       } // otherwise stay at zero (init value)
- 
+    }
+
+  } else if (shthmethod == 4) {
+    // correlation: shift to the reference (pixels) + reference centroid
+    for ( l0=0 ; l0<nsubs ; l0+=S2S_BLOCK ) {
+      l1 = (l0+S2S_BLOCK < nsubs)? l0+S2S_BLOCK : nsubs;
+      s2s_correlate(pix, refspots, nsubs, nb, l0, l1, scratch, cx, cy);
+    }
+    mf = mfilter + 2*nb2*nsubs;
+    for ( l=0 ; l<nsubs ; l++ ) {
+      if ( (vidx[l] < 0) || (svipc_subok[l]==0) ) continue;
+      mesvec[vidx[l]]            = mf[l]       + pixsize*cx[l];
+      mesvec[nvalidsubs+vidx[l]] = mf[nsubs+l] + pixsize*cy[l];
+    }
+
+  } else if (shthmethod == 5) {
+    // matched filter, on the flux normalized spots
+    for ( p=0 ; p<nb2 ; p++ ) {
+      s2s_accumulate(cx, cy, ci, pix+p*nsubs, 0.0f, 0.0f, mfilter+p*nsubs, \
+                     nb2*nsubs, nsubs);
+    }
+    mf = mfilter + 2*nb2*nsubs;
+    for ( l=0 ; l<nsubs ; l++ ) {
+      if ( (vidx[l] < 0) || (svipc_subok[l]==0) ) continue;
+      mesvec[vidx[l]]            = mf[l];
+      mesvec[nvalidsubs+vidx[l]] = mf[nsubs+l];
+      if ( (ci[l] > 0.0f) && (mf[2*nsubs+l] > 0.0f) ) {
+        g = mf[2*nsubs+l] / ci[l];
+        mesvec[vidx[l]]            += g*cx[l] - mf[3*nsubs+l];
+        mesvec[nvalidsubs+vidx[l]] += g*cy[l] - mf[4*nsubs+l];
+      }
     }
   }
+
   // with respect to the noise in the outskirt of the fimage:
   // the threshold has been applied everywhere, but the condition
   // if (pixel<0) pixel=0 only has been applied in the valid
   // subapertures. Let's make sure it is applied everywhere here:
-  for ( i = xyoff; i < (xyoff+fimnx*fimny); i++ ) {
+  for ( i = xyoff; i < (xyoff+npix); i++ ) {
     if (fimage[i] < 0.0f) fimage[i] = 0.0f;
   }
 
-  free ( bimage2 );
-  free ( fnoise );
-
   return (0);
 }
 
@@ -1501,17 +3710,17 @@ int _cwfs (float *pupil,      // input pupil
                               // note it will be 1/2 of given value per image
                               // ron and darkcurrent are only added if noise = 1
            int noise,         // enable noise ?
-           float *mesvec)     // final measurement vector
+           float *mesvec,     // final measurement vector
+           int fftctx)        // fft workspace context for this wfs (wfs._fftctx)
 
 {
   fftwf_complex *A, *B, *result;
   float         *ptr,*ptr1;
   fftwf_plan     p,p1;
-  float         *x1,*x2,*gnoise;
+  float         *x1,*x2;
   float         tot;
   long          log2nr, log2nc, n, ns;
   int           i,k,sindstride,koff;
-  float         pp,ppsin,ppcos;
   const float   excess_noise_sqr = pow(excessnoise,2.0f);
   const float   one_over_excess_noise_sqr = 1.0f/excess_noise_sqr;
 
@@ -1532,47 +3741,35 @@ int _cwfs (float *pupil,      // input pupil
   n  = 1 << ( log2nr + log2nc ); // total number of pixels in small array
   ns = 1 << log2nr; // total number of pixels in small array
 
-  // Allocate memory for the input operands and check its availability.
-  x1     = ( float* ) malloc ( nsubs * sizeof ( float ) );
-  x2     = ( float* ) malloc ( nsubs * sizeof ( float ) );
-  gnoise = ( float* ) malloc ( nsubs * sizeof ( float ) );
-  A      = fftwf_malloc ( n * sizeof ( fftwf_complex ) );
-  B      = fftwf_malloc ( n * sizeof ( fftwf_complex ) );
-  result = fftwf_malloc ( n * sizeof ( fftwf_complex ) );
+  // Get the workspace for the input operands and check its availability.
+  x1     = yao_fft_workspace ( fftctx, 0, nsubs * sizeof ( float ) );
+  x2     = yao_fft_workspace ( fftctx, 1, nsubs * sizeof ( float ) );
+  A      = yao_fft_workspace ( fftctx, 3, n * sizeof ( fftwf_complex ) );
+  B      = yao_fft_workspace ( fftctx, 4, n * sizeof ( fftwf_complex ) );
+  result = yao_fft_workspace ( fftctx, 5, n * sizeof ( fftwf_complex ) );
 
-  if ( A == NULL || B == NULL || result == NULL ) { return (1); }
+  if ( x1 == NULL || x2 == NULL || \
+       A == NULL || B == NULL || result == NULL ) { return (1); }
 
   for (i=0;i<nsubs;i++) {
     x1[i] = 0.0f;
     x2[i] = 0.0f;
   }
       
-  // Set up the required memory for the FFT routines and 
-  // check its availability.
-  p  = fftwf_plan_dft_2d(ns, ns, A, B, FFTW_FORWARD, FFTWOPTMODE);
-  p1 = fftwf_plan_dft_2d(ns, ns, A, result, FFTW_BACKWARD, FFTWOPTMODE);
+  // Get the (cached) plans for the FFT routines
+  p  = yao_fft_plan(ns, ns, 1, FFTW_FORWARD, YAO_FFT_C2C);
+  p1 = yao_fft_plan(ns, ns, 1, FFTW_BACKWARD, YAO_FFT_C2C);
+
+  if ( p == NULL || p1 == NULL ) { return (1); }
 
 
   // intermediate FFT, to find intermediate complex amplitude
   // fill A
-  ptr = (void *)A;
-  for ( i=0; i<n ; i++ ) {
-    if (pupil[i] != 0.0f) {
-      pp = phasescale*(phase[i]+phaseoffset[i]);
-      if (use_sincos_approx_flag) _sinecosinef(pp,&ppsin,&ppcos);
-      else sincosf(pp,&ppsin,&ppcos);
-      *(ptr)   = pupil[i]*ppcos;
-      *(ptr+1) = pupil[i]*ppsin;
-    } else {
-      *(ptr)   = 0.0f;
-      *(ptr+1) = 0.0f;
-    }
-    ptr += 2;
-  }
+  yao_phasor(A, pupil, phase, phaseoffset, phasescale, n, yao_fft_phasor(fftctx));
 
 
   // Carry out a Forward 2d FFT transform, check for errors.
-  fftwf_execute(p); /* repeat as needed */
+  fftwf_execute_dft(p, A, B); /* repeat as needed */
 
   // image #1:
   ptr = (void *)A;
@@ -1583,7 +3780,7 @@ int _cwfs (float *pupil,      // input pupil
     ptr += 2; ptr1 += 2;
   }
 
-  fftwf_execute(p1); /* repeat as needed */
+  fftwf_execute_dft(p1, A, result); /* repeat as needed */
 
   ptr = (void *)result;
   for ( i=0; i<n; i++ ) {
@@ -1600,7 +3797,7 @@ int _cwfs (float *pupil,      // input pupil
     ptr += 2; ptr1 += 2;
   }
 
-  fftwf_execute(p1); /* repeat as needed */
+  fftwf_execute_dft(p1, A, result); /* repeat as needed */
 
   ptr = (void *)result;
   for ( i=0; i<n; i++ ) {
@@ -1634,16 +3831,12 @@ int _cwfs (float *pupil,      // input pupil
       for ( i=0 ; i<nsubs ; i++ ) { x1[i] += skynphotons/2.0f ; }
       // apply poisson noise
       for ( i=0 ; i<nsubs ; i++ ) { x1[i] *= one_over_excess_noise_sqr; }
-      _poidev(x1,nsubs);
+      yao_rng_poisson(fftctx,x1,nsubs,0);
       for ( i=0 ; i<nsubs ; i++ ) { x1[i] *= excess_noise_sqr; }
     }
     if (ron > 0.0f) {
-      // set up gaussian noise vector
-      for ( i=0 ; i<nsubs ; i++ ) { gnoise[i] = ron; }
-      // draw gaussian noise
-      _gaussdev(gnoise,nsubs);
-      // add to x1
-      for ( i=0 ; i<nsubs ; i++ ) { x1[i] += gnoise[i]; }
+      // add gaussian noise, rms ron
+      yao_rng_gauss(fftctx,x1,nsubs,0,ron);
     }
 
     // x2, same comment as above for x1:
@@ -1655,13 +3848,11 @@ int _cwfs (float *pupil,      // input pupil
       for ( i=0 ; i<nsubs ; i++ ) { x2[i] += darkcurrent/2.0f ; }
       for ( i=0 ; i<nsubs ; i++ ) { x2[i] += skynphotons/2.0f ; }
       for ( i=0 ; i<nsubs ; i++ ) { x2[i] *= one_over_excess_noise_sqr; }
-      _poidev(x2,nsubs);
+      yao_rng_poisson(fftctx,x2,nsubs,0);
       for ( i=0 ; i<nsubs ; i++ ) { x2[i] *= excess_noise_sqr; }
     }
     if (ron > 0.0f) {
-      for ( i=0 ; i<nsubs ; i++ ) { gnoise[i] = ron; }
-      _gaussdev(gnoise,nsubs);
-      for ( i=0 ; i<nsubs ; i++ ) { x2[i] += gnoise[i]; }
+      yao_rng_gauss(fftctx,x2,nsubs,0,ron);
     }    
   }
 
@@ -1673,14 +3864,5 @@ int _cwfs (float *pupil,      // input pupil
     }
   }
 
-  fftwf_destroy_plan(p);
-  fftwf_destroy_plan(p1);
-  free ( x1 );
-  free ( x2 );
-  free ( gnoise );
-  fftwf_free ( A );
-  fftwf_free ( B );
-  fftwf_free ( result );
-
   return (0);
 }
@@ -56,14 +56,21 @@ func calc_psf_fast(pupil,phase,scale=,noswap=)
 
   if (dims(1) == 3) {nplans = int(dims(4));} else {nplans = 1n;}
   
-  err = _calc_psf_fast(&pupil,&phase,&outimage,n,nplans,scale,1n-noswap);
+  err = _calc_psf_fast(&pupil,&phase,&outimage,n,nplans,scale,1n-noswap,0n);
 
   return outimage;
 }
 extern _calc_psf_fast
 /* PROTOTYPE
    int _calc_psf_fast(pointer pupil, pointer phase, pointer image, int n,
-                      int nplans, float scale, int swap)
+                      int nplans, float scale, int swap, int fftctx)
+*/
+
+extern _calc_psf_multi
+/* PROTOTYPE
+   int _calc_psf_multi(float array pupil, float array phase, float array im,
+                       float array imav, int n, int ntarget, float array scal,
+                       int nlambda, int swap, int nthreads, int fftctx)
 */
 
 func fftw_wisdom(void)
@@ -128,6 +135,61 @@ extern _export_wisdom
    int _export_wisdom(string wisdom_file)
 */
 
+func yao_fft_stats(void,zero=,quiet=)
+/* DOCUMENT yao_fft_stats(void,zero=,quiet=)
+   Report on the FFTW plan and workspace registry used by the C
+   engines (_shwfs_phase2spots, _cwfs, _calc_psf_fast, _fftVE).
+   Returns [plan hits, plan misses, workspace hits, workspace misses,
+   # of cached plans, # of contexts in use, workspace size in bytes].
+   zero  = reset the hit/miss counters after reading them
+   quiet = don't print
+   SEE ALSO: yao_fft_free, _yao_fft_context_new
+ */
+{
+  stats = array(long,7);
+  _yao_fft_stats,stats,int(is_set(zero));
+  if (!is_set(quiet)) {
+    write,format="FFT plans     : %d hits, %d misses, %d cached\n",
+      stats(1),stats(2),stats(5);
+    write,format="FFT workspaces: %d hits, %d misses, %d contexts, %.1f MB\n",
+      stats(3),stats(4),stats(6),stats(7)/1024.^2;
+  }
+  return stats;
+}
+
+func yao_fft_free(ctx,plans=,release=)
+/* DOCUMENT yao_fft_free(ctx,plans=,release=)
+   Free the workspaces of context(s) ctx (all contexts if ctx is void).
+   release = also release the context handles, so that they can be
+             handed out again by _yao_fft_context_new()
+   plans   = also destroy all the cached FFTW plans
+   Called with no argument by reset(), with release=1 by aoinit and
+   with release=1,plans=1 by aoinit,clean=1.
+   SEE ALSO: yao_fft_stats
+ */
+{
+  if (ctx==[]) ctx = -1;
+  for (i=1;i<=numberof(ctx);i++) _yao_fft_context_free,int(ctx(i)),int(is_set(release));
+  if (is_set(plans)) _yao_fft_plans_free;
+}
+
+extern _yao_fft_context_new
+/* PROTOTYPE
+   int _yao_fft_context_new(void)
+*/
+extern _yao_fft_context_free
+/* PROTOTYPE
+   void _yao_fft_context_free(int ctx, int release)
+*/
+extern _yao_fft_plans_free
+/* PROTOTYPE
+   void _yao_fft_plans_free(void)
+*/
+extern _yao_fft_stats
+/* PROTOTYPE
+   void _yao_fft_stats(long array stats, int zero)
+*/
+
 extern _set_sincos_approx
 /* PROTOTYPE
    void _set_sincos_approx(int flag)
@@ -141,11 +203,262 @@ func use_sincos_approx(use_it)
   else return _get_sincos_approx();
 }
 
+extern _set_fft_pruning
+/* PROTOTYPE
+   void _set_fft_pruning(int mode)
+*/
+
+extern _get_fft_pruning;
+
+func fft_pruning(mode)
+/* DOCUMENT fft_pruning(mode)
+   Set (fft_pruning,mode) or get (fft_pruning()) the pruned FFT mode of
+   the PSF and SH engines. When the pupil (or subaperture) only fills
+   the first pass rows [j0,j0+nrows) of the padded array, the first pass
+   row FFTs are restricted to these rows, the column FFTs are then done
+   on the full array.
+   mode = 0: never, 1: when the support covers less than half of the
+   padded array (default), 2: always.
+   SEE ALSO: fft_pruning_bench
+ */
+{
+  if (mode!=[]) _set_fft_pruning,int(mode(1));
+  else return _get_fft_pruning();
+}
+
+func fft_pruning_bench(n,diams=,niter=)
+/* DOCUMENT fft_pruning_bench(n,diams=,niter=)
+   Times _calc_psf_fast with the plain and pruned FFT paths, for a n*n
+   [256] array and pupil diameters diams [n*(0.25,0.4,0.5,0.6,0.7,0.8)],
+   over niter [20] calls. Prints the time per call, the speedup and the
+   max difference between the two images (relative to the peak).
+   SEE ALSO: fft_pruning
+ */
+{
+  if (n==[]) n = 256;
+  if (diams==[]) diams = long(n*[0.25,0.4,0.5,0.6,0.7,0.8]);
+  if (niter==[]) niter = 20;
+  mode = fft_pruning();
+  pha = float(random_n(n,n));
+  im1 = im2 = array(float,n,n);
+  write,format="%s\n","   n  pupd  plain[ms]  pruned[ms]  speedup  max rel. diff";
+  for (i=1;i<=numberof(diams);i++) {
+    pup = float(make_pupil(n,diams(i),xc=n/2+0.5,yc=n/2+0.5));
+    fft_pruning,0;
+    _calc_psf_fast,&pup,&pha,&im1,n,1,1.0f,1n,0n; // plans
+    tic; for (j=1;j<=niter;j++) _calc_psf_fast,&pup,&pha,&im1,n,1,1.0f,1n,0n;
+    t1 = tac()/niter*1e3;
+    fft_pruning,2;
+    _calc_psf_fast,&pup,&pha,&im2,n,1,1.0f,1n,0n;
+    tic; for (j=1;j<=niter;j++) _calc_psf_fast,&pup,&pha,&im2,n,1,1.0f,1n,0n;
+    t2 = tac()/niter*1e3;
+    write,format="%4d  %4d  %9.3f  %10.3f  %7.2f  %.2g\n",n,diams(i),t1,t2,t1/t2,
+      max(abs(im2-im1))/max(im1);
+  }
+  fft_pruning,mode;
+}
+
 extern _sinecosinef
 /* PROTOTYPE
    void _sinecosinef(float x, pointer s, pointer c)
 */
 
+extern _yao_phasor_tier
+/* PROTOTYPE
+   void _yao_phasor_tier(int ctx, int tier)
+*/
+extern _yao_phasor
+/* PROTOTYPE
+   void _yao_phasor(float array out, float array amp, float array phase,
+   float scal, long n, int tier)
+*/
+
+func yao_phasor(amp,phase,tier=,scal=)
+/* DOCUMENT yao_phasor(amp,phase,tier=,scal=)
+   Returns amp*exp(1i*scal*phase) as computed by the C engines,
+   as a [2,dimsof(phase)] float array (real, imaginary).
+   tier = accuracy tier (see wfs.phasor): 0 as per use_sincos_approx(),
+          1 sincosf, 2 old approximation, 3 polynomial, 4 table [0]
+   scal = phase scaling factor [1.]
+   SEE ALSO: yao_phasor_check
+ */
+{
+  phase = float(phase);
+  amp = float(amp)+array(0.0f,dimsof(phase));
+  if (scal==[]) scal = 1.;
+  out = array(float,_cat(2,dimsof(phase)));
+  _yao_phasor,out,amp,phase,float(scal),numberof(phase),int(tier);
+  return out;
+}
+
+func yao_phasor_check(xmax,n=,quiet=,noerr=)
+/* DOCUMENT yao_phasor_check(xmax,n=,quiet=,noerr=)
+   Max absolute error of the phasor accuracy tiers vs double precision
+   sin/cos, for n [1e6] phases evenly spaced in [-xmax,xmax] (xmax
+   defaults to 100 rad). Also times each tier. Returns the errors
+   for tier=1..4. Typical values (x86_64):
+     xmax=3.2    : 3.3e-8 (sincosf), 1.1e-3 (old), 9.2e-8 (poly), 1.2e-7 (table)
+     xmax=1e4    : 3.3e-8 (sincosf), 2.3e-3 (old), 9.3e-8 (poly), 1.2e-7 (table)
+     xmax=1e6    : 3.2e-8 (sincosf), 6.6e-2 (old), 9.2e-8 (poly), 1.2e-7 (table)
+   The documented bounds, checked here, are 1e-7 (sincosf), 2e-3+1e-7*xmax
+   (old: its range reduction loses accuracy with the phase), 2e-7 (poly)
+   and 2e-7 (table). Any error over its bound is an error (so this can
+   be used as a test), unless noerr=1.
+   The poly and table tiers are 3 to 6 times faster than sincosf.
+   SEE ALSO: yao_phasor, use_sincos_approx
+ */
+{
+  if (xmax==[]) xmax = 100.;
+  if (n==[]) n = long(1e6);
+  x = float(span(-xmax,xmax,n));
+  xd = double(x);
+  err = tim = array(0.,4);
+  for (tier=1;tier<=4;tier++) {
+    tic; ph = yao_phasor(1.0f,x,tier=tier); tim(tier) = tac();
+    err(tier) = max(max(abs(ph(1,)-cos(xd))),max(abs(ph(2,)-sin(xd))));
+  }
+  bound = [1e-7,2e-3+1e-7*abs(xmax),2e-7,2e-7];
+  names = ["sincosf","old approx","polynomial","table"];
+  if (!is_set(quiet)) {
+    for (tier=1;tier<=4;tier++) \
+      write,format="tier %d (%-11s): max error %.2g (bound %.2g), %.1f ns/phasor\n",
+        tier,names(tier),err(tier),bound(tier),tim(tier)/n*1e9;
+  }
+  if ((!is_set(noerr)) && anyof(err > bound)) {
+    w = where(err > bound)(1);
+    error,swrite(format="phasor tier %d (%s): max error %.2g over its bound %.2g",
+                 w,names(w),err(w),bound(w));
+  }
+  return err;
+}
+
+
+extern _yao_rng_seed
+/* PROTOTYPE
+   void _yao_rng_seed(long seed)
+*/
+extern _yao_rng_stream
+/* PROTOTYPE
+   void _yao_rng_stream(int ctx, int stream)
+*/
+extern _yao_rng_draw
+/* PROTOTYPE
+   void _yao_rng_draw(int ctx, int draw)
+*/
+extern _yao_rng_poisson
+/* PROTOTYPE
+   void _yao_rng_poisson(int ctx, float array x, long n, long index0)
+*/
+extern _yao_rng_gauss
+/* PROTOTYPE
+   void _yao_rng_gauss(int ctx, float array x, long n, long index0, float sigma)
+*/
+
+func yao_poidev(x,ctx=,index0=)
+/* DOCUMENT yao_poidev(x,ctx=,index0=)
+   Poisson deviates of mean x, from the counter based generator of the
+   C engines (the wfs noise). Each call is a new draw of stream ctx.
+   ctx    = fft context, whose stream is used [0]
+   index0 = index of x(1) in the stream [0]. Elements with the same
+            index in the same draw get the same deviate, whatever
+            the split of the calls.
+   SEE ALSO: yao_gaussdev, yao_rng_check, sim.rngseed
+ */
+{
+  x = float(x)+0.0f; // a copy, x may be the caller's array
+  _yao_rng_poisson,int(ctx),x,numberof(x),long(index0);
+  return x;
+}
+
+func yao_gaussdev(dims,ctx=,index0=)
+/* DOCUMENT yao_gaussdev(dims,ctx=,index0=)
+   As gaussdev(dims), from the counter based generator of the C engines.
+   See yao_poidev for ctx and index0.
+   SEE ALSO: yao_poidev, yao_rng_check
+ */
+{
+  x = array(float,dims);
+  _yao_rng_gauss,int(ctx),x,numberof(x),long(index0),1.0f;
+  return x;
+}
+
+func yao_rng_check(n,quiet=)
+/* DOCUMENT yao_rng_check(n,quiet=)
+   Checks the noise generator of the C engines on n [1e6] deviates:
+   mean and variance of Poisson deviates (means 0.5 to 1e4, both
+   samplers), mean, variance and kurtosis of the gaussian ones, and that
+   the deviates do not depend on how a draw is split in calls. The
+   splits are the ones of the engines: blocks of pixels (subapertures)
+   handed out round robin to 1 to 4 threads, and contiguous ranges
+   done in reverse order (svipc forks). The split deviates have to be
+   identical to the ones of a single call, and the moments within 6
+   sigma of their expected values, otherwise this is an error.
+   Also times them against poidev/gaussdev.
+   Returns the max relative error on the Poisson variance (should be
+   a few sqrt(2/n)).
+   SEE ALSO: yao_poidev, yao_gaussdev
+ */
+{
+  if (n==[]) n = long(1e6);
+  ctx = _yao_fft_context_new();
+  _yao_rng_stream,ctx,1n;
+  lam = [0.5,3.,9.9,10.,50.,1e4];
+  err = 0.;
+  msg = [];
+  for (i=1;i<=numberof(lam);i++) {
+    x = array(float(lam(i)),n);
+    tic; y = yao_poidev(x,ctx=ctx); t1 = tac();
+    tic; z = poidev(x); t2 = tac();
+    rvar = abs(y(rms)^2/lam(i)-1);
+    err = max(err,rvar);
+    if (!is_set(quiet)) write,format="poisson %6g: mean %.5g var %.5g, %.0f ns/dev "+
+      "(poidev %.0f ns/dev)\n",lam(i),avg(y),y(rms)^2,t1/n*1e9,t2/n*1e9;
+    if ((abs(avg(y)-lam(i)) > 6*sqrt(lam(i)/n)) || (rvar > 6*sqrt((2+1./lam(i))/n)))
+      grow,msg,swrite(format="poisson %g: mean %.5g var %.5g",lam(i),avg(y),y(rms)^2);
+  }
+  tic; y = yao_gaussdev(n,ctx=ctx); t1 = tac();
+  tic; z = gaussdev(n); t2 = tac();
+  kurt = avg((y-avg(y))^4)/y(rms)^4;
+  if (!is_set(quiet)) write,format="gauss: mean %.2g var %.5g kurtosis %.4f, %.0f ns/dev "+
+    "(gaussdev %.0f ns/dev)\n",avg(y),y(rms)^2,kurt,t1/n*1e9,t2/n*1e9;
+  if ((abs(avg(y)) > 6/sqrt(n)) || (abs(y(rms)^2-1) > 6*sqrt(2./n)) ||
+      (abs(kurt-3) > 6*sqrt(24./n)))
+    grow,msg,swrite(format="gauss: mean %.2g var %.5g kurtosis %.4f",avg(y),y(rms)^2,kurt);
+  // split invariance: same draw, in one call or split as the engines do
+  x = float(indgen(n)%37)*0.7f;
+  _yao_rng_draw,ctx,5n; y = yao_poidev(x,ctx=ctx);
+  _yao_rng_draw,ctx,5n; g = yao_gaussdev(n,ctx=ctx);
+  blk = 1000; // pixels per subaperture
+  nblk = (n+blk-1)/blk;
+  for (nth=1;nth<=5;nth++) {
+    y2 = x*0; g2 = x*0;
+    if (nth <= 4) {  // threads: subapertures t, t+nth, ...
+      for (t=0;t<nth;t++) {
+        for (b=t;b<nblk;b+=nth) {
+          i1 = b*blk+1; i2 = min(n,(b+1)*blk);
+          _yao_rng_draw,ctx,5n; y2(i1:i2) = yao_poidev(x(i1:i2),ctx=ctx,index0=i1-1);
+          _yao_rng_draw,ctx,5n; g2(i1:i2) = yao_gaussdev(i2-i1+1,ctx=ctx,index0=i1-1);
+        }
+      }
+      layout = swrite(format="%d thread(s)",nth);
+    } else {         // forks: 3 contiguous ranges, the last one first
+      k = [0,n/3,(2*n)/3,n];
+      for (f=3;f>=1;f--) {
+        i1 = k(f)+1; i2 = k(f+1);
+        _yao_rng_draw,ctx,5n; y2(i1:i2) = yao_poidev(x(i1:i2),ctx=ctx,index0=i1-1);
+        _yao_rng_draw,ctx,5n; g2(i1:i2) = yao_gaussdev(i2-i1+1,ctx=ctx,index0=i1-1);
+      }
+      layout = "3 forks";
+    }
+    same = allof(y2 == y) && allof(g2 == g);
+    if (!is_set(quiet)) write,format="split draw, %s: %s\n",layout,
+                          (same? "identical": "DIFFERENT");
+    if (!same) grow,msg,"split draw, "+layout+": deviates differ from one call";
+  }
+  _yao_fft_context_free,ctx,1n;
+  if (numberof(msg)) error,"yao_rng_check failed: "+(msg+"; ")(sum);
+  return err;
+}
 
 func fftVE(realp,imagp,dir)
 {
@@ -207,12 +520,13 @@ extern _shwfs_phase2spots
    float array kerffti, int initkernels, int kernelconv,
    int array binindices, int binxy, int rebinfactor, int nx,
    float array unittip, float array unittilt,
-   float array lgs_profile, float array defocuses, int n_in_profile,
+   float array lgs_profile, float array defocuses, int n_in_profile, int lgs_fast,
    float array unit_defocus, float array fimage, int array svipc_subok,
    int array imistart, int array jmistart, int fimnx, int fimny,
    float array flux, float array rayleighflux, float array skyflux, 
    float darkcurrent, int rayleighflag, float array rayleigh,
-   int bckgrdinit, int counter, int niter)
+   int bckgrdinit, int counter, int niter, int nbatch, int nthreads,
+   int fftctx)
 */
 
 extern _shwfs_spots2slopes
@@ -220,10 +534,11 @@ extern _shwfs_spots2slopes
    int _shwfs_spots2slopes( float array fimage, int array imistart2,
    int array imjstart2, int nsubs, int binxy2, int fimnx, int fimny,
    int yoffset, float array centroidw, long shthmethod, float array threshold,
+   float array refspots, float array mfilter, int refinit,
    float array bias, float array flat,
    float ron, float excessnoise, long noise, float array bckgrdcalib,
    int bckgrdinit, int bckgrdsub, int array validsubs, int array svipc_subok,
-   int niter, float array mesvec)
+   int niter, float array mesvec, int fftctx)
 */
 
 extern _shwfs_simple
@@ -240,7 +555,55 @@ extern _cwfs
    float array phaseoffset, float array cxdef, float array sxdef,
    int dimpow2, int array sind, int array nsind, int nsubs,
    float array fimage, float array fimage2, float nphotons, float skynphotons,
-   float ron, float excessnoise, float darkcurrent, int noise, float array mesvec)
+   float ron, float excessnoise, float darkcurrent, int noise, float array mesvec,
+   int fftctx)
+*/
+
+extern _dm_fourier_kernel
+/* PROTOTYPE
+   int _dm_fourier_kernel(float array ker, int ksize, int n, float array kerf)
+*/
+
+extern _dm_fourier_shape
+/* PROTOTYPE
+   int _dm_fourier_shape(pointer kerf, int n, int off, pointer i1, pointer j1,
+                         int nact, pointer coefs, pointer dmshape, int outnx,
+                         int outny)
+*/
+
+extern _ftr_recon
+/* PROTOTYPE
+   int _ftr_recon(float array mes, int nsub, int array ix, int array iy, int n,
+                  int array bounds, float array filt, int niter, int nout,
+                  int array ia, int array ja, float array out)
+*/
+
+extern _yao_sp_init
+/* PROTOTYPE
+   int _yao_sp_init(int h, int sym, long r, long c, long array ix,
+                    long array jx, float array xn, float array xd)
+*/
+
+extern _yao_sp_free
+/* PROTOTYPE
+   void _yao_sp_free(int h)
+*/
+
+extern _yao_sp_xv
+/* PROTOTYPE
+   int _yao_sp_xv(int h, float array v, float array u)
+*/
+
+extern _yao_sp_precond
+/* PROTOTYPE
+   int _yao_sp_precond(int h, int a0, int nact, int n, int array ia,
+                       int array ja, float array filt)
+*/
+
+extern _yao_sp_pcg
+/* PROTOTYPE
+   int _yao_sp_pcg(int h, float array b, float array x, float tol, int maxit,
+                   float array res)
 */
 
 // _fftw_init_threads;
@@ -248,7 +248,7 @@ func comp_turb_lgs_kernel(ns,init=)
   err = _get2dPhase(wfs(1)._LLT_pscreen,d(2),d(3),1,&skip,
                     wfs(ns)._LLT_phase,wfs(ns)._nx4fft,wfs(ns)._nx4fft,
                     &ishifts,&xshifts,
-                    &jshifts,&yshifts);
+                    &jshifts,&yshifts,1n);
 
   psf = calc_psf_fast(*wfs(ns)._LLT_pupil,*wfs(ns)._LLT_phase,scale=scal,noswap=1);
 
@@ -27,12 +27,12 @@ local yao_setnsync;
    in an yao session, e.g., r0, wfs noise, wfs flux, etc...
    - Set the proper variables, and write in shared memory if need be.
    - Execute the needed action to effect the change (e.g. changing
-     the Cn2 profile will need to re-run get_turb_phase_init() )
+     the Cn2 profile will need to re-run get_turb_phase_weights() )
 
    Implement syncing of the child, when in svipc mode.
    - read the shared memory structure
    - Execute the needed action to effect the change (e.g. changing
-     the Cn2 profile will need to re-run get_turb_phase_init() )
+     the Cn2 profile will need to re-run get_turb_phase_weights() )
    SEE ALSO: yao, yao_svipc
 */
 
@@ -229,8 +229,8 @@ func set_dr0(dr0)
     // broadcast message to children
     broadcast_sync,targets,"sync_dr0";
   }
-  // action to take.
-  get_turb_phase_init,skipReadPhaseScreens=0;
+  // action to take (the weights are applied by the ray tracer).
+  get_turb_phase_weights;
 }
 
 func sync_dr0(void)
@@ -243,8 +243,8 @@ func sync_dr0(void)
   }
   write,format="D/r0 sync'ed on child %s (D/r0=%.2f)\n",\
     svipc_procname,atm.dr0at05mic;
-  // action to take.
-  get_turb_phase_init,skipReadPhaseScreens=0;
+  // action to take (the weights are applied by the ray tracer).
+  get_turb_phase_weights;
 }
 
 
@@ -273,8 +273,8 @@ func set_cn2(layerfrac)
     // broadcast message to children
     broadcast_sync,targets,"sync_cn2";
   }
-  // action to take.
-  get_turb_phase_init,skipReadPhaseScreens=1;
+  // action to take (the weights are applied by the ray tracer).
+  get_turb_phase_weights;
 }
 
 func sync_cn2(void)
@@ -286,8 +286,8 @@ func sync_cn2(void)
     restore,openb(var);
   }
   write,format="Cn2 sync'ed on child %s\n",svipc_procname;
-  // action to take.
-  get_turb_phase_init,skipReadPhaseScreens=1;  
+  // action to take (the weights are applied by the ray tracer).
+  get_turb_phase_weights;
 }
 
 
@@ -399,6 +399,8 @@ func set_lgs_profile(amp,alt,lgs_focus_alt,ns)
     if (alt!=[]) wfs(ns(i)).lgs_prof_alt = &float(alt);
     if (lgs_focus_alt!=[]) wfs(ns(i)).lgs_focus_alt = lgs_focus_alt; \
     shwfs_comp_lgs_defocuses,ns(i);
+    // with wfs.lgs_fast, the profile lives in the kernels FFTs:
+    if (wfs(ns(i)).lgs_fast) wfs(ns(i))._initkernels = 1n;
   }
   
   if (sim.svipc) {
@@ -82,6 +82,8 @@ struct sim_struct
                           // some image calculations. Optional [0]
   long    debug;          // set the debug level (0:no debug, 1:some, 2: most). Optional [0]
   long    verbose;        // set the verbose level (0:none, 1: some, 2: most). Optional [0]
+  long    rngseed;        // seed of the wfs noise generator (C engines). Gives the same
+                          // noise whatever nthreads/svipc. 0: from random(). Optional [0]
   long    svipc;          // set to the number of process for parallelization
                           // 0 = no parallelization
                           // bits    effect
@@ -126,6 +128,15 @@ struct atm_struct
                           // phase screen generated by another party.
   // Required [none]
   pointer winddir;        // Wind dir (use 0 for now)
+  long    infinite;       // 1: the screens are not read from atm.screen but extruded
+                          // on the fly as the layers move (Assemat et al. 2006).
+                          // Memory is set by the beam footprint, not by loop.niter.
+                          // Optional [0]
+  float   L0;             // Outer scale (m) of the infinite screens. Optional [25]
+  long    screen_int16;   // 1: the screens are stored as int16 with a per screen
+                          // scale, converted by the ray tracer. Half the memory
+                          // and memory traffic, for a few 1e-5 relative rms phase
+                          // error (see get2dphase_int16_check). Optional [0]
   // Internal variables
   pointer _layeralt;      // float vectorptr. Actual layer altitude (m), from atm.alt & zen.angle
 };
@@ -179,6 +190,14 @@ struct wfs_struct
                           // see user_pupil(). Allow for GMT-type topology.
   long    svipc;          // number of parallel process to use for this WFS.
                           // (0 or 1: don't parallelize)
+  long    nthreads;       // number of threads to split the SH subapertures over
+                          // (in process, see also svipc), also used for the
+                          // phase ray tracing (any type). Optional [1]
+  long    fftbatch;       // number of SH subapertures per batch (phasors, FFTs,
+                          // then spots; bit identical spots). Optional [1]
+  long    phasor;         // accuracy of exp(i*phase) in the C engine: 0 as per
+                          // use_sincos_approx(), 1 sincosf, 2 old approximation,
+                          // 3 polynomial (SIMD), 4 table (SIMD). Optional [0]
   float   zeropoint;      // zeropoint for the wavefront sensor. Optional [0.]
   long    ncpdm;          // DM on the path of the WFS, if any
   pointer dmnotinpath;    // vector with indices of DM NOT in this WFS path
@@ -220,7 +239,9 @@ struct wfs_struct
                           // will be rounded of to nearest possible value.
   float   pupoffset(2);   // offset of the whole wfs subs w.r.t telescope aperture [meter]
                           // allow misregistration w.r.t tel pupil and funky configurations
-  long    shthmethod;     // 1: yao default, 2: podium, 3: brightest pixels. Required [1]
+  long    shthmethod;     // 1: yao default, 2: podium, 3: brightest pixels,
+                          // 4: correlation, 5: matched filter (4 & 5 w.r.t. reference
+                          // spots taken with the reference measurements). Required [1]
   float   shthreshold;    // Threshold in computation of subaperture signal, >=0. Optional [0]
   float   shcalibseeing;  // fraction of the seeing FWHM to be used in the iMat calibration
   float   biasrmserror;   // rms error on WFS bias in electron. Optional [0]
@@ -248,6 +269,10 @@ struct wfs_struct
   float   lgs_focus_alt;  // LGS WFS current focusing altitude [m]
   pointer lgs_prof_amp;   // vector of lgs profile (intensity, Arbitrary, renormlaized later using laserpower), same # as lgs_prof_alt
   pointer lgs_prof_alt;   // vector of lgs profile (altitudes [m]), same # as lgs_prof_amp
+  long    lgs_fast;       // 1: elongation from the lgs profile as a per subaperture
+                          // transfer function (one FFT/subap instead of one per
+                          // profile point; neglects the intra-subap defocus).
+                          // 0 (default): exact. See shwfs_lgs_fast_check.
 
   // zernike wfs only
   int     nzer;           // # of zernike sensed
@@ -326,9 +351,10 @@ struct wfs_struct
   pointer _submask;       // internal: array. subaperture amplitude mask.
   pointer _kernel;        // internal: kernel for _shwfs. use: dointer or LGS uplink im.
   pointer _kernels;       // internal: subaperture dependant image kernel
-  pointer _kerfftr;       // internal: storage of FFTs of kernels
-  pointer _kerffti;       // internal: storage of FFTs of kernels
+  pointer _kerfftr;       // internal: storage of FFTs of kernels (hermitian half)
+  pointer _kerffti;       // internal: storage of FFTs of kernels (hermitian half)
   int     _kernelconv;    // interal: convolve with kernel in _shwfs?
+  int     _fftctx;        // internal: handle to C fft plans/workspace context
   int     _cyclecounter;  // counter in integration sequence (see nintegcycles above)
   pointer _dispimage;     // image to display (same as fimage except if nintegcycles!=1)
   pointer _x;             // shwfs: X positions of subaperture centers
@@ -338,6 +364,9 @@ struct wfs_struct
   pointer _bckgrdcalib;   // pointer to background array calibration
   int     _bckgrdinit;    // set to one to fill calibration array
   int     _bckgrdsub;     // set to one to subtract background (default)
+  pointer _refspots;      // reference spots for shthmethod 4 & 5 (1 element dummy otherwise)
+  pointer _mfilter;       // matched filters and reference data for shthmethod 4 & 5
+  int     _refinit;       // set to one to take the reference spots
   pointer _meashist;      // measurement history, useful for nintegcycles > 1
   float   _zeropoint;     // zeropoint for the wavefront sensor.
   pointer _pha2dhc;       // projection matrix phase to DH coefs for this wfs
@@ -404,6 +433,11 @@ struct dm_struct
   float   xscale;         // scale fractional difference x vs y. 0 [default] would be no scale
                           // difference. 0.1 would mean X pitch is 10% smaller than Y pitch.
   string  actlocfile;     // fits file specifying the DM actuator locations. Only implemented for stackarray DMs.
+  long    nthreads;       // number of threads to split the DM shape (comp_dm_shape) over. Optional [1]
+  long    incremental;    // set to update the DM shape from the command changes instead
+                          // of recomputing it each iteration. Optional [0]
+  float   incr_tol;       // incremental: smallest command change applied (accumulates). Optional [0]
+  long    incr_resync;    // incremental: recompute from scratch every incr_resync updates. Optional [100]
 
   // Bimorph-only keywords:
   pointer nelperring;     // long vectorptr. # of elec. per ring, e.g &([6,12,18]). Required [none]
@@ -422,6 +456,8 @@ struct dm_struct
   string  ecmatfile;      // valid to extrap. actuator matrix (extrap_com). Optional.
   long    noextrap;       // set to 1 if no extrapolated actuators whatsoever are to be used [0]
   long    elt;            // set to 1 if fast dmsum to be used
+  long    fourier;        // elt=1: DM shape by FFT convolution of the command grid with
+                          // the (single, shift-invariant) IF. Optional [0]
   long    irexp;          // use old/regular form (irexp=0) or
                           // exp(-(d/irfact)^1.5) model (irexp=1) or
                           // sinc*gaussian (irexp=2)
@@ -484,18 +520,38 @@ struct dm_struct
   pointer _flat_command;  // pointer to command vector
   pointer _extrapcmat;    // extrapolation matrix: extrap_com = extrapmat(,+)*valid_com(+)
   int     _eltdefsize;    // size of def in case elt=1
+  pointer _sbox;          // Internal: [4,nact] int bounding boxes (i0,j0,nx,ny) of the IFs
+  pointer _sdef;          // Internal: IF values in the boxes, packed (comp_dm_shape_init)
+  pointer _sdefof;        // Internal: the _def _sbox and _sdef were made from
+  pointer _esbox;         // Internal: same as _sbox for the extrap. actuators
+  pointer _esdef;         // Internal: same as _sdef for the extrap. actuators
+  pointer _esdefof;       // Internal: the _edef _esbox and _esdef were made from
+  pointer _sshape;        // Internal: incremental shape (before _puppixoffset/disjointpup)
+  pointer _sprev;         // Internal: commands _sshape was made with
+  long    _sincr;         // Internal: incremental updates since _sshape last recomputed
+  pointer _esshape;       // Internal: same as _sshape for the extrap. actuators
+  pointer _esprev;        // Internal: same as _sprev for the extrap. actuators
+  long    _esincr;        // Internal: same as _sincr for the extrap. actuators
+  pointer _fkern;         // Internal: dm.fourier, r2c FFT of the IF kernel (comp_dm_shape_init)
+  long    _fn;            // Internal: dm.fourier, FFT size
+  long    _fks;           // Internal: dm.fourier, IF kernel size (impulse offset in _fkern grid)
   pointer _regmatrix;     // regularization matrix used, if any
   pointer _fMat;          // fitting matrix for tomography
+  int     _spfmat;        // Internal: mat.sparse_pcg, C handle of _fMat (yao_sparse_init)
 };
 
 struct mat_struct
 {
-  string  method;         // reconstruction method: "svd" (default), "mmse", "mmse-sparse"
+  string  method;         // reconstruction method: "svd" (default), "mmse", "mmse-sparse", "ftr"
   pointer condition;      // float vecorptr. Condition numbers for SVD, per subsystem. Required [none]
   long    sparse_MR;      // maximum number of rows for sparse method
   long    sparse_MN;      // maximum number of elements for sparse method
   float   sparse_thresh;  // threshold for non-zero sparse elements
   float   sparse_pcgtol;  // tolerance for reconstruction, default = 1e-3
+  long    sparse_pcg;     // PCG of the sparse method, warm started from the previous solution:
+                          // 0: soy ruopcg, 1: C (products and PCG in C, jacobi preconditioner),
+                          // 2: C with FFT preconditioner on the stackarray DMs. Optional [0]
+  long    sparse_maxit;   // mat.sparse_pcg: maximum number of PCG iterations. Optional [1000]
   string  file;           // iMat and cMat filename. Leave it alone.
   // fitting parameters for tomographic reconstruction
   long    fit_simple;     // 0 or 1, default = 0. Simple optimizes on the optical axis and only works if the tomographic DM is the same as the corresponding virtual DMs, but is faster.
@@ -504,6 +560,29 @@ struct mat_struct
   string  fit_type;       // optimize for a target or wfs location
   long    fit_which;      // which target or wfs to optimize fitting for, default = 1
   float   fit_minval;     // minimum value for sparse fitting matrix, default = 1e-2
+  long    mvm;            // svd/mmse: reconstruct with the C engine (cMat, dMat in C storage):
+                          // 0: yorick, 1: float, 2: bf16, 3: fp16. Optional [0]
+  long    nthreads;       // number of threads to split the C reconstructor rows over. Optional [1]
+  long    lowrank;        // svd only: reconstruct with the SVD factors (2 skinny MVMs, modal
+                          // gains applied in between) instead of cMat. Optional [0]
+  long    ftr_dm;         // ftr: DM reconstructed with the FTR (stackarray). Optional [the largest one]
+  long    ftr_wfs;        // ftr: hartmann WFS it is reconstructed from (shnxsub=nxact-1). Optional [auto]
+  long    ftr_niter;      // ftr: boundary iterations after the slope extension. Optional [0]
+  pointer ftr_filter;     // ftr: gains per spatial frequency, [n/2+1,n] (see ftr_freq). Optional [none]
+  int     _mvm;           // Internal: C reconstructor handle (yao_mvm_init), -1: none
+  int     _spata;         // Internal: mat.sparse_pcg, C handles of AtAregSP,
+  int     _spgx;          //   GxSP
+  int     _sppolc;        //   and polcMatSP (-1 if none)
+  pointer _spx;           // Internal: mmse-sparse, previous solution (PCG warm start)
+  long    _spniter;       // Internal: mat.sparse_pcg, PCG iterations of the last loop iteration
+  long    _ftrn;          // Internal: FTR grid size
+  pointer _ftrfilt;       // Internal: FTR filters (x, y slopes to phase, post filter)
+  pointer _ftrsub;        // Internal: FTR grid coordinates of the subapertures [nsub,2]
+  pointer _ftrbnd;        // Internal: FTR slope extension bounds [n,4]
+  pointer _ftract;        // Internal: FTR grid coordinates of the actuators [nact,2]
+  pointer _ftrmes;        // Internal: FTR WFS measurement indices in the mesvec
+  pointer _ftrother;      // Internal: actuators of the other DMs (cMat)
+  pointer _ftrdoth;       // Internal: iMat of the other DMs on the FTR WFS
 };
 
 struct tel_struct
@@ -535,10 +614,15 @@ struct target_struct
   pointer yspeed;         // float vectorptr. Y speed in arcsec/s. Default [0.]
   pointer dispzoom;       // float vectorptr. Display zoom (typically around 1.). Optional [1.]
   pointer ncpdm;          // DM on the path of the targets, if any
+  long    phasor;         // accuracy of exp(i*phase) for the PSFs, see wfs.phasor.
+                          // Optional [0]
+  long    nthreads;       // number of threads to split the (target,lambda) PSFs
+                          // and the phase ray tracing over. Optional [1]
 
   // Internal keywords
   long    _ntarget;       // Internal: # of target
   long    _nlambda;       // Internal: # of lambda
+  int     _fftctx;        // Internal: handle to C fft plans/workspace context (PSFs)
 };
 
 struct gs_struct
@@ -174,6 +174,9 @@ func svipc_wfs_init(phase,ns)
   // it'll be impossible to compare results for short sample length.
   // at least that's the philosophy I've been following with yao
   // since a long time. So let's do that this way:
+  // (the wfs noise of the C engines does not need it: it is drawn from
+  // a counter based generator, same noise for a pixel whatever fork
+  // computes it, see sim.rngseed. This is for the yorick side randoms)
   svipc_random_seeds = random(wfs(ns).svipc);
   // if the user decides to restart a run and wish to use the same
   // random seed, he should do
@@ -282,6 +285,7 @@ func wfs_fork_listen(ns,nf)
             wfs(ns)._rebinfactor, wfs(ns)._nx4fft, *wfs(ns)._unittip, 
             *wfs(ns)._unittilt, *wfs(ns).lgs_prof_amp,
             *wfs(ns)._lgs_defocuses, int(numberof(*wfs(ns).lgs_prof_amp)),
+            int(wfs(ns).lgs_fast),
             *wfs(ns)._unitdefocus, ffimage, svipc_subok,
             *wfs(ns)._imistart, *wfs(ns)._imjstart,
             wfs(ns)._fimnx , wfs(ns)._fimny,
@@ -289,7 +293,8 @@ func wfs_fork_listen(ns,nf)
             *wfs(ns)._skyfluxpersub, float(wfs(ns).darkcurrent*loop.ittime),
             int(wfs(ns).rayleighflag),
             *wfs(ns)._rayleigh, wfs(ns)._bckgrdinit,
-            wfs(ns)._cyclecounter, wfs(ns).nintegcycles);
+            wfs(ns)._cyclecounter, wfs(ns).nintegcycles, int(wfs(ns).fftbatch),
+            int(wfs(ns).nthreads), wfs(ns)._fftctx);
 
     // give trigger back:
     if (sim.debug>20) write,format="fork: giving trigger on sem %d\n",20+4*(ns-1)+1;
@@ -300,7 +305,7 @@ func wfs_fork_listen(ns,nf)
 
     threshold   = array(float,wfs(ns)._nsub4disp+1)+wfs(ns).shthreshold;
 
-    err = _shwfs_spots2slopes(ffimage, *wfs(ns)._imistart2, *wfs(ns)._imjstart2, wfs(ns)._nsub4disp, wfs(ns).npixels, wfs(ns)._fimnx, fimny2, yoffset, *wfs(ns)._centroidw, wfs(ns).shthmethod, threshold, *wfs(ns)._bias, *wfs(ns)._flat, wfs(ns).ron, wfs(ns).excessnoise, wfs(ns).noise, *wfs(ns)._bckgrdcalib, wfs(ns)._bckgrdinit, wfs(ns)._bckgrdsub, *wfs(ns)._validsubs, svipc_subok2, wfs(ns).nintegcycles, mesvec);
+    err = _shwfs_spots2slopes(ffimage, *wfs(ns)._imistart2, *wfs(ns)._imjstart2, wfs(ns)._nsub4disp, wfs(ns).npixels, wfs(ns)._fimnx, fimny2, yoffset, *wfs(ns)._centroidw, wfs(ns).shthmethod, threshold, *wfs(ns)._refspots, *wfs(ns)._mfilter, wfs(ns)._refinit, *wfs(ns)._bias, *wfs(ns)._flat, wfs(ns).ron, wfs(ns).excessnoise, wfs(ns).noise, *wfs(ns)._bckgrdcalib, wfs(ns)._bckgrdinit, wfs(ns)._bckgrdsub, *wfs(ns)._validsubs, svipc_subok2, wfs(ns).nintegcycles, mesvec, wfs(ns)._fftctx);
 
 
     sem_give,semkey,20+4*(ns-1)+3;
@@ -390,7 +395,10 @@ func svipc_start_forks(void)
     sim.svipc_wfs_forknb = &tmp;
   }
 
-  if (!pscreens_no_shm) shm_write,shmkey,"pscreens",&pscreens;
+  // infinite screens are extruded by each process, identically (see
+  // infinite_screens_advance), they can not be shared. Mapped screens
+  // (screenflags&GET2D_MAPPED) are inherited by the children with the mappings.
+  if (!pscreens_no_shm && !atm.infinite && !(screenflags&GET2D_MAPPED)) shm_write,shmkey,"pscreens",&pscreens;
 
 
   // WFS CHILD
@@ -409,8 +417,8 @@ func svipc_start_forks(void)
 
       // get rid of what we don't need
       iMat = cMat = [];
-      for (i=1;i<=ndm;i++) dm(i)._def = &[];
-      if (!pscreens_no_shm) {
+      for (i=1;i<=ndm;i++) dm(i)._def = dm(i)._sdefof = dm(i)._sdef = &[];
+      if (!pscreens_no_shm && !atm.infinite && !(screenflags&GET2D_MAPPED)) {
         pscreens = [];
         shm_var,shmkey,"pscreens",pscreens;
       }
@@ -433,7 +441,7 @@ func svipc_start_forks(void)
       write,format="PSFs child fork()ed with PID %d\n",getpid();
       // get rid of what we don't need
       iMat = cMat = [];
-      if (!pscreens_no_shm) {
+      if (!pscreens_no_shm && !atm.infinite && !(screenflags&GET2D_MAPPED)) {
         pscreens = [];
         shm_var,shmkey,"pscreens",pscreens;
       }
@@ -456,8 +464,8 @@ func svipc_start_forks(void)
         write,format="WFS fork %d PID %d\n",nf,getpid();
         // get rid of what we don't need
         iMat = cMat = [];
-        for (i=1;i<=ndm;i++) dm(i)._def = &[];
-        if (!pscreens_no_shm) {
+        for (i=1;i<=ndm;i++) dm(i)._def = dm(i)._sdefof = dm(i)._sdef = &[];
+        if (!pscreens_no_shm && !atm.infinite && !(screenflags&GET2D_MAPPED)) {
           pscreens = [];
           shm_var,shmkey,"pscreens",pscreens;
         }
@@ -663,19 +671,13 @@ func psf_listen(void)
 
     mircube = shm_read(shmkey,"mircube");
 
-    for (jl=1;jl<=target._nlambda;jl++) {
-      for (jt=1;jt<=target._ntarget;jt++) {
-        cubphase(,,jt)  = get_phase2d_from_dms(jt,"target") +    \
-                          get_phase2d_from_optics(jt,"target") + \
-                          get_turb_phase(loopCounter,jt,"target");
-      }
-      // compute image cube from phase cube
-      err = _calc_psf_fast(&pupil,&cubphase,&im,2^dimpow2,
-                           target._ntarget,float(2*pi/(*target.lambda)(jl)),1n);
-
-      // Accumulate statistics:
-      imav(,,,jl) = imav(,,,jl) + im;
-    }
+    // all targets in one pass on the screens:
+    cubphase(,,) = get_phase2d(loopCounter,indgen(target._ntarget),"target");
+    // compute all (target,lambda) images, accumulate in imav:
+    err = _calc_psf_multi(pupil,cubphase,im,imav,2^dimpow2,
+                          target._ntarget,float(2*pi/(*target.lambda)),
+                          target._nlambda,1n,int(target.nthreads),
+                          target._fftctx);
 
     // we're done.
     if (smdebug) write,"psf_listen: done, writing result in shm";
@@ -793,11 +795,7 @@ func svipc_single_wfs(iter,ns)
   extern wfs;
 
   offsets = wfs(ns).gspos;
-  phase   = get_phase2d_from_optics(ns,"wfs");
-  phase  += get_turb_phase(iter,ns,"wfs");
-  if (loop.method != "open-loop") {
-    phase  += get_phase2d_from_dms(ns,"wfs");
-  }
+  phase   = get_phase2d(iter,ns,"wfs",nodm=(loop.method=="open-loop"));
 
   if (wfs(ns).correctUpTT) {
     phase = correct_uplink_tt(phase,ns);
@@ -49,11 +49,312 @@ extern _dmsumelt
    pointer coefs, pointer outphase, int outnx, int outny)
 */
 
+extern _dm_sparse_boxes
+/* PROTOTYPE
+   long _dm_sparse_boxes(pointer def, int nx, int ny, int nact, pointer box)
+*/
+
+extern _dm_sparse_pack
+/* PROTOTYPE
+   void _dm_sparse_pack(pointer def, int nx, int ny, int nact, pointer box, pointer vals)
+*/
+
+extern _dmsum_sparse
+/* PROTOTYPE
+   void _dmsum_sparse(pointer vals, pointer box, int nact, pointer coefs, pointer outphase, int outnx, int outny, int nthreads)
+*/
+
+extern _dmsum_sparse_delta
+/* PROTOTYPE
+   int _dmsum_sparse_delta(pointer vals, pointer box, int nact, pointer coefs, pointer prev, float tol, pointer outphase, int outnx, int outny, int nthreads)
+*/
+
 extern _get2dPhase
 /* PROTOTYPE
-   int _get2dPhase(pointer pscreens, int psnx, int psny, int nscreens, pointer skip, pointer outphase, int phnx, int phny, pointer ishifts, pointer xshifts, pointer jshifts, pointer yshifts)
+   int _get2dPhase(pointer pscreens, int psnx, int psny, int nscreens, pointer skip, pointer outphase, int phnx, int phny, pointer ishifts, pointer xshifts, pointer jshifts, pointer yshifts, int nthreads)
+*/
+
+extern _get2dPhase_multi
+/* PROTOTYPE
+   int _get2dPhase_multi(pointer pscreens, int psnx, int psny, int nscreens, pointer skip, pointer weight, pointer perm, int flags, pointer outphase, int phnx, int phny, int ndir, pointer ishifts, pointer xshifts, pointer jshifts, pointer yshifts, int nthreads)
+*/
+
+extern _get2dPhase_fused
+/* PROTOTYPE
+   int _get2dPhase_fused(pointer outphase, int outnx, int outny, int ndir, int x0, int y0, int phnx, int phny, pointer pscreens, int psnx, int psny, int nscreens, pointer skip, pointer weight, pointer perm, int flags, pointer ishifts, pointer xshifts, pointer jshifts, pointer yshifts, pointer mircube, int mcnx, int mcny, int nmirrors, pointer dmskip, pointer dmishifts, pointer dmxshifts, pointer dmjshifts, pointer dmyshifts, pointer optcube, int ocnx, int ocny, int nopts, pointer optscale, pointer optskip, pointer optishifts, pointer optxshifts, pointer optjshifts, pointer optyshifts, int nthreads)
+*/
+
+extern _yao_screen_extrude
+/* PROTOTYPE
+   int _yao_screen_extrude(pointer pscreens, int nb, int nscreens, int layer, int dir, int ncols, long pos, pointer A, pointer B, int nst, float weight)
+*/
+
+extern _yao_quantize16
+/* PROTOTYPE
+   float _yao_quantize16(pointer in, long n, pointer out)
+*/
+
+extern _yao_mvm_init
+/* PROTOTYPE
+   int _yao_mvm_init(int h, float array cmat, int nact, int nmes, float array dmat, int ncom, int storage)
+*/
+
+extern _yao_mvm
+/* PROTOTYPE
+   int _yao_mvm(int h, float array mes, int nmes, float array com, int ncom, int polc, float array err, float array polcout, int nthreads)
+*/
+
+extern _yao_mvm_free
+/* PROTOTYPE
+   void _yao_mvm_free(int h)
+*/
+
+func yao_mvm_check(nact,nmes,nthreads=,niter=)
+/* DOCUMENT yao_mvm_check(nact,nmes,nthreads=,niter=)
+   Accuracy and speed of the C reconstructor (mat.mvm) on a random
+   [nact,nmes] cMat [1000,2000] and [nact,nact] dMat (fused POLC), for
+   the float, bf16 and fp16 storages, against the yorick products.
+   Prints the relative rms error and the time per call of each.
+   Returns [3,2] [relative rms error, ms] per storage.
+   SEE ALSO: _yao_mvm, yao_mvm_init
+ */
+{
+  if (nact==[]) nact = 1000;
+  if (nmes==[]) nmes = 2000;
+  if (nthreads==[]) nthreads = 1;
+  if (niter==[]) niter = 20;
+  cmat = float(random_n(nact,nmes));
+  dmat = float(random_n(nact,nact))/nact;
+  mes = float(random_n(nmes));
+  com = float(random_n(nact));
+  tic;
+  for (it=1;it<=niter;it++) ref = cmat(,+)*mes(+)-dmat(,+)*com(+);
+  t = tac()/niter*1000.;
+  write,format="yorick  : %.2f ms\n",t;
+  res = array(double,[2,3,2]);
+  err = array(float,nact);
+  for (st=1;st<=3;st++) {
+    h = _yao_mvm_init(-1n,cmat,nact,nmes,dmat,nact,st);
+    if (h < 0) error,"_yao_mvm_init failed";
+    tic;
+    for (it=1;it<=niter;it++) e = _yao_mvm(h,mes,nmes,com,nact,1n,err,err,nthreads);
+    res(st,2) = tac()/niter*1000.;
+    _yao_mvm_free,h;
+    if (e) error,"_yao_mvm failed";
+    res(st,1) = (err-ref)(rms)/ref(rms);
+    write,format="%-8s: relative rms error %.2g, %.2f ms\n",
+      (["float","bf16","fp16"])(st),res(st,1),res(st,2);
+  }
+  return res;
+}
+
+extern _yao_screen_spectrum
+/* PROTOTYPE
+   int _yao_screen_spectrum(string scratch, int dim, float l0, int nalias, int draw, pointer sf, int noff, long maxmem, int nthreads)
+*/
+
+extern _yao_screen_synth
+/* PROTOTYPE
+   int _yao_screen_synth(string scratch, string prefix, int dim, int dimy, int nparts, float scale, long maxmem, int nthreads)
 */
 
+extern _yao_fits_map
+/* PROTOTYPE
+   int _yao_fits_map(string fname, string cache, int slot, pointer dims)
+*/
+
+extern _yao_fits_unmap
+/* PROTOTYPE
+   void _yao_fits_unmap(int slot)
+*/
+
+extern _yao_fits_dims
+/* PROTOTYPE
+   int _yao_fits_dims(string fname, pointer dims)
+*/
+
+extern _yao_fits_read
+/* PROTOTYPE
+   int _yao_fits_read(string fname, string cache, pointer out, long n)
+*/
+
+func yao_fits_cache(name)
+/* DOCUMENT cache = yao_fits_cache(name)
+   Name of the native cache file of the FITS file name (see
+   _yao_fits_map), in the cache directory YAO_CACHEPATH (default
+   YAO_SAVEPATH+"yaocache/", created if needed), so that the user
+   directories (e.g. shared phase screens) are left alone. The full
+   path of name is encoded in the cache name ("/" -> "%"), so that
+   files of the same name in different directories do not collide.
+   Returns "" (no cache: the data are converted in memory at each run)
+   if YAO_CACHEPATH is set to "".
+   The caches are remade when their FITS file changes. They can be
+   removed at any time, e.g. with yao_fits_cache_clean.
+   SEE ALSO: yao_fits_cache_clean, yao_fitsread_native
+*/
+{
+  extern YAO_CACHEPATH;
+  dir = (is_void(YAO_CACHEPATH)? YAO_SAVEPATH+"yaocache/": YAO_CACHEPATH);
+  if (dir == "") return "";
+  if (strpart(dir,-1:0) != "/") dir += "/";
+  mkdirp,dir;
+  if (strpart(name,0:1) != "/") name = get_cwd()+name;
+  c = strchar(name);
+  c(where(c == '/')) = '%';
+  return dir+strchar(c)+".yaomap";
+}
+
+func yao_fits_cache_clean(void)
+/* DOCUMENT yao_fits_cache_clean
+   Removes all the native FITS caches (*.yaomap) of the cache
+   directory (see yao_fits_cache). They are remade when needed.
+   SEE ALSO: yao_fits_cache
+*/
+{
+  extern YAO_CACHEPATH;
+  dir = (is_void(YAO_CACHEPATH)? YAO_SAVEPATH+"yaocache/": YAO_CACHEPATH);
+  if (dir == "") return;
+  if (strpart(dir,-1:0) != "/") dir += "/";
+  files = lsdir(dir);
+  if (structof(files) != string) return;
+  for (i=1;i<=numberof(files);i++) {
+    if (strpart(files(i),-7:0) == ".yaomap") remove,dir+files(i);
+  }
+}
+
+func yao_fitsread_native(name)
+/* DOCUMENT data = yao_fitsread_native(name)
+   Primary data array of the FITS file name, as float. The data are
+   copied from the native cache yao_fits_cache(name) (made by the
+   first call, see _yao_fits_map) instead of going through the yorick
+   FITS reader. Falls back on float(yao_fitsread(name)) if the file
+   can not be mapped.
+   SEE ALSO: yao_fitsread, _yao_fits_map, yao_fits_cache
+*/
+{
+  dims = array(long,4);
+  if (_yao_fits_dims(name,&dims)) return float(yao_fitsread(name));
+  data = array(float,dims(1:dims(1)+1));
+  if (_yao_fits_read(name,yao_fits_cache(name),&data,numberof(data)))
+    return float(yao_fitsread(name));
+  return data;
+}
+
+func get2dphase_speed_tests(psnx,phnx,nscreens,nthreads=,niter=)
+/* DOCUMENT get2dphase_speed_tests(psnx,phnx,nscreens,nthreads=,niter=)
+   Times _get2dPhase (ms/call) for all combinations of the screen size
+   psnx [256,1024,2048], output size phnx [64,128,256,512] and number
+   of screens nscreens [1,4,10], for the 3 kinds of shifts: integer
+   (unit steps, no fraction), unit steps with a fraction (NGS, DMs) and
+   non unit steps (LGS cone effect). nthreads [1] as wfs.nthreads.
+   Returns the timings as [kind,nscreens,phnx,psnx].
+   SEE ALSO: get_turb_phase
+ */
+{
+  if (psnx==[]) psnx = [256,1024,2048];
+  if (phnx==[]) phnx = [64,128,256,512];
+  if (nscreens==[]) nscreens = [1,4,10];
+  if (nthreads==[]) nthreads = 1;
+  if (niter==[]) niter = 20;
+  kinds = ["integer","unit+frac","non unit"];
+  step = [1.,1.,0.93];
+  frac = [0.,0.37,0.37];
+  tim = array(0.,3,numberof(nscreens),numberof(phnx),numberof(psnx));
+  for (l=1;l<=numberof(psnx);l++) {
+    for (m=1;m<=numberof(phnx);m++) {
+      if (phnx(m)+4 > psnx(l)) continue;
+      for (n=1;n<=numberof(nscreens);n++) {
+        ns = nscreens(n);
+        scr = float(random_n(psnx(l),psnx(l),ns));
+        skip = array(0n,ns);
+        for (k=1;k<=3;k++) {
+          pos = 1.+step(k)*(indgen(phnx(m))-1)+frac(k);
+          xshifts = yshifts = float(pos(,-:1:ns));
+          ishifts = int(xshifts); xshifts -= ishifts;
+          jshifts = int(yshifts); yshifts -= jshifts;
+          phase = array(float,phnx(m),phnx(m));
+          tic;
+          for (it=1;it<=niter;it++) {
+            err = _get2dPhase(&scr,psnx(l),psnx(l),ns,&skip,&phase,phnx(m),phnx(m),
+                              &ishifts,&xshifts,&jshifts,&yshifts,int(nthreads));
+          }
+          tim(k,n,m,l) = tac()/niter*1000.;
+          write,format="psnx=%4d phnx=%4d nscreens=%2d %-10s: %8.3f ms\n",
+            psnx(l),phnx(m),ns,kinds(k),tim(k,n,m,l);
+        }
+      }
+    }
+  }
+  return tim;
+}
+
+func get2dphase_int16_check(psnx,phnx,nscreens,nthreads=,niter=)
+/* DOCUMENT get2dphase_int16_check(psnx,phnx,nscreens,nthreads=,niter=)
+   Wavefront error of the int16 screens (atm.screen_int16) against the
+   float ones: nscreens [4] von Karman screens psnx [1024] wide (r0 = 1
+   pixel) are ray traced over phnx [256] pixels, with unit and non unit
+   X steps, from both storages. Prints the rms phase, the rms error
+   (rad, and relative) and the time per call of each storage.
+   Returns [relative rms error, ms float, ms int16] of the non unit case.
+   SEE ALSO: _yao_quantize16, get2dphase_speed_tests
+ */
+{
+  if (psnx==[]) psnx = 1024;
+  if (phnx==[]) phnx = 256;
+  if (nscreens==[]) nscreens = 4;
+  if (nthreads==[]) nthreads = 1;
+  if (niter==[]) niter = 20;
+  scr = array(float,psnx,psnx,nscreens);
+  for (k=1;k<=nscreens;k+=2) {
+    tmp = create_phase_screens(psnx,psnx,silent=1);
+    scr(,,k) = tmp(,,1);
+    if (k<nscreens) scr(,,k+1) = tmp(,,2);
+  }
+  tmp = [];
+  scr16 = array(short,dimsof(scr));
+  scale = array(float,nscreens);
+  for (k=1;k<=nscreens;k++) {
+    s = scr(,,k); q = array(short,dimsof(s));
+    scale(k) = _yao_quantize16(&s,numberof(s),&q);
+    scr16(,,k) = q;
+  }
+  weight = array(1.0f,nscreens);
+  perm = int(indgen(nscreens)-1);
+  skip = array(0n,nscreens);
+  step = [1.,0.93];
+  for (c=1;c<=2;c++) {
+    pos = 1.7+step(c)*(indgen(phnx)-1)+3.1*indgen(nscreens)(-,);
+    xshifts = yshifts = float(pos);
+    ishifts = int(xshifts); xshifts -= ishifts;
+    jshifts = int(yshifts); yshifts -= jshifts;
+    ph32 = ph16 = array(float,phnx,phnx);
+    tic;
+    for (it=1;it<=niter;it++) {
+      ph32(*) = 0.0f;
+      err = _get2dPhase_multi(&scr,psnx,psnx,nscreens,&skip,&weight,&perm,
+                              GET2D_WRAPX|GET2D_WRAPY,
+                              &ph32,phnx,phnx,1,&ishifts,&xshifts,
+                              &jshifts,&yshifts,int(nthreads));
+    }
+    t32 = tac()/niter*1000.;
+    tic;
+    for (it=1;it<=niter;it++) {
+      ph16(*) = 0.0f;
+      err |= _get2dPhase_multi(&scr16,psnx,psnx,nscreens,&skip,&scale,&perm,
+                               GET2D_WRAPX|GET2D_WRAPY|GET2D_INT16,
+                               &ph16,phnx,phnx,1,&ishifts,&xshifts,
+                               &jshifts,&yshifts,int(nthreads));
+    }
+    t16 = tac()/niter*1000.;
+    if (err) error,"Error in _get2dPhase_multi";
+    rms = ph32(*)(rms);
+    rmserr = (ph16-ph32)(*)(rms);
+    write,format="%-9s steps: rms phase %.3g rad, rms error %.3g rad (%.2g), %.2f ms (float) %.2f ms (int16)\n",
+      (c==1? "unit": "non unit"),rms,rmserr,rmserr/rms,t32,t16;
+  }
+  return [rmserr/rms,t32,t16];
+}
+
 func cosf(array)
 /* DOCUMENT func cosf(array)
    Returns the cos of the argument.
@@ -474,6 +474,14 @@ func shwfs_init(pupsh,ns,silent=,imat=,clean=)
   //same here, take background calib image for entire _fimage
   wfs(ns)._bckgrdcalib = &(array(float,[2,wfs(ns)._fimnx,wfs(ns)._fimny]));
 
+  // reference spots and matched filters (shthmethod 4 & 5), filled
+  // with the reference measurements (see aoinit). Not used by the
+  // other methods, which get a dummy:
+  if (wfs(ns).shthmethod >= 4) {
+    wfs(ns)._refspots = &(array(float,[2,wfs(ns).npixels^2,wfs(ns)._nsub4disp]));
+    wfs(ns)._mfilter  = &(array(float,[2,2*wfs(ns).npixels^2+5,wfs(ns)._nsub4disp]));
+  } else wfs(ns)._refspots = wfs(ns)._mfilter = &([0.0f]);
+
   if (sim.verbose == 2) {
     write,format="Dark current wfs#%d / iter / pixel=%f\n",ns,
       float(wfs(ns).darkcurrent*loop.ittime);
@@ -692,8 +700,11 @@ func shwfs_init_lgs_kernels(ns)
   clean_progressbar;
 
   wfs(ns)._kernels = &(float(kall));
-  wfs(ns)._kerfftr = &(float(kall*0.0f));
-  wfs(ns)._kerffti = &(float(kall*0.0f));
+  // _shwfs_phase2spots keeps only the hermitian half of the kernel
+  // (real to complex) FFTs: nx4fft*(nx4fft/2+1) per subaperture.
+  nker = wfs(ns)._nx4fft*(wfs(ns)._nx4fft/2+1)*wfs(ns)._nsub4disp;
+  wfs(ns)._kerfftr = &(array(float,nker));
+  wfs(ns)._kerffti = &(array(float,nker));
   kall = [];
   wfs(ns)._initkernels = 1n;
 }
@@ -998,6 +1009,7 @@ func sh_wfs(pupsh,phase,ns)
             wfs(ns)._nx4fft, *wfs(ns)._unittip,
             *wfs(ns)._unittilt, *wfs(ns).lgs_prof_amp,
             *wfs(ns)._lgs_defocuses, int(numberof(*wfs(ns).lgs_prof_amp)),
+            int(wfs(ns).lgs_fast),
             *wfs(ns)._unitdefocus, ffimage, *wfs(ns)._svipc_subok,
             *wfs(ns)._imistart, *wfs(ns)._imjstart,
             wfs(ns)._fimnx , wfs(ns)._fimny,
@@ -1005,7 +1017,8 @@ func sh_wfs(pupsh,phase,ns)
             *wfs(ns)._skyfluxpersub, float(wfs(ns).darkcurrent*loop.ittime), // darkcurrent not applied in there anymore (2012sep17)
             int(wfs(ns).rayleighflag),
             *wfs(ns)._rayleigh, wfs(ns)._bckgrdinit,
-            wfs(ns)._cyclecounter, wfs(ns).nintegcycles);
+            wfs(ns)._cyclecounter, wfs(ns).nintegcycles, int(wfs(ns).fftbatch),
+            int(wfs(ns).nthreads), wfs(ns)._fftctx);
 
     if ( wfs(ns).svipc>1 ) {
       if (sim.debug>20) write,format="main: waiting fork ready sem %d\n",2*ns+1;
@@ -1027,13 +1040,17 @@ func sh_wfs(pupsh,phase,ns)
       if (anyof(wfs.excessnoise < 1.)){
         error, "wfs.excessnoise must be set to be greater than or equal to 1";
       }
+      if ((wfs(ns).shthmethod >= 4) && (numberof(*wfs(ns)._mfilter) == 1)) {
+        error, "wfs.shthmethod 4 & 5 need the reference spots: run aoinit";
+      }
 
       err = _shwfs_spots2slopes(ffimage, xtmp, ytmp,wfs(ns)._nsub4disp,
         wfs(ns).npixels, wfs(ns)._fimnx, fimny,yoffset,*wfs(ns)._centroidw,
-        wfs(ns).shthmethod, threshold, *wfs(ns)._bias, *wfs(ns)._flat,
+        wfs(ns).shthmethod, threshold, *wfs(ns)._refspots, *wfs(ns)._mfilter,
+        wfs(ns)._refinit, *wfs(ns)._bias, *wfs(ns)._flat,
         wfs(ns).ron, wfs(ns).excessnoise, wfs(ns).noise, *wfs(ns)._bckgrdcalib,
         wfs(ns)._bckgrdinit, wfs(ns)._bckgrdsub, *wfs(ns)._validsubs, subok2,
-        wfs(ns).nintegcycles, mesvec);
+        wfs(ns).nintegcycles, mesvec, wfs(ns)._fftctx);
     } else mesvec *= 0;
 
     if ( wfs(ns).svipc>1 ) {
@@ -1157,7 +1174,7 @@ func curv_wfs(pupil,phase,ns,init=,disp=,silent=)
                wfs(ns)._nsub, *wfs(ns)._fimage, *wfs(ns)._fimage2,
                float(wfs(ns)._nphotons), float(wfs(ns)._skynphotons),
                float(wfs(ns).ron), float(wfs(ns).excessnoise), float(wfs(ns).darkcurrent*loop.ittime),
-               int(wfs(ns).noise), mesvec);
+               int(wfs(ns).noise), mesvec, wfs(ns)._fftctx);
 
   wfs(ns)._dispimage = wfs(ns)._fimage;
 
@@ -1886,15 +1903,13 @@ func mult_wfs(iter,disp=)
  */
 {
   mes = [];
+  // phase (optics + turbulence + DMs) of all the WFSs, in one pass on
+  // the screens. Only look at DMs if not running in open loop
+  wfsphase = get_phase2d(iter,indgen(nwfs),"wfs",nodm=(loop.method=="open-loop"));
   for (ns=1;ns<=nwfs;ns++) {
 
     offsets = wfs(ns).gspos;
-    phase   = get_phase2d_from_optics(ns,"wfs");
-    phase  += get_turb_phase(iter,ns,"wfs");
-    // only look at DMs if not running in open loop
-    if (loop.method != "open-loop") {
-      phase  += get_phase2d_from_dms(ns,"wfs");
-    }
+    phase   = wfsphase(,,ns);
 
     if (wfs(ns).correctUpTT) {
       phase = correct_uplink_tt(phase,ns);
@@ -2223,15 +2238,85 @@ func pyramid_wfs_checks(nchecks)
   }
 }
 
+func shwfs_lgs_fast_check(ns,phase=,nit=)
+/* DOCUMENT shwfs_lgs_fast_check,ns,phase=,nit=
+   Compare the spots and slopes of SH wfs #ns computed with the fast
+   LGS elongation (wfs.lgs_fast=1: the lgs profile is applied as a per
+   subaperture transfer function on the spot at focus) to the exact ones
+   (wfs.lgs_fast=0: one FFT per profile point), for the current lgs profile
+   (see set_lgs_profile). Prints the spot and slope errors and the time
+   per sh_wfs() call of both. aoinit must have been run. The wfs noise is
+   disabled for the comparison, wfs(ns).lgs_fast is left unchanged.
+   phase = input phase in microns (sim._size x sim._size). Default flat.
+   nit   = number of sh_wfs() calls for the timing (default 10)
+   Returns [max,rms] spot error (as a fraction of the spot image max)
+   and the rms slope error in arcsec: [maxerr,rmserr,slopeerr]
+   SEE ALSO: set_lgs_profile, sh_wfs
+ */
+{
+  extern wfs;
+
+  if (ns==[]) ns = 1;
+  if (nit==[]) nit = 10;
+  if (phase==[]) phase = array(0.0f,sim._size,sim._size);
+  if ((wfs(ns).type!="hartmann")||(wfs(ns).shmethod!=2)) \
+    error,"only for physical model SH wfs (shmethod=2)";
+  if (numberof(*wfs(ns).lgs_prof_amp)<2) \
+    error,"wfs.lgs_prof_amp/alt have less than 2 points, nothing to compare";
+  if (wfs(ns).svipc>1) error,"not available with wfs.svipc>1";
+
+  fast_orig  = wfs(ns).lgs_fast;
+  noise_orig = wfs(ns).noise;
+  cycle_orig = wfs(ns).nintegcycles;
+  wfs(ns).noise = 0;
+  wfs(ns).nintegcycles = 1;
+
+  tim = [0.,0.];
+  for (m=0;m<=1;m++) {
+    // the fast elongation lives in the kernel FFTs, recompute them:
+    wfs(ns).lgs_fast = m;
+    wfs(ns)._initkernels = 1n;
+    wfs(ns)._cyclecounter = 1;
+    mes = sh_wfs(ipupil,float(phase),ns);
+    if (m==0) { mes0 = mes; fim0 = *wfs(ns)._fimage; }
+    else { mes1 = mes; fim1 = *wfs(ns)._fimage; }
+    tic;
+    for (j=1;j<=nit;j++) mes = sh_wfs(ipupil,float(phase),ns);
+    tim(m+1) = 1000.*tac()/nit;
+  }
+
+  wfs(ns).lgs_fast = fast_orig;
+  wfs(ns).noise = noise_orig;
+  wfs(ns).nintegcycles = cycle_orig;
+  wfs(ns)._cyclecounter = 1;
+  wfs(ns)._initkernels = 1n;
+
+  maxerr = max(abs(fim1-fim0))/max(fim0);
+  rmserr = sqrt(avg((fim1-fim0)^2.))/max(fim0);
+  slopeerr = sqrt(avg((mes1-mes0)^2.));
+
+  write,format="WFS#%d, %d lgs profile points, %d subapertures:\n",
+    ns,numberof(*wfs(ns).lgs_prof_amp),wfs(ns)._nsub4disp;
+  write,format="  exact: %.2fms/call, fast: %.2fms/call (x%.1f)\n",
+    tim(1),tim(2),tim(1)/tim(2);
+  write,format="  spot error (fraction of max): max %.3g, rms %.3g\n",
+    maxerr,rmserr;
+  write,format="  slope error: rms %.3g arcsec, max %.3g arcsec "+
+    "(rms slope %.3g arcsec)\n",slopeerr,max(abs(mes1-mes0)),
+    sqrt(avg(mes0^2.));
+
+  return [maxerr,rmserr,slopeerr];
+}
+
 func sh_wfs_speed_tests(case,png=)
 {
   if (case==[]) {
-    write,"sh_wfs_speed_tests,case  with case=1,2,3,4,..";
+    write,"sh_wfs_speed_tests,case  with case=1,2,3,4,..8";
     return;
   }
 
   if (case==0) {
-    for (i=1;i<=6;i++) {
+    for (i=1;i<=8;i++) {
       sh_wfs_speed_tests,i,png=png;
       pause,100;
     }
@@ -2394,6 +2479,87 @@ func sh_wfs_speed_tests(case,png=)
       label = yao_struct_member_to_string(["sim.pupildiam","wfs(1).shnxsub", \
         "wfs(1).pixsize","wfs(1).npixels","wfs(1).noise"]);
     }
+  } else if (case==7) {
+    // batched subapertures. Same setup for all, only wfs.fftbatch
+    // changes (no need to aoinit again). Also check that the spots are
+    // identical to the unbatched ones.
+    cname = "wfs.fftbatch"; cunit = "#subap/batch";
+    in = [1,2,4,8,16,32,64,128];
+    tim = in*0.;
+    pfit = 0; pzero = 0;
+    aoread,"sh6x6.par";
+    wfs(1).shnxsub = 64;
+    sim.pupildiam = 256;
+    wfs(1).pixsize=0.3;
+    wfs(1).npixels=4;
+    wfs(1).noise = 0;
+    atm.screen = &(Y_USER+"data/verywide"+["1","2","3","4"]+".fits");
+    atm.dr0at05mic=0.;
+    aoinit,disp=0;
+    phase = float(random_n(dimsof(pupil)));
+    for (i=1;i<=numberof(in);i++) {
+      wfs(1).fftbatch = in(i);
+      sh_wfs,pupil,phase,1;
+      if (i==1) fim1 = *wfs(1)._fimage;
+      if (anyof(*wfs(1)._fimage != fim1))
+        error,swrite(format="fftbatch=%d: spots differ from fftbatch=1",in(i));
+      tic;
+      for (j=1;j<=10;j++) sh_wfs,pupil,phase,1;
+      now = tim(i) = 1000./10.*tac();
+      write,format="SH%dx%d, nx=%d, fftbatch=%d, time/call=%.1fms, "+
+        "%.0f subap/ms, spots identical to fftbatch=1\n",
+        wfs(1).shnxsub, wfs(1).shnxsub, wfs(1)._nx, in(i), now,
+        wfs(1)._nsub4disp/now;
+      label = yao_struct_member_to_string(["sim.pupildiam","wfs(1).shnxsub", \
+        "wfs(1).pixsize","wfs(1).npixels","wfs(1).nthreads"]);
+    }
+  } else if (case==8) {
+    // slope computation only (_shwfs_spots2slopes), 100x100 subapertures,
+    // vs wfs.shthmethod, on the same spots. 4 & 5 measure w.r.t. the
+    // reference spots taken by aoinit. Time is per call, on a fresh copy
+    // of the spot image (the thresholds modify it).
+    cname = "wfs.shthmethod"; cunit = "1: yao, 2: podium, 3: brightest, 4: corr., 5: MF";
+    in = [1,2,3,4,5];
+    tim = in*0.;
+    pfit = 0; pzero = 0;
+    aoread,"sh6x6.par";
+    wfs(1).shnxsub = 100;
+    sim.pupildiam = 400;
+    wfs(1).pixsize=0.3;
+    wfs(1).npixels=6;
+    wfs(1).noise = 0;
+    wfs(1).shthmethod = 5;
+    atm.screen = &(Y_USER+"data/verywide"+["1","2","3","4"]+".fits");
+    atm.dr0at05mic=0.;
+    aoinit,disp=0;
+    phase = float(random_n(dimsof(pupil)));
+    sh_wfs,pupil,phase,1;
+    fim0 = *wfs(1)._fimage;
+    xysof = (wfs(1)._npixels-wfs(1).npixels-wfs(1)._npb/2);
+    xtmp = int(*wfs(1)._imistart2+xysof);
+    ytmp = int(*wfs(1)._imjstart2+xysof);
+    subok = array(1n,wfs(1)._nsub4disp);
+    mesvec = array(float,wfs(1)._nmes);
+    for (i=1;i<=numberof(in);i++) {
+      threshold = array(float,wfs(1)._nsub4disp+1)+((in(i)==3)? 8.f: 0.f);
+      tic;
+      for (j=1;j<=100;j++) {
+        fim = fim0;
+        err = _shwfs_spots2slopes(fim, xtmp, ytmp, wfs(1)._nsub4disp,
+          wfs(1).npixels, wfs(1)._fimnx, wfs(1)._fimny, 0n, *wfs(1)._centroidw,
+          in(i), threshold, *wfs(1)._refspots, *wfs(1)._mfilter, 0n,
+          *wfs(1)._bias, *wfs(1)._flat, wfs(1).ron, wfs(1).excessnoise,
+          wfs(1).noise, *wfs(1)._bckgrdcalib, 0n, wfs(1)._bckgrdsub,
+          *wfs(1)._validsubs, subok, 1n, mesvec, wfs(1)._fftctx);
+      }
+      now = tim(i) = 1000./100.*tac();
+      write,format="SH%dx%d, npixels=%d, shthmethod=%d, time/call=%.2fms, "+
+        "%.0f subap/ms, rms slope=%.3f\"\n", wfs(1).shnxsub, wfs(1).shnxsub,
+        wfs(1).npixels, in(i), now, wfs(1)._nsub4disp/now,
+        (mesvec-*wfs(1)._refmes)(rms);
+      label = yao_struct_member_to_string(["sim.pupildiam","wfs(1).shnxsub", \
+        "wfs(1).pixsize","wfs(1).npixels"]);
+    }
   }
   winkill,0;
   window,0,dpi=120,wait=1;
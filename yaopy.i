@@ -261,7 +261,7 @@ func change_zenith_angle(zen)
 func change_dr0(dr0) {
   extern atm;
   atm.dr0at05mic=dr0;
-  if (initdone) get_turb_phase_init;
+  if (initdone) get_turb_phase_weights;
 }
 
 func change_seeing(seeing) {  //seeing at 550 (V band)
@@ -271,7 +271,7 @@ func change_seeing(seeing) {  //seeing at 550 (V band)
     // propagate to child if svipc:
     if (set_dr0!=[]) set_dr0,atm.dr0at05mic;
   } else atm.dr0at05mic = 0.;
-  if (initdone) get_turb_phase_init;
+  if (initdone) get_turb_phase_weights;
 }
 
 